@@ -7,6 +7,16 @@
 #define ARGS_DRYRUN  {"dryrun", 0, 0, G_OPTION_ARG_NONE, &dryrun,"Don't actually apply updates", NULL}
 #define ARGS_FORCE   {"force", 0, 0, G_OPTION_ARG_NONE, &force,"Update even if the latest version is the same", NULL}
 #define ARGS_LOG     {"logfile", 'l', 0, G_OPTION_ARG_STRING, &logfile, NULL, NULL}
+#define ARGS_CODEC    {"codec", 0, 0, G_OPTION_ARG_STRING, &codec,"preferred codec for compressed images: auto, zstd, lz4 or none", NULL}
+#define ARGS_COMPARE  {"compare", 0, 0, G_OPTION_ARG_NONE, &compare,"Only erase and program blocks that don't already have the right data, turns off erasing ahead of a deferred download", NULL}
+#define ARGS_ONESHOT  {"oneshot", 0, 0, G_OPTION_ARG_NONE, &oneshot,"Check for an update once and exit, for running from a timer", NULL}
+#define ARGS_PEERS    {"peers", 0, 0, G_OPTION_ARG_NONE, &peers,"Share images with and fetch images from other devices on the local network", NULL}
+#define ARGS_PEERGROUP {"peergroup", 0, 0, G_OPTION_ARG_STRING, &peergroup,"multicast group peers announce their images to", NULL}
+#define ARGS_PEERPORT {"peerport", 0, 0, G_OPTION_ARG_INT, &peerport,"port to serve images to peers on", NULL}
+#define ARGS_METRICSDIR {"metricsdir", 0, 0, G_OPTION_ARG_FILENAME, &metricsdir,"where to write metrics.prom and metrics.json, defaults to the state directory", NULL}
+#define ARGS_DISCARD  {"discard", 0, 0, G_OPTION_ARG_NONE, &discard,"Discard the blocks of a block device partition before writing to it", NULL}
+#define ARGS_BENCH    {"bench", 0, 0, G_OPTION_ARG_FILENAME, &benchrepo,"Install the newest image from a local repo directory on the first mtd, verify it and report how long each stage took", NULL}
+#define ARGS_STATEDIR {"statedir", 's', 0, G_OPTION_ARG_FILENAME, &statedir,"ota state directory, must be persistent", NULL}
 
 // for stamp only
 #define ARGS_ROOTDIR                 {"rootdir", 't', 0, G_OPTION_ARG_FILENAME, &arg_rootdir,"image root directory", NULL}
@@ -15,6 +25,7 @@
 
 // for stamp and ota
 #define ARGS_CONFIGDIR {"configdir", 'c', 0, G_OPTION_ARG_FILENAME, &arg_configdir,"ota config directory", NULL}
+#define ARGS_TAGS      {"tag", 'g', 0, G_OPTION_ARG_STRING_ARRAY, &arg_tags,"tag as key=value (hw=revb, channel=stable..), can be specified multiple times", NULL}
 
 // for stamp and repo
 #define ARGS_REPODIR       {"repodir", 'r', 0, G_OPTION_ARG_STRING, &arg_repodir, "repo directory", NULL}
@@ -27,9 +38,16 @@
 #define ARGS_ACTION_DELETE {"delete", 0, 0, G_OPTION_ARG_NONE, &action_delete,"delete an image", NULL}
 #define ARGS_ACTION_VERIFY {"verify", 0, 0, G_OPTION_ARG_NONE, &action_verify,"verify images and manifest", NULL}
 #define ARGS_ACTION_REPAIR {"repair", 0, 0, G_OPTION_ARG_NONE, &action_repair,"", NULL}
+#define ARGS_ACTION_ROLLOUT {"rollout", 0, 0, G_OPTION_ARG_NONE, &action_rollout,"start, change or finish the staged rollout of an image", NULL}
 
 #define ARGS_PARAMETER_IMAGEPATH    {"path", 'p', 0, G_OPTION_ARG_FILENAME, &param_imagepath, "path to image", NULL}
 #define ARGS_PARAMETER_IMAGEINDEX   {"index", 'i', 0, G_OPTION_ARG_INT, &param_imageindex, "index of image", NULL}
 #define ARGS_PARAMETER_IMAGESTAMP	{"stamp", 's', 0, G_OPTION_ARG_FILENAME, &param_stamp, "image stamp path", NULL}
 #define ARGS_PARAMETER_IMAGETAGS    {"tag", 't', 0, G_OPTION_ARG_STRING_ARRAY, &param_imagetags, "image tag, can be specified multiple times. To remove a tag prefix with -", NULL}
+#define ARGS_PARAMETER_DELTAS       {"deltas", 'd', 0, G_OPTION_ARG_INT, &param_deltas, "number of previous versions to generate deltas from", NULL}
 #define ARGS_PARAMETER_IMAGEENABLED {"enabled", 'e', 0, G_OPTION_ARG_STRING, &param_imageenabled, "image enabled", NULL}
+#define ARGS_PARAMETER_ROLLOUTPERCENT {"percent", 0, 0, G_OPTION_ARG_INT, &param_rolloutpercent, "percentage of devices to offer the image to, 100 finishes the rollout", NULL}
+#define ARGS_PARAMETER_ROLLOUTRATE  {"rate", 0, 0, G_OPTION_ARG_INT, &param_rolloutrate, "percentage of devices to add to the rollout every hour", NULL}
+#define ARGS_PARAMETER_ROLLOUTSTART {"start", 0, 0, G_OPTION_ARG_INT64, &param_rolloutstart, "when the rollout starts (unix time), default now", NULL}
+#define ARGS_PARAMETER_SHARDBY      {"shardby", 0, 0, G_OPTION_ARG_STRING_ARRAY, &param_shardby, "tag key (hw, channel..) to publish a manifest shard per value of, can be specified multiple times, none stops sharding", NULL}
+#define ARGS_PARAMETER_POLLINTERVAL {"pollinterval", 0, 0, G_OPTION_ARG_INT, &param_pollinterval, "seconds devices should wait between checks, 0 for their default", NULL}
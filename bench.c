@@ -0,0 +1,268 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "bench.h"
+#include "manifest.h"
+#include "pipeline.h"
+#include "verify.h"
+#include "metrics.h"
+#include "utils.h"
+
+#define BENCH_READSZ (64 * 1024)
+
+/*
+ * Runs the same fetch, verify and flash path an update takes but with a
+ * repo on the local filesystem standing in for the server so the numbers
+ * are down to hashing, the pipeline and the flash (or the simulator) and
+ * not the network.
+ */
+
+static struct manifest_envelope* bench_loadenvelope(const gchar* repodir) {
+	struct manifest_envelope* envelope = NULL;
+	gchar* data;
+	gsize len;
+
+	gchar* envelopepath = buildpath(repodir, OTA_ENVELOPE, NULL);
+	if (g_file_get_contents(envelopepath, &data, &len, NULL)) {
+		envelope = manifest_envelope_deserialise(data, len);
+		g_free(data);
+		goto out;
+	}
+
+	gchar* sigpath = buildpath(repodir, OTA_SIG, NULL);
+	gchar* manifestpath = buildpath(repodir, OTA_MANIFEST, NULL);
+	if (!g_file_get_contents(sigpath, &data, &len, NULL))
+		goto err_readsig;
+	GPtrArray* sigs = manifest_signatures_deserialise(data, len);
+	g_free(data);
+	if (sigs == NULL)
+		goto err_parsesig;
+
+	if (!g_file_get_contents(manifestpath, &data, &len, NULL)) {
+		g_ptr_array_free(sigs, TRUE);
+		goto err_readmanifest;
+	}
+
+	envelope = g_malloc0(sizeof(*envelope));
+	envelope->manifest = data;
+	envelope->manifestlen = len;
+	envelope->signatures = sigs;
+
+	err_readmanifest: //
+	err_parsesig: //
+	err_readsig: //
+	g_free(sigpath);
+	g_free(manifestpath);
+	out: //
+	g_free(envelopepath);
+	return envelope;
+}
+
+static struct manifest_image* bench_newestimage(
+		struct manifest_manifest* manifest) {
+	struct manifest_image* newest = NULL;
+	for (guint i = 0; i < manifest->images->len; i++) {
+		struct manifest_image* image = g_ptr_array_index(manifest->images, i);
+		if (image->enabled && (newest == NULL || image->version > newest->version))
+			newest = image;
+	}
+	return newest;
+}
+
+struct bench_file {
+	int fd;
+};
+
+static gboolean bench_refetch(gsize offset, guint8* data, gsize len,
+		gpointer user_data) {
+	struct bench_file* file = user_data;
+	metrics_add(METRICS_RETRIES, 1);
+	return pread(file->fd, data, len, offset) == len;
+}
+
+// bytes per second as a human friendly string
+static gchar* bench_rate(guint64 bytes, guint64 us) {
+	if (us == 0)
+		return g_strdup("-");
+	gchar* size = g_format_size((bytes * G_USEC_PER_SEC) / us);
+	gchar* rate = g_strdup_printf("%s/s", size);
+	g_free(size);
+	return rate;
+}
+
+static void bench_reportstage(const gchar* stage,
+		enum metrics_histogram histogram, guint64 bytes) {
+	guint64 count, sum;
+	metrics_gethistogram(histogram, &count, &sum);
+	if (count == 0)
+		return;
+	gchar* rate = bench_rate(bytes, sum);
+	g_print("%-16s %8" G_GUINT64_FORMAT " %12" G_GUINT64_FORMAT " %10"
+	G_GUINT64_FORMAT " %14s\n", stage, count, sum, sum / count,
+			bytes != 0 ? rate : "-");
+	g_free(rate);
+}
+
+static void bench_report(const gchar* mtd, struct manifest_image* image,
+		guint64 flashtook, guint64 verifytook) {
+	guint64 pages = metrics_getcounter(METRICS_PAGESPROGRAMMED);
+	guint32 writesize = mtd != NULL ? mtd_writesize(mtd) : 0;
+
+	g_print("\nimage %s version %u, %" G_GSIZE_FORMAT " bytes to %s\n",
+			image->uuid, image->version, image->size,
+			mtd != NULL ? mtd : "nowhere (dry run)");
+	g_print("%-16s %8s %12s %10s %14s\n", "stage", "count", "total us",
+			"mean us", "throughput");
+	bench_reportstage("manifest load", METRICS_MANIFESTFETCH, 0);
+	bench_reportstage("manifest parse", METRICS_MANIFESTPARSE, 0);
+	bench_reportstage("signatures", METRICS_SIGVERIFY, 0);
+	bench_reportstage("hash", METRICS_HASH,
+			metrics_getcounter(METRICS_BYTESHASHED));
+	bench_reportstage("erase", METRICS_ERASE,
+			metrics_getcounter(METRICS_BLOCKSERASED)
+					* (mtd != NULL ? mtd_erasesize(mtd) : 0));
+	bench_reportstage("program", METRICS_PROGRAM, pages * writesize);
+	bench_reportstage("readback", METRICS_READBACK, image->size);
+
+	gchar* flashrate = bench_rate(image->size, flashtook);
+	gchar* verifyrate = bench_rate(image->size, verifytook);
+	gchar* totalrate = bench_rate(image->size, flashtook + verifytook);
+	g_print("\nfetch+flash %" G_GUINT64_FORMAT "us (%s), verify %"
+	G_GUINT64_FORMAT "us (%s), end to end %s\n", flashtook, flashrate,
+			verifytook, verifyrate, totalrate);
+	g_print("peak buffered in pipeline %" G_GUINT64_FORMAT " bytes,"
+	" %" G_GUINT64_FORMAT " blocks refetched\n",
+			metrics_getpeak(METRICS_PIPELINEBUFFERED),
+			metrics_getcounter(METRICS_RETRIES));
+	g_free(flashrate);
+	g_free(verifyrate);
+	g_free(totalrate);
+}
+
+/*
+ * Install the newest image in the repo at repodir on mtd and verify it,
+ * then print how long each stage took. If mtd is NULL only the fetching
+ * and hashing is timed.
+ */
+gboolean bench_run(const gchar* repodir, const gchar* mtd,
+		struct crypto_keys* keys) {
+	gboolean ret = FALSE;
+
+	gint64 loadstart = g_get_monotonic_time();
+	struct manifest_envelope* envelope = bench_loadenvelope(repodir);
+	if (envelope == NULL) {
+		g_message("failed to load manifest from %s", repodir);
+		goto err_loadenvelope;
+	}
+	metrics_observesince(METRICS_MANIFESTFETCH, loadstart);
+
+	struct crypto_checksigcntx manifestcntx = { .what = "manifest", .data =
+			(guint8*) envelope->manifest, .len = envelope->manifestlen, .keys =
+			keys, .cont = TRUE };
+	if (!crypto_checksigs(envelope->signatures, &manifestcntx)) {
+		g_message("manifest sig check failed");
+		goto err_manifestsig;
+	}
+
+	gint64 parsestart = g_get_monotonic_time();
+	struct manifest_manifest* manifest = manifest_deserialise(
+			envelope->manifest, envelope->manifestlen);
+	metrics_observesince(METRICS_MANIFESTPARSE, parsestart);
+	if (manifest == NULL) {
+		g_message("failed to parse manifest");
+		goto err_manifestparse;
+	}
+
+	struct manifest_image* image = bench_newestimage(manifest);
+	if (image == NULL) {
+		g_message("no enabled images in %s", repodir);
+		goto err_noimage;
+	}
+
+	struct bench_file file;
+	gchar* imagepath = buildpath(repodir, image->uuid, NULL);
+	file.fd = open(imagepath, O_RDONLY);
+	if (file.fd == -1) {
+		g_message("failed to open %s; %d", imagepath, errno);
+		goto err_openimage;
+	}
+
+	if (mtd != NULL)
+		g_message("benchmarking with %s, anything on it will be lost", mtd);
+
+	struct crypto_digests digests;
+	crypto_digests_init_for(&digests, image->signatures);
+	gint64 flashstart = g_get_monotonic_time();
+	struct pipeline* pipeline = pipeline_new(mtd, image->size, 0, &digests,
+	NULL, NULL, NULL);
+	if (pipeline == NULL)
+		goto err_pipeline;
+
+	guint8* buffer = g_malloc(BENCH_READSZ);
+	for (gsize offset = 0; offset < image->size;) {
+		gssize got = pread(file.fd, buffer,
+				MIN(BENCH_READSZ, image->size - offset), offset);
+		if (got <= 0) {
+			g_message("image is shorter than the manifest says");
+			goto err_read;
+		}
+		if (!pipeline_push(pipeline, buffer, got))
+			goto err_push;
+		offset += got;
+	}
+
+	if (pipeline_finish(pipeline) != PIPELINE_OK) {
+		g_message("failed to write image");
+		goto err_finish;
+	}
+	guint64 flashtook = g_get_monotonic_time() - flashstart;
+
+	struct crypto_checksigcntx imagecntx = { .what = "image", .digests =
+			pipeline_digests(pipeline), .keys = keys, .cont = TRUE };
+	if (!crypto_checksigs(image->signatures, &imagecntx)) {
+		g_message("image failed signature verification");
+		goto err_imagesig;
+	}
+
+	guint64 verifytook = 0;
+	if (mtd != NULL) {
+		gint64 verifystart = g_get_monotonic_time();
+		struct verify_result result;
+		gboolean verified = verify_image(mtd, pipeline, image->size,
+				image->signatures, bench_refetch, &file, &result);
+		verifytook = g_get_monotonic_time() - verifystart;
+		if (verified) {
+			struct crypto_checksigcntx flashcntx = { .what = "image on flash",
+					.digests = &result.digests, .keys = keys, .cont = TRUE };
+			verified = crypto_checksigs(image->signatures, &flashcntx);
+		}
+		verify_result_clear(&result);
+		if (!verified) {
+			g_message("image on flash failed verification");
+			goto err_verify;
+		}
+	}
+
+	bench_report(mtd, image, flashtook, verifytook);
+	ret = TRUE;
+
+	err_verify: //
+	err_imagesig: //
+	err_finish: //
+	err_push: //
+	err_read: //
+	g_free(buffer);
+	pipeline_free(pipeline);
+	err_pipeline: //
+	close(file.fd);
+	err_openimage: //
+	g_free(imagepath);
+	err_noimage: //
+	manifest_free(manifest);
+	err_manifestparse: //
+	err_manifestsig: //
+	manifest_envelope_free(envelope);
+	err_loadenvelope: //
+	return ret;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <glib.h>
+#include "crypto.h"
+
+gboolean bench_run(const gchar* repodir, const gchar* mtd,
+		struct crypto_keys* keys);
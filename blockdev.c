@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <linux/fs.h>
+#include <linux/ioctl.h>
+#include <mtd/mtd-user.h>
+
+#include "blockdev.h"
+
+/*
+ * Slots on a block device (eMMC, SD..) made to look like an mtd partition
+ * that doesn't need erasing. Everything is done with O_DIRECT so a whole
+ * image going past doesn't push everything else out of the page cache,
+ * data that isn't suitably aligned is bounced through an aligned buffer.
+ * The "erase blocks" are just the unit of transfer. Erasing can discard
+ * the blocks so the card knows the old data is garbage, otherwise it
+ * does nothing and the old data is overwritten in place.
+ */
+
+struct blockdev_file {
+	int fd;
+	guint32 blocksize;
+	/*
+	 * the active slot is read from several peer server threads at once
+	 * through the same fd, they take turns with the buffer
+	 */
+	GMutex bufferlock;
+	guint8* buffer;
+	gboolean written;
+};
+
+static gboolean blockdev_discard = FALSE;
+
+// partitions that have been opened by path and open files by fd
+static GMutex blockdev_lock;
+static GHashTable* blockdev_devices;
+static GHashTable* blockdev_files;
+
+void blockdev_setdiscard(gboolean discard) {
+	blockdev_discard = discard;
+}
+
+static gboolean blockdev_handles(const gchar* mtd) {
+	struct stat st;
+	return stat(mtd, &st) == 0 && S_ISBLK(st.st_mode);
+}
+
+static int blockdev_open(const gchar* mtd, int flags) {
+	int fd = open(mtd, flags | O_DIRECT);
+	if (fd == -1)
+		goto err_open;
+
+	int blocksize;
+	if (ioctl(fd, BLKSSZGET, &blocksize) == -1)
+		goto err_blocksize;
+
+	struct blockdev_file* file = g_malloc0(sizeof(*file));
+	file->fd = fd;
+	file->blocksize = blocksize;
+	g_mutex_init(&file->bufferlock);
+
+	g_mutex_lock(&blockdev_lock);
+	if (blockdev_devices == NULL) {
+		blockdev_devices = g_hash_table_new_full(g_str_hash, g_str_equal,
+				g_free, NULL);
+		blockdev_files = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+	g_hash_table_add(blockdev_devices, g_strdup(mtd));
+	g_hash_table_insert(blockdev_files, GINT_TO_POINTER(fd), file);
+	g_mutex_unlock(&blockdev_lock);
+	return fd;
+
+	err_blocksize: //
+	close(fd);
+	err_open: //
+	return -1;
+}
+
+static struct blockdev_file* blockdev_forfd(int fd) {
+	g_mutex_lock(&blockdev_lock);
+	struct blockdev_file* file = g_hash_table_lookup(blockdev_files,
+			GINT_TO_POINTER(fd));
+	g_mutex_unlock(&blockdev_lock);
+	return file;
+}
+
+static guint8* blockdev_buffer(struct blockdev_file* file) {
+	if (file->buffer == NULL
+			&& posix_memalign((void**) &file->buffer, BLOCKDEV_ALIGN,
+			BLOCKDEV_BUFFERSZ) != 0)
+		file->buffer = NULL;
+	return file->buffer;
+}
+
+static int blockdev_getinfo(int fd, struct mtd_info_user* info) {
+	guint64 size;
+	if (ioctl(fd, BLKGETSIZE64, &size) == -1)
+		return -1;
+
+	memset(info, 0, sizeof(*info));
+	info->type = MTD_RAM;
+	info->flags = MTD_CAP_RAM;
+	info->erasesize = BLOCKDEV_BUFFERSZ;
+	info->writesize = blockdev_forfd(fd)->blocksize;
+	/*
+	 * Offsets everywhere above this are 32 bits like the mtd api's, a
+	 * bigger slot is refused rather than quietly used as a 4GiB one.
+	 */
+	if (size > G_MAXUINT32) {
+		g_message("block device is bigger than 4GiB, that isn't supported");
+		errno = EFBIG;
+		return -1;
+	}
+	info->size = size - (size % info->erasesize);
+	return 0;
+}
+
+static int blockdev_erase(int fd, const struct erase_info_user* eraseinfo) {
+	if (!blockdev_discard)
+		return 0;
+
+	guint64 range[] = { eraseinfo->start, eraseinfo->length };
+	if (ioctl(fd, BLKDISCARD, range) == -1) {
+		if (errno != EOPNOTSUPP)
+			return -1;
+		g_message("device doesn't support discard, not discarding");
+		blockdev_discard = FALSE;
+	}
+	return 0;
+}
+
+static int blockdev_ioctl(int fd, unsigned long request, void* arg) {
+	switch (request) {
+	case MEMGETINFO:
+		return blockdev_getinfo(fd, arg);
+	case MEMERASE:
+		return blockdev_erase(fd, arg);
+	case MEMGETBADBLOCK:
+		return 0;
+	default:
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+}
+
+// called with the buffer lock held
+static ssize_t blockdev_bounceread(struct blockdev_file* file, void* data,
+		size_t len, off_t offset) {
+	int fd = file->fd;
+	guint8* buffer = blockdev_buffer(file);
+	if (buffer == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	gsize done = 0;
+	while (done < len) {
+		off_t start = offset + done;
+		gsize head = start % file->blocksize;
+		start -= head;
+		gsize want = MIN(len - done, BLOCKDEV_BUFFERSZ - head);
+		gsize readlen = ((head + want + file->blocksize - 1) / file->blocksize)
+				* file->blocksize;
+		ssize_t got = pread(fd, buffer, readlen, start);
+		if (got < 0)
+			return done > 0 ? done : -1;
+		if (got < head + want) {
+			if (got > head) {
+				memcpy((guint8*) data + done, buffer + head, got - head);
+				done += got - head;
+			}
+			break;
+		}
+		memcpy((guint8*) data + done, buffer + head, want);
+		done += want;
+	}
+	return done;
+}
+
+static ssize_t blockdev_pread(int fd, void* data, size_t len, off_t offset) {
+	struct blockdev_file* file = blockdev_forfd(fd);
+	if (((guintptr) data) % BLOCKDEV_ALIGN == 0 && offset % file->blocksize == 0
+			&& len % file->blocksize == 0)
+		return pread(fd, data, len, offset);
+
+	g_mutex_lock(&file->bufferlock);
+	ssize_t ret = blockdev_bounceread(file, data, len, offset);
+	g_mutex_unlock(&file->bufferlock);
+	return ret;
+}
+
+// called with the buffer lock held
+static ssize_t blockdev_bouncewrite(struct blockdev_file* file,
+		const void* data, size_t len, off_t offset) {
+	int fd = file->fd;
+	guint8* buffer = blockdev_buffer(file);
+	if (buffer == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	gsize done = 0;
+	while (done < len) {
+		gsize chunk = MIN(len - done, BLOCKDEV_BUFFERSZ);
+		memcpy(buffer, (const guint8*) data + done, chunk);
+		ssize_t wrote = pwrite(fd, buffer, chunk, offset + done);
+		if (wrote < 0)
+			return done > 0 ? done : -1;
+		done += wrote;
+		if (wrote < chunk)
+			break;
+	}
+	return done;
+}
+
+static ssize_t blockdev_pwrite(int fd, const void* data, size_t len,
+		off_t offset) {
+	struct blockdev_file* file = blockdev_forfd(fd);
+	if (offset % file->blocksize != 0 || len % file->blocksize != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	file->written = TRUE;
+	if (((guintptr) data) % BLOCKDEV_ALIGN == 0)
+		return pwrite(fd, data, len, offset);
+
+	g_mutex_lock(&file->bufferlock);
+	ssize_t ret = blockdev_bouncewrite(file, data, len, offset);
+	g_mutex_unlock(&file->bufferlock);
+	return ret;
+}
+
+/*
+ * O_DIRECT skips the page cache but not the card's own cache so anything
+ * that was written is flushed once when it's closed.
+ */
+static int blockdev_close(int fd) {
+	g_mutex_lock(&blockdev_lock);
+	struct blockdev_file* file = g_hash_table_lookup(blockdev_files,
+			GINT_TO_POINTER(fd));
+	g_hash_table_remove(blockdev_files, GINT_TO_POINTER(fd));
+	g_mutex_unlock(&blockdev_lock);
+
+	int ret = 0;
+	if (file->written && fdatasync(fd) == -1) {
+		g_message("failed to sync; %d", errno);
+		ret = -1;
+	}
+	free(file->buffer);
+	g_mutex_clear(&file->bufferlock);
+	g_free(file);
+	if (close(fd) == -1)
+		ret = -1;
+	return ret;
+}
+
+static guint64 blockdev_readsysfs(const gchar* name, const gchar* attr) {
+	guint64 value = 0;
+	gchar* path = g_build_path("/", "/sys/class/block", name, attr, NULL);
+	gchar* contents;
+	if (g_file_get_contents(path, &contents, NULL, NULL)) {
+		value = g_ascii_strtoull(contents, NULL, 10);
+		g_free(contents);
+	}
+	g_free(path);
+	return value;
+}
+
+/*
+ * The offset uboot passes for a block device is the byte offset of the
+ * partition on the disk, only partitions that have been opened (which
+ * mtd_init does for all of them) are considered.
+ */
+static gchar* blockdev_foroffset(guint64 offset) {
+	gchar* mtd = NULL;
+	g_mutex_lock(&blockdev_lock);
+	if (blockdev_devices == NULL)
+		goto out;
+
+	GHashTableIter iter;
+	gpointer key;
+	g_hash_table_iter_init(&iter, blockdev_devices);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		gchar* dev = realpath(key, NULL);
+		if (dev == NULL)
+			continue;
+		gchar* name = g_path_get_basename(dev);
+		free(dev);
+		// sysfs sizes are always in 512 byte sectors
+		guint64 start = blockdev_readsysfs(name, "start") * 512;
+		guint64 size = blockdev_readsysfs(name, "size") * 512;
+		g_free(name);
+		if (size != 0 && offset >= start && offset < start + size) {
+			mtd = g_strdup(key);
+			break;
+		}
+	}
+
+	out: //
+	g_mutex_unlock(&blockdev_lock);
+	return mtd;
+}
+
+const struct mtd_backend blockdev_backend = { .name = "blockdev", .handles =
+		blockdev_handles, .open = blockdev_open, .ioctl = blockdev_ioctl,
+		.pread = blockdev_pread, .pwrite = blockdev_pwrite, .close =
+				blockdev_close, .foroffset = blockdev_foroffset };
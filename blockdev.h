@@ -0,0 +1,9 @@
+#pragma once
+
+#include "mtdbackend.h"
+
+// O_DIRECT transfers go through buffers this big and this aligned
+#define BLOCKDEV_BUFFERSZ (1024 * 1024)
+#define BLOCKDEV_ALIGN    4096
+
+void blockdev_setdiscard(gboolean discard);
@@ -0,0 +1,258 @@
+#include <string.h>
+#include <json-glib/json-glib.h>
+#include "changes.h"
+#include "jsonparserutils.h"
+#include "jsonbuilderutils.h"
+
+gchar* changes_filename(guint serial) {
+	return g_strdup_printf("%s/%u.json", OTA_CHANGESDIR, serial);
+}
+
+/*
+ * The timestamp changes with every publish so a repo that was rolled back
+ * and published the same serial again doesn't hash the same.
+ */
+gchar* changes_manifesthash(const struct manifest_manifest* manifest) {
+	gchar* id = g_strdup_printf("%s\n%u\n%" G_GINT64_FORMAT, manifest->uuid,
+			manifest->serial, manifest->timestamp);
+	gchar* hash = g_compute_checksum_for_string(G_CHECKSUM_SHA256, id, -1);
+	g_free(id);
+	return hash;
+}
+
+gchar* changes_head_serialise(const struct changes_head* head, gsize* len) {
+	JsonBuilder* builder = json_builder_new();
+	json_builder_begin_object(builder);
+	JSONBUILDER_ADD_INT(builder, CHANGES_JSONFIELD_SERIAL, head->serial);
+	JSONBUILDER_ADD_INT(builder, CHANGES_JSONFIELD_FIRST, head->first);
+	json_builder_end_object(builder);
+	return jsonbuilder_freetostring(builder, len, TRUE);
+}
+
+gboolean changes_head_deserialise(const gchar* data, gsize len,
+		struct changes_head* head) {
+	gboolean ret = FALSE;
+	JsonParser* parser = json_parser_new();
+	if (!json_parser_load_from_data(parser, data, len, NULL)) {
+		g_message("failed to parse changes head");
+		goto err_parse;
+	}
+
+	JsonObject* rootobj = JSON_NODE_GET_OBJECT(json_parser_get_root(parser));
+	if (rootobj == NULL)
+		goto err_badroot;
+	gint64 serial = JSON_OBJECT_GET_MEMBER_INT(rootobj,
+			CHANGES_JSONFIELD_SERIAL);
+	gint64 first = JSON_OBJECT_GET_MEMBER_INT(rootobj, CHANGES_JSONFIELD_FIRST);
+	if (serial <= 0 || serial > G_MAXUINT || first <= 0 || first > serial) {
+		g_message("changes head is incomplete or invalid");
+		goto err_invalid;
+	}
+
+	head->serial = serial;
+	head->first = first;
+	ret = TRUE;
+
+	err_invalid: //
+	err_badroot: //
+	err_parse: //
+	g_object_unref(parser);
+	return ret;
+}
+
+struct changes_entry* changes_entry_new() {
+	struct changes_entry* entry = g_malloc0(sizeof(*entry));
+	entry->put = g_ptr_array_new_with_free_func(
+			(GDestroyNotify) manifest_image_free);
+	entry->delete = g_ptr_array_new_with_free_func(g_free);
+	return entry;
+}
+
+static gchar* changes_image_tostring(struct manifest_image* image) {
+	JsonBuilder* builder = json_builder_new();
+	manifest_image_serialise(builder, image);
+	gsize len;
+	return jsonbuilder_freetostring(builder, &len, FALSE);
+}
+
+/*
+ * What turns previous into manifest. Images are compared by how they
+ * serialise so changing anything about one, enabling it, its tags or
+ * rollout, puts all of it again. Images are never big. The images that
+ * are put still belong to manifest.
+ */
+struct changes_entry* changes_entry_diff(
+		const struct manifest_manifest* previous,
+		const struct manifest_manifest* manifest) {
+	struct changes_entry* entry = changes_entry_new();
+	g_ptr_array_set_free_func(entry->put, NULL);
+	entry->serial = manifest->serial;
+	entry->timestamp = manifest->timestamp;
+	entry->pollinterval = manifest->pollinterval;
+
+	GHashTable* before = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+			g_free);
+	for (guint i = 0; i < previous->images->len; i++) {
+		struct manifest_image* image = g_ptr_array_index(previous->images, i);
+		g_hash_table_insert(before, (gpointer) image->uuid,
+				changes_image_tostring(image));
+	}
+
+	for (guint i = 0; i < manifest->images->len; i++) {
+		struct manifest_image* image = g_ptr_array_index(manifest->images, i);
+		gchar* now = changes_image_tostring(image);
+		const gchar* then = g_hash_table_lookup(before, image->uuid);
+		if (then == NULL || strcmp(then, now) != 0)
+			g_ptr_array_add(entry->put, image);
+		g_hash_table_remove(before, image->uuid);
+		g_free(now);
+	}
+
+	GHashTableIter iter;
+	gpointer uuid;
+	g_hash_table_iter_init(&iter, before);
+	while (g_hash_table_iter_next(&iter, &uuid, NULL))
+		g_ptr_array_add(entry->delete, g_strdup(uuid));
+
+	g_hash_table_unref(before);
+	return entry;
+}
+
+gchar* changes_entry_serialise(const struct changes_entry* entry, gsize* len) {
+	JsonBuilder* builder = json_builder_new();
+	json_builder_begin_object(builder);
+	JSONBUILDER_ADD_INT(builder, CHANGES_JSONFIELD_SERIAL, entry->serial);
+	JSONBUILDER_ADD_STRING(builder, CHANGES_JSONFIELD_PREV,
+			entry->prev != NULL ? entry->prev : "");
+	JSONBUILDER_ADD_INT(builder, CHANGES_JSONFIELD_TIMESTAMP,
+			entry->timestamp);
+	JSONBUILDER_ADD_INT(builder, CHANGES_JSONFIELD_POLLINTERVAL,
+			entry->pollinterval);
+	JSONBUILDER_START_ARRAY(builder, CHANGES_JSONFIELD_PUT);
+	for (guint i = 0; i < entry->put->len; i++)
+		manifest_image_serialise(builder, g_ptr_array_index(entry->put, i));
+	json_builder_end_array(builder);
+	JSONBUILDER_START_ARRAY(builder, CHANGES_JSONFIELD_DELETE);
+	for (guint i = 0; i < entry->delete->len; i++)
+		json_builder_add_string_value(builder,
+				g_ptr_array_index(entry->delete, i));
+	json_builder_end_array(builder);
+	json_builder_end_object(builder);
+	return jsonbuilder_freetostring(builder, len, TRUE);
+}
+
+struct changes_entry* changes_entry_deserialise(const gchar* data, gsize len) {
+	struct changes_entry* entry = NULL;
+	JsonParser* parser = json_parser_new();
+	if (!json_parser_load_from_data(parser, data, len, NULL)) {
+		g_message("failed to parse changes entry");
+		goto err_parse;
+	}
+
+	JsonObject* rootobj = JSON_NODE_GET_OBJECT(json_parser_get_root(parser));
+	if (rootobj == NULL)
+		goto err_badroot;
+
+	gint64 serial = JSON_OBJECT_GET_MEMBER_INT(rootobj,
+			CHANGES_JSONFIELD_SERIAL);
+	const gchar* prev = JSON_OBJECT_GET_MEMBER_STRING(rootobj,
+			CHANGES_JSONFIELD_PREV);
+	gint64 pollinterval = JSON_OBJECT_GET_MEMBER_INT(rootobj,
+			CHANGES_JSONFIELD_POLLINTERVAL);
+	JsonArray* put = JSON_OBJECT_GET_MEMBER_ARRAY(rootobj,
+			CHANGES_JSONFIELD_PUT);
+	JsonArray* delete = JSON_OBJECT_GET_MEMBER_ARRAY(rootobj,
+			CHANGES_JSONFIELD_DELETE);
+	if (serial <= 0 || serial > G_MAXUINT || prev == NULL || pollinterval < 0
+			|| pollinterval > G_MAXUINT || put == NULL || delete == NULL) {
+		g_message("changes entry is incomplete or invalid");
+		goto err_invalid;
+	}
+
+	entry = changes_entry_new();
+	entry->serial = serial;
+	entry->prev = g_strdup(prev);
+	entry->timestamp = JSON_OBJECT_GET_MEMBER_INT(rootobj,
+			CHANGES_JSONFIELD_TIMESTAMP);
+	entry->pollinterval = pollinterval;
+	// an image that's left out would silently never be updated
+	manifest_images_deserialise(put, entry->put);
+	if (entry->put->len != json_array_get_length(put)) {
+		g_message("changes entry has invalid images");
+		goto err_images;
+	}
+	for (guint i = 0; i < json_array_get_length(delete); i++) {
+		const gchar* uuid = json_array_get_string_element(delete, i);
+		if (uuid == NULL) {
+			g_message("changes entry has an invalid uuid");
+			goto err_images;
+		}
+		g_ptr_array_add(entry->delete, g_strdup(uuid));
+	}
+	goto out;
+
+	err_images: //
+	changes_entry_free(entry);
+	entry = NULL;
+	out: //
+	err_invalid: //
+	err_badroot: //
+	err_parse: //
+	g_object_unref(parser);
+	return entry;
+}
+
+void changes_entry_free(struct changes_entry* entry) {
+	g_free(entry->prev);
+	g_ptr_array_free(entry->put, TRUE);
+	g_ptr_array_free(entry->delete, TRUE);
+	g_free(entry);
+}
+
+static void changes_removeimage(struct manifest_manifest* manifest,
+		const gchar* uuid) {
+	for (guint i = 0; i < manifest->images->len; i++) {
+		struct manifest_image* image = g_ptr_array_index(manifest->images, i);
+		if (strcmp(image->uuid, uuid) == 0) {
+			g_ptr_array_remove_index(manifest->images, i);
+			return;
+		}
+	}
+}
+
+static gint changes_sortbyversion(gconstpointer a, gconstpointer b) {
+	const struct manifest_image* left = *((struct manifest_image**) a);
+	const struct manifest_image* right = *((struct manifest_image**) b);
+	if (left->version == right->version)
+		return 0;
+	return left->version < right->version ? -1 : 1;
+}
+
+/*
+ * Apply an entry that has already been verified to the manifest it
+ * follows on from. The images in the entry are moved into the manifest.
+ */
+gboolean changes_apply(struct manifest_manifest* manifest,
+		struct changes_entry* entry) {
+	if (entry->serial != manifest->serial + 1) {
+		g_message("changes entry %u doesn't follow manifest %u",
+				entry->serial, manifest->serial);
+		return FALSE;
+	}
+
+	for (guint i = 0; i < entry->delete->len; i++)
+		changes_removeimage(manifest, g_ptr_array_index(entry->delete, i));
+	for (guint i = 0; i < entry->put->len; i++) {
+		struct manifest_image* image = g_ptr_array_index(entry->put, i);
+		changes_removeimage(manifest, image->uuid);
+		g_ptr_array_add(manifest->images, image);
+	}
+	g_ptr_array_set_free_func(entry->put, NULL);
+	g_ptr_array_set_size(entry->put, 0);
+	g_ptr_array_sort(manifest->images, changes_sortbyversion);
+
+	manifest->serial = entry->serial;
+	manifest->timestamp = entry->timestamp;
+	manifest->pollinterval = entry->pollinterval;
+	return TRUE;
+}
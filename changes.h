@@ -0,0 +1,64 @@
+#pragma once
+
+#include <glib.h>
+#include "manifest.h"
+
+#define OTA_CHANGES       "changes.json"
+#define OTA_CHANGESDIR    "changes"
+// how many entries the repo keeps, devices further behind fetch it all
+#define CHANGES_KEEP      32
+
+#define CHANGES_JSONFIELD_SERIAL       "serial"
+#define CHANGES_JSONFIELD_FIRST        "first"
+#define CHANGES_JSONFIELD_PREV         "prev"
+#define CHANGES_JSONFIELD_TIMESTAMP    "timestamp"
+#define CHANGES_JSONFIELD_POLLINTERVAL "pollinterval"
+#define CHANGES_JSONFIELD_PUT          "put"
+#define CHANGES_JSONFIELD_DELETE       "delete"
+
+/*
+ * A journal of what changed in the manifest so a device that already has
+ * it can catch up without fetching all of it again.
+ *
+ * changes.json is the head, the newest serial and the oldest one there's
+ * an entry for. It isn't signed, lying about it only makes a device fetch
+ * entries that don't exist or fail to verify and then the whole manifest.
+ * changes/<serial>.json is an envelope with the entry that turned the
+ * manifest before serial into serial. Entries are signed and each has a
+ * hash of the exact manifest it applies to, its uuid, serial and
+ * timestamp, which a device checks against the manifest it has so it
+ * notices a gap or a fork. Applying an entry gives the manifest the next
+ * entry was made against so the chain is anchored on a verified manifest.
+ *
+ * An entry has the images that were added or changed in full and the
+ * uuids of the ones that were removed.
+ */
+struct changes_head {
+	guint serial;
+	guint first;
+};
+
+struct changes_entry {
+	guint serial;
+	// changes_manifesthash() of the manifest this applies to
+	gchar* prev;
+	gint64 timestamp;
+	guint pollinterval;
+	GPtrArray* put;
+	GPtrArray* delete;
+};
+
+gchar* changes_filename(guint serial);
+gchar* changes_manifesthash(const struct manifest_manifest* manifest);
+gchar* changes_head_serialise(const struct changes_head* head, gsize* len);
+gboolean changes_head_deserialise(const gchar* data, gsize len,
+		struct changes_head* head);
+struct changes_entry* changes_entry_new(void);
+struct changes_entry* changes_entry_diff(
+		const struct manifest_manifest* previous,
+		const struct manifest_manifest* manifest);
+gchar* changes_entry_serialise(const struct changes_entry* entry, gsize* len);
+struct changes_entry* changes_entry_deserialise(const gchar* data, gsize len);
+void changes_entry_free(struct changes_entry* entry);
+gboolean changes_apply(struct manifest_manifest* manifest,
+		struct changes_entry* entry);
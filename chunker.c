@@ -0,0 +1,195 @@
+/*
+ * Content defined chunking with a gear hash. Boundaries depend only on the
+ * bytes just before them so an insert or delete only changes the chunks
+ * around it. The repo and the devices must cut chunks identically so the
+ * gear table is generated from a fixed seed.
+ */
+
+#include <json-glib/json-glib.h>
+#include "chunker.h"
+#include "jsonparserutils.h"
+#include "jsonbuilderutils.h"
+#include "utils.h"
+
+#define CHUNKER_MIN   (4 * 1024)
+#define CHUNKER_MAX   (64 * 1024)
+#define CHUNKER_MASK  ((16 * 1024) - 1)
+#define CHUNKER_SEED  0x6f7461636863686bULL
+
+struct chunker {
+	struct chunker_chunk chunk;
+	guint32 hash;
+	struct sha256_ctx sha256;
+	chunker_callback callback;
+	gpointer user_data;
+};
+
+static guint32 gear[256];
+
+static void chunker_initgear() {
+	static gsize initialised = 0;
+	if (g_once_init_enter(&initialised)) {
+		// splitmix64
+		guint64 state = CHUNKER_SEED;
+		for (int i = 0; i < G_N_ELEMENTS(gear); i++) {
+			guint64 z = (state += 0x9e3779b97f4a7c15ULL);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			gear[i] = (z ^ (z >> 31)) >> 32;
+		}
+		g_once_init_leave(&initialised, 1);
+	}
+}
+
+struct chunker* chunker_new(chunker_callback callback, gpointer user_data) {
+	chunker_initgear();
+	struct chunker* chunker = g_malloc0(sizeof(*chunker));
+	sha256_init(&chunker->sha256);
+	chunker->callback = callback;
+	chunker->user_data = user_data;
+	return chunker;
+}
+
+static void chunker_emit(struct chunker* chunker) {
+	sha256_digest(&chunker->sha256, sizeof(chunker->chunk.sha256),
+			chunker->chunk.sha256);
+	chunker->callback(&chunker->chunk, chunker->user_data);
+	chunker->chunk.offset += chunker->chunk.len;
+	chunker->chunk.len = 0;
+}
+
+void chunker_push(struct chunker* chunker, const guint8* data, gsize len) {
+	gsize start = 0;
+	for (gsize i = 0; i < len; i++) {
+		chunker->hash = (chunker->hash << 1) + gear[data[i]];
+		chunker->chunk.len++;
+		if ((chunker->chunk.len >= CHUNKER_MIN
+				&& (chunker->hash & CHUNKER_MASK) == 0)
+				|| chunker->chunk.len == CHUNKER_MAX) {
+			sha256_update(&chunker->sha256, (i + 1) - start, data + start);
+			chunker_emit(chunker);
+			start = i + 1;
+		}
+	}
+	sha256_update(&chunker->sha256, len - start, data + start);
+}
+
+void chunker_finish(struct chunker* chunker) {
+	if (chunker->chunk.len > 0)
+		chunker_emit(chunker);
+}
+
+void chunker_free(struct chunker* chunker) {
+	g_free(chunker);
+}
+
+static void chunker_index_add(const struct chunker_chunk* chunk,
+		gpointer user_data) {
+	g_array_append_vals((GArray*) user_data, chunk, 1);
+}
+
+GArray* chunker_index(const guint8* data, gsize len) {
+	GArray* chunks = g_array_new(FALSE, FALSE, sizeof(struct chunker_chunk));
+	struct chunker* chunker = chunker_new(chunker_index_add, chunks);
+	chunker_push(chunker, data, len);
+	chunker_finish(chunker);
+	chunker_free(chunker);
+	return chunks;
+}
+
+gchar* chunker_index_serialise(GArray* chunks, gsize* len) {
+	JsonBuilder* builder = json_builder_new();
+	json_builder_begin_object(builder);
+	JSONBUILDER_START_ARRAY(builder, CHUNKER_JSONFIELD_CHUNKS);
+	for (int i = 0; i < chunks->len; i++) {
+		struct chunker_chunk* chunk = &g_array_index(chunks,
+				struct chunker_chunk, i);
+		gchar* sha256 = hexencode(chunk->sha256, sizeof(chunk->sha256));
+		json_builder_begin_object(builder);
+		JSONBUILDER_ADD_INT(builder, CHUNKER_JSONFIELD_OFFSET, chunk->offset);
+		JSONBUILDER_ADD_INT(builder, CHUNKER_JSONFIELD_LENGTH, chunk->len);
+		JSONBUILDER_ADD_STRING(builder, CHUNKER_JSONFIELD_SHA256, sha256);
+		json_builder_end_object(builder);
+		g_free(sha256);
+	}
+	json_builder_end_array(builder);
+	json_builder_end_object(builder);
+	return jsonbuilder_freetostring(builder, len, FALSE);
+}
+
+static void chunker_index_deserialise_chunk(JsonArray *array, guint index,
+		JsonNode *element_node, gpointer user_data) {
+	GArray* chunks = user_data;
+	JsonObject* chunkobj = JSON_NODE_GET_OBJECT(element_node);
+	if (chunkobj == NULL)
+		goto err_parse;
+
+	gint64 offset = JSON_OBJECT_GET_MEMBER_INT(chunkobj,
+			CHUNKER_JSONFIELD_OFFSET);
+	gint64 len = JSON_OBJECT_GET_MEMBER_INT(chunkobj,
+			CHUNKER_JSONFIELD_LENGTH);
+	const gchar* sha256 = JSON_OBJECT_GET_MEMBER_STRING(chunkobj,
+			CHUNKER_JSONFIELD_SHA256);
+	if (offset < 0 || len <= 0 || len > CHUNKER_MAX || sha256 == NULL)
+		goto err_parse;
+
+	// chunks have to be contiguous
+	gsize expected = 0;
+	if (chunks->len > 0) {
+		struct chunker_chunk* last = &g_array_index(chunks,
+				struct chunker_chunk, chunks->len - 1);
+		expected = last->offset + last->len;
+	}
+	if (offset != expected)
+		goto err_parse;
+
+	struct chunker_chunk chunk = { .offset = offset, .len = len };
+	if (!hexdecode(sha256, chunk.sha256, sizeof(chunk.sha256)))
+		goto err_parse;
+	g_array_append_vals(chunks, &chunk, 1);
+	return;
+
+	err_parse: //
+	// the caller notices the missing chunk and rejects the whole index
+	g_message("bad chunk %u in index", index);
+}
+
+GArray* chunker_index_deserialise(const gchar* data, gsize len) {
+	GArray* chunks = NULL;
+	JsonParser* parser = json_parser_new();
+	if (!json_parser_load_from_data(parser, data, len, NULL)) {
+		g_message("failed to parse chunk index");
+		goto err_parse;
+	}
+
+	JsonObject* root = JSON_NODE_GET_OBJECT(json_parser_get_root(parser));
+	if (root == NULL)
+		goto err_parse;
+
+	JsonArray* chunkarray = JSON_OBJECT_GET_MEMBER_ARRAY(root,
+			CHUNKER_JSONFIELD_CHUNKS);
+	if (chunkarray == NULL)
+		goto err_parse;
+
+	chunks = g_array_new(FALSE, FALSE, sizeof(struct chunker_chunk));
+	json_array_foreach_element(chunkarray, chunker_index_deserialise_chunk,
+			chunks);
+	if (chunks->len != json_array_get_length(chunkarray)) {
+		g_array_free(chunks, TRUE);
+		chunks = NULL;
+	}
+
+	err_parse: //
+	g_object_unref(parser);
+	return chunks;
+}
+
+guint chunker_digest_hash(gconstpointer key) {
+	guint hash;
+	memcpy(&hash, key, sizeof(hash));
+	return hash;
+}
+
+gboolean chunker_digest_equal(gconstpointer a, gconstpointer b) {
+	return memcmp(a, b, SHA256_DIGEST_SIZE) == 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <glib.h>
+#include <nettle/sha2.h>
+
+#define CHUNKER_JSONFIELD_CHUNKS "chunks"
+#define CHUNKER_JSONFIELD_OFFSET "offset"
+#define CHUNKER_JSONFIELD_LENGTH "length"
+#define CHUNKER_JSONFIELD_SHA256 "sha256"
+
+// the digest must stay first, tables keyed on chunks look up by digest
+struct chunker_chunk {
+	guint8 sha256[SHA256_DIGEST_SIZE];
+	gsize offset;
+	gsize len;
+};
+
+typedef void (*chunker_callback)(const struct chunker_chunk* chunk,
+		gpointer user_data);
+
+struct chunker;
+
+struct chunker* chunker_new(chunker_callback callback, gpointer user_data);
+void chunker_push(struct chunker* chunker, const guint8* data, gsize len);
+void chunker_finish(struct chunker* chunker);
+void chunker_free(struct chunker* chunker);
+
+GArray* chunker_index(const guint8* data, gsize len);
+gchar* chunker_index_serialise(GArray* chunks, gsize* len);
+GArray* chunker_index_deserialise(const gchar* data, gsize len);
+guint chunker_digest_hash(gconstpointer key);
+gboolean chunker_digest_equal(gconstpointer a, gconstpointer b);
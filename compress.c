@@ -0,0 +1,234 @@
+#ifdef OTA_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef OTA_HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#include "compress.h"
+
+#define COMPRESS_ZSTD_LEVEL 19
+/*
+ * Level 19 would otherwise pick a window as big as the image and the
+ * decoder has to keep the whole window in memory. 1MiB keeps devices
+ * within the same bounds as the rest of the pipeline.
+ */
+#define COMPRESS_ZSTD_WINDOWLOG 20
+#define COMPRESS_LZ4_LEVEL  12
+#define COMPRESS_BUFFERSZ   (64 * 1024)
+
+struct compress_decompressor {
+	enum manifest_compression algorithm;
+	compress_outputcallback outputcallback;
+	gpointer user_data;
+	guint8* buffer;
+	// set once the end of the compressed frame has been seen
+	gboolean complete;
+#ifdef OTA_HAVE_ZSTD
+	ZSTD_DStream* zstd;
+#endif
+#ifdef OTA_HAVE_LZ4
+	LZ4F_dctx* lz4;
+#endif
+};
+
+gboolean compress_supported(enum manifest_compression algorithm) {
+	switch (algorithm) {
+#ifdef OTA_HAVE_ZSTD
+	case OTA_COMPRESSION_ZSTD:
+		return TRUE;
+#endif
+#ifdef OTA_HAVE_LZ4
+	case OTA_COMPRESSION_LZ4:
+		return TRUE;
+#endif
+	default:
+		return FALSE;
+	}
+}
+
+GByteArray* compress_compress(enum manifest_compression algorithm,
+		const guint8* data, gsize len) {
+	GByteArray* out = NULL;
+	switch (algorithm) {
+#ifdef OTA_HAVE_ZSTD
+	case OTA_COMPRESSION_ZSTD: {
+		ZSTD_CCtx* cctx = ZSTD_createCCtx();
+		if (cctx == NULL) {
+			g_message("failed to create zstd context");
+			return NULL;
+		}
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+		COMPRESS_ZSTD_LEVEL);
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog,
+		COMPRESS_ZSTD_WINDOWLOG);
+		gsize bound = ZSTD_compressBound(len);
+		out = g_byte_array_sized_new(bound);
+		g_byte_array_set_size(out, bound);
+		gsize outlen = ZSTD_compress2(cctx, out->data, bound, data, len);
+		ZSTD_freeCCtx(cctx);
+		if (ZSTD_isError(outlen)) {
+			g_message("zstd compression failed; %s",
+					ZSTD_getErrorName(outlen));
+			g_byte_array_free(out, TRUE);
+			return NULL;
+		}
+		g_byte_array_set_size(out, outlen);
+	}
+		break;
+#endif
+#ifdef OTA_HAVE_LZ4
+	case OTA_COMPRESSION_LZ4: {
+		LZ4F_preferences_t prefs = { 0 };
+		prefs.compressionLevel = COMPRESS_LZ4_LEVEL;
+		prefs.frameInfo.contentSize = len;
+		gsize bound = LZ4F_compressFrameBound(len, &prefs);
+		out = g_byte_array_sized_new(bound);
+		g_byte_array_set_size(out, bound);
+		gsize outlen = LZ4F_compressFrame(out->data, bound, data, len, &prefs);
+		if (LZ4F_isError(outlen)) {
+			g_message("lz4 compression failed; %s",
+					LZ4F_getErrorName(outlen));
+			g_byte_array_free(out, TRUE);
+			return NULL;
+		}
+		g_byte_array_set_size(out, outlen);
+	}
+		break;
+#endif
+	default:
+		g_message("compression algorithm not supported");
+		break;
+	}
+	return out;
+}
+
+struct compress_decompressor* compress_decompressor_new(
+		enum manifest_compression algorithm,
+		compress_outputcallback outputcallback, gpointer user_data) {
+	if (!compress_supported(algorithm))
+		return NULL;
+
+	struct compress_decompressor* decompressor = g_malloc0(
+			sizeof(*decompressor));
+	decompressor->algorithm = algorithm;
+	decompressor->outputcallback = outputcallback;
+	decompressor->user_data = user_data;
+	decompressor->buffer = g_malloc(COMPRESS_BUFFERSZ);
+
+	switch (algorithm) {
+#ifdef OTA_HAVE_ZSTD
+	case OTA_COMPRESSION_ZSTD:
+		decompressor->zstd = ZSTD_createDStream();
+		if (decompressor->zstd == NULL
+				|| ZSTD_isError(ZSTD_initDStream(decompressor->zstd))
+				|| ZSTD_isError(
+						ZSTD_DCtx_setParameter(decompressor->zstd,
+								ZSTD_d_windowLogMax,
+								COMPRESS_ZSTD_WINDOWLOG))) {
+			compress_decompressor_free(decompressor);
+			return NULL;
+		}
+		break;
+#endif
+#ifdef OTA_HAVE_LZ4
+	case OTA_COMPRESSION_LZ4:
+		if (LZ4F_isError(
+				LZ4F_createDecompressionContext(&decompressor->lz4,
+						LZ4F_VERSION))) {
+			compress_decompressor_free(decompressor);
+			return NULL;
+		}
+		break;
+#endif
+	default:
+		break;
+	}
+
+	return decompressor;
+}
+
+/*
+ * Decompress into a fixed buffer and pass each buffer full on so memory use
+ * doesn't depend on the image size.
+ */
+gboolean compress_decompressor_push(struct compress_decompressor* decompressor,
+		const guint8* data, gsize len) {
+	switch (decompressor->algorithm) {
+#ifdef OTA_HAVE_ZSTD
+	case OTA_COMPRESSION_ZSTD: {
+		ZSTD_inBuffer in = { .src = data, .size = len, .pos = 0 };
+		for (;;) {
+			ZSTD_outBuffer out = { .dst = decompressor->buffer, .size =
+			COMPRESS_BUFFERSZ, .pos = 0 };
+			gsize ret = ZSTD_decompressStream(decompressor->zstd, &out, &in);
+			if (ZSTD_isError(ret)) {
+				g_message("zstd decompression failed; %s",
+						ZSTD_getErrorName(ret));
+				return FALSE;
+			}
+			if (ret == 0)
+				decompressor->complete = TRUE;
+			if (out.pos > 0
+					&& !decompressor->outputcallback(decompressor->buffer,
+							out.pos, decompressor->user_data))
+				return FALSE;
+			// a full output buffer means there might be more to flush
+			if (in.pos == in.size && out.pos < out.size)
+				return TRUE;
+			if (decompressor->complete && in.pos < in.size) {
+				g_message("trailing data after zstd frame");
+				return FALSE;
+			}
+		}
+	}
+#endif
+#ifdef OTA_HAVE_LZ4
+	case OTA_COMPRESSION_LZ4:
+		for (;;) {
+			gsize outlen = COMPRESS_BUFFERSZ;
+			gsize inlen = len;
+			gsize ret = LZ4F_decompress(decompressor->lz4,
+					decompressor->buffer, &outlen, data, &inlen, NULL);
+			if (LZ4F_isError(ret)) {
+				g_message("lz4 decompression failed; %s",
+						LZ4F_getErrorName(ret));
+				return FALSE;
+			}
+			if (ret == 0)
+				decompressor->complete = TRUE;
+			data += inlen;
+			len -= inlen;
+			if (outlen > 0
+					&& !decompressor->outputcallback(decompressor->buffer,
+							outlen, decompressor->user_data))
+				return FALSE;
+			if (len == 0 && outlen < COMPRESS_BUFFERSZ)
+				return TRUE;
+			if (decompressor->complete && len > 0) {
+				g_message("trailing data after lz4 frame");
+				return FALSE;
+			}
+		}
+#endif
+	default:
+		return FALSE;
+	}
+}
+
+gboolean compress_decompressor_finish(
+		struct compress_decompressor* decompressor) {
+	return decompressor->complete;
+}
+
+void compress_decompressor_free(struct compress_decompressor* decompressor) {
+#ifdef OTA_HAVE_ZSTD
+	if (decompressor->zstd != NULL)
+		ZSTD_freeDStream(decompressor->zstd);
+#endif
+#ifdef OTA_HAVE_LZ4
+	if (decompressor->lz4 != NULL)
+		LZ4F_freeDecompressionContext(decompressor->lz4);
+#endif
+	g_free(decompressor->buffer);
+	g_free(decompressor);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <glib.h>
+#include "manifest.h"
+
+typedef gboolean (*compress_outputcallback)(const guint8* data, gsize len,
+		gpointer user_data);
+
+struct compress_decompressor;
+
+gboolean compress_supported(enum manifest_compression algorithm);
+GByteArray* compress_compress(enum manifest_compression algorithm,
+		const guint8* data, gsize len);
+struct compress_decompressor* compress_decompressor_new(
+		enum manifest_compression algorithm,
+		compress_outputcallback outputcallback, gpointer user_data);
+gboolean compress_decompressor_push(struct compress_decompressor* decompressor,
+		const guint8* data, gsize len);
+gboolean compress_decompressor_finish(
+		struct compress_decompressor* decompressor);
+void compress_decompressor_free(struct compress_decompressor* decompressor);
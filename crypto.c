@@ -1,5 +1,6 @@
 #include <nettle/yarrow.h>
 #include <nettle/buffer.h>
+#include <nettle/bignum.h>
 
 #if 0
 #include <thingymcconfig/utils.h>
@@ -7,6 +8,7 @@
 
 #include "crypto.h"
 #include "utils.h"
+#include "metrics.h"
 
 #define DEFAULT_KEYSIZE 2048
 #define SIGBASE 16
@@ -101,13 +103,43 @@ struct manifest_signature* crypto_sign(enum manifest_signaturetype sigtype,
 	return s;
 }
 
+// signatures from a binary manifest are already decoded
+static void crypto_signature_get(const struct manifest_signature* signature,
+		mpz_t sig) {
+	if (signature->raw != NULL)
+		nettle_mpz_set_str_256_u(sig, signature->rawlen, signature->raw);
+	else
+		mpz_set_str(sig, signature->data, SIGBASE);
+}
+
+/*
+ * The signature as big endian bytes for the binary manifest. Returns NULL
+ * if the hex can't be parsed.
+ */
+guint8* crypto_signature_raw(const struct manifest_signature* signature,
+		gsize* len) {
+	guint8* raw = NULL;
+	mpz_t sig;
+	mpz_init(sig);
+	if (signature->raw != NULL) {
+		raw = g_memdup(signature->raw, signature->rawlen);
+		*len = signature->rawlen;
+	} else if (mpz_set_str(sig, signature->data, SIGBASE) == 0) {
+		*len = nettle_mpz_sizeinbase_256_u(sig);
+		raw = g_malloc(*len);
+		nettle_mpz_get_str_256(*len, raw, sig);
+	}
+	mpz_clear(sig);
+	return raw;
+}
+
 gboolean crypto_verify(struct manifest_signature* signature,
 		struct crypto_keys* keys, guint8* data, gsize len) {
 	gboolean ret = FALSE;
 
 	mpz_t sig;
 	mpz_init(sig);
-	mpz_set_str(sig, signature->data, SIGBASE);
+	crypto_signature_get(signature, sig);
 
 	switch (signature->type) {
 	case OTA_SIGTYPE_RSASHA256: {
@@ -126,6 +158,103 @@ gboolean crypto_verify(struct manifest_signature* signature,
 	return ret;
 }
 
+// hashing both digests of anything this big is split across two threads
+#define CRYPTO_PARALLELTHRESHOLD (1024 * 1024)
+
+void crypto_digests_init(struct crypto_digests* digests) {
+	digests->which = CRYPTO_DIGEST_ALL;
+	sha256_init(&digests->sha256);
+	sha512_init(&digests->sha512);
+}
+
+static guint crypto_digestfor(enum manifest_signaturetype type) {
+	switch (type) {
+	case OTA_SIGTYPE_RSASHA256:
+		return CRYPTO_DIGEST_SHA256;
+	case OTA_SIGTYPE_RSASHA512:
+		return CRYPTO_DIGEST_SHA512;
+	default:
+		return 0;
+	}
+}
+
+// only set up the digests that the signatures need
+void crypto_digests_init_for(struct crypto_digests* digests,
+		GPtrArray* signatures) {
+	crypto_digests_init(digests);
+	digests->which = 0;
+	for (int i = 0; i < signatures->len; i++) {
+		struct manifest_signature* sig = g_ptr_array_index(signatures, i);
+		digests->which |= crypto_digestfor(sig->type);
+	}
+}
+
+struct crypto_sha512job {
+	struct sha512_ctx* sha512;
+	const guint8* data;
+	gsize len;
+};
+
+static gpointer crypto_sha512thread(gpointer data) {
+	struct crypto_sha512job* job = data;
+	sha512_update(job->sha512, job->len, job->data);
+	return NULL;
+}
+
+void crypto_digests_update(struct crypto_digests* digests, const guint8* data,
+		gsize len) {
+	gint64 start = g_get_monotonic_time();
+	if (digests->which == CRYPTO_DIGEST_ALL && len >= CRYPTO_PARALLELTHRESHOLD
+			&& g_get_num_processors() > 1) {
+		struct crypto_sha512job job = { .sha512 = &digests->sha512, .data =
+				data, .len = len };
+		GThread* thread = g_thread_new("sha512", crypto_sha512thread, &job);
+		sha256_update(&digests->sha256, len, data);
+		g_thread_join(thread);
+	} else {
+		if (digests->which & CRYPTO_DIGEST_SHA256)
+			sha256_update(&digests->sha256, len, data);
+		if (digests->which & CRYPTO_DIGEST_SHA512)
+			sha512_update(&digests->sha512, len, data);
+	}
+	metrics_observesince(METRICS_HASH, start);
+	metrics_add(METRICS_BYTESHASHED, len);
+}
+
+gboolean crypto_verify_digests(struct manifest_signature* signature,
+		struct crypto_keys* keys, const struct crypto_digests* digests) {
+	gboolean ret = FALSE;
+
+	if (!(digests->which & crypto_digestfor(signature->type))) {
+		g_message("digest needed for %s signature wasn't computed",
+				manifest_signaturetypestrings[signature->type]);
+		return FALSE;
+	}
+
+	mpz_t sig;
+	mpz_init(sig);
+	crypto_signature_get(signature, sig);
+
+	// verifying consumes the hash state so work on copies
+	switch (signature->type) {
+	case OTA_SIGTYPE_RSASHA256: {
+		struct sha256_ctx sha256hash = digests->sha256;
+		ret = rsa_sha256_verify(&keys->pubkey, &sha256hash, sig);
+	}
+		break;
+	case OTA_SIGTYPE_RSASHA512: {
+		struct sha512_ctx sha512hash = digests->sha512;
+		ret = rsa_sha512_verify(&keys->pubkey, &sha512hash, sig);
+	}
+		break;
+	default:
+		break;
+	}
+
+	mpz_clear(sig);
+	return ret;
+}
+
 gboolean crypto_keygen(struct crypto_keys* keys) {
 	struct yarrow256_ctx yarrowctx;
 	if (!crypto_inityarrow(&yarrowctx))
@@ -219,12 +348,41 @@ void crypto_checksig(gpointer data, gpointer user_data) {
 
 	g_message("validating %s with %s", cntx->what,
 			manifest_signaturetypestrings[sig->type]);
-	cntx->cont = crypto_verify(sig, cntx->keys, cntx->data, cntx->len);
+	if (cntx->digests != NULL)
+		cntx->cont = crypto_verify_digests(sig, cntx->keys, cntx->digests);
+	else
+		cntx->cont = crypto_verify(sig, cntx->keys, cntx->data, cntx->len);
 	if (!cntx->cont) {
 		g_message("sig check failed");
 	}
 }
 
+/*
+ * Check all of the signatures. If the context has data instead of digests
+ * it's hashed once for all of the signatures instead of once per signature.
+ * No signatures at all is a failure, not a pass.
+ */
+gboolean crypto_checksigs(GPtrArray* signatures,
+		struct crypto_checksigcntx* cntx) {
+	if (signatures->len == 0) {
+		g_message("%s has no signatures to check", cntx->what);
+		cntx->cont = FALSE;
+		return FALSE;
+	}
+	gint64 start = g_get_monotonic_time();
+	struct crypto_digests digests;
+	if (cntx->digests == NULL) {
+		crypto_digests_init_for(&digests, signatures);
+		crypto_digests_update(&digests, cntx->data, cntx->len);
+		cntx->digests = &digests;
+	}
+	g_ptr_array_foreach(signatures, crypto_checksig, cntx);
+	if (cntx->digests == &digests)
+		cntx->digests = NULL;
+	metrics_observesince(METRICS_SIGVERIFY, start);
+	return cntx->cont;
+}
+
 void crypto_keys_free(struct crypto_keys* keys) {
 	g_free(keys);
 }
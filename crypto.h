@@ -2,6 +2,7 @@
 
 #include <glib.h>
 #include <nettle/rsa.h>
+#include <nettle/sha2.h>
 #include "manifest.h"
 
 #define CRYPTO_KEYNAME_RSA_PUB  "rsa.pub"
@@ -12,18 +13,44 @@ struct crypto_keys {
 	struct rsa_private_key privatekey;
 };
 
+#define CRYPTO_DIGEST_SHA256 (1 << 0)
+#define CRYPTO_DIGEST_SHA512 (1 << 1)
+#define CRYPTO_DIGEST_ALL    (CRYPTO_DIGEST_SHA256 | CRYPTO_DIGEST_SHA512)
+
+/*
+ * Running hash state for data that arrives in chunks. Only the digests
+ * in "which" are computed so data is hashed once per digest that a set of
+ * signatures actually needs.
+ */
+struct crypto_digests {
+	guint which;
+	struct sha256_ctx sha256;
+	struct sha512_ctx sha512;
+};
+
 struct crypto_checksigcntx {
 	const gchar* what;
 	guint8* data;
 	gsize len;
+	// if set the signatures are checked against these instead of data
+	const struct crypto_digests* digests;
 	struct crypto_keys* keys;
 	gboolean cont;
 };
 
 struct manifest_signature* crypto_sign(enum manifest_signaturetype sigtype,
 		struct crypto_keys* keys, guint8* data, gsize len);
+guint8* crypto_signature_raw(const struct manifest_signature* signature,
+		gsize* len);
 gboolean crypto_verify(struct manifest_signature* signature,
 		struct crypto_keys* keys, guint8* data, gsize len);
+void crypto_digests_init(struct crypto_digests* digests);
+void crypto_digests_init_for(struct crypto_digests* digests,
+		GPtrArray* signatures);
+void crypto_digests_update(struct crypto_digests* digests, const guint8* data,
+		gsize len);
+gboolean crypto_verify_digests(struct manifest_signature* signature,
+		struct crypto_keys* keys, const struct crypto_digests* digests);
 gboolean crypto_keygen(struct crypto_keys* keys);
 void crypto_writekeys(struct crypto_keys* keys, const gchar* rsapubkeypath,
 		const gchar* rsaprivkeypath);
@@ -31,3 +58,5 @@ struct crypto_keys* crypto_readkeys(const gchar* rsapubkeypath,
 		const gchar* rsaprivkeypath);
 void crypto_keys_free(struct crypto_keys* keys);
 void crypto_checksig(gpointer data, gpointer user_data);
+gboolean crypto_checksigs(GPtrArray* signatures,
+		struct crypto_checksigcntx* cntx);
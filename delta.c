@@ -0,0 +1,281 @@
+#include <string.h>
+#include "delta.h"
+
+#define DELTA_HEADERSZ  (4 + 4 + 8 + 8)
+#define DELTA_COPYSZ    (1 + 4 + 8)
+#define DELTA_ADDSZ     (1 + 4)
+#define DELTA_BLOCKSZ   32
+#define DELTA_HASHBASE  257
+#define DELTA_COPYBUFSZ (64 * 1024)
+
+enum delta_state {
+	DELTA_STATE_HEADER, DELTA_STATE_OP, DELTA_STATE_ADD
+};
+
+struct delta_patcher {
+	delta_sourcecallback sourcecallback;
+	gpointer sourcedata;
+	gsize sourcelimit;
+	gsize sourcelen;
+	gsize targetlen;
+	gsize produced;
+	delta_outputcallback outputcallback;
+	gpointer user_data;
+	enum delta_state state;
+	guint8 buf[DELTA_HEADERSZ];
+	gsize fill;
+	gsize remaining;
+	guint8* copybuffer;
+};
+
+static void delta_putu32(GByteArray* out, guint32 value) {
+	value = GUINT32_TO_LE(value);
+	g_byte_array_append(out, (guint8*) &value, sizeof(value));
+}
+
+static void delta_putu64(GByteArray* out, guint64 value) {
+	value = GUINT64_TO_LE(value);
+	g_byte_array_append(out, (guint8*) &value, sizeof(value));
+}
+
+static guint32 delta_getu32(const guint8* data) {
+	guint32 value;
+	memcpy(&value, data, sizeof(value));
+	return GUINT32_FROM_LE(value);
+}
+
+static guint64 delta_getu64(const guint8* data) {
+	guint64 value;
+	memcpy(&value, data, sizeof(value));
+	return GUINT64_FROM_LE(value);
+}
+
+static void delta_emitadd(GByteArray* out, const guint8* data, gsize len) {
+	if (len == 0)
+		return;
+	guint8 op = DELTA_OP_ADD;
+	g_byte_array_append(out, &op, sizeof(op));
+	delta_putu32(out, len);
+	g_byte_array_append(out, data, len);
+}
+
+static void delta_emitcopy(GByteArray* out, gsize offset, gsize len) {
+	guint8 op = DELTA_OP_COPY;
+	g_byte_array_append(out, &op, sizeof(op));
+	delta_putu32(out, len);
+	delta_putu64(out, offset);
+}
+
+static guint32 delta_hash(const guint8* data) {
+	guint32 hash = 0;
+	for (int i = 0; i < DELTA_BLOCKSZ; i++)
+		hash = (hash * DELTA_HASHBASE) + data[i];
+	return hash;
+}
+
+/*
+ * Index the source in fixed blocks and then slide a rolling hash over the
+ * target looking for them. Matches are grown in both directions so the
+ * copies aren't limited to block alignment in the source.
+ */
+GByteArray* delta_encode(const guint8* source, gsize sourcelen,
+		const guint8* target, gsize targetlen) {
+	GByteArray* out = g_byte_array_new();
+	g_byte_array_append(out, (guint8*) DELTA_MAGIC, strlen(DELTA_MAGIC));
+	delta_putu32(out, DELTA_VERSION);
+	delta_putu64(out, sourcelen);
+	delta_putu64(out, targetlen);
+
+	// values are offset + 1 so that offset 0 isn't NULL
+	GHashTable* index = g_hash_table_new(g_direct_hash, g_direct_equal);
+	for (gsize off = 0; off + DELTA_BLOCKSZ <= sourcelen; off +=
+	DELTA_BLOCKSZ) {
+		gpointer key = GUINT_TO_POINTER(delta_hash(source + off));
+		if (!g_hash_table_contains(index, key))
+			g_hash_table_insert(index, key, GSIZE_TO_POINTER(off + 1));
+	}
+
+	guint32 outfactor = 1;
+	for (int i = 0; i < DELTA_BLOCKSZ - 1; i++)
+		outfactor *= DELTA_HASHBASE;
+
+	gsize pending = 0;
+	gsize i = 0;
+	guint32 hash = targetlen >= DELTA_BLOCKSZ ? delta_hash(target) : 0;
+	while (i + DELTA_BLOCKSZ <= targetlen) {
+		gsize candidate = GPOINTER_TO_SIZE(
+				g_hash_table_lookup(index, GUINT_TO_POINTER(hash)));
+		if (candidate != 0
+				&& memcmp(source + candidate - 1, target + i, DELTA_BLOCKSZ)
+						== 0) {
+			gsize src = candidate - 1;
+			gsize back = 0;
+			while (i - back > pending && src - back > 0
+					&& source[src - back - 1] == target[i - back - 1])
+				back++;
+			gsize fwd = DELTA_BLOCKSZ;
+			while (i + fwd < targetlen && src + fwd < sourcelen
+					&& source[src + fwd] == target[i + fwd])
+				fwd++;
+
+			delta_emitadd(out, target + pending, i - back - pending);
+			delta_emitcopy(out, src - back, back + fwd);
+
+			i += fwd;
+			pending = i;
+			if (i + DELTA_BLOCKSZ <= targetlen)
+				hash = delta_hash(target + i);
+			continue;
+		}
+
+		if (i + DELTA_BLOCKSZ < targetlen)
+			hash = ((hash - (target[i] * outfactor)) * DELTA_HASHBASE)
+					+ target[i + DELTA_BLOCKSZ];
+		i++;
+	}
+	delta_emitadd(out, target + pending, targetlen - pending);
+
+	g_hash_table_unref(index);
+	return out;
+}
+
+/*
+ * Applies a delta as it streams in, reading the source with sourcecallback
+ * and passing the reconstructed image to outputcallback. sourcelimit is
+ * the most the delta is allowed to claim the source is.
+ */
+struct delta_patcher* delta_patcher_new(delta_sourcecallback sourcecallback,
+		gpointer sourcedata, gsize sourcelimit,
+		delta_outputcallback outputcallback, gpointer user_data) {
+	struct delta_patcher* patcher = g_malloc0(sizeof(*patcher));
+	patcher->sourcecallback = sourcecallback;
+	patcher->sourcedata = sourcedata;
+	patcher->sourcelimit = sourcelimit;
+	patcher->outputcallback = outputcallback;
+	patcher->user_data = user_data;
+	patcher->state = DELTA_STATE_HEADER;
+	patcher->copybuffer = g_malloc(DELTA_COPYBUFSZ);
+	return patcher;
+}
+
+static gboolean delta_patcher_output(struct delta_patcher* patcher,
+		const guint8* data, gsize len) {
+	patcher->produced += len;
+	return patcher->outputcallback(data, len, patcher->user_data);
+}
+
+static gboolean delta_patcher_copy(struct delta_patcher* patcher, gsize offset,
+		gsize len) {
+	while (len > 0) {
+		gsize want = MIN(len, DELTA_COPYBUFSZ);
+		if (!patcher->sourcecallback(offset, patcher->copybuffer, want,
+				patcher->sourcedata)) {
+			g_message("failed to read delta source at %" G_GSIZE_FORMAT,
+					offset);
+			return FALSE;
+		}
+		if (!delta_patcher_output(patcher, patcher->copybuffer, want))
+			return FALSE;
+		offset += want;
+		len -= want;
+	}
+	return TRUE;
+}
+
+static gsize delta_patcher_need(struct delta_patcher* patcher) {
+	if (patcher->state == DELTA_STATE_HEADER)
+		return DELTA_HEADERSZ;
+	if (patcher->fill == 0)
+		return 1;
+	switch (patcher->buf[0]) {
+	case DELTA_OP_COPY:
+		return DELTA_COPYSZ;
+	case DELTA_OP_ADD:
+		return DELTA_ADDSZ;
+	default:
+		// let delta_patcher_process() reject it
+		return 1;
+	}
+}
+
+static gboolean delta_patcher_process(struct delta_patcher* patcher) {
+	patcher->fill = 0;
+
+	if (patcher->state == DELTA_STATE_HEADER) {
+		if (memcmp(patcher->buf, DELTA_MAGIC, strlen(DELTA_MAGIC)) != 0
+				|| delta_getu32(patcher->buf + 4) != DELTA_VERSION) {
+			g_message("bad delta header");
+			return FALSE;
+		}
+		patcher->sourcelen = delta_getu64(patcher->buf + 8);
+		patcher->targetlen = delta_getu64(patcher->buf + 16);
+		if (patcher->sourcelen > patcher->sourcelimit) {
+			g_message("delta source is bigger than the source partition");
+			return FALSE;
+		}
+		patcher->state = DELTA_STATE_OP;
+		return TRUE;
+	}
+
+	guint32 len = delta_getu32(patcher->buf + 1);
+	if (patcher->produced + len > patcher->targetlen) {
+		g_message("delta op runs past the end of the target");
+		return FALSE;
+	}
+
+	switch (patcher->buf[0]) {
+	case DELTA_OP_COPY: {
+		guint64 offset = delta_getu64(patcher->buf + 5);
+		if (offset + len > patcher->sourcelen) {
+			g_message("delta copy runs past the end of the source");
+			return FALSE;
+		}
+		return delta_patcher_copy(patcher, offset, len);
+	}
+	case DELTA_OP_ADD:
+		patcher->remaining = len;
+		if (len > 0)
+			patcher->state = DELTA_STATE_ADD;
+		return TRUE;
+	default:
+		g_message("unknown delta op %d", (int) patcher->buf[0]);
+		return FALSE;
+	}
+}
+
+gboolean delta_patcher_push(struct delta_patcher* patcher, const guint8* data,
+		gsize len) {
+	while (len > 0) {
+		if (patcher->state == DELTA_STATE_ADD) {
+			gsize add = MIN(len, patcher->remaining);
+			if (!delta_patcher_output(patcher, data, add))
+				return FALSE;
+			data += add;
+			len -= add;
+			patcher->remaining -= add;
+			if (patcher->remaining == 0)
+				patcher->state = DELTA_STATE_OP;
+			continue;
+		}
+
+		gsize want = MIN(len, delta_patcher_need(patcher) - patcher->fill);
+		memcpy(patcher->buf + patcher->fill, data, want);
+		patcher->fill += want;
+		data += want;
+		len -= want;
+		if (patcher->fill == delta_patcher_need(patcher)
+				&& !delta_patcher_process(patcher))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+gboolean delta_patcher_finish(struct delta_patcher* patcher) {
+	return patcher->state == DELTA_STATE_OP && patcher->fill == 0
+			&& patcher->produced == patcher->targetlen;
+}
+
+void delta_patcher_free(struct delta_patcher* patcher) {
+	g_free(patcher->copybuffer);
+	g_free(patcher);
+}
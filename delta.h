@@ -0,0 +1,34 @@
+#pragma once
+
+#include <glib.h>
+
+/*
+ * Delta format, all integers are little endian.
+ *
+ * header: "OTAD", u32 version, u64 source length, u64 target length
+ * then a sequence of ops until the target is complete:
+ * copy: u8 DELTA_OP_COPY, u32 length, u64 source offset
+ * add:  u8 DELTA_OP_ADD, u32 length, length bytes of literal data
+ */
+
+#define DELTA_MAGIC    "OTAD"
+#define DELTA_VERSION  1
+#define DELTA_OP_COPY  1
+#define DELTA_OP_ADD   2
+
+typedef gboolean (*delta_outputcallback)(const guint8* data, gsize len,
+		gpointer user_data);
+typedef gboolean (*delta_sourcecallback)(gsize offset, guint8* data,
+		gsize len, gpointer user_data);
+
+struct delta_patcher;
+
+GByteArray* delta_encode(const guint8* source, gsize sourcelen,
+		const guint8* target, gsize targetlen);
+struct delta_patcher* delta_patcher_new(delta_sourcecallback sourcecallback,
+		gpointer sourcedata, gsize sourcelimit,
+		delta_outputcallback outputcallback, gpointer user_data);
+gboolean delta_patcher_push(struct delta_patcher* patcher, const guint8* data,
+		gsize len);
+gboolean delta_patcher_finish(struct delta_patcher* patcher);
+void delta_patcher_free(struct delta_patcher* patcher);
@@ -0,0 +1,218 @@
+#include <gio/gio.h>
+#include <string.h>
+#include "http.h"
+#include "metrics.h"
+
+#define HTTP_TIMEOUT     30
+#define HTTP_BUFFERSZ    (16 * 1024)
+
+static gboolean http_parsestatus(const gchar* line, guint* code) {
+	gchar** parts = g_strsplit(line, " ", 3);
+	gboolean ret = FALSE;
+	if (g_strv_length(parts) < 2 || !g_str_has_prefix(parts[0], "HTTP/1."))
+		goto err_parse;
+	*code = g_ascii_strtoull(parts[1], NULL, 10);
+	ret = *code != 0;
+	err_parse: //
+	g_strfreev(parts);
+	return ret;
+}
+
+static gboolean http_readheaders(GDataInputStream* in,
+		struct http_response* response, GCancellable* cancellable) {
+	for (;;) {
+		gchar* line = g_data_input_stream_read_line(in, NULL, cancellable,
+		NULL);
+		if (line == NULL)
+			return FALSE;
+
+		if (*line == '\0') {
+			g_free(line);
+			return TRUE;
+		}
+
+		gchar* colon = strchr(line, ':');
+		if (colon != NULL) {
+			*colon = '\0';
+			gchar* name = g_ascii_strdown(g_strstrip(line), -1);
+			gchar* value = g_strdup(g_strstrip(colon + 1));
+			g_hash_table_replace(response->headers, name, value);
+		}
+		g_free(line);
+	}
+}
+
+static gboolean http_readbody(GInputStream* in, gssize len,
+		http_datacallback datacallback, gpointer user_data,
+		GCancellable* cancellable) {
+	guint8* buffer = g_malloc(HTTP_BUFFERSZ);
+	gboolean ret = FALSE;
+
+	while (len != 0) {
+		gsize want = len > 0 ? MIN(len, HTTP_BUFFERSZ) : HTTP_BUFFERSZ;
+		gssize got = g_input_stream_read(in, buffer, want, cancellable, NULL);
+		if (got < 0)
+			goto err_read;
+		// eof is only ok if the length wasn't known
+		if (got == 0) {
+			if (len > 0)
+				goto err_read;
+			break;
+		}
+		metrics_add(METRICS_BYTESRECEIVED, got);
+		if (!datacallback(buffer, got, user_data))
+			goto err_callback;
+		if (len > 0)
+			len -= got;
+	}
+
+	ret = TRUE;
+
+	err_callback: //
+	err_read: //
+	g_free(buffer);
+	return ret;
+}
+
+static gboolean http_readchunkedbody(GDataInputStream* in,
+		http_datacallback datacallback, gpointer user_data,
+		GCancellable* cancellable) {
+	for (;;) {
+		gchar* line = g_data_input_stream_read_line(in, NULL, cancellable,
+		NULL);
+		if (line == NULL)
+			return FALSE;
+		gssize chunklen = g_ascii_strtoll(line, NULL, 16);
+		g_free(line);
+
+		if (chunklen < 0)
+			return FALSE;
+		if (chunklen == 0)
+			return TRUE;
+		if (!http_readbody(G_INPUT_STREAM(in), chunklen, datacallback,
+				user_data, cancellable))
+			return FALSE;
+
+		// each chunk is followed by a CRLF
+		line = g_data_input_stream_read_line(in, NULL, cancellable, NULL);
+		if (line == NULL)
+			return FALSE;
+		g_free(line);
+	}
+}
+
+gboolean http_datacallback_bytebuffer(guint8* data, gsize len,
+		gpointer user_data) {
+	g_byte_array_append((GByteArray*) user_data, data, len);
+	return TRUE;
+}
+
+/*
+ * Minimal HTTP/1.1 GET. Unlike teenyhttp this allows extra request headers
+ * (i.e. Range) and exposes the response headers to the response callback.
+ *
+ * This blocks so it should be called from a worker thread. If the thread
+ * has pushed a cancellable (g_cancellable_push_current()) cancelling it
+ * aborts the request. Connecting and every read and write time out after
+ * HTTP_TIMEOUT seconds.
+ */
+gboolean http_get(const gchar* host, const gchar* path, const gchar** headers,
+		http_responsecallback responsecallback, gpointer responseuserdata,
+		http_datacallback datacallback, gpointer datauserdata) {
+	gboolean ret = FALSE;
+	GError* err = NULL;
+	GCancellable* cancellable = g_cancellable_get_current();
+
+	GSocketClient* client = g_socket_client_new();
+	g_socket_client_set_timeout(client, HTTP_TIMEOUT);
+
+	GSocketConnection* connection = g_socket_client_connect_to_host(client,
+			host, HTTP_PORT, cancellable, &err);
+	if (connection == NULL) {
+		g_message("failed to connect to %s; %s", host, err->message);
+		goto err_connect;
+	}
+
+	GString* request = g_string_new(NULL);
+	g_string_printf(request, "GET %s HTTP/1.1\r\nHost: %s\r\n"
+			"Connection: close\r\n", path, host);
+	for (const gchar** header = headers; header != NULL && *header != NULL;
+			header++)
+		g_string_append_printf(request, "%s\r\n", *header);
+	g_string_append(request, "\r\n");
+
+	GOutputStream* out = g_io_stream_get_output_stream(
+			G_IO_STREAM(connection));
+	if (!g_output_stream_write_all(out, request->str, request->len, NULL,
+			cancellable, &err)) {
+		g_message("failed to send request; %s", err->message);
+		goto err_write;
+	}
+
+	GDataInputStream* in = g_data_input_stream_new(
+			g_io_stream_get_input_stream(G_IO_STREAM(connection)));
+	g_data_input_stream_set_newline_type(in,
+			G_DATA_STREAM_NEWLINE_TYPE_CR_LF);
+
+	struct http_response response = { 0 };
+	response.headers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			g_free);
+
+	gchar* statusline = g_data_input_stream_read_line(in, NULL, cancellable,
+	NULL);
+	if (statusline == NULL || !http_parsestatus(statusline, &response.code)) {
+		g_message("bad status line from %s", host);
+		goto err_status;
+	}
+
+	if (!http_readheaders(in, &response, cancellable)) {
+		g_message("failed to read headers from %s", host);
+		goto err_headers;
+	}
+
+	response.contenttype = g_hash_table_lookup(response.headers,
+			"content-type");
+	if (response.contenttype == NULL)
+		response.contenttype = "";
+
+	if (responsecallback != NULL
+			&& !responsecallback(&response, responseuserdata))
+		goto err_response;
+
+	// a 304 never has a body
+	if (response.code == HTTP_STATUS_NOTMODIFIED) {
+		ret = TRUE;
+		goto out;
+	}
+
+	const gchar* transferencoding = g_hash_table_lookup(response.headers,
+			"transfer-encoding");
+	const gchar* contentlength = g_hash_table_lookup(response.headers,
+			"content-length");
+	if (transferencoding != NULL && strcmp(transferencoding, "chunked") == 0)
+		ret = http_readchunkedbody(in, datacallback, datauserdata,
+				cancellable);
+	else
+		ret = http_readbody(G_INPUT_STREAM(in),
+				contentlength != NULL ?
+						g_ascii_strtoll(contentlength, NULL, 10) : -1,
+				datacallback, datauserdata, cancellable);
+
+	if (!ret && g_cancellable_is_cancelled(cancellable))
+		g_message("request to %s was cancelled", host);
+
+	out: //
+	err_response: //
+	err_headers: //
+	err_status: //
+	g_free(statusline);
+	g_hash_table_unref(response.headers);
+	g_object_unref(in);
+	err_write: //
+	g_string_free(request, TRUE);
+	g_object_unref(connection);
+	err_connect: //
+	g_clear_error(&err);
+	g_object_unref(client);
+	return ret;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <glib.h>
+
+#define HTTP_PORT 80
+
+#define HTTP_STATUS_OK             200
+#define HTTP_STATUS_PARTIALCONTENT 206
+#define HTTP_STATUS_NOTMODIFIED    304
+#define HTTP_STATUS_NOTFOUND       404
+
+struct http_response {
+	guint code;
+	const gchar* contenttype;
+	// header values keyed by lower case header name
+	GHashTable* headers;
+};
+
+typedef gboolean (*http_responsecallback)(const struct http_response* response,
+		gpointer user_data);
+typedef gboolean (*http_datacallback)(guint8* data, gsize len,
+		gpointer user_data);
+
+gboolean http_datacallback_bytebuffer(guint8* data, gsize len,
+		gpointer user_data);
+gboolean http_get(const gchar* host, const gchar* path, const gchar** headers,
+		http_responsecallback responsecallback, gpointer responseuserdata,
+		http_datacallback datacallback, gpointer datauserdata);
@@ -0,0 +1,88 @@
+#include <unistd.h>
+#include <json-glib/json-glib.h>
+#include "journal.h"
+#include "jsonparserutils.h"
+#include "jsonbuilderutils.h"
+
+struct journal* journal_load(const gchar* path) {
+	struct journal* journal = NULL;
+	JsonParser* parser = json_parser_new();
+	if (!json_parser_load_from_file(parser, path, NULL))
+		goto err_load;
+
+	JsonObject* root = JSON_NODE_GET_OBJECT(json_parser_get_root(parser));
+	if (root == NULL)
+		goto err_parse;
+
+	const gchar* uuid = JSON_OBJECT_GET_MEMBER_STRING(root,
+			JOURNAL_JSONFIELD_UUID);
+	const gchar* mtd = JSON_OBJECT_GET_MEMBER_STRING(root,
+			JOURNAL_JSONFIELD_MTD);
+	gint64 size = JSON_OBJECT_GET_MEMBER_INT(root, JOURNAL_JSONFIELD_SIZE);
+	gint64 committed = JSON_OBJECT_GET_MEMBER_INT(root,
+			JOURNAL_JSONFIELD_COMMITTED);
+	const gchar* digests = JSON_OBJECT_GET_MEMBER_STRING(root,
+			JOURNAL_JSONFIELD_DIGESTS);
+
+	if (uuid == NULL || mtd == NULL || size <= 0 || committed < 0
+			|| committed > size || digests == NULL) {
+		g_message("journal is incomplete or invalid");
+		goto err_parse;
+	}
+
+	// the hash state is stored raw so it's only valid on the same build
+	gsize digestslen;
+	guchar* rawdigests = g_base64_decode(digests, &digestslen);
+	if (digestslen != sizeof(journal->digests)) {
+		g_message("journal hash state doesn't match this build");
+		g_free(rawdigests);
+		goto err_parse;
+	}
+
+	journal = g_malloc0(sizeof(*journal));
+	journal->uuid = g_strdup(uuid);
+	journal->mtd = g_strdup(mtd);
+	journal->size = size;
+	journal->committed = committed;
+	memcpy(&journal->digests, rawdigests, digestslen);
+	g_free(rawdigests);
+
+	err_parse: //
+	err_load: //
+	g_object_unref(parser);
+	return journal;
+}
+
+gboolean journal_save(const gchar* path, const struct journal* journal) {
+	gchar* digests = g_base64_encode((const guchar*) &journal->digests,
+			sizeof(journal->digests));
+
+	JsonBuilder* builder = json_builder_new();
+	json_builder_begin_object(builder);
+	JSONBUILDER_ADD_STRING(builder, JOURNAL_JSONFIELD_UUID, journal->uuid);
+	JSONBUILDER_ADD_STRING(builder, JOURNAL_JSONFIELD_MTD, journal->mtd);
+	JSONBUILDER_ADD_INT(builder, JOURNAL_JSONFIELD_SIZE, journal->size);
+	JSONBUILDER_ADD_INT(builder, JOURNAL_JSONFIELD_COMMITTED,
+			journal->committed);
+	JSONBUILDER_ADD_STRING(builder, JOURNAL_JSONFIELD_DIGESTS, digests);
+	json_builder_end_object(builder);
+
+	gsize jsonlen;
+	gchar* json = jsonbuilder_freetostring(builder, &jsonlen, TRUE);
+	// g_file_set_contents() writes a temp file and renames it over the
+	// old journal so a power cut leaves either the old or the new one
+	gboolean ret = g_file_set_contents(path, json, jsonlen, NULL);
+	g_free(json);
+	g_free(digests);
+	return ret;
+}
+
+void journal_clear(const gchar* path) {
+	unlink(path);
+}
+
+void journal_free(struct journal* journal) {
+	g_free(journal->uuid);
+	g_free(journal->mtd);
+	g_free(journal);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <glib.h>
+#include "crypto.h"
+
+#define JOURNALFILE                 "journal.json"
+#define JOURNAL_JSONFIELD_UUID      "uuid"
+#define JOURNAL_JSONFIELD_MTD       "mtd"
+#define JOURNAL_JSONFIELD_SIZE      "size"
+#define JOURNAL_JSONFIELD_COMMITTED "committed"
+#define JOURNAL_JSONFIELD_DIGESTS   "digests"
+
+/*
+ * Records how far an image got before the agent was interrupted so that
+ * the next attempt can carry on from the last committed erase block.
+ */
+struct journal {
+	gchar* uuid;
+	gchar* mtd;
+	gsize size;
+	gsize committed;
+	// hash state for the first committed bytes of the image
+	struct crypto_digests digests;
+};
+
+struct journal* journal_load(const gchar* path);
+gboolean journal_save(const gchar* path, const struct journal* journal);
+void journal_clear(const gchar* path);
+void journal_free(struct journal* journal);
@@ -16,18 +16,104 @@ static void manifest_signature_free_gdestroynotify(gpointer data) {
 	manifest_signature_free((struct manifest_signature*) data);
 }
 
+struct manifest_delta* manifest_delta_new() {
+	struct manifest_delta* delta = g_malloc0(sizeof(*delta));
+	delta->signatures = g_ptr_array_new_with_free_func(
+			manifest_signature_free_gdestroynotify);
+	return delta;
+}
+
+void manifest_delta_free(struct manifest_delta* delta) {
+	g_ptr_array_free(delta->signatures, TRUE);
+	g_free(delta);
+}
+
+static void manifest_delta_free_gdestroynotify(gpointer data) {
+	manifest_delta_free((struct manifest_delta*) data);
+}
+
+gchar* manifest_delta_filename(const struct manifest_image* image,
+		const struct manifest_delta* delta) {
+	return g_strdup_printf("%s_%u%s", image->uuid, delta->from,
+	MANIFEST_DELTASUFFIX);
+}
+
+struct manifest_chunkindex* manifest_chunkindex_new() {
+	struct manifest_chunkindex* chunkindex = g_malloc0(sizeof(*chunkindex));
+	chunkindex->signatures = g_ptr_array_new_with_free_func(
+			manifest_signature_free_gdestroynotify);
+	return chunkindex;
+}
+
+void manifest_chunkindex_free(struct manifest_chunkindex* chunkindex) {
+	g_ptr_array_free(chunkindex->signatures, TRUE);
+	g_free(chunkindex);
+}
+
+gchar* manifest_chunkindex_filename(const struct manifest_image* image) {
+	return g_strdup_printf("%s%s", image->uuid, MANIFEST_CHUNKINDEXSUFFIX);
+}
+
+struct manifest_compressed* manifest_compressed_new() {
+	struct manifest_compressed* compressed = g_malloc0(sizeof(*compressed));
+	compressed->signatures = g_ptr_array_new_with_free_func(
+			manifest_signature_free_gdestroynotify);
+	return compressed;
+}
+
+void manifest_compressed_free(struct manifest_compressed* compressed) {
+	g_ptr_array_free(compressed->signatures, TRUE);
+	g_free(compressed);
+}
+
+static void manifest_compressed_free_gdestroynotify(gpointer data) {
+	manifest_compressed_free((struct manifest_compressed*) data);
+}
+
+gchar* manifest_compressed_filename(const struct manifest_image* image,
+		const struct manifest_compressed* compressed) {
+	return g_strdup_printf("%s%s", image->uuid,
+			manifest_compressionsuffixes[compressed->algorithm]);
+}
+
+enum manifest_compression manifest_compression_fromstring(const gchar* name) {
+	for (int i = 0; i < G_N_ELEMENTS(manifest_compressionstrings); i++) {
+		const gchar* algorithmstr = manifest_compressionstrings[i];
+		if (algorithmstr != NULL && strcmp(name, algorithmstr) == 0)
+			return i;
+	}
+	return OTA_COMPRESSION_INVALID;
+}
+
+struct manifest_rollout* manifest_rollout_new() {
+	struct manifest_rollout* rollout = g_malloc0(sizeof(*rollout));
+	return rollout;
+}
+
 struct manifest_image* manifest_image_new() {
 	struct manifest_image* image = g_malloc0(sizeof(*image));
 	image->tags = g_ptr_array_new();
 	image->signatures = g_ptr_array_new_with_free_func(
 			manifest_signature_free_gdestroynotify);
+	image->deltas = g_ptr_array_new_with_free_func(
+			manifest_delta_free_gdestroynotify);
+	image->compressed = g_ptr_array_new_with_free_func(
+			manifest_compressed_free_gdestroynotify);
 	return image;
 }
 
-static void manifest_image_free(struct manifest_image* manifest_image) {
-	if (manifest_image->uuid != NULL)
+void manifest_image_free(struct manifest_image* manifest_image) {
+	if (manifest_image->uuid != NULL && !manifest_image->borrowed)
 		g_free((gchar*) manifest_image->uuid);
+	if (!manifest_image->borrowed)
+		g_ptr_array_foreach(manifest_image->tags, (GFunc) g_free, NULL);
+	g_ptr_array_free(manifest_image->tags, TRUE);
 	g_ptr_array_free(manifest_image->signatures, TRUE);
+	g_ptr_array_free(manifest_image->deltas, TRUE);
+	g_ptr_array_free(manifest_image->compressed, TRUE);
+	if (manifest_image->chunkindex != NULL)
+		manifest_chunkindex_free(manifest_image->chunkindex);
+	g_free(manifest_image->rollout);
 	g_free(manifest_image);
 }
 
@@ -78,8 +164,16 @@ void manifest_signature_serialise(JsonBuilder* builder,
 	json_builder_begin_object(builder);
 	JSONBUILDER_ADD_STRING(builder, MANIFEST_JSONFIELD_SIGNATURE_TYPE,
 			manifest_signaturetypestrings[signature->type]);
-	JSONBUILDER_ADD_STRING(builder, MANIFEST_JSONFIELD_SIGNATURE_DATA,
-			signature->data);
+	// from a binary manifest if there isn't any hex
+	if (signature->data != NULL)
+		JSONBUILDER_ADD_STRING(builder, MANIFEST_JSONFIELD_SIGNATURE_DATA,
+				signature->data);
+	else {
+		gchar* hex = hexencode(signature->raw, signature->rawlen);
+		JSONBUILDER_ADD_STRING(builder, MANIFEST_JSONFIELD_SIGNATURE_DATA,
+				hex);
+		g_free(hex);
+	}
 	json_builder_end_object(builder);
 }
 
@@ -89,10 +183,157 @@ static void manifest_signature_serialise_gfunc(gpointer data,
 			(struct manifest_signature*) data);
 }
 
-static void manifest_image_serialise(gpointer data, gpointer user_data) {
-	struct manifest_image* image = data;
+static void manifest_delta_serialise(gpointer data, gpointer user_data) {
+	struct manifest_delta* delta = data;
+	JsonBuilder* builder = user_data;
+
+	json_builder_begin_object(builder);
+	JSONBUILDER_ADD_INT(builder, MANIFEST_JSONFIELD_DELTA_FROM, delta->from);
+	JSONBUILDER_ADD_INT(builder, MANIFEST_JSONFIELD_DELTA_SIZE, delta->size);
+	JSONBUILDER_START_ARRAY(builder, MANIFEST_JSONFIELD_SIGNATURES);
+	g_ptr_array_foreach(delta->signatures, manifest_signature_serialise_gfunc,
+			builder);
+	json_builder_end_array(builder);
+	json_builder_end_object(builder);
+}
+
+static void manifest_delta_deserialise(JsonArray *array, guint index,
+		JsonNode *element_node, gpointer user_data) {
+	GPtrArray* deltas = user_data;
+
+	JsonObject* deltaobj = JSON_NODE_GET_OBJECT(element_node);
+	if (deltaobj == NULL)
+		return;
+
+	int from = JSON_OBJECT_GET_MEMBER_INT(deltaobj,
+			MANIFEST_JSONFIELD_DELTA_FROM);
+	gssize size = JSON_OBJECT_GET_MEMBER_INT(deltaobj,
+			MANIFEST_JSONFIELD_DELTA_SIZE);
+	JsonArray* signatures = JSON_OBJECT_GET_MEMBER_ARRAY(deltaobj,
+			MANIFEST_JSONFIELD_SIGNATURES);
+	if (from == -1 || size <= 0 || signatures == NULL) {
+		g_message("incomplete or invalid delta");
+		return;
+	}
+
+	struct manifest_delta* delta = manifest_delta_new();
+	json_array_foreach_element(signatures, manifest_signature_deserialise,
+			delta->signatures);
+	if (delta->signatures->len == 0) {
+		g_message("delta has no usable signatures");
+		manifest_delta_free(delta);
+		return;
+	}
+
+	delta->from = from;
+	delta->size = size;
+	g_ptr_array_add(deltas, delta);
+}
+
+static struct manifest_chunkindex* manifest_chunkindex_deserialise(
+		JsonObject* chunkindexobj) {
+	gssize size = JSON_OBJECT_GET_MEMBER_INT(chunkindexobj,
+			MANIFEST_JSONFIELD_CHUNKINDEX_SIZE);
+	JsonArray* signatures = JSON_OBJECT_GET_MEMBER_ARRAY(chunkindexobj,
+			MANIFEST_JSONFIELD_SIGNATURES);
+	if (size <= 0 || signatures == NULL) {
+		g_message("incomplete or invalid chunk index");
+		return NULL;
+	}
+
+	struct manifest_chunkindex* chunkindex = manifest_chunkindex_new();
+	json_array_foreach_element(signatures, manifest_signature_deserialise,
+			chunkindex->signatures);
+	if (chunkindex->signatures->len == 0) {
+		g_message("chunk index has no usable signatures");
+		manifest_chunkindex_free(chunkindex);
+		return NULL;
+	}
+	chunkindex->size = size;
+	return chunkindex;
+}
+
+/*
+ * A rollout that can't be understood fails the whole image, treating it
+ * as no rollout would offer the image to every device.
+ */
+static struct manifest_rollout* manifest_rollout_deserialise(
+		JsonObject* rolloutobj) {
+	gint64 percent = JSON_OBJECT_GET_MEMBER_INT(rolloutobj,
+			MANIFEST_JSONFIELD_ROLLOUT_PERCENT);
+	gint64 start = JSON_OBJECT_GET_MEMBER_INT(rolloutobj,
+			MANIFEST_JSONFIELD_ROLLOUT_START);
+	gint64 rate = JSON_OBJECT_GET_MEMBER_INT(rolloutobj,
+			MANIFEST_JSONFIELD_ROLLOUT_RATE);
+	if (percent < 0 || percent > 100 || start < 0 || rate < 0 || rate > 100) {
+		g_message("invalid rollout");
+		return NULL;
+	}
+
+	struct manifest_rollout* rollout = manifest_rollout_new();
+	rollout->percent = percent;
+	rollout->start = start;
+	rollout->rate = rate;
+	return rollout;
+}
+
+static void manifest_compressed_serialise(gpointer data, gpointer user_data) {
+	struct manifest_compressed* compressed = data;
 	JsonBuilder* builder = user_data;
 
+	json_builder_begin_object(builder);
+	JSONBUILDER_ADD_STRING(builder, MANIFEST_JSONFIELD_COMPRESSED_ALGORITHM,
+			manifest_compressionstrings[compressed->algorithm]);
+	JSONBUILDER_ADD_INT(builder, MANIFEST_JSONFIELD_COMPRESSED_SIZE,
+			compressed->size);
+	JSONBUILDER_START_ARRAY(builder, MANIFEST_JSONFIELD_SIGNATURES);
+	g_ptr_array_foreach(compressed->signatures,
+			manifest_signature_serialise_gfunc, builder);
+	json_builder_end_array(builder);
+	json_builder_end_object(builder);
+}
+
+static void manifest_compressed_deserialise(JsonArray *array, guint index,
+		JsonNode *element_node, gpointer user_data) {
+	GPtrArray* compressedimages = user_data;
+
+	JsonObject* compressedobj = JSON_NODE_GET_OBJECT(element_node);
+	if (compressedobj == NULL)
+		return;
+
+	const gchar* algorithm = JSON_OBJECT_GET_MEMBER_STRING(compressedobj,
+			MANIFEST_JSONFIELD_COMPRESSED_ALGORITHM);
+	gssize size = JSON_OBJECT_GET_MEMBER_INT(compressedobj,
+			MANIFEST_JSONFIELD_COMPRESSED_SIZE);
+	JsonArray* signatures = JSON_OBJECT_GET_MEMBER_ARRAY(compressedobj,
+			MANIFEST_JSONFIELD_SIGNATURES);
+	if (algorithm == NULL || size <= 0 || signatures == NULL) {
+		g_message("incomplete or invalid compressed image");
+		return;
+	}
+
+	// newer repos might have algorithms we don't know about
+	enum manifest_compression compression = manifest_compression_fromstring(
+			algorithm);
+	if (compression == OTA_COMPRESSION_INVALID)
+		return;
+
+	struct manifest_compressed* compressed = manifest_compressed_new();
+	json_array_foreach_element(signatures, manifest_signature_deserialise,
+			compressed->signatures);
+	if (compressed->signatures->len == 0) {
+		g_message("compressed image has no usable signatures");
+		manifest_compressed_free(compressed);
+		return;
+	}
+
+	compressed->algorithm = compression;
+	compressed->size = size;
+	g_ptr_array_add(compressedimages, compressed);
+}
+
+void manifest_image_serialise(JsonBuilder* builder,
+		struct manifest_image* image) {
 	json_builder_begin_object(builder);
 	JSONBUILDER_ADD_STRING(builder, MANIFEST_JSONFIELD_IMAGE_UUID, image->uuid);
 	JSONBUILDER_ADD_INT(builder, MANIFEST_JSONFIELD_IMAGE_VERSION,
@@ -102,16 +343,69 @@ static void manifest_image_serialise(gpointer data, gpointer user_data) {
 			image->enabled);
 	if (image->tags->len > 0) {
 		JSONBUILDER_START_ARRAY(builder, MANIFEST_JSONFIELD_IMAGE_TAGS);
+		for (guint i = 0; i < image->tags->len; i++)
+			json_builder_add_string_value(builder,
+					g_ptr_array_index(image->tags, i));
 		json_builder_end_array(builder);
 	}
 	JSONBUILDER_START_ARRAY(builder, MANIFEST_JSONFIELD_SIGNATURES);
 	g_ptr_array_foreach(image->signatures, manifest_signature_serialise_gfunc,
 			builder);
 	json_builder_end_array(builder);
+	if (image->deltas->len > 0) {
+		JSONBUILDER_START_ARRAY(builder, MANIFEST_JSONFIELD_IMAGE_DELTAS);
+		g_ptr_array_foreach(image->deltas, manifest_delta_serialise, builder);
+		json_builder_end_array(builder);
+	}
+	if (image->compressed->len > 0) {
+		JSONBUILDER_START_ARRAY(builder, MANIFEST_JSONFIELD_IMAGE_COMPRESSED);
+		g_ptr_array_foreach(image->compressed, manifest_compressed_serialise,
+				builder);
+		json_builder_end_array(builder);
+	}
+	if (image->chunkindex != NULL) {
+		json_builder_set_member_name(builder,
+				MANIFEST_JSONFIELD_IMAGE_CHUNKINDEX);
+		json_builder_begin_object(builder);
+		JSONBUILDER_ADD_INT(builder, MANIFEST_JSONFIELD_CHUNKINDEX_SIZE,
+				image->chunkindex->size);
+		JSONBUILDER_START_ARRAY(builder, MANIFEST_JSONFIELD_SIGNATURES);
+		g_ptr_array_foreach(image->chunkindex->signatures,
+				manifest_signature_serialise_gfunc, builder);
+		json_builder_end_array(builder);
+		json_builder_end_object(builder);
+	}
+	if (image->rollout != NULL) {
+		json_builder_set_member_name(builder, MANIFEST_JSONFIELD_IMAGE_ROLLOUT);
+		json_builder_begin_object(builder);
+		JSONBUILDER_ADD_INT(builder, MANIFEST_JSONFIELD_ROLLOUT_PERCENT,
+				image->rollout->percent);
+		JSONBUILDER_ADD_INT(builder, MANIFEST_JSONFIELD_ROLLOUT_START,
+				image->rollout->start);
+		JSONBUILDER_ADD_INT(builder, MANIFEST_JSONFIELD_ROLLOUT_RATE,
+				image->rollout->rate);
+		json_builder_end_object(builder);
+	}
 
 	json_builder_end_object(builder);
 }
 
+static void manifest_tag_deserialise(JsonArray *array, guint index,
+		JsonNode *element_node, gpointer user_data) {
+	GPtrArray* tags = user_data;
+	if (!JSON_NODE_HOLDS_VALUE(element_node)
+			|| json_node_get_value_type(element_node) != G_TYPE_STRING) {
+		g_message("image tag isn't a string");
+		return;
+	}
+	g_ptr_array_add(tags, g_strdup(json_node_get_string(element_node)));
+}
+
+static void manifest_image_serialise_gfunc(gpointer data, gpointer user_data) {
+	manifest_image_serialise((JsonBuilder*) user_data,
+			(struct manifest_image*) data);
+}
+
 static void manifest_image_deserialise(JsonArray *array, guint index,
 		JsonNode *element_node, gpointer user_data) {
 	GPtrArray* manifest_images = user_data;
@@ -138,6 +432,43 @@ static void manifest_image_deserialise(JsonArray *array, guint index,
 		}
 		json_array_foreach_element(signatures, manifest_signature_deserialise,
 				image->signatures);
+		JsonArray* tags = JSON_OBJECT_GET_MEMBER_ARRAY(imageobj,
+				MANIFEST_JSONFIELD_IMAGE_TAGS);
+		if (tags != NULL)
+			json_array_foreach_element(tags, manifest_tag_deserialise,
+					image->tags);
+		JsonArray* deltas = JSON_OBJECT_GET_MEMBER_ARRAY(imageobj,
+				MANIFEST_JSONFIELD_IMAGE_DELTAS);
+		if (deltas != NULL)
+			json_array_foreach_element(deltas, manifest_delta_deserialise,
+					image->deltas);
+		JsonArray* compressed = JSON_OBJECT_GET_MEMBER_ARRAY(imageobj,
+				MANIFEST_JSONFIELD_IMAGE_COMPRESSED);
+		if (compressed != NULL)
+			json_array_foreach_element(compressed,
+					manifest_compressed_deserialise, image->compressed);
+		if (json_object_has_member(imageobj,
+				MANIFEST_JSONFIELD_IMAGE_CHUNKINDEX)) {
+			JsonObject* chunkindex = JSON_NODE_GET_OBJECT(
+					json_object_get_member(imageobj,
+							MANIFEST_JSONFIELD_IMAGE_CHUNKINDEX));
+			if (chunkindex != NULL)
+				image->chunkindex = manifest_chunkindex_deserialise(
+						chunkindex);
+		}
+		if (json_object_has_member(imageobj,
+				MANIFEST_JSONFIELD_IMAGE_ROLLOUT)) {
+			JsonObject* rollout = JSON_NODE_GET_OBJECT(
+					json_object_get_member(imageobj,
+							MANIFEST_JSONFIELD_IMAGE_ROLLOUT));
+			if (rollout == NULL) {
+				g_message("image rollout isn't an object");
+				goto err_parse;
+			}
+			image->rollout = manifest_rollout_deserialise(rollout);
+			if (image->rollout == NULL)
+				goto err_parse;
+		}
 	} else {
 		g_message("image element isn't an object");
 		goto err_parse;
@@ -160,6 +491,11 @@ static void manifest_image_deserialise(JsonArray *array, guint index,
 	return;
 }
 
+// images that aren't complete or valid are left out
+void manifest_images_deserialise(JsonArray* array, GPtrArray* images) {
+	json_array_foreach_element(array, manifest_image_deserialise, images);
+}
+
 gboolean manifest_deserialise_into(struct manifest_manifest* manifest,
 		const gchar* data, gsize len) {
 	gboolean ret = FALSE;
@@ -185,6 +521,14 @@ gboolean manifest_deserialise_into(struct manifest_manifest* manifest,
 				goto err_parse;
 			}
 
+			if (json_object_has_member(rootobj,
+					MANIFEST_JSONFIELD_POLLINTERVAL)) {
+				gint64 pollinterval = JSON_OBJECT_GET_MEMBER_INT(rootobj,
+						MANIFEST_JSONFIELD_POLLINTERVAL);
+				if (pollinterval > 0 && pollinterval <= G_MAXUINT)
+					manifest->pollinterval = pollinterval;
+			}
+
 			JsonArray* images = JSON_OBJECT_GET_MEMBER_ARRAY(rootobj,
 					MANIFEST_JSONFIELD_IMAGES);
 			if (images != NULL) {
@@ -224,8 +568,12 @@ JsonBuilder* manifest_serialise(struct manifest_manifest* manifest) {
 
 	JSONBUILDER_ADD_INT(builder, MANIFEST_JSONFIELD_TIMESTAMP,
 			manifest->timestamp);
+	if (manifest->pollinterval != 0)
+		JSONBUILDER_ADD_INT(builder, MANIFEST_JSONFIELD_POLLINTERVAL,
+				manifest->pollinterval);
 	JSONBUILDER_START_ARRAY(builder, MANIFEST_JSONFIELD_IMAGES);
-	g_ptr_array_foreach(manifest->images, manifest_image_serialise, builder);
+	g_ptr_array_foreach(manifest->images, manifest_image_serialise_gfunc,
+			builder);
 	json_builder_end_array(builder);
 
 	json_builder_end_object(builder);
@@ -242,6 +590,53 @@ struct manifest_manifest* manifest_deserialise(const gchar* data, gsize len) {
 	}
 }
 
+gboolean manifest_image_hastag(const struct manifest_image* image,
+		const gchar* tag) {
+	for (guint i = 0; i < image->tags->len; i++) {
+		if (strcmp(g_ptr_array_index(image->tags, i), tag) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// an image is for every device that has all of its tags
+static gboolean manifest_image_eligible(const struct manifest_image* image,
+		GHashTable* tags) {
+	for (guint i = 0; i < image->tags->len; i++) {
+		if (tags == NULL
+				|| !g_hash_table_contains(tags,
+						g_ptr_array_index(image->tags, i)))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static gint manifest_image_newestfirst(gconstpointer a, gconstpointer b) {
+	const struct manifest_image* left = *((struct manifest_image**) a);
+	const struct manifest_image* right = *((struct manifest_image**) b);
+	if (left->version == right->version)
+		return 0;
+	return left->version > right->version ? -1 : 1;
+}
+
+/*
+ * The enabled images a device with tags can install, newest first. The
+ * images still belong to the manifest. This is only done when the
+ * manifest changes so looking for an update is a walk from the front
+ * that stops at the first image that's new enough.
+ */
+GPtrArray* manifest_index(const struct manifest_manifest* manifest,
+		GHashTable* tags) {
+	GPtrArray* index = g_ptr_array_new();
+	for (guint i = 0; i < manifest->images->len; i++) {
+		struct manifest_image* image = g_ptr_array_index(manifest->images, i);
+		if (image->enabled && manifest_image_eligible(image, tags))
+			g_ptr_array_add(index, image);
+	}
+	g_ptr_array_sort(index, manifest_image_newestfirst);
+	return index;
+}
+
 struct manifest_manifest* manifest_new() {
 	struct manifest_manifest* manifest = g_malloc0(sizeof(*manifest));
 	manifest->uuid = g_uuid_string_random();
@@ -253,9 +648,16 @@ struct manifest_manifest* manifest_new() {
 void manifest_free(struct manifest_manifest* manifest) {
 	g_free((gchar*) manifest->uuid);
 	g_ptr_array_free(manifest->images, TRUE);
+	if (manifest->backing != NULL)
+		g_bytes_unref(manifest->backing);
 	g_free(manifest);
 }
 
+GPtrArray* manifest_signatures_new() {
+	return g_ptr_array_new_with_free_func(
+			manifest_signature_free_gdestroynotify);
+}
+
 GPtrArray* manifest_signatures_deserialise(const gchar* data, gsize len) {
 	GPtrArray* sigs = NULL;
 	JsonParser* jsonparser = json_parser_new();
@@ -265,7 +667,7 @@ GPtrArray* manifest_signatures_deserialise(const gchar* data, gsize len) {
 	}
 	JsonArray* sigarray = JSON_NODE_GET_ARRAY(json_parser_get_root(jsonparser));
 	if (sigarray != NULL) {
-		sigs = g_ptr_array_new();
+		sigs = manifest_signatures_new();
 		json_array_foreach_element(sigarray, manifest_signature_deserialise,
 				sigs);
 	} else {
@@ -283,6 +685,71 @@ GPtrArray* manifest_signatures_deserialise(const gchar* data, gsize len) {
 	return sigs;
 }
 
+/*
+ * The manifest is embedded as a string so the signatures cover exactly
+ * the bytes that were signed and not whatever json-glib makes of them.
+ */
+JsonBuilder* manifest_envelope_serialise(const gchar* manifest,
+		GPtrArray* signatures) {
+	JsonBuilder* builder = json_builder_new();
+	json_builder_begin_object(builder);
+	JSONBUILDER_ADD_STRING(builder, MANIFEST_JSONFIELD_ENVELOPE_MANIFEST,
+			manifest);
+	JSONBUILDER_START_ARRAY(builder, MANIFEST_JSONFIELD_SIGNATURES);
+	g_ptr_array_foreach(signatures, manifest_signature_serialise_gfunc,
+			builder);
+	json_builder_end_array(builder);
+	json_builder_end_object(builder);
+	return builder;
+}
+
+struct manifest_envelope* manifest_envelope_deserialise(const gchar* data,
+		gsize len) {
+	struct manifest_envelope* envelope = NULL;
+	JsonParser* jsonparser = json_parser_new();
+	if (!json_parser_load_from_data(jsonparser, data, len, NULL)) {
+		g_message("failed to parse envelope json");
+		goto err_parse;
+	}
+
+	JsonObject* rootobj = JSON_NODE_GET_OBJECT(
+			json_parser_get_root(jsonparser));
+	if (rootobj == NULL)
+		goto err_badroot;
+
+	const gchar* manifest = JSON_OBJECT_GET_MEMBER_STRING(rootobj,
+			MANIFEST_JSONFIELD_ENVELOPE_MANIFEST);
+	JsonArray* signatures = JSON_OBJECT_GET_MEMBER_ARRAY(rootobj,
+			MANIFEST_JSONFIELD_SIGNATURES);
+	if (manifest == NULL || signatures == NULL) {
+		g_message("incomplete or invalid envelope");
+		goto err_badroot;
+	}
+
+	envelope = g_malloc0(sizeof(*envelope));
+	envelope->manifest = g_strdup(manifest);
+	envelope->manifestlen = strlen(manifest);
+	envelope->signatures = manifest_signatures_new();
+	json_array_foreach_element(signatures, manifest_signature_deserialise,
+			envelope->signatures);
+	if (envelope->signatures->len == 0) {
+		g_message("envelope has no usable signatures");
+		manifest_envelope_free(envelope);
+		envelope = NULL;
+	}
+
+	err_badroot: //
+	err_parse: //
+	g_object_unref(jsonparser);
+	return envelope;
+}
+
+void manifest_envelope_free(struct manifest_envelope* envelope) {
+	g_free(envelope->manifest);
+	g_ptr_array_free(envelope->signatures, TRUE);
+	g_free(envelope);
+}
+
 struct manifest_manifest* manifest_load(const gchar* path) {
 	struct manifest_manifest* manifest = manifest_new();
 	gchar* existingmanifest;
@@ -6,40 +6,113 @@ enum manifest_signaturetype {
 	OTA_SIGTYPE_INVALID, OTA_SIGTYPE_RSASHA256, OTA_SIGTYPE_RSASHA512
 };
 
+enum manifest_compression {
+	OTA_COMPRESSION_INVALID, OTA_COMPRESSION_ZSTD, OTA_COMPRESSION_LZ4
+};
+
 struct manifest_image {
+	// the strings and signatures belong to the manifest's backing data
+	gboolean borrowed;
 	const gchar* uuid;
 	unsigned version;
 	gsize size;
 	gboolean enabled;
+	// hardware revision, channel, region.. as key=value
 	GPtrArray* tags;
 	GPtrArray* signatures;
+	GPtrArray* deltas;
+	struct manifest_chunkindex* chunkindex;
+	GPtrArray* compressed;
+	struct manifest_rollout* rollout;
+};
+
+/*
+ * A staged rollout, the image is offered to "percent" percent of devices
+ * from "start" (unix time) and to "rate" percent more every hour after
+ * that. No rollout means every device.
+ */
+struct manifest_rollout {
+	guint percent;
+	gint64 start;
+	guint rate;
+};
+
+// a compressed copy of the image
+struct manifest_compressed {
+	enum manifest_compression algorithm;
+	gsize size;
+	GPtrArray* signatures;
+};
+
+// a delta that turns image version "from" into the image it belongs to
+struct manifest_delta {
+	unsigned from;
+	gsize size;
+	GPtrArray* signatures;
+};
+
+// content defined chunk index for the image, see chunker.h
+struct manifest_chunkindex {
+	gsize size;
+	GPtrArray* signatures;
 };
 
 struct manifest_signature {
 	enum manifest_signaturetype type;
 	const gchar* data;
+	// already decoded, from a binary manifest, data is NULL if these are set
+	const guint8* raw;
+	gsize rawlen;
 };
 
 struct manifest_manifest {
 	unsigned serial;
 	const gchar* uuid;
 	gint64 timestamp;
+	// seconds between checks the repo would like, 0 for the default
+	guint pollinterval;
 	GPtrArray* images;
+	// the binary manifest this was made from if it was
+	GBytes* backing;
+};
+
+// the manifest and its signatures in a single file
+struct manifest_envelope {
+	gchar* manifest;
+	gsize manifestlen;
+	GPtrArray* signatures;
 };
 
 #define OTA_MANIFEST         "manifest.json"
 #define OTA_SIG              "sig.json"
+#define OTA_ENVELOPE         "envelope.json"
 #define MANIFEST_CONTENTTYPE "application/json"
+#define MANIFEST_DELTASUFFIX ".delta"
+#define MANIFEST_CHUNKINDEXSUFFIX ".chunks"
 
 #define MANIFEST_JSONFIELD_SERIAL         "serial"
 #define MANIFEST_JSONFIELD_UUID			  "uuid"
 #define MANIFEST_JSONFIELD_TIMESTAMP      "timestamp"
 #define MANIFEST_JSONFIELD_IMAGES         "images"
+#define MANIFEST_JSONFIELD_POLLINTERVAL   "pollinterval"
 #define MANIFEST_JSONFIELD_IMAGE_UUID     "uuid"
 #define MANIFEST_JSONFIELD_IMAGE_VERSION  "version"
 #define MANIFEST_JSONFIELD_IMAGE_SIZE     "size"
 #define MANIFEST_JSONFIELD_IMAGE_TAGS     "tags"
 #define MANIFEST_JSONFIELD_IMAGE_ENABLED  "enabled"
+#define MANIFEST_JSONFIELD_IMAGE_DELTAS   "deltas"
+#define MANIFEST_JSONFIELD_DELTA_FROM     "from"
+#define MANIFEST_JSONFIELD_DELTA_SIZE     "size"
+#define MANIFEST_JSONFIELD_IMAGE_CHUNKINDEX "chunkindex"
+#define MANIFEST_JSONFIELD_CHUNKINDEX_SIZE  "size"
+#define MANIFEST_JSONFIELD_IMAGE_COMPRESSED "compressed"
+#define MANIFEST_JSONFIELD_COMPRESSED_ALGORITHM "algorithm"
+#define MANIFEST_JSONFIELD_COMPRESSED_SIZE "size"
+#define MANIFEST_JSONFIELD_IMAGE_ROLLOUT  "rollout"
+#define MANIFEST_JSONFIELD_ROLLOUT_PERCENT "percent"
+#define MANIFEST_JSONFIELD_ROLLOUT_START  "start"
+#define MANIFEST_JSONFIELD_ROLLOUT_RATE   "rate"
+#define MANIFEST_JSONFIELD_ENVELOPE_MANIFEST "manifest"
 #define MANIFEST_JSONFIELD_SIGNATURES     "signatures"
 #define MANIFEST_JSONFIELD_SIGNATURE_DATA "data"
 #define MANIFEST_JSONFIELD_SIGNATURE_TYPE "type"
@@ -51,14 +124,53 @@ static const gchar* manifest_signaturetypestrings[] __attribute__((unused)) = {
 		[OTA_SIGTYPE_RSASHA256 ] = OTA_SIGNATURE_TYPE_RSASHA256,
 		[OTA_SIGTYPE_RSASHA512 ] = OTA_SIGNATURE_TYPE_RSASHA512 };
 
+#define OTA_COMPRESSION_ZSTD_NAME "zstd"
+#define OTA_COMPRESSION_LZ4_NAME  "lz4"
+
+static const gchar* manifest_compressionstrings[] __attribute__((unused)) = {
+		[OTA_COMPRESSION_ZSTD ] = OTA_COMPRESSION_ZSTD_NAME,
+		[OTA_COMPRESSION_LZ4 ] = OTA_COMPRESSION_LZ4_NAME };
+
+// file name suffixes for the compressed copies
+static const gchar* manifest_compressionsuffixes[] __attribute__((unused)) = {
+		[OTA_COMPRESSION_ZSTD ] = ".zst",
+		[OTA_COMPRESSION_LZ4 ] = ".lz4" };
+
 void manifest_signature_serialise(JsonBuilder* builder,
 		struct manifest_signature* signature);
+void manifest_image_serialise(JsonBuilder* builder,
+		struct manifest_image* image);
+void manifest_images_deserialise(JsonArray* array, GPtrArray* images);
 gboolean manifest_deserialise_into(struct manifest_manifest* manifest,
 		const gchar* data, gsize len);
 JsonBuilder* manifest_serialise(struct manifest_manifest* manifest);
 struct manifest_manifest* manifest_deserialise(const gchar* data, gsize len);
 struct manifest_image* manifest_image_new(void);
+void manifest_image_free(struct manifest_image* image);
+gboolean manifest_image_hastag(const struct manifest_image* image,
+		const gchar* tag);
+GPtrArray* manifest_index(const struct manifest_manifest* manifest,
+		GHashTable* tags);
+struct manifest_chunkindex* manifest_chunkindex_new(void);
+struct manifest_compressed* manifest_compressed_new(void);
+void manifest_compressed_free(struct manifest_compressed* compressed);
+gchar* manifest_compressed_filename(const struct manifest_image* image,
+		const struct manifest_compressed* compressed);
+enum manifest_compression manifest_compression_fromstring(const gchar* name);
+void manifest_chunkindex_free(struct manifest_chunkindex* chunkindex);
+struct manifest_rollout* manifest_rollout_new(void);
+gchar* manifest_chunkindex_filename(const struct manifest_image* image);
+struct manifest_delta* manifest_delta_new(void);
+void manifest_delta_free(struct manifest_delta* delta);
+gchar* manifest_delta_filename(const struct manifest_image* image,
+		const struct manifest_delta* delta);
 struct manifest_manifest* manifest_new(void);
 void manifest_free(struct manifest_manifest* manifest);
 GPtrArray* manifest_signatures_deserialise(const gchar* data, gsize len);
+GPtrArray* manifest_signatures_new(void);
+JsonBuilder* manifest_envelope_serialise(const gchar* manifest,
+		GPtrArray* signatures);
+struct manifest_envelope* manifest_envelope_deserialise(const gchar* data,
+		gsize len);
+void manifest_envelope_free(struct manifest_envelope* envelope);
 struct manifest_manifest* manifest_load(const gchar* path);
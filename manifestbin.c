@@ -0,0 +1,633 @@
+#include <string.h>
+
+#include "manifestbin.h"
+#include "crypto.h"
+
+G_STATIC_ASSERT(sizeof(struct manifestbin_header) == 16);
+G_STATIC_ASSERT(sizeof(struct manifestbin_signature) == 16);
+G_STATIC_ASSERT(sizeof(struct manifestbin_body) == 72);
+G_STATIC_ASSERT(sizeof(struct manifestbin_image) == 64);
+G_STATIC_ASSERT(sizeof(struct manifestbin_attachment) == 24);
+
+#define MANIFESTBIN_ALIGN 8
+
+struct manifestbin_builder {
+	GByteArray* images;
+	GByteArray* attachments;
+	GByteArray* signatures;
+	GByteArray* tags;
+	GByteArray* strings;
+	GByteArray* blobs;
+	GHashTable* stringoffsets;
+};
+
+static void manifestbin_pad(GByteArray* array) {
+	static const guint8 zeros[MANIFESTBIN_ALIGN] = { 0 };
+	gsize over = array->len % MANIFESTBIN_ALIGN;
+	if (over != 0)
+		g_byte_array_append(array, zeros, MANIFESTBIN_ALIGN - over);
+}
+
+static guint32 manifestbin_addstring(struct manifestbin_builder* builder,
+		const gchar* string) {
+	gpointer offset;
+	if (g_hash_table_lookup_extended(builder->stringoffsets, string, NULL,
+			&offset))
+		return GPOINTER_TO_UINT(offset);
+	guint32 newoffset = builder->strings->len;
+	g_byte_array_append(builder->strings, (const guint8*) string,
+			strlen(string) + 1);
+	g_hash_table_insert(builder->stringoffsets, (gpointer) string,
+			GUINT_TO_POINTER(newoffset));
+	return newoffset;
+}
+
+// returns the index of the first signature added
+static guint32 manifestbin_addsignatures(struct manifestbin_builder* builder,
+		GPtrArray* signatures, guint32* count) {
+	guint32 first = builder->signatures->len
+			/ sizeof(struct manifestbin_signature);
+	*count = 0;
+	for (guint i = 0; i < signatures->len; i++) {
+		struct manifest_signature* signature = g_ptr_array_index(signatures,
+				i);
+		gsize rawlen;
+		guint8* raw = crypto_signature_raw(signature, &rawlen);
+		if (raw == NULL)
+			continue;
+		struct manifestbin_signature record = { .type = GUINT32_TO_LE(
+				signature->type), .offset = GUINT32_TO_LE(builder->blobs->len),
+				.len = GUINT32_TO_LE(rawlen) };
+		g_byte_array_append(builder->blobs, raw, rawlen);
+		g_free(raw);
+		g_byte_array_append(builder->signatures, (const guint8*) &record,
+				sizeof(record));
+		(*count)++;
+	}
+	return first;
+}
+
+static void manifestbin_addattachment(struct manifestbin_builder* builder,
+		enum manifestbin_attachmentkind kind, guint32 param, guint64 size,
+		GPtrArray* signatures) {
+	guint32 numsignatures;
+	guint32 firstsignature = manifestbin_addsignatures(builder, signatures,
+			&numsignatures);
+	struct manifestbin_attachment record = { .kind = GUINT32_TO_LE(kind),
+			.param = GUINT32_TO_LE(param), .size = GUINT64_TO_LE(size),
+			.firstsignature = GUINT32_TO_LE(firstsignature), .numsignatures =
+					GUINT32_TO_LE(numsignatures) };
+	g_byte_array_append(builder->attachments, (const guint8*) &record,
+			sizeof(record));
+}
+
+static void manifestbin_addimage(struct manifestbin_builder* builder,
+		struct manifest_image* image) {
+	struct manifestbin_image record = { 0 };
+	record.uuid = GUINT32_TO_LE(manifestbin_addstring(builder, image->uuid));
+	record.version = GUINT32_TO_LE(image->version);
+	record.size = GUINT64_TO_LE(image->size);
+	guint32 flags = image->enabled ? MANIFESTBIN_IMAGE_ENABLED : 0;
+	if (image->rollout != NULL) {
+		flags |= MANIFESTBIN_IMAGE_HASROLLOUT;
+		record.rolloutpercent = GUINT32_TO_LE(image->rollout->percent);
+		record.rolloutstart = GINT64_TO_LE(image->rollout->start);
+		record.rolloutrate = GUINT32_TO_LE(image->rollout->rate);
+	}
+	record.flags = GUINT32_TO_LE(flags);
+
+	guint32 numsignatures;
+	record.firstsignature = GUINT32_TO_LE(
+			manifestbin_addsignatures(builder, image->signatures,
+					&numsignatures));
+	record.numsignatures = GUINT32_TO_LE(numsignatures);
+
+	guint32 firstattachment = builder->attachments->len
+			/ sizeof(struct manifestbin_attachment);
+	for (guint i = 0; i < image->deltas->len; i++) {
+		struct manifest_delta* delta = g_ptr_array_index(image->deltas, i);
+		manifestbin_addattachment(builder, MANIFESTBIN_DELTA, delta->from,
+				delta->size, delta->signatures);
+	}
+	for (guint i = 0; i < image->compressed->len; i++) {
+		struct manifest_compressed* compressed = g_ptr_array_index(
+				image->compressed, i);
+		manifestbin_addattachment(builder, MANIFESTBIN_COMPRESSED,
+				compressed->algorithm, compressed->size,
+				compressed->signatures);
+	}
+	if (image->chunkindex != NULL)
+		manifestbin_addattachment(builder, MANIFESTBIN_CHUNKINDEX, 0,
+				image->chunkindex->size, image->chunkindex->signatures);
+	record.firstattachment = GUINT32_TO_LE(firstattachment);
+	record.numattachments = GUINT32_TO_LE(
+			(builder->attachments->len / sizeof(struct manifestbin_attachment))
+					- firstattachment);
+
+	record.firsttag = GUINT32_TO_LE(
+			builder->tags->len / sizeof(struct manifestbin_tag));
+	record.numtags = GUINT32_TO_LE(image->tags->len);
+	for (guint i = 0; i < image->tags->len; i++) {
+		struct manifestbin_tag tag = { .name = GUINT32_TO_LE(
+				manifestbin_addstring(builder,
+						g_ptr_array_index(image->tags, i))) };
+		g_byte_array_append(builder->tags, (const guint8*) &tag, sizeof(tag));
+	}
+
+	g_byte_array_append(builder->images, (const guint8*) &record,
+			sizeof(record));
+}
+
+static gint manifestbin_sortbyversion(gconstpointer a, gconstpointer b) {
+	const struct manifest_image* left = *((struct manifest_image**) a);
+	const struct manifest_image* right = *((struct manifest_image**) b);
+	return left->version < right->version ?
+			-1 : (left->version > right->version ? 1 : 0);
+}
+
+static guint32 manifestbin_appendtable(GByteArray* body, GByteArray* table) {
+	manifestbin_pad(body);
+	guint32 offset = body->len;
+	g_byte_array_append(body, table->data, table->len);
+	return offset;
+}
+
+/*
+ * The part of the binary manifest that gets signed, built from the json
+ * manifest.
+ */
+GByteArray* manifestbin_serialisebody(struct manifest_manifest* manifest) {
+	struct manifestbin_builder builder = { .images = g_byte_array_new(),
+			.attachments = g_byte_array_new(), .signatures =
+					g_byte_array_new(), .tags = g_byte_array_new(), .strings =
+					g_byte_array_new(), .blobs = g_byte_array_new(),
+			.stringoffsets = g_hash_table_new(g_str_hash, g_str_equal) };
+
+	struct manifestbin_body header = { 0 };
+	header.serial = GUINT32_TO_LE(manifest->serial);
+	header.pollinterval = GUINT32_TO_LE(manifest->pollinterval);
+	header.timestamp = GINT64_TO_LE(manifest->timestamp);
+	header.uuid = GUINT32_TO_LE(
+			manifestbin_addstring(&builder, manifest->uuid));
+
+	GPtrArray* sorted = g_ptr_array_sized_new(manifest->images->len);
+	for (guint i = 0; i < manifest->images->len; i++)
+		g_ptr_array_add(sorted, g_ptr_array_index(manifest->images, i));
+	g_ptr_array_sort(sorted, manifestbin_sortbyversion);
+	for (guint i = 0; i < sorted->len; i++)
+		manifestbin_addimage(&builder, g_ptr_array_index(sorted, i));
+	g_ptr_array_free(sorted, TRUE);
+
+	header.numimages = GUINT32_TO_LE(
+			builder.images->len / sizeof(struct manifestbin_image));
+	header.numattachments = GUINT32_TO_LE(
+			builder.attachments->len / sizeof(struct manifestbin_attachment));
+	header.numsignatures = GUINT32_TO_LE(
+			builder.signatures->len / sizeof(struct manifestbin_signature));
+	header.numtags = GUINT32_TO_LE(
+			builder.tags->len / sizeof(struct manifestbin_tag));
+	header.stringslen = GUINT32_TO_LE(builder.strings->len);
+	header.blobslen = GUINT32_TO_LE(builder.blobs->len);
+
+	GByteArray* body = g_byte_array_new();
+	g_byte_array_append(body, (const guint8*) &header, sizeof(header));
+	header.images = GUINT32_TO_LE(
+			manifestbin_appendtable(body, builder.images));
+	header.attachments = GUINT32_TO_LE(
+			manifestbin_appendtable(body, builder.attachments));
+	header.signatures = GUINT32_TO_LE(
+			manifestbin_appendtable(body, builder.signatures));
+	header.tags = GUINT32_TO_LE(manifestbin_appendtable(body, builder.tags));
+	header.strings = GUINT32_TO_LE(
+			manifestbin_appendtable(body, builder.strings));
+	header.blobs = GUINT32_TO_LE(manifestbin_appendtable(body, builder.blobs));
+	manifestbin_pad(body);
+	memcpy(body->data, &header, sizeof(header));
+
+	g_byte_array_free(builder.images, TRUE);
+	g_byte_array_free(builder.attachments, TRUE);
+	g_byte_array_free(builder.signatures, TRUE);
+	g_byte_array_free(builder.tags, TRUE);
+	g_byte_array_free(builder.strings, TRUE);
+	g_byte_array_free(builder.blobs, TRUE);
+	g_hash_table_unref(builder.stringoffsets);
+	return body;
+}
+
+// wrap a signed body up with its signatures
+GByteArray* manifestbin_serialise(const GByteArray* body,
+		GPtrArray* signatures) {
+	GByteArray* records = g_byte_array_new();
+	GByteArray* blobs = g_byte_array_new();
+	for (guint i = 0; i < signatures->len; i++) {
+		struct manifest_signature* signature = g_ptr_array_index(signatures,
+				i);
+		gsize rawlen;
+		guint8* raw = crypto_signature_raw(signature, &rawlen);
+		if (raw == NULL)
+			continue;
+		struct manifestbin_signature record = { .type = GUINT32_TO_LE(
+				signature->type), .offset = GUINT32_TO_LE(blobs->len), .len =
+				GUINT32_TO_LE(rawlen) };
+		g_byte_array_append(blobs, raw, rawlen);
+		g_free(raw);
+		g_byte_array_append(records, (const guint8*) &record, sizeof(record));
+	}
+
+	struct manifestbin_header header = { .magic = MANIFESTBIN_MAGIC };
+	header.version = GUINT16_TO_LE(MANIFESTBIN_VERSION);
+	header.numsignatures = GUINT16_TO_LE(
+			records->len / sizeof(struct manifestbin_signature));
+
+	GByteArray* out = g_byte_array_new();
+	g_byte_array_append(out, (const guint8*) &header, sizeof(header));
+	g_byte_array_append(out, records->data, records->len);
+	g_byte_array_append(out, blobs->data, blobs->len);
+	manifestbin_pad(out);
+	header.bodyoffset = GUINT32_TO_LE(out->len);
+	header.bodylen = GUINT32_TO_LE(body->len);
+	g_byte_array_append(out, body->data, body->len);
+	memcpy(out->data, &header, sizeof(header));
+
+	g_byte_array_free(records, TRUE);
+	g_byte_array_free(blobs, TRUE);
+	return out;
+}
+
+// is the table of count records of size at offset inside a region of len
+static gboolean manifestbin_tablefits(guint32 offset, guint32 count,
+		gsize size, gsize len) {
+	return offset % MANIFESTBIN_ALIGN == 0 && offset <= len
+			&& count <= (len - offset) / size;
+}
+
+static gboolean manifestbin_rangefits(guint32 first, guint32 count,
+		guint32 total) {
+	return first <= total && count <= total - first;
+}
+
+static gboolean manifestbin_stringok(const struct manifestbin_body* header,
+		const guint8* body, guint32 offset) {
+	guint32 strings = GUINT32_FROM_LE(header->strings);
+	guint32 stringslen = GUINT32_FROM_LE(header->stringslen);
+	return offset < stringslen
+			&& memchr(body + strings + offset, '\0', stringslen - offset)
+					!= NULL;
+}
+
+static gboolean manifestbin_signaturesok(const struct manifestbin_body* header,
+		const guint8* body, guint32 first, guint32 count) {
+	if (!manifestbin_rangefits(first, count,
+			GUINT32_FROM_LE(header->numsignatures)))
+		return FALSE;
+	const struct manifestbin_signature* signatures =
+			(const struct manifestbin_signature*) (body
+					+ GUINT32_FROM_LE(header->signatures));
+	for (guint32 i = first; i < first + count; i++) {
+		if (!manifestbin_rangefits(GUINT32_FROM_LE(signatures[i].offset),
+				GUINT32_FROM_LE(signatures[i].len),
+				GUINT32_FROM_LE(header->blobslen)))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Check that everything in the body is where it says it is so nothing
+ * after this has to bounds check.
+ */
+static gboolean manifestbin_checkbody(const guint8* body, gsize len) {
+	if (len < sizeof(struct manifestbin_body))
+		return FALSE;
+	const struct manifestbin_body* header =
+			(const struct manifestbin_body*) body;
+
+	guint32 numimages = GUINT32_FROM_LE(header->numimages);
+	guint32 numattachments = GUINT32_FROM_LE(header->numattachments);
+	guint32 numsignatures = GUINT32_FROM_LE(header->numsignatures);
+	guint32 numtags = GUINT32_FROM_LE(header->numtags);
+	if (!manifestbin_tablefits(GUINT32_FROM_LE(header->images), numimages,
+			sizeof(struct manifestbin_image), len)
+			|| !manifestbin_tablefits(GUINT32_FROM_LE(header->attachments),
+					numattachments, sizeof(struct manifestbin_attachment),
+					len)
+			|| !manifestbin_tablefits(GUINT32_FROM_LE(header->signatures),
+					numsignatures, sizeof(struct manifestbin_signature), len)
+			|| !manifestbin_tablefits(GUINT32_FROM_LE(header->tags), numtags,
+					sizeof(struct manifestbin_tag), len)
+			|| !manifestbin_tablefits(GUINT32_FROM_LE(header->strings),
+					GUINT32_FROM_LE(header->stringslen), 1, len)
+			|| !manifestbin_tablefits(GUINT32_FROM_LE(header->blobs),
+					GUINT32_FROM_LE(header->blobslen), 1, len))
+		return FALSE;
+
+	if (!manifestbin_stringok(header, body, GUINT32_FROM_LE(header->uuid)))
+		return FALSE;
+
+	const struct manifestbin_attachment* attachments =
+			(const struct manifestbin_attachment*) (body
+					+ GUINT32_FROM_LE(header->attachments));
+	for (guint32 i = 0; i < numattachments; i++) {
+		if (!manifestbin_signaturesok(header, body,
+				GUINT32_FROM_LE(attachments[i].firstsignature),
+				GUINT32_FROM_LE(attachments[i].numsignatures)))
+			return FALSE;
+	}
+
+	const struct manifestbin_tag* tags = (const struct manifestbin_tag*) (body
+			+ GUINT32_FROM_LE(header->tags));
+	for (guint32 i = 0; i < numtags; i++) {
+		if (!manifestbin_stringok(header, body,
+				GUINT32_FROM_LE(tags[i].name)))
+			return FALSE;
+	}
+
+	const struct manifestbin_image* images =
+			(const struct manifestbin_image*) (body
+					+ GUINT32_FROM_LE(header->images));
+	for (guint32 i = 0; i < numimages; i++) {
+		const struct manifestbin_image* image = &images[i];
+		if (!manifestbin_stringok(header, body, GUINT32_FROM_LE(image->uuid))
+				|| !manifestbin_signaturesok(header, body,
+						GUINT32_FROM_LE(image->firstsignature),
+						GUINT32_FROM_LE(image->numsignatures))
+				|| !manifestbin_rangefits(
+						GUINT32_FROM_LE(image->firstattachment),
+						GUINT32_FROM_LE(image->numattachments), numattachments)
+				|| !manifestbin_rangefits(GUINT32_FROM_LE(image->firsttag),
+						GUINT32_FROM_LE(image->numtags), numtags))
+			return FALSE;
+		if (i > 0
+				&& GUINT32_FROM_LE(image->version)
+						< GUINT32_FROM_LE(images[i - 1].version))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean manifestbin_typeok(const struct manifestbin_signature* record) {
+	guint32 type = GUINT32_FROM_LE(record->type);
+	return type != OTA_SIGTYPE_INVALID && type <= OTA_SIGTYPE_RSASHA512;
+}
+
+static struct manifest_signature* manifestbin_signature(
+		const struct manifestbin_signature* record, const guint8* blobs) {
+	struct manifest_signature* signature = g_malloc0(sizeof(*signature));
+	signature->type = GUINT32_FROM_LE(record->type);
+	signature->raw = blobs + GUINT32_FROM_LE(record->offset);
+	signature->rawlen = GUINT32_FROM_LE(record->len);
+	return signature;
+}
+
+/*
+ * Check a binary manifest and find the body and the signatures over it.
+ * The signatures point into data so data has to outlive them.
+ */
+const struct manifestbin_body* manifestbin_check(const guint8* data,
+		gsize len, const guint8** body, gsize* bodylen,
+		GPtrArray** signatures) {
+	if (len < sizeof(struct manifestbin_header)
+			|| ((guintptr) data) % MANIFESTBIN_ALIGN != 0)
+		goto err_header;
+
+	const struct manifestbin_header* header =
+			(const struct manifestbin_header*) data;
+	if (memcmp(header->magic, MANIFESTBIN_MAGIC, sizeof(header->magic)) != 0
+			|| GUINT16_FROM_LE(header->version) != MANIFESTBIN_VERSION) {
+		g_message("not a binary manifest or unknown version");
+		goto err_header;
+	}
+
+	guint32 bodyoffset = GUINT32_FROM_LE(header->bodyoffset);
+	guint32 len32 = MIN(len, G_MAXUINT32);
+	guint16 numsignatures = GUINT16_FROM_LE(header->numsignatures);
+	gsize recordsend = sizeof(*header)
+			+ (numsignatures * sizeof(struct manifestbin_signature));
+	if (!manifestbin_tablefits(bodyoffset, GUINT32_FROM_LE(header->bodylen), 1,
+			len32) || recordsend > bodyoffset)
+		goto err_header;
+
+	const guint8* blobs = data + recordsend;
+	const struct manifestbin_signature* records =
+			(const struct manifestbin_signature*) (data + sizeof(*header));
+	for (guint i = 0; i < numsignatures; i++) {
+		if (!manifestbin_rangefits(GUINT32_FROM_LE(records[i].offset),
+				GUINT32_FROM_LE(records[i].len), bodyoffset - recordsend))
+			goto err_header;
+	}
+
+	*body = data + bodyoffset;
+	*bodylen = GUINT32_FROM_LE(header->bodylen);
+	if (!manifestbin_checkbody(*body, *bodylen)) {
+		g_message("binary manifest is corrupt");
+		goto err_body;
+	}
+
+	// like the envelope, nothing to check would pass any check
+	guint usable = 0;
+	for (guint i = 0; i < numsignatures; i++) {
+		if (manifestbin_typeok(&records[i]))
+			usable++;
+	}
+	if (usable == 0) {
+		g_message("binary manifest has no usable signatures");
+		goto err_nosigs;
+	}
+
+	if (signatures != NULL) {
+		*signatures = manifest_signatures_new();
+		for (guint i = 0; i < numsignatures; i++) {
+			if (manifestbin_typeok(&records[i]))
+				g_ptr_array_add(*signatures,
+						manifestbin_signature(&records[i], blobs));
+		}
+	}
+	return (const struct manifestbin_body*) *body;
+
+	err_nosigs: //
+	err_body: //
+	err_header: //
+	return NULL;
+}
+
+static void manifestbin_addsignaturesto(GPtrArray* signatures,
+		const struct manifestbin_body* header, const guint8* body,
+		guint32 first, guint32 count) {
+	const struct manifestbin_signature* records =
+			(const struct manifestbin_signature*) (body
+					+ GUINT32_FROM_LE(header->signatures));
+	const guint8* blobs = body + GUINT32_FROM_LE(header->blobs);
+	for (guint32 i = first; i < first + count; i++) {
+		if (manifestbin_typeok(&records[i]))
+			g_ptr_array_add(signatures,
+					manifestbin_signature(&records[i], blobs));
+	}
+}
+
+static struct manifest_image* manifestbin_image(
+		const struct manifestbin_body* header, const guint8* body,
+		const struct manifestbin_image* record) {
+	const gchar* strings = (const gchar*) body
+			+ GUINT32_FROM_LE(header->strings);
+	struct manifest_image* image = manifest_image_new();
+	image->borrowed = TRUE;
+	image->uuid = strings + GUINT32_FROM_LE(record->uuid);
+	image->version = GUINT32_FROM_LE(record->version);
+	image->size = GUINT64_FROM_LE(record->size);
+	guint32 flags = GUINT32_FROM_LE(record->flags);
+	image->enabled = (flags & MANIFESTBIN_IMAGE_ENABLED) != 0;
+	if (flags & MANIFESTBIN_IMAGE_HASROLLOUT) {
+		image->rollout = manifest_rollout_new();
+		image->rollout->percent = GUINT32_FROM_LE(record->rolloutpercent);
+		image->rollout->start = GINT64_FROM_LE(record->rolloutstart);
+		image->rollout->rate = GUINT32_FROM_LE(record->rolloutrate);
+		// same as the json manifest, the image is left out
+		if (image->rollout->percent > 100 || image->rollout->start < 0
+				|| image->rollout->rate > 100) {
+			g_message("invalid rollout");
+			manifest_image_free(image);
+			return NULL;
+		}
+	}
+	manifestbin_addsignaturesto(image->signatures, header, body,
+			GUINT32_FROM_LE(record->firstsignature),
+			GUINT32_FROM_LE(record->numsignatures));
+
+	const struct manifestbin_tag* tags = (const struct manifestbin_tag*) (body
+			+ GUINT32_FROM_LE(header->tags));
+	for (guint32 i = GUINT32_FROM_LE(record->firsttag);
+			i < GUINT32_FROM_LE(record->firsttag)
+					+ GUINT32_FROM_LE(record->numtags); i++)
+		g_ptr_array_add(image->tags,
+				(gpointer) (strings + GUINT32_FROM_LE(tags[i].name)));
+
+	const struct manifestbin_attachment* attachments =
+			(const struct manifestbin_attachment*) (body
+					+ GUINT32_FROM_LE(header->attachments));
+	for (guint32 i = GUINT32_FROM_LE(record->firstattachment);
+			i < GUINT32_FROM_LE(record->firstattachment)
+					+ GUINT32_FROM_LE(record->numattachments); i++) {
+		const struct manifestbin_attachment* attachment = &attachments[i];
+		guint32 param = GUINT32_FROM_LE(attachment->param);
+		gsize size = GUINT64_FROM_LE(attachment->size);
+		guint32 firstsignature = GUINT32_FROM_LE(attachment->firstsignature);
+		guint32 numsignatures = GUINT32_FROM_LE(attachment->numsignatures);
+		switch (GUINT32_FROM_LE(attachment->kind)) {
+		case MANIFESTBIN_DELTA: {
+			struct manifest_delta* delta = manifest_delta_new();
+			delta->from = param;
+			delta->size = size;
+			manifestbin_addsignaturesto(delta->signatures, header, body,
+					firstsignature, numsignatures);
+			// the json manifest leaves out attachments that can't be checked
+			if (delta->signatures->len == 0) {
+				g_message("delta has no usable signatures");
+				manifest_delta_free(delta);
+				break;
+			}
+			g_ptr_array_add(image->deltas, delta);
+		}
+			break;
+		case MANIFESTBIN_COMPRESSED: {
+			// newer repos might have algorithms we don't know about
+			if (param == OTA_COMPRESSION_INVALID
+					|| param > OTA_COMPRESSION_LZ4)
+				break;
+			struct manifest_compressed* compressed = manifest_compressed_new();
+			compressed->algorithm = param;
+			compressed->size = size;
+			manifestbin_addsignaturesto(compressed->signatures, header, body,
+					firstsignature, numsignatures);
+			if (compressed->signatures->len == 0) {
+				g_message("compressed image has no usable signatures");
+				manifest_compressed_free(compressed);
+				break;
+			}
+			g_ptr_array_add(image->compressed, compressed);
+		}
+			break;
+		case MANIFESTBIN_CHUNKINDEX:
+			if (image->chunkindex != NULL)
+				break;
+			image->chunkindex = manifest_chunkindex_new();
+			image->chunkindex->size = size;
+			manifestbin_addsignaturesto(image->chunkindex->signatures, header,
+					body, firstsignature, numsignatures);
+			if (image->chunkindex->signatures->len == 0) {
+				g_message("chunk index has no usable signatures");
+				manifest_chunkindex_free(image->chunkindex);
+				image->chunkindex = NULL;
+			}
+			break;
+		}
+	}
+	return image;
+}
+
+// the first image with at least version, the images are sorted
+static guint32 manifestbin_findversion(const struct manifestbin_image* images,
+		guint32 numimages, guint minversion) {
+	guint32 low = 0, high = numimages;
+	while (low < high) {
+		guint32 mid = low + ((high - low) / 2);
+		if (GUINT32_FROM_LE(images[mid].version) < minversion)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/*
+ * Turn a binary manifest that has already had its signatures checked into
+ * a manifest. Strings and signatures aren't copied, they point into data
+ * which the manifest keeps a reference to, and images older than
+ * minversion are skipped without being looked at.
+ */
+struct manifest_manifest* manifestbin_deserialise(GBytes* data,
+		guint minversion) {
+	gsize len;
+	const guint8* bytes = g_bytes_get_data(data, &len);
+	const guint8* body;
+	gsize bodylen;
+	const struct manifestbin_body* header = manifestbin_check(bytes, len,
+			&body, &bodylen, NULL);
+	if (header == NULL)
+		return NULL;
+
+	if (GUINT32_FROM_LE(header->serial) == 0) {
+		g_message("bad serial");
+		return NULL;
+	}
+
+	struct manifest_manifest* manifest = manifest_new();
+	g_free((gchar*) manifest->uuid);
+	manifest->backing = g_bytes_ref(data);
+	manifest->uuid = g_strdup(
+			(const gchar*) body + GUINT32_FROM_LE(header->strings)
+					+ GUINT32_FROM_LE(header->uuid));
+	manifest->serial = GUINT32_FROM_LE(header->serial);
+	manifest->timestamp = GINT64_FROM_LE(header->timestamp);
+	manifest->pollinterval = GUINT32_FROM_LE(header->pollinterval);
+
+	const struct manifestbin_image* images =
+			(const struct manifestbin_image*) (body
+					+ GUINT32_FROM_LE(header->images));
+	guint32 numimages = GUINT32_FROM_LE(header->numimages);
+	for (guint32 i = manifestbin_findversion(images, numimages, minversion);
+			i < numimages; i++) {
+		struct manifest_image* image = manifestbin_image(header, body,
+				&images[i]);
+		if (image == NULL)
+			continue;
+		if (image->signatures->len == 0) {
+			g_message("image has no usable signatures");
+			manifest_image_free(image);
+			continue;
+		}
+		g_ptr_array_add(manifest->images, image);
+	}
+
+	return manifest;
+}
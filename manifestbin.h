@@ -0,0 +1,108 @@
+#pragma once
+
+#include <glib.h>
+#include "manifest.h"
+
+#define OTA_MANIFESTBIN             "manifest.bin"
+#define MANIFESTBIN_CONTENTTYPE     "application/octet-stream"
+#define MANIFESTBIN_MAGIC           "OTAM"
+#define MANIFESTBIN_VERSION         1
+
+/*
+ * A compact binary form of the manifest for devices. The json is still
+ * what the repo tool works with, this is generated from it each time the
+ * manifest changes. Everything is little endian and every table is 8 byte
+ * aligned so the records can be used where they are once the file has
+ * been checked, strings are offsets into a table of nul terminated strings
+ * and signatures are raw bytes in a blob area instead of hex. Images are
+ * sorted by version.
+ *
+ * The file is a header, the signatures over the body and the body.
+ */
+struct manifestbin_header {
+	gchar magic[4];
+	guint16 version;
+	guint16 numsignatures;
+	// from the start of the file, the signature records follow the header
+	guint32 bodyoffset;
+	guint32 bodylen;
+};
+
+struct manifestbin_signature {
+	guint32 type;
+	// into the blob area, for the header's signatures from the end of the
+	// signature records
+	guint32 offset;
+	guint32 len;
+	guint32 reserved;
+};
+
+// all offsets are from the start of the body
+struct manifestbin_body {
+	guint32 serial;
+	guint32 pollinterval;
+	gint64 timestamp;
+	guint32 uuid;
+	guint32 numimages;
+	guint32 images;
+	guint32 numattachments;
+	guint32 attachments;
+	guint32 numsignatures;
+	guint32 signatures;
+	guint32 numtags;
+	guint32 tags;
+	guint32 strings;
+	guint32 stringslen;
+	guint32 blobs;
+	guint32 blobslen;
+	guint32 reserved;
+};
+
+#define MANIFESTBIN_IMAGE_ENABLED    (1 << 0)
+#define MANIFESTBIN_IMAGE_HASROLLOUT (1 << 1)
+
+struct manifestbin_image {
+	guint32 uuid;
+	guint32 version;
+	guint64 size;
+	guint32 flags;
+	guint32 rolloutpercent;
+	gint64 rolloutstart;
+	guint32 rolloutrate;
+	// ranges of the signature, attachment and tag tables
+	guint32 firstsignature;
+	guint32 numsignatures;
+	guint32 firstattachment;
+	guint32 numattachments;
+	guint32 firsttag;
+	guint32 numtags;
+	guint32 reserved;
+};
+
+enum manifestbin_attachmentkind {
+	MANIFESTBIN_DELTA = 1, MANIFESTBIN_COMPRESSED, MANIFESTBIN_CHUNKINDEX
+};
+
+// the other files that go with an image
+struct manifestbin_attachment {
+	guint32 kind;
+	// the version a delta is from or the compression algorithm
+	guint32 param;
+	guint64 size;
+	guint32 firstsignature;
+	guint32 numsignatures;
+};
+
+// tags are just string offsets
+struct manifestbin_tag {
+	guint32 name;
+};
+
+GByteArray* manifestbin_serialisebody(struct manifest_manifest* manifest);
+GByteArray* manifestbin_serialise(const GByteArray* body,
+		GPtrArray* signatures);
+const struct manifestbin_body* manifestbin_check(const guint8* data,
+		gsize len, const guint8** body, gsize* bodylen,
+		GPtrArray** signatures);
+struct manifest_manifest* manifestbin_deserialise(GBytes* data,
+		guint minversion);
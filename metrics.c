@@ -0,0 +1,263 @@
+#include <json-glib/json-glib.h>
+#include "metrics.h"
+#include "jsonbuilderutils.h"
+#include "utils.h"
+
+#define METRICS_PREFIX "ota_"
+
+/*
+ * upper bounds of the histogram buckets, there's an extra +Inf bucket. The
+ * ones past a minute are for downloads and erasing whole slots, which
+ * take that long over a slow link or on big NAND.
+ */
+static const guint64 metrics_buckets[] = { 100, 1000, 10000, 100000, 1000000,
+		10000000, 60000000, 300000000, 1800000000, 3600000000, 14400000000 };
+static const gchar* metrics_bucketlabels[] = { "0.0001", "0.001", "0.01",
+		"0.1", "1", "10", "60", "300", "1800", "3600", "14400" };
+
+struct metrics_histogramdef {
+	const gchar* name;
+	const gchar* help;
+};
+
+static const struct metrics_histogramdef metrics_histogramdefs[] = {
+		[METRICS_MANIFESTFETCH ] = { "manifest_fetch",
+				"Time taken to fetch the manifest and its signatures" },
+		[METRICS_MANIFESTPARSE ] = { "manifest_parse",
+				"Time taken to parse the manifest" },
+		[METRICS_SIGVERIFY ] = { "signature_verify",
+				"Time taken to hash (if needed) and check a set of signatures" },
+		[METRICS_HASH ] = { "hash", "Time taken by each call to hash data" },
+		[METRICS_DOWNLOAD ] = { "image_download",
+				"Time taken to download and write an image" },
+		[METRICS_ERASE ] = { "erase", "Time taken to erase an erase block" },
+		[METRICS_PROGRAM ] = { "program",
+				"Time taken to program an erase block's worth of pages" },
+		[METRICS_READBACK ] = { "readback",
+				"Time taken to read back and check an erase block" } };
+
+struct metrics_counterdef {
+	const gchar* name;
+	const gchar* help;
+};
+
+static const struct metrics_counterdef metrics_counterdefs[] = {
+		[METRICS_CHECKS ] = { "checks_total", "Checks for updates" },
+		[METRICS_CHECKSFAILED ] = { "checks_failed_total",
+				"Checks for updates that failed" },
+		[METRICS_BYTESRECEIVED ] = { "received_bytes_total",
+				"Bytes of http bodies received" },
+		[METRICS_BYTESHASHED ] = { "hashed_bytes_total", "Bytes hashed" },
+		[METRICS_BLOCKSERASED ] = { "erased_blocks_total",
+				"Erase blocks erased" },
+		[METRICS_PAGESPROGRAMMED ] = { "programmed_pages_total",
+				"Pages programmed" },
+		[METRICS_RETRIES ] = { "retries_total",
+				"Downloads resumed, blocks fetched again and fallbacks from peers" },
+		[METRICS_UPDATES ] = { "updates_total",
+				"Updates that were installed and verified" } };
+
+static const struct metrics_counterdef metrics_peakdefs[] = {
+		[METRICS_PIPELINEBUFFERED ] = { "pipeline_buffered_peak_bytes",
+				"Most data waiting between the download and the flash" } };
+
+static const struct metrics_counterdef metrics_gaugedefs[] = {
+		[METRICS_DOWNLOADRATE ] = { "image_download_rate_bytes",
+				"Bytes per second the last image was downloaded and written at" } };
+
+struct metrics_histogramdata {
+	guint64 buckets[G_N_ELEMENTS(metrics_buckets) + 1];
+	guint64 count;
+	guint64 sum;
+};
+
+static GMutex metrics_lock;
+static struct metrics_histogramdata metrics_histograms[METRICS_HISTOGRAM_COUNT];
+static guint64 metrics_counters[METRICS_COUNTER_COUNT];
+static guint64 metrics_peaks[METRICS_PEAK_COUNT];
+static guint64 metrics_gauges[METRICS_GAUGE_COUNT];
+
+void metrics_observe(enum metrics_histogram histogram, guint64 us) {
+	int bucket = 0;
+	while (bucket < G_N_ELEMENTS(metrics_buckets)
+			&& us > metrics_buckets[bucket])
+		bucket++;
+
+	g_mutex_lock(&metrics_lock);
+	struct metrics_histogramdata* data = &metrics_histograms[histogram];
+	data->buckets[bucket]++;
+	data->count++;
+	data->sum += us;
+	g_mutex_unlock(&metrics_lock);
+}
+
+void metrics_observesince(enum metrics_histogram histogram, gint64 start) {
+	metrics_observe(histogram, g_get_monotonic_time() - start);
+}
+
+void metrics_add(enum metrics_counter counter, guint64 value) {
+	g_mutex_lock(&metrics_lock);
+	metrics_counters[counter] += value;
+	g_mutex_unlock(&metrics_lock);
+}
+
+void metrics_peak(enum metrics_peak peak, guint64 value) {
+	g_mutex_lock(&metrics_lock);
+	metrics_peaks[peak] = MAX(metrics_peaks[peak], value);
+	g_mutex_unlock(&metrics_lock);
+}
+
+void metrics_set(enum metrics_gauge gauge, guint64 value) {
+	g_mutex_lock(&metrics_lock);
+	metrics_gauges[gauge] = value;
+	g_mutex_unlock(&metrics_lock);
+}
+
+void metrics_gethistogram(enum metrics_histogram histogram, guint64* count,
+		guint64* sum) {
+	g_mutex_lock(&metrics_lock);
+	*count = metrics_histograms[histogram].count;
+	*sum = metrics_histograms[histogram].sum;
+	g_mutex_unlock(&metrics_lock);
+}
+
+guint64 metrics_getcounter(enum metrics_counter counter) {
+	g_mutex_lock(&metrics_lock);
+	guint64 value = metrics_counters[counter];
+	g_mutex_unlock(&metrics_lock);
+	return value;
+}
+
+guint64 metrics_getpeak(enum metrics_peak peak) {
+	g_mutex_lock(&metrics_lock);
+	guint64 value = metrics_peaks[peak];
+	g_mutex_unlock(&metrics_lock);
+	return value;
+}
+
+// seconds without going through a double so the locale doesn't matter
+static void metrics_appendseconds(GString* out, guint64 us) {
+	g_string_append_printf(out, "%" G_GUINT64_FORMAT ".%06u",
+			us / G_USEC_PER_SEC, (unsigned) (us % G_USEC_PER_SEC));
+}
+
+static void metrics_appendsimple(GString* out, const gchar* type,
+		const struct metrics_counterdef* def, guint64 value) {
+	g_string_append_printf(out, "# HELP " METRICS_PREFIX "%s %s\n"
+	"# TYPE " METRICS_PREFIX "%s %s\n"
+	METRICS_PREFIX "%s %" G_GUINT64_FORMAT "\n", def->name, def->help,
+			def->name, type, def->name, value);
+}
+
+// the prometheus text format, for node_exporter's textfile collector
+static gchar* metrics_toprom(gsize* len) {
+	GString* out = g_string_new(NULL);
+
+	for (int i = 0; i < METRICS_HISTOGRAM_COUNT; i++) {
+		const struct metrics_histogramdef* def = &metrics_histogramdefs[i];
+		const struct metrics_histogramdata* data = &metrics_histograms[i];
+		g_string_append_printf(out, "# HELP " METRICS_PREFIX "%s_seconds %s\n"
+		"# TYPE " METRICS_PREFIX "%s_seconds histogram\n", def->name,
+				def->help, def->name);
+		guint64 cumulative = 0;
+		for (int b = 0; b < G_N_ELEMENTS(metrics_buckets); b++) {
+			cumulative += data->buckets[b];
+			g_string_append_printf(out,
+					METRICS_PREFIX "%s_seconds_bucket{le=\"%s\"} %"
+					G_GUINT64_FORMAT "\n", def->name, metrics_bucketlabels[b],
+					cumulative);
+		}
+		g_string_append_printf(out,
+				METRICS_PREFIX "%s_seconds_bucket{le=\"+Inf\"} %"
+				G_GUINT64_FORMAT "\n", def->name, data->count);
+		g_string_append_printf(out, METRICS_PREFIX "%s_seconds_sum ",
+				def->name);
+		metrics_appendseconds(out, data->sum);
+		g_string_append_printf(out,
+				"\n" METRICS_PREFIX "%s_seconds_count %" G_GUINT64_FORMAT "\n",
+				def->name, data->count);
+	}
+
+	for (int i = 0; i < METRICS_COUNTER_COUNT; i++)
+		metrics_appendsimple(out, "counter", &metrics_counterdefs[i],
+				metrics_counters[i]);
+	for (int i = 0; i < METRICS_PEAK_COUNT; i++)
+		metrics_appendsimple(out, "gauge", &metrics_peakdefs[i],
+				metrics_peaks[i]);
+	for (int i = 0; i < METRICS_GAUGE_COUNT; i++)
+		metrics_appendsimple(out, "gauge", &metrics_gaugedefs[i],
+				metrics_gauges[i]);
+
+	*len = out->len;
+	return g_string_free(out, FALSE);
+}
+
+static gchar* metrics_tojson(gsize* len) {
+	JsonBuilder* builder = json_builder_new();
+	json_builder_begin_object(builder);
+	JSONBUILDER_ADD_INT(builder, "time", g_get_real_time() / G_USEC_PER_SEC);
+
+	json_builder_set_member_name(builder, "histograms");
+	json_builder_begin_object(builder);
+	for (int i = 0; i < METRICS_HISTOGRAM_COUNT; i++) {
+		const struct metrics_histogramdata* data = &metrics_histograms[i];
+		json_builder_set_member_name(builder, metrics_histogramdefs[i].name);
+		json_builder_begin_object(builder);
+		JSONBUILDER_ADD_INT(builder, "count", data->count);
+		JSONBUILDER_ADD_INT(builder, "sum_us", data->sum);
+		JSONBUILDER_START_ARRAY(builder, "buckets");
+		for (int b = 0; b <= G_N_ELEMENTS(metrics_buckets); b++) {
+			json_builder_begin_object(builder);
+			// the last bucket has no upper bound
+			if (b < G_N_ELEMENTS(metrics_buckets))
+				JSONBUILDER_ADD_INT(builder, "le_us", metrics_buckets[b]);
+			JSONBUILDER_ADD_INT(builder, "count", data->buckets[b]);
+			json_builder_end_object(builder);
+		}
+		json_builder_end_array(builder);
+		json_builder_end_object(builder);
+	}
+	json_builder_end_object(builder);
+
+	json_builder_set_member_name(builder, "counters");
+	json_builder_begin_object(builder);
+	for (int i = 0; i < METRICS_COUNTER_COUNT; i++)
+		JSONBUILDER_ADD_INT(builder, metrics_counterdefs[i].name,
+				metrics_counters[i]);
+	for (int i = 0; i < METRICS_PEAK_COUNT; i++)
+		JSONBUILDER_ADD_INT(builder, metrics_peakdefs[i].name,
+				metrics_peaks[i]);
+	for (int i = 0; i < METRICS_GAUGE_COUNT; i++)
+		JSONBUILDER_ADD_INT(builder, metrics_gaugedefs[i].name,
+				metrics_gauges[i]);
+	json_builder_end_object(builder);
+
+	json_builder_end_object(builder);
+	return jsonbuilder_freetostring(builder, len, TRUE);
+}
+
+/*
+ * Write a snapshot of everything to dir as a prometheus textfile and as
+ * json. Both are replaced atomically so a collector never sees half a
+ * file.
+ */
+gboolean metrics_write(const gchar* dir) {
+	gsize promlen, jsonlen;
+	g_mutex_lock(&metrics_lock);
+	gchar* prom = metrics_toprom(&promlen);
+	gchar* json = metrics_tojson(&jsonlen);
+	g_mutex_unlock(&metrics_lock);
+
+	gchar* prompath = buildpath(dir, METRICSFILE_PROM, NULL);
+	gchar* jsonpath = buildpath(dir, METRICSFILE_JSON, NULL);
+	gboolean ret = g_file_set_contents(prompath, prom, promlen, NULL)
+			&& g_file_set_contents(jsonpath, json, jsonlen, NULL);
+	if (!ret)
+		g_message("failed to write metrics to %s", dir);
+
+	g_free(prompath);
+	g_free(jsonpath);
+	g_free(prom);
+	g_free(json);
+	return ret;
+}
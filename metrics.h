@@ -0,0 +1,58 @@
+#pragma once
+
+#include <glib.h>
+
+#define METRICSFILE_PROM "metrics.prom"
+#define METRICSFILE_JSON "metrics.json"
+
+// things that are timed, all in microseconds
+enum metrics_histogram {
+	METRICS_MANIFESTFETCH,
+	METRICS_MANIFESTPARSE,
+	METRICS_SIGVERIFY,
+	METRICS_HASH,
+	METRICS_DOWNLOAD,
+	METRICS_ERASE,
+	METRICS_PROGRAM,
+	METRICS_READBACK,
+	METRICS_HISTOGRAM_COUNT
+};
+
+enum metrics_counter {
+	METRICS_CHECKS,
+	METRICS_CHECKSFAILED,
+	METRICS_BYTESRECEIVED,
+	METRICS_BYTESHASHED,
+	METRICS_BLOCKSERASED,
+	METRICS_PAGESPROGRAMMED,
+	METRICS_RETRIES,
+	METRICS_UPDATES,
+	METRICS_COUNTER_COUNT
+};
+
+// gauges that only go up, the highest value seen
+enum metrics_peak {
+	METRICS_PIPELINEBUFFERED,
+	METRICS_PEAK_COUNT
+};
+
+// gauges that are set
+enum metrics_gauge {
+	METRICS_DOWNLOADRATE,
+	METRICS_GAUGE_COUNT
+};
+
+/*
+ * Counters and latency histograms for each stage of checking for and
+ * installing an update. Everything can be called from any thread.
+ */
+void metrics_observe(enum metrics_histogram histogram, guint64 us);
+void metrics_observesince(enum metrics_histogram histogram, gint64 start);
+void metrics_add(enum metrics_counter counter, guint64 value);
+void metrics_peak(enum metrics_peak peak, guint64 value);
+void metrics_set(enum metrics_gauge gauge, guint64 value);
+void metrics_gethistogram(enum metrics_histogram histogram, guint64* count,
+		guint64* sum);
+guint64 metrics_getcounter(enum metrics_counter counter);
+guint64 metrics_getpeak(enum metrics_peak peak);
+gboolean metrics_write(const gchar* dir);
@@ -5,31 +5,186 @@
 #include <errno.h>
 
 #include "mtd.h"
+#include "mtdbackend.h"
+#include "metrics.h"
 
 static unsigned maximagesz = UINT_MAX;
 static GHashTable* mtdinfos;
+static gboolean compareblocks = FALSE;
+
+static int mtd_kernel_open(const gchar* mtd, int flags) {
+	return open(mtd, flags);
+}
+
+static int mtd_kernel_ioctl(int fd, unsigned long request, void* arg) {
+	return ioctl(fd, request, arg);
+}
+
+static gboolean mtd_kernel_handles(const gchar* mtd) {
+	return TRUE;
+}
+
+static const struct mtd_backend mtd_backend_kernel = { .name = "kernel",
+		.handles = mtd_kernel_handles, .open = mtd_kernel_open, .ioctl =
+				mtd_kernel_ioctl, .pread = pread, .pwrite = pwrite, .close =
+				close };
+
+// the first backend that claims a partition gets it
+static const struct mtd_backend* mtd_backends[] = { &mtdsim_backend,
+		&blockdev_backend, &ubi_backend, &mtd_backend_kernel };
+
+// which backend each open fd came from, fds are used from the eraser thread
+static GHashTable* mtd_fds;
+static GMutex mtd_fdslock;
+
+static const struct mtd_backend* mtd_backendfor(const gchar* mtd) {
+	for (int i = 0; i < G_N_ELEMENTS(mtd_backends); i++) {
+		if (mtd_backends[i]->handles(mtd))
+			return mtd_backends[i];
+	}
+	return &mtd_backend_kernel;
+}
+
+static int mtd_open(const gchar* mtd, int flags) {
+	const struct mtd_backend* backend = mtd_backendfor(mtd);
+	int fd = backend->open(mtd, flags);
+	if (fd == -1)
+		return fd;
+
+	g_mutex_lock(&mtd_fdslock);
+	if (mtd_fds == NULL)
+		mtd_fds = g_hash_table_new(g_direct_hash, g_direct_equal);
+	g_hash_table_insert(mtd_fds, GINT_TO_POINTER(fd), (gpointer) backend);
+	g_mutex_unlock(&mtd_fdslock);
+	return fd;
+}
+
+static const struct mtd_backend* mtd_backendforfd(int fd) {
+	g_mutex_lock(&mtd_fdslock);
+	const struct mtd_backend* backend = g_hash_table_lookup(mtd_fds,
+			GINT_TO_POINTER(fd));
+	g_mutex_unlock(&mtd_fdslock);
+	return backend;
+}
+
+static int mtd_ioctl(int fd, unsigned long request, void* arg) {
+	return mtd_backendforfd(fd)->ioctl(fd, request, arg);
+}
+
+static ssize_t mtd_pread(int fd, void* data, size_t len, off_t offset) {
+	return mtd_backendforfd(fd)->pread(fd, data, len, offset);
+}
+
+static ssize_t mtd_pwrite(int fd, const void* data, size_t len, off_t offset) {
+	return mtd_backendforfd(fd)->pwrite(fd, data, len, offset);
+}
+
+// backends that need the whole image in one go are told how long it is
+static gboolean mtd_begin(int fd, gsize len) {
+	const struct mtd_backend* backend = mtd_backendforfd(fd);
+	return backend->begin == NULL || backend->begin(fd, len);
+}
+
+/*
+ * Whether a partition can be written from part way through, resuming an
+ * interrupted download or rewriting a single block, or only from the start.
+ */
+gboolean mtd_canresume(const gchar* mtd) {
+	return mtd == NULL || mtd_backendfor(mtd)->begin == NULL;
+}
+
+/*
+ * Whether a partition is really a file standing in for flash, it's safe to
+ * throw anything at those.
+ */
+gboolean mtd_issimulated(const gchar* mtd) {
+	return mtd_backendfor(mtd) == &mtdsim_backend;
+}
+
+static int mtd_close(int fd) {
+	const struct mtd_backend* backend = mtd_backendforfd(fd);
+	g_mutex_lock(&mtd_fdslock);
+	g_hash_table_remove(mtd_fds, GINT_TO_POINTER(fd));
+	g_mutex_unlock(&mtd_fdslock);
+	return backend->close(fd);
+}
+
+struct mtd_eraser {
+	struct mtd_info_user* info;
+	int fd;
+	// logical offset the eraser was started for and where that really is
+	guint32 start;
+	guint32 physical;
+	guint32 end;
+	GThread* thread;
+	GMutex lock;
+	GCond cond;
+	// everything below this has been erased
+	guint32 erased;
+	gboolean done;
+	gboolean failed;
+	gboolean cancelled;
+	/*
+	 * In compare mode only the blocks that differ are erased, the writer
+	 * queues them up in order as it finds them. NULL when everything from
+	 * physical to end is erased.
+	 */
+	GAsyncQueue* queue;
+};
+
+// the queue holds block numbers plus one, this tells the eraser to stop
+#define MTD_ERASER_STOP GUINT_TO_POINTER(G_MAXUINT)
+
+// where a block of the current write is going and if it needs erasing
+struct mtd_plannedblock {
+	guint32 offset;
+	guint32 physical;
+	gboolean unchanged;
+};
+
+struct mtd_writer {
+	struct mtd_info_user* info;
+	int fd;
+	guint32 offset;
+	// where the next block will really go once bad blocks are skipped
+	guint32 physical;
+	GArray* blockmap;
+	struct mtd_eraser* eraser;
+	// scratch space for the compare, one block for what is there now and
+	// one for what would be there after erasing and programming
+	guint8* existing;
+	guint8* expected;
+	// compare mode works out which blocks of each write need erasing first
+	GArray* plan;
+	guint planned;
+	// the end of the last block that was queued for erasing
+	guint32 queuedend;
+	unsigned blockswritten;
+	unsigned blocksskipped;
+};
 
 static struct mtd_info_user* mtd_getinfo(const gchar* mtd) {
 	struct mtd_info_user* info = NULL;
 
-	int fd = open(mtd, O_RDONLY);
+	int fd = mtd_open(mtd, O_RDONLY);
 	if (fd == -1) {
 		goto err_open;
 	}
 
 	info = g_malloc0(sizeof(*info));
-	if (ioctl(fd, MEMGETINFO, info) == -1) {
+	if (mtd_ioctl(fd, MEMGETINFO, info) == -1) {
 		g_free(info);
 		goto err_ioctl;
 	}
 
 	err_ioctl: //
-	close(fd);
+	mtd_close(fd);
 	err_open: //
 	return info;
 }
 
-gboolean mtd_init(const gchar** mtds) {
+gboolean mtd_init(const gchar** mtds, gboolean compare) {
+	compareblocks = compare;
 	mtdinfos = g_hash_table_new(g_str_hash, g_str_equal);
 	while (*mtds != NULL) {
 		const gchar* mtd = *mtds++;
@@ -51,7 +206,7 @@ gboolean mtd_init(const gchar** mtds) {
 
 gboolean mtd_erase(const gchar* mtd) {
 	gboolean ret = FALSE;
-	int fd = open(mtd, O_RDWR);
+	int fd = mtd_open(mtd, O_RDWR);
 	if (fd == -1) {
 		goto err_open;
 	}
@@ -62,7 +217,7 @@ gboolean mtd_erase(const gchar* mtd) {
 	eraseinfo.start = 0;
 	eraseinfo.length = mtdinfo->size;
 
-	if (ioctl(fd, MEMERASE, &eraseinfo) == -1) {
+	if (mtd_ioctl(fd, MEMERASE, &eraseinfo) == -1) {
 		g_message("failed to erase; %d", errno);
 		goto err_erase;
 
@@ -71,7 +226,7 @@ gboolean mtd_erase(const gchar* mtd) {
 	ret = TRUE;
 
 	err_erase: //
-	close(fd);
+	mtd_close(fd);
 	err_open: //
 	return ret;
 }
@@ -84,7 +239,7 @@ gboolean mtd_writeimage(const gchar* mtd, guint8* data, gsize len) {
 		goto err_imagesz;
 	}
 
-	int fd = open(mtd, O_RDWR);
+	int fd = mtd_open(mtd, O_RDWR);
 	if (fd == -1) {
 		goto err_open;
 	}
@@ -94,8 +249,11 @@ gboolean mtd_writeimage(const gchar* mtd, guint8* data, gsize len) {
 	int tail = len % mtdinfo->writesize;
 	int head = len - tail;
 
+	if (!mtd_begin(fd, head + (tail > 0 ? mtdinfo->writesize : 0)))
+		goto err_begin;
+
 	int writeret;
-	if ((writeret = write(fd, data, head)) < 0) {
+	if ((writeret = mtd_pwrite(fd, data, head, 0)) < 0) {
 		g_message("head write failed");
 		goto err_writehead;
 	}
@@ -104,7 +262,8 @@ gboolean mtd_writeimage(const gchar* mtd, guint8* data, gsize len) {
 	if (tail > 0) {
 		paddedtail = g_malloc0(mtdinfo->writesize);
 		memcpy(paddedtail, data + head, tail);
-		if ((writeret = write(fd, paddedtail, mtdinfo->writesize)) < 0) {
+		if ((writeret = mtd_pwrite(fd, paddedtail, mtdinfo->writesize, head))
+				< 0) {
 			g_message("tail write failed");
 			goto err_writetail;
 		}
@@ -116,15 +275,784 @@ gboolean mtd_writeimage(const gchar* mtd, guint8* data, gsize len) {
 	if (paddedtail != NULL)
 		g_free(paddedtail);
 	err_writehead: //
-	close(fd);
+	err_begin: //
+	mtd_close(fd);
 	err_open: //
 	err_imagesz: //
 	return ret;
 }
 
-gchar* mtd_foroffset(guint32 off) {
+guint32 mtd_size(const gchar* mtd) {
+	guint32 size = 0;
+	struct mtd_info_user* info = mtd_getinfo(mtd);
+	if (info != NULL) {
+		size = info->size;
+		g_free(info);
+	}
+	return size;
+}
+
+guint32 mtd_erasesize(const gchar* mtd) {
+	struct mtd_info_user* mtdinfo = g_hash_table_lookup(mtdinfos, mtd);
+	return mtdinfo->erasesize;
+}
+
+guint32 mtd_writesize(const gchar* mtd) {
+	struct mtd_info_user* mtdinfo = g_hash_table_lookup(mtdinfos, mtd);
+	return mtdinfo->writesize;
+}
+
+static gboolean mtd_isnand(const struct mtd_info_user* info) {
+	return info->type == MTD_NANDFLASH || info->type == MTD_MLCNANDFLASH;
+}
+
+/*
+ * Only NAND has bad blocks, > 0 means the block at offset is bad and < 0
+ * that the check itself failed.
+ */
+static int mtd_blockisbad(int fd, const struct mtd_info_user* info,
+		guint32 offset) {
+	if (!mtd_isnand(info))
+		return 0;
+	__kernel_loff_t off = offset;
+	int ret = mtd_ioctl(fd, MEMGETBADBLOCK, &off);
+	if (ret < 0)
+		g_message("failed to check block at 0x%x; %d", (unsigned) offset,
+				errno);
+	return ret;
+}
+
+static void mtd_markbad(int fd, guint32 offset) {
+	__kernel_loff_t off = offset;
+	if (mtd_ioctl(fd, MEMSETBADBLOCK, &off) == -1)
+		g_message("failed to mark block at 0x%x bad; %d", (unsigned) offset,
+				errno);
+	else
+		g_message("marked block at 0x%x bad", (unsigned) offset);
+}
+
+/*
+ * Find the physical block that the block at logical offset lives in by
+ * walking the partition skipping bad blocks, the same thing that uboot's
+ * nand read does. If map isn't NULL the physical offsets of the good blocks
+ * before it are appended to it.
+ */
+static gboolean mtd_logicaltophysical(int fd, const struct mtd_info_user* info,
+		guint32 logical, guint32* physical, GArray* map) {
+	guint32 block = 0;
+	for (guint32 offset = 0; offset < info->size; offset += info->erasesize) {
+		int bad = mtd_blockisbad(fd, info, offset);
+		if (bad < 0)
+			return FALSE;
+		else if (bad > 0)
+			continue;
+
+		if (block == logical / info->erasesize) {
+			*physical = offset;
+			return TRUE;
+		}
+		if (map != NULL)
+			g_array_append_val(map, offset);
+		block++;
+	}
+	g_message("not enough good blocks for offset 0x%x", (unsigned) logical);
+	return FALSE;
+}
+
+// erase one block for the eraser and let the writer know how it went
+static gboolean mtd_eraser_eraseblock(struct mtd_eraser* eraser,
+		guint32 offset) {
+	gboolean erased = FALSE;
+	int bad = mtd_blockisbad(eraser->fd, eraser->info, offset);
+	if (bad == 0) {
+		struct erase_info_user eraseinfo;
+		eraseinfo.start = offset;
+		eraseinfo.length = eraser->info->erasesize;
+		erased = mtd_ioctl(eraser->fd, MEMERASE, &eraseinfo) != -1;
+		if (!erased) {
+			g_message("failed to erase at 0x%x; %d", (unsigned) offset,
+					errno);
+			// on NAND a block that won't erase is just another bad block
+			if (mtd_isnand(eraser->info)) {
+				mtd_markbad(eraser->fd, offset);
+				erased = TRUE;
+			}
+		}
+	} else
+		// bad blocks are skipped by the writer
+		erased = bad > 0;
+
+	g_mutex_lock(&eraser->lock);
+	if (erased)
+		eraser->erased = offset + eraser->info->erasesize;
+	else
+		eraser->failed = TRUE;
+	g_cond_broadcast(&eraser->cond);
+	g_mutex_unlock(&eraser->lock);
+	return erased;
+}
+
+static gpointer mtd_eraser_thread(gpointer data) {
+	struct mtd_eraser* eraser = data;
+
+	if (eraser->queue != NULL) {
+		for (;;) {
+			gpointer block = g_async_queue_pop(eraser->queue);
+			if (block == MTD_ERASER_STOP
+					|| !mtd_eraser_eraseblock(eraser,
+							(GPOINTER_TO_UINT(block) - 1)
+									* eraser->info->erasesize))
+				break;
+		}
+	} else {
+		for (guint32 offset = eraser->physical; offset < eraser->end;
+				offset += eraser->info->erasesize) {
+			g_mutex_lock(&eraser->lock);
+			gboolean cancelled = eraser->cancelled;
+			g_mutex_unlock(&eraser->lock);
+			if (cancelled || !mtd_eraser_eraseblock(eraser, offset))
+				break;
+		}
+	}
+
+	g_mutex_lock(&eraser->lock);
+	eraser->done = TRUE;
+	g_cond_broadcast(&eraser->cond);
+	g_mutex_unlock(&eraser->lock);
+	return NULL;
+}
+
+/*
+ * Start erasing the blocks that will hold the part of an image of len bytes
+ * from offset onwards in the background so that erasing, which is much
+ * slower than programming on NOR, overlaps with fetching and writing. On
+ * NAND there's no telling how many bad blocks will be skipped so the rest
+ * of the partition is erased.
+ */
+static struct mtd_eraser* mtd_eraser_open(const gchar* mtd, guint32 offset,
+		gsize len, gboolean queued) {
+	struct mtd_eraser* eraser = NULL;
+
+	int fd = mtd_open(mtd, O_RDWR);
+	if (fd == -1) {
+		g_message("failed to open %s; %d", mtd, errno);
+		goto err_open;
+	}
+
+	struct mtd_info_user* info = g_hash_table_lookup(mtdinfos, mtd);
+	guint32 physical;
+	if (!mtd_logicaltophysical(fd, info, offset, &physical, NULL))
+		goto err_physical;
+
+	eraser = g_malloc0(sizeof(*eraser));
+	eraser->info = info;
+	eraser->fd = fd;
+	eraser->start = offset;
+	eraser->physical = physical;
+	eraser->erased = physical;
+	if (mtd_isnand(info))
+		eraser->end = info->size;
+	else
+		eraser->end = MIN(
+				((len + info->erasesize - 1) / info->erasesize)
+						* info->erasesize, info->size);
+	if (queued)
+		eraser->queue = g_async_queue_new();
+	g_mutex_init(&eraser->lock);
+	g_cond_init(&eraser->cond);
+	eraser->thread = g_thread_new("erase", mtd_eraser_thread, eraser);
+
+	return eraser;
+
+	err_physical: //
+	mtd_close(fd);
+	err_open: //
+	return eraser;
+}
+
+struct mtd_eraser* mtd_eraser_new(const gchar* mtd, guint32 offset,
+		gsize len) {
+	return mtd_eraser_open(mtd, offset, len, FALSE);
+}
+
+// queue a block for erasing, blocks have to be queued in order
+static void mtd_eraser_queue(struct mtd_eraser* eraser, guint32 physical) {
+	g_async_queue_push(eraser->queue,
+			GUINT_TO_POINTER((physical / eraser->info->erasesize) + 1));
+}
+
+guint32 mtd_eraser_start(struct mtd_eraser* eraser) {
+	return eraser->start;
+}
+
+// block until everything below physical offset has been erased
+static gboolean mtd_eraser_waitfor(struct mtd_eraser* eraser, guint32 offset) {
+	g_mutex_lock(&eraser->lock);
+	while (eraser->erased < offset && !eraser->failed && !eraser->done)
+		g_cond_wait(&eraser->cond, &eraser->lock);
+	gboolean ret = eraser->erased >= offset;
+	g_mutex_unlock(&eraser->lock);
+	return ret;
+}
+
+void mtd_eraser_free(struct mtd_eraser* eraser) {
+	g_mutex_lock(&eraser->lock);
+	eraser->cancelled = TRUE;
+	g_mutex_unlock(&eraser->lock);
+	if (eraser->queue != NULL)
+		g_async_queue_push(eraser->queue, MTD_ERASER_STOP);
+	g_thread_join(eraser->thread);
+	if (eraser->queue != NULL)
+		g_async_queue_unref(eraser->queue);
+	g_mutex_clear(&eraser->lock);
+	g_cond_clear(&eraser->cond);
+	mtd_close(eraser->fd);
+	g_free(eraser);
+}
+
+/*
+ * Open a writer for the part of an image of len bytes from offset onwards.
+ * Erasing is done ahead of the writer on another thread. When blocks are
+ * being compared only the blocks that differ are erased so the eraser is
+ * fed them as each write is compared. An eraser that was started earlier
+ * for the same range can be passed in and the writer takes ownership of
+ * it, that isn't any use in compare mode.
+ */
+struct mtd_writer* mtd_writer_open(const gchar* mtd, guint32 offset,
+		gsize len, struct mtd_eraser* eraser) {
+	struct mtd_writer* writer = NULL;
+
+	if (eraser != NULL
+			&& (compareblocks || mtd_eraser_start(eraser) != offset)) {
+		mtd_eraser_free(eraser);
+		eraser = NULL;
+	}
+
+	if (offset != 0 && !mtd_canresume(mtd)) {
+		g_message("%s can only be written from the start", mtd);
+		goto err_resume;
+	}
+
+	int fd = mtd_open(mtd, O_RDWR);
+	if (fd == -1) {
+		g_message("failed to open %s; %d", mtd, errno);
+		goto err_open;
+	}
+
+	struct mtd_info_user* info = g_hash_table_lookup(mtdinfos, mtd);
+	gsize paddedlen = ((len + info->writesize - 1) / info->writesize)
+			* info->writesize;
+	if (offset == 0 && !mtd_begin(fd, paddedlen))
+		goto err_begin;
+
+	GArray* blockmap = g_array_new(FALSE, FALSE, sizeof(guint32));
+	guint32 physical;
+	if (!mtd_logicaltophysical(fd, info, offset, &physical, blockmap))
+		goto err_physical;
+
+	if (eraser == NULL && !compareblocks) {
+		eraser = mtd_eraser_new(mtd, offset, len);
+		if (eraser == NULL)
+			goto err_eraser;
+	}
+
+	writer = g_malloc0(sizeof(*writer));
+	writer->eraser = eraser;
+	eraser = NULL;
+	writer->info = info;
+	writer->fd = fd;
+	writer->offset = offset;
+	writer->physical = physical;
+	writer->blockmap = blockmap;
+	// skipping blocks isn't possible when everything has to be written
+	if (compareblocks && mtd_canresume(mtd)) {
+		writer->eraser = mtd_eraser_open(mtd, offset, len, TRUE);
+		if (writer->eraser == NULL) {
+			mtd_writer_close(writer);
+			return NULL;
+		}
+		writer->existing = g_malloc(writer->info->erasesize);
+		writer->expected = g_malloc(writer->info->erasesize);
+		writer->plan = g_array_new(FALSE, FALSE,
+				sizeof(struct mtd_plannedblock));
+	}
+
+	return writer;
+
+	err_eraser: //
+	err_physical: //
+	g_array_free(blockmap, TRUE);
+	err_begin: //
+	mtd_close(fd);
+	err_open: //
+	err_resume: //
+	if (eraser != NULL)
+		mtd_eraser_free(eraser);
+	return writer;
+}
+
+/*
+ * A block is left alone if it already contains exactly what erasing and
+ * programming it would leave behind: the data, zeros padding out the last
+ * page and the erased state after that.
+ */
+static gboolean mtd_writer_blockunchanged(struct mtd_writer* writer,
+		guint32 physical, const guint8* data, gsize len) {
+	guint32 erasesize = writer->info->erasesize;
+	int tail = len % writer->info->writesize;
+	gsize paddedlen = (len - tail) + (tail > 0 ? writer->info->writesize : 0);
+	if (mtd_pread(writer->fd, writer->existing, erasesize, physical)
+			!= erasesize)
+		return FALSE;
+
+	memcpy(writer->expected, data, len);
+	memset(writer->expected + len, 0, paddedlen - len);
+	memset(writer->expected + paddedlen, 0xff, erasesize - paddedlen);
+	return memcmp(writer->existing, writer->expected, erasesize) == 0;
+}
+
+// program len bytes at physical padding the last page out with zeros
+static gboolean mtd_program(int fd, const struct mtd_info_user* info,
+		guint32 physical, const guint8* data, gsize len) {
+	gboolean ret = FALSE;
+	gint64 start = g_get_monotonic_time();
+
+	int tail = len % info->writesize;
+	int head = len - tail;
+
+	if (head > 0 && mtd_pwrite(fd, data, head, physical) != head) {
+		g_message("head write failed at 0x%x; %d", (unsigned) physical,
+				errno);
+		goto err_writehead;
+	}
+
+	guint8* paddedtail = NULL;
+	if (tail > 0) {
+		paddedtail = g_malloc0(info->writesize);
+		memcpy(paddedtail, data + head, tail);
+		if (mtd_pwrite(fd, paddedtail, info->writesize, physical + head)
+				!= info->writesize) {
+			g_message("tail write failed");
+			goto err_writetail;
+		}
+	}
+
+	metrics_observesince(METRICS_PROGRAM, start);
+	metrics_add(METRICS_PAGESPROGRAMMED,
+			(len + info->writesize - 1) / info->writesize);
+	ret = TRUE;
+
+	err_writetail: //
+	if (paddedtail != NULL)
+		g_free(paddedtail);
+	err_writehead: //
+	return ret;
+}
+
+static gboolean mtd_eraseblock(int fd, const struct mtd_info_user* info,
+		guint32 physical) {
+	struct erase_info_user eraseinfo;
+	eraseinfo.start = physical;
+	eraseinfo.length = info->erasesize;
+	gint64 start = g_get_monotonic_time();
+	if (mtd_ioctl(fd, MEMERASE, &eraseinfo) == -1) {
+		g_message("failed to erase at 0x%x; %d", (unsigned) physical, errno);
+		return FALSE;
+	}
+	metrics_observesince(METRICS_ERASE, start);
+	metrics_add(METRICS_BLOCKSERASED, 1);
+	return TRUE;
+}
+
+/*
+ * Compare each block of a write with what's already there before any of it
+ * is written and queue the ones that differ for erasing. Erasing a block
+ * then overlaps with programming the one before it.
+ */
+static void mtd_writer_plan(struct mtd_writer* writer, const guint8* data,
+		gsize len) {
+	guint32 erasesize = writer->info->erasesize;
+	guint32 physical = writer->physical;
+	for (gsize offset = 0; offset < len; offset += erasesize) {
+		int bad = 0;
+		while (physical < writer->info->size
+				&& (bad = mtd_blockisbad(writer->fd, writer->info, physical))
+						> 0)
+			physical += erasesize;
+		if (physical >= writer->info->size || bad < 0)
+			break;
+
+		struct mtd_plannedblock block = { .offset = writer->offset + offset,
+				.physical = physical };
+		block.unchanged = mtd_writer_blockunchanged(writer, physical,
+				data + offset, MIN(erasesize, len - offset));
+		if (!block.unchanged) {
+			mtd_eraser_queue(writer->eraser, physical);
+			writer->queuedend = physical + erasesize;
+		}
+		g_array_append_val(writer->plan, block);
+		physical += erasesize;
+	}
+}
+
+/*
+ * The plan for the block about to be written. If a block went bad the
+ * blocks have shifted so the rest of the plan is dropped once the eraser
+ * has caught up and the remaining blocks are compared and erased as they
+ * are written.
+ */
+static struct mtd_plannedblock* mtd_writer_planned(struct mtd_writer* writer) {
+	if (writer->plan == NULL || writer->planned >= writer->plan->len)
+		return NULL;
+
+	struct mtd_plannedblock* block = &g_array_index(writer->plan,
+			struct mtd_plannedblock, writer->planned);
+	if (block->offset == writer->offset
+			&& block->physical == writer->physical) {
+		writer->planned++;
+		return block;
+	}
+
+	mtd_eraser_waitfor(writer->eraser, writer->queuedend);
+	writer->planned = writer->plan->len;
+	return NULL;
+}
+
+static gboolean mtd_writer_programblock(struct mtd_writer* writer,
+		const guint8* data, gsize len) {
+	struct mtd_plannedblock* planned = mtd_writer_planned(writer);
+	gboolean unchanged =
+			planned != NULL ?
+					planned->unchanged :
+					writer->existing != NULL
+							&& mtd_writer_blockunchanged(writer,
+									writer->physical, data, len);
+	if (unchanged) {
+		writer->blocksskipped++;
+		return TRUE;
+	}
+
+	if (planned != NULL) {
+		if (!mtd_eraser_waitfor(writer->eraser,
+				writer->physical + writer->info->erasesize))
+			return FALSE;
+	} else if ((writer->eraser == NULL || writer->eraser->queue != NULL)
+			&& !mtd_eraseblock(writer->fd, writer->info, writer->physical))
+		return FALSE;
+
+	if (!mtd_program(writer->fd, writer->info, writer->physical, data, len))
+		return FALSE;
+
+	writer->blockswritten++;
+	return TRUE;
+}
+
+/*
+ * Put one logical block in the next good physical block. On NAND blocks
+ * that are already marked bad are skipped and blocks that fail to erase or
+ * program are marked bad and skipped.
+ */
+static gboolean mtd_writer_writeblock(struct mtd_writer* writer,
+		const guint8* data, gsize len) {
+	gboolean nand = mtd_isnand(writer->info);
+
+	for (; writer->physical < writer->info->size;
+			writer->physical += writer->info->erasesize) {
+		if (writer->eraser != NULL && writer->eraser->queue == NULL
+				&& !mtd_eraser_waitfor(writer->eraser,
+						writer->physical + writer->info->erasesize))
+			return FALSE;
+
+		int bad = mtd_blockisbad(writer->fd, writer->info, writer->physical);
+		if (bad < 0)
+			return FALSE;
+		else if (bad > 0) {
+			g_message("skipping bad block at 0x%x",
+					(unsigned) writer->physical);
+			continue;
+		}
+
+		if (mtd_writer_programblock(writer, data, len)) {
+			g_array_append_val(writer->blockmap, writer->physical);
+			writer->physical += writer->info->erasesize;
+			return TRUE;
+		} else if (!nand)
+			return FALSE;
+
+		mtd_markbad(writer->fd, writer->physical);
+	}
+
+	g_message("ran out of good blocks");
+	return FALSE;
+}
+
+/*
+ * Writes the next part of an image. Every write apart from the last one
+ * must be a multiple of the erase size so that each write starts on a fresh
+ * erase block, the blocks that are about to be written are erased first and
+ * the last write is padded out to a whole page. In compare mode blocks
+ * that already hold the right data aren't erased or programmed at all.
+ */
+gboolean mtd_writer_write(struct mtd_writer* writer, const guint8* data,
+		gsize len) {
+	if (writer->offset + len > maximagesz) {
+		g_message("image is too big");
+		return FALSE;
+	}
+
+	if (writer->plan != NULL) {
+		g_array_set_size(writer->plan, 0);
+		writer->planned = 0;
+		mtd_writer_plan(writer, data, len);
+	}
+
+	while (len > 0) {
+		gsize blocklen = MIN(len, writer->info->erasesize);
+		if (!mtd_writer_writeblock(writer, data, blocklen))
+			return FALSE;
+		writer->offset += blocklen;
+		data += blocklen;
+		len -= blocklen;
+	}
+
+	return TRUE;
+}
+
+/*
+ * The physical offset of each logical block of the image written so far,
+ * including any before the offset the writer was opened at.
+ */
+const GArray* mtd_writer_blockmap(struct mtd_writer* writer) {
+	return writer->blockmap;
+}
+
+void mtd_writer_close(struct mtd_writer* writer) {
+	if (writer->existing != NULL)
+		g_message("%u blocks written, %u unchanged blocks skipped",
+				writer->blockswritten, writer->blocksskipped);
+	if (writer->eraser != NULL)
+		mtd_eraser_free(writer->eraser);
+	g_array_free(writer->blockmap, TRUE);
+	if (writer->plan != NULL)
+		g_array_free(writer->plan, TRUE);
+	g_free(writer->existing);
+	g_free(writer->expected);
+	mtd_close(writer->fd);
+	g_free(writer);
+}
+
+gboolean mtd_read(const gchar* mtd, guint32 physical, guint8* data,
+		gsize len) {
+	gboolean ret = FALSE;
+	int fd = mtd_open(mtd, O_RDONLY);
+	if (fd == -1) {
+		g_message("failed to open %s; %d", mtd, errno);
+		goto err_open;
+	}
+
+	if (mtd_pread(fd, data, len, physical) != len) {
+		g_message("failed to read at 0x%x; %d", (unsigned) physical, errno);
+		goto err_read;
+	}
+
+	ret = TRUE;
+
+	err_read: //
+	mtd_close(fd);
+	err_open: //
+	return ret;
+}
+
+struct mtd_reader {
+	struct mtd_info_user info;
+	int fd;
+	// physical offset of each good block, logical blocks index into this
+	GArray* blocks;
+};
+
+/*
+ * Read a partition by logical offset like uboot would, skipping the bad
+ * blocks, for reading the image that is already in the active partition.
+ */
+struct mtd_reader* mtd_reader_open(const gchar* mtd) {
+	int fd = mtd_open(mtd, O_RDONLY);
+	if (fd == -1) {
+		g_message("failed to open %s; %d", mtd, errno);
+		goto err_open;
+	}
+
+	struct mtd_reader* reader = g_malloc0(sizeof(*reader));
+	reader->fd = fd;
+	if (mtd_ioctl(fd, MEMGETINFO, &reader->info) == -1) {
+		g_message("failed to get info for %s; %d", mtd, errno);
+		goto err_info;
+	}
+
+	reader->blocks = g_array_new(FALSE, FALSE, sizeof(guint32));
+	guint32 physical;
+	if (!mtd_logicaltophysical(fd, &reader->info, 0, &physical, NULL))
+		goto err_map;
+	for (; physical < reader->info.size;
+			physical += reader->info.erasesize) {
+		int bad = mtd_blockisbad(fd, &reader->info, physical);
+		if (bad < 0)
+			goto err_map;
+		else if (bad == 0)
+			g_array_append_val(reader->blocks, physical);
+	}
+
+	return reader;
+
+	err_map: //
+	g_array_free(reader->blocks, TRUE);
+	err_info: //
+	g_free(reader);
+	mtd_close(fd);
+	err_open: //
+	return NULL;
+}
+
+// how much can be read, the size of the partition less the bad blocks
+guint32 mtd_reader_size(struct mtd_reader* reader) {
+	return reader->blocks->len * reader->info.erasesize;
+}
+
+gboolean mtd_reader_read(struct mtd_reader* reader, guint32 offset,
+		guint8* data, gsize len) {
+	if (offset + len > mtd_reader_size(reader)) {
+		g_message("read at 0x%x is past the last good block",
+				(unsigned) offset);
+		return FALSE;
+	}
+
+	while (len > 0) {
+		guint32 inblock = offset % reader->info.erasesize;
+		gsize want = MIN(len, reader->info.erasesize - inblock);
+		guint32 physical = g_array_index(reader->blocks, guint32,
+				offset / reader->info.erasesize) + inblock;
+		if (mtd_pread(reader->fd, data, want, physical) != want) {
+			g_message("failed to read at 0x%x; %d", (unsigned) physical,
+					errno);
+			return FALSE;
+		}
+		offset += want;
+		data += want;
+		len -= want;
+	}
+	return TRUE;
+}
+
+void mtd_reader_close(struct mtd_reader* reader) {
+	g_array_free(reader->blocks, TRUE);
+	mtd_close(reader->fd);
+	g_free(reader);
+}
+
+/*
+ * Erase and program a single block in place, for fixing up a block that
+ * didn't read back correctly.
+ */
+gboolean mtd_rewriteblock(const gchar* mtd, guint32 physical,
+		const guint8* data, gsize len) {
+	gboolean ret = FALSE;
+	if (!mtd_canresume(mtd)) {
+		g_message("blocks on %s can't be rewritten in place", mtd);
+		goto err_rewrite;
+	}
+
+	int fd = mtd_open(mtd, O_RDWR);
+	if (fd == -1) {
+		g_message("failed to open %s; %d", mtd, errno);
+		goto err_open;
+	}
+
+	struct mtd_info_user* info = g_hash_table_lookup(mtdinfos, mtd);
+	if (!mtd_eraseblock(fd, info, physical))
+		goto err_erase;
+	if (!mtd_program(fd, info, physical, data, len))
+		goto err_program;
+
+	ret = TRUE;
+
+	err_program: //
+	err_erase: //
+	mtd_close(fd);
+	err_open: //
+	err_rewrite: //
+	return ret;
+}
+
+/*
+ * Wipe the first good erase block of a partition so that a partially
+ * written or unverified image can't be booted.
+ */
+gboolean mtd_invalidate(const gchar* mtd) {
+	gboolean ret = FALSE;
+	int fd = mtd_open(mtd, O_RDWR);
+	if (fd == -1) {
+		goto err_open;
+	}
+
+	struct mtd_info_user* mtdinfo = g_hash_table_lookup(mtdinfos, mtd);
+
+	guint32 first;
+	if (!mtd_logicaltophysical(fd, mtdinfo, 0, &first, NULL))
+		goto err_nogoodblocks;
+
+	struct erase_info_user eraseinfo;
+	eraseinfo.start = first;
+	eraseinfo.length = mtdinfo->erasesize;
+
+	if (mtd_ioctl(fd, MEMERASE, &eraseinfo) == -1) {
+		g_message("failed to invalidate; %d", errno);
+		goto err_erase;
+	}
+
+	/*
+	 * Erasing doesn't get rid of the old data on a block device or UBI
+	 * volume, replace it with a block of zeros instead.
+	 */
+	if (mtdinfo->flags & MTD_NO_ERASE) {
+		guint8* zeros = g_malloc0(mtdinfo->erasesize);
+		gboolean zeroed = mtd_begin(fd, mtdinfo->erasesize)
+				&& mtd_program(fd, mtdinfo, first, zeros, mtdinfo->erasesize);
+		g_free(zeros);
+		if (!zeroed) {
+			g_message("failed to invalidate");
+			goto err_zero;
+		}
+	}
+
+	ret = TRUE;
+
+	err_zero: //
+	err_erase: //
+	err_nogoodblocks: //
+	mtd_close(fd);
+	err_open: //
+	return ret;
+}
+
+/*
+ * The partition that ota.part in the bootargs refers to. That's usually
+ * the offset of the partition in hex but some backends use an id.
+ */
+gchar* mtd_forpart(const gchar* part) {
+	guint64 off = g_ascii_strtoull(part, NULL, 16);
+	for (int i = 0; i < G_N_ELEMENTS(mtd_backends); i++) {
+		gchar* mtd = NULL;
+		if (mtd_backends[i]->forid != NULL)
+			mtd = mtd_backends[i]->forid(g_ascii_strtoull(part, NULL, 10));
+		else if (mtd_backends[i]->foroffset != NULL)
+			mtd = mtd_backends[i]->foroffset(off);
+		if (mtd != NULL)
+			return mtd;
+	}
+
 	const gchar* mtdclasspath = "/sys/class/mtd";
 	GDir* mtdclassdir = g_dir_open(mtdclasspath, 0, NULL);
+	if (mtdclassdir == NULL)
+		return NULL;
 	for (const gchar* subdir = g_dir_read_name(mtdclassdir); subdir != NULL;
 			subdir = g_dir_read_name(mtdclassdir)) {
 		const gchar* offsetpath = g_build_path("/", mtdclasspath, subdir,
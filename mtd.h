@@ -4,7 +4,36 @@
 #include <mtd/mtd-user.h>
 #include <glib.h>
 
-gboolean mtd_init(const gchar** mtds);
+struct mtd_writer;
+struct mtd_eraser;
+struct mtd_reader;
+
+gboolean mtd_init(const gchar** mtds, gboolean compare);
 gboolean mtd_erase(const gchar* mtd);
 gboolean mtd_writeimage(const gchar* mtd, guint8* data, gsize len);
-gchar* mtd_foroffset(guint32 off);
+guint32 mtd_size(const gchar* mtd);
+guint32 mtd_erasesize(const gchar* mtd);
+guint32 mtd_writesize(const gchar* mtd);
+struct mtd_eraser* mtd_eraser_new(const gchar* mtd, guint32 offset,
+		gsize len);
+guint32 mtd_eraser_start(struct mtd_eraser* eraser);
+void mtd_eraser_free(struct mtd_eraser* eraser);
+struct mtd_writer* mtd_writer_open(const gchar* mtd, guint32 offset,
+		gsize len, struct mtd_eraser* eraser);
+gboolean mtd_writer_write(struct mtd_writer* writer, const guint8* data,
+		gsize len);
+const GArray* mtd_writer_blockmap(struct mtd_writer* writer);
+void mtd_writer_close(struct mtd_writer* writer);
+gboolean mtd_read(const gchar* mtd, guint32 physical, guint8* data,
+		gsize len);
+struct mtd_reader* mtd_reader_open(const gchar* mtd);
+guint32 mtd_reader_size(struct mtd_reader* reader);
+gboolean mtd_reader_read(struct mtd_reader* reader, guint32 offset,
+		guint8* data, gsize len);
+void mtd_reader_close(struct mtd_reader* reader);
+gboolean mtd_rewriteblock(const gchar* mtd, guint32 physical,
+		const guint8* data, gsize len);
+gboolean mtd_invalidate(const gchar* mtd);
+gboolean mtd_canresume(const gchar* mtd);
+gboolean mtd_issimulated(const gchar* mtd);
+gchar* mtd_forpart(const gchar* part);
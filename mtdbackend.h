@@ -0,0 +1,42 @@
+#pragma once
+
+#include <sys/types.h>
+#include <glib.h>
+
+/*
+ * What mtd.c does to a partition, everything else is built on top of
+ * these. The kernel backend is the mtd character device, other backends
+ * stand in for it and answer the same ioctls (MEMGETINFO, MEMERASE,
+ * MEMGETBADBLOCK and MEMSETBADBLOCK) so mtd.c doesn't need to care which
+ * one it's talking to. Backends return -1 and set errno on failure like
+ * the system calls they replace.
+ */
+struct mtd_backend {
+	const gchar* name;
+	gboolean (*handles)(const gchar* mtd);
+	int (*open)(const gchar* mtd, int flags);
+	int (*ioctl)(int fd, unsigned long request, void* arg);
+	ssize_t (*pread)(int fd, void* data, size_t len, off_t offset);
+	ssize_t (*pwrite)(int fd, const void* data, size_t len, off_t offset);
+	int (*close)(int fd);
+	/*
+	 * optional, for backends that can only take a whole image written in
+	 * order from the start. Called before the first write with the length
+	 * of the image.
+	 */
+	gboolean (*begin)(int fd, gsize len);
+	/*
+	 * optional, the partition that starts at offset in the whole flash or
+	 * disk, disks are bigger than 4GiB so this is 64 bits
+	 */
+	gchar* (*foroffset)(guint64 offset);
+	/*
+	 * optional, for backends where ota.part in the bootargs is an id
+	 * (in decimal) rather than an offset
+	 */
+	gchar* (*forid)(guint id);
+};
+
+extern const struct mtd_backend mtdsim_backend;
+extern const struct mtd_backend blockdev_backend;
+extern const struct mtd_backend ubi_backend;
@@ -0,0 +1,433 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <linux/ioctl.h>
+#include <mtd/mtd-user.h>
+
+#include "mtdsim.h"
+
+#define MTDSIM_DEFAULTSIZE (8 * 1024 * 1024)
+
+/*
+ * A flash partition kept in a regular file so everything from fetching to
+ * verifying can be run without hardware. The geometry, how long erasing,
+ * programming and reading take, blocks that are bad or will fail and when
+ * the power goes come from a keyfile next to the image. Erasing sets bits
+ * and programming can only clear them like real flash so a missed erase
+ * shows up as corruption.
+ */
+struct mtdsim_device {
+	gchar* path;
+	gchar* configpath;
+	GKeyFile* config;
+	struct mtd_info_user info;
+	// where the partition would be in the whole flash, for foroffset
+	gboolean hasoffset;
+	guint32 offset;
+	// microseconds per erase block, per page programmed and per page read
+	guint64 erasetime;
+	guint64 programtime;
+	guint64 readtime;
+	// block numbers that are marked bad and that will fail to erase or program
+	GHashTable* badblocks;
+	GHashTable* failblocks;
+	// bytes that can be programmed before the power goes, -1 for never
+	gint64 powercut;
+	guint64 programmed;
+};
+
+// devices by path and by the fds open on them
+static GMutex mtdsim_lock;
+static GHashTable* mtdsim_devices;
+static GHashTable* mtdsim_fds;
+
+static gchar* mtdsim_configpath(const gchar* mtd) {
+	return g_strconcat(mtd, MTDSIM_CONFIGSUFFIX, NULL);
+}
+
+/*
+ * Anything that is a regular file, or that has a config so the file can be
+ * created, is simulated. Real partitions are character devices.
+ */
+static gboolean mtdsim_handles(const gchar* mtd) {
+	if (g_file_test(mtd, G_FILE_TEST_IS_REGULAR))
+		return TRUE;
+	gchar* configpath = mtdsim_configpath(mtd);
+	gboolean ret = g_file_test(configpath, G_FILE_TEST_IS_REGULAR);
+	g_free(configpath);
+	return ret;
+}
+
+static guint64 mtdsim_getuint(GKeyFile* config, const gchar* key,
+		guint64 fallback) {
+	if (!g_key_file_has_key(config, MTDSIM_GROUP, key, NULL))
+		return fallback;
+	return g_key_file_get_uint64(config, MTDSIM_GROUP, key, NULL);
+}
+
+static GHashTable* mtdsim_getblocks(GKeyFile* config, const gchar* key) {
+	GHashTable* blocks = g_hash_table_new(g_direct_hash, g_direct_equal);
+	gsize len = 0;
+	gint* list = g_key_file_get_integer_list(config, MTDSIM_GROUP, key, &len,
+	NULL);
+	for (gsize i = 0; i < len; i++)
+		g_hash_table_add(blocks, GINT_TO_POINTER(list[i]));
+	g_free(list);
+	return blocks;
+}
+
+// pad the backing file out to the size of the partition with erased flash
+static gboolean mtdsim_fill(const gchar* path, guint32 size, guint32 erasesize) {
+	gboolean ret = FALSE;
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd == -1)
+		goto err_open;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+		goto err_stat;
+
+	guint8* erased = g_malloc(erasesize);
+	memset(erased, 0xff, erasesize);
+	for (off_t offset = st.st_size; offset < size; offset += erasesize) {
+		gsize len = MIN(erasesize, size - offset);
+		if (pwrite(fd, erased, len, offset) != len)
+			goto err_write;
+	}
+
+	ret = TRUE;
+
+	err_write: //
+	g_free(erased);
+	err_stat: //
+	close(fd);
+	err_open: //
+	return ret;
+}
+
+static struct mtdsim_device* mtdsim_device_load(const gchar* path) {
+	GKeyFile* config = g_key_file_new();
+	gchar* configpath = mtdsim_configpath(path);
+	GError* error = NULL;
+	if (g_file_test(configpath, G_FILE_TEST_EXISTS)
+			&& !g_key_file_load_from_file(config, configpath,
+					G_KEY_FILE_KEEP_COMMENTS, &error)) {
+		g_message("failed to load simulator config %s; %s", configpath,
+				error->message);
+		g_error_free(error);
+		goto err_load;
+	}
+
+	gchar* type = g_key_file_get_string(config, MTDSIM_GROUP, "type", NULL);
+	gboolean nand = type != NULL && strcmp(type, "nand") == 0;
+	if (type != NULL && !nand && strcmp(type, "nor") != 0) {
+		g_message("unknown flash type %s in %s", type, configpath);
+		g_free(type);
+		goto err_type;
+	}
+	g_free(type);
+
+	guint64 existing = 0;
+	struct stat st;
+	if (stat(path, &st) == 0)
+		existing = st.st_size;
+
+	guint64 erasesize = mtdsim_getuint(config, "erasesize",
+			nand ? 128 * 1024 : 64 * 1024);
+	guint64 writesize = mtdsim_getuint(config, "writesize", nand ? 2048 : 1);
+	guint64 size = mtdsim_getuint(config, "size",
+			existing != 0 ? existing : MTDSIM_DEFAULTSIZE);
+	if (writesize == 0 || erasesize == 0 || erasesize % writesize != 0
+			|| size == 0 || size % erasesize != 0 || size > G_MAXUINT32) {
+		g_message("bad geometry in %s", configpath);
+		goto err_geometry;
+	}
+
+	if (!mtdsim_fill(path, size, erasesize)) {
+		g_message("failed to create simulated flash %s; %d", path, errno);
+		goto err_fill;
+	}
+
+	struct mtdsim_device* device = g_malloc0(sizeof(*device));
+	device->path = g_strdup(path);
+	device->configpath = configpath;
+	device->config = config;
+	device->info.type = nand ? MTD_NANDFLASH : MTD_NORFLASH;
+	device->info.flags = nand ? MTD_CAP_NANDFLASH : MTD_CAP_NORFLASH;
+	device->info.size = size;
+	device->info.erasesize = erasesize;
+	device->info.writesize = writesize;
+	device->hasoffset = g_key_file_has_key(config, MTDSIM_GROUP, "offset",
+	NULL);
+	device->offset = mtdsim_getuint(config, "offset", 0);
+	device->erasetime = mtdsim_getuint(config, "erasetime", 0);
+	device->programtime = mtdsim_getuint(config, "programtime", 0);
+	device->readtime = mtdsim_getuint(config, "readtime", 0);
+	device->badblocks = mtdsim_getblocks(config, "badblocks");
+	device->failblocks = mtdsim_getblocks(config, "failblocks");
+	device->powercut =
+			g_key_file_has_key(config, MTDSIM_GROUP, "powercut", NULL) ?
+					mtdsim_getuint(config, "powercut", 0) : -1;
+
+	g_message("simulating %s %s, %u bytes, %u byte blocks, %u byte pages",
+			nand ? "nand" : "nor", path, device->info.size,
+			device->info.erasesize, device->info.writesize);
+	return device;
+
+	err_fill: //
+	err_geometry: //
+	err_type: //
+	err_load: //
+	g_free(configpath);
+	g_key_file_free(config);
+	return NULL;
+}
+
+static int mtdsim_open(const gchar* mtd, int flags) {
+	g_mutex_lock(&mtdsim_lock);
+	if (mtdsim_devices == NULL) {
+		mtdsim_devices = g_hash_table_new(g_str_hash, g_str_equal);
+		mtdsim_fds = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+
+	int fd = -1;
+	struct mtdsim_device* device = g_hash_table_lookup(mtdsim_devices, mtd);
+	if (device == NULL) {
+		device = mtdsim_device_load(mtd);
+		if (device == NULL) {
+			errno = EINVAL;
+			goto err_load;
+		}
+		g_hash_table_insert(mtdsim_devices, device->path, device);
+	}
+
+	fd = open(mtd, flags);
+	if (fd != -1)
+		g_hash_table_insert(mtdsim_fds, GINT_TO_POINTER(fd), device);
+
+	err_load: //
+	g_mutex_unlock(&mtdsim_lock);
+	return fd;
+}
+
+static struct mtdsim_device* mtdsim_forfd(int fd) {
+	g_mutex_lock(&mtdsim_lock);
+	struct mtdsim_device* device = g_hash_table_lookup(mtdsim_fds,
+			GINT_TO_POINTER(fd));
+	g_mutex_unlock(&mtdsim_lock);
+	return device;
+}
+
+static gboolean mtdsim_isnand(const struct mtdsim_device* device) {
+	return device->info.type == MTD_NANDFLASH;
+}
+
+static gboolean mtdsim_hasblock(GHashTable* blocks, guint32 block) {
+	g_mutex_lock(&mtdsim_lock);
+	gboolean ret = g_hash_table_contains(blocks, GINT_TO_POINTER(block));
+	g_mutex_unlock(&mtdsim_lock);
+	return ret;
+}
+
+// called with the lock held
+static void mtdsim_savebadblocks(struct mtdsim_device* device) {
+	GList* blocks = g_hash_table_get_keys(device->badblocks);
+	gsize len = g_list_length(blocks);
+	gint* list = g_malloc_n(MAX(len, 1), sizeof(*list));
+	gsize i = 0;
+	for (GList* b = blocks; b != NULL; b = b->next)
+		list[i++] = GPOINTER_TO_INT(b->data);
+	g_list_free(blocks);
+
+	g_key_file_set_integer_list(device->config, MTDSIM_GROUP, "badblocks",
+			list, len);
+	g_free(list);
+	if (!g_key_file_save_to_file(device->config, device->configpath, NULL))
+		g_message("failed to save bad blocks to %s", device->configpath);
+}
+
+static void mtdsim_delay(guint64 us) {
+	if (us > 0)
+		g_usleep(us);
+}
+
+static int mtdsim_erase(int fd, struct mtdsim_device* device,
+		const struct erase_info_user* eraseinfo) {
+	guint32 erasesize = device->info.erasesize;
+	if (eraseinfo->start % erasesize != 0 || eraseinfo->length % erasesize != 0
+			|| eraseinfo->start + eraseinfo->length > device->info.size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	guint8* erased = g_malloc(erasesize);
+	memset(erased, 0xff, erasesize);
+	int ret = 0;
+	for (guint32 offset = eraseinfo->start;
+			offset < eraseinfo->start + eraseinfo->length; offset +=
+					erasesize) {
+		guint32 block = offset / erasesize;
+		mtdsim_delay(device->erasetime);
+		if (mtdsim_hasblock(device->badblocks, block)
+				|| mtdsim_hasblock(device->failblocks, block)) {
+			errno = EIO;
+			ret = -1;
+			break;
+		}
+		if (pwrite(fd, erased, erasesize, offset) != erasesize) {
+			ret = -1;
+			break;
+		}
+	}
+	g_free(erased);
+	return ret;
+}
+
+static int mtdsim_ioctl(int fd, unsigned long request, void* arg) {
+	struct mtdsim_device* device = mtdsim_forfd(fd);
+	switch (request) {
+	case MEMGETINFO:
+		memcpy(arg, &device->info, sizeof(device->info));
+		return 0;
+	case MEMERASE:
+		return mtdsim_erase(fd, device, arg);
+	case MEMGETBADBLOCK: {
+		__kernel_loff_t offset = *((__kernel_loff_t*) arg);
+		if (offset < 0 || offset >= device->info.size) {
+			errno = EINVAL;
+			return -1;
+		}
+		return mtdsim_isnand(device)
+				&& mtdsim_hasblock(device->badblocks,
+						offset / device->info.erasesize) ? 1 : 0;
+	}
+	case MEMSETBADBLOCK: {
+		__kernel_loff_t offset = *((__kernel_loff_t*) arg);
+		if (!mtdsim_isnand(device)) {
+			errno = EOPNOTSUPP;
+			return -1;
+		}
+		if (offset < 0 || offset >= device->info.size) {
+			errno = EINVAL;
+			return -1;
+		}
+		// bad block markers survive restarts like they do in the oob
+		g_mutex_lock(&mtdsim_lock);
+		g_hash_table_add(device->badblocks,
+				GINT_TO_POINTER(offset / device->info.erasesize));
+		mtdsim_savebadblocks(device);
+		g_mutex_unlock(&mtdsim_lock);
+		return 0;
+	}
+	default:
+		errno = ENOTTY;
+		return -1;
+	}
+}
+
+static ssize_t mtdsim_pread(int fd, void* data, size_t len, off_t offset) {
+	struct mtdsim_device* device = mtdsim_forfd(fd);
+	guint32 writesize = device->info.writesize;
+	mtdsim_delay(device->readtime * ((len + writesize - 1) / writesize));
+	return pread(fd, data, len, offset);
+}
+
+/*
+ * Programming ANDs the new data into what's there. Once the byte budget
+ * for the power cut has been used up whatever made it to flash stays
+ * there and the process dies without any chance to clean up.
+ */
+static ssize_t mtdsim_pwrite(int fd, const void* data, size_t len,
+		off_t offset) {
+	struct mtdsim_device* device = mtdsim_forfd(fd);
+	guint32 writesize = device->info.writesize;
+	guint32 erasesize = device->info.erasesize;
+
+	if (offset % writesize != 0 || len % writesize != 0 || offset < 0
+			|| offset + len > device->info.size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (guint32 block = offset / erasesize;
+			block <= (offset + len - 1) / erasesize && len > 0; block++) {
+		if (mtdsim_hasblock(device->badblocks, block)
+				|| mtdsim_hasblock(device->failblocks, block)) {
+			mtdsim_delay(device->programtime);
+			errno = EIO;
+			return -1;
+		}
+	}
+
+	gsize programlen = len;
+	gboolean powercut = FALSE;
+	g_mutex_lock(&mtdsim_lock);
+	if (device->powercut >= 0 && device->programmed + len > device->powercut) {
+		programlen = device->powercut - device->programmed;
+		powercut = TRUE;
+	}
+	device->programmed += programlen;
+	g_mutex_unlock(&mtdsim_lock);
+
+	ssize_t ret = -1;
+	guint8* programmed = g_malloc(MAX(programlen, 1));
+	if (pread(fd, programmed, programlen, offset) != programlen)
+		goto err_read;
+	for (gsize i = 0; i < programlen; i++)
+		programmed[i] &= ((const guint8*) data)[i];
+	if (pwrite(fd, programmed, programlen, offset) != programlen)
+		goto err_write;
+	mtdsim_delay(
+			device->programtime * ((programlen + writesize - 1) / writesize));
+
+	if (powercut) {
+		g_message("simulated power cut after %" G_GUINT64_FORMAT
+		" bytes programmed", device->programmed);
+		fsync(fd);
+		_exit(MTDSIM_POWERCUTEXIT);
+	}
+
+	ret = len;
+
+	err_write: //
+	err_read: //
+	g_free(programmed);
+	return ret;
+}
+
+static int mtdsim_close(int fd) {
+	g_mutex_lock(&mtdsim_lock);
+	g_hash_table_remove(mtdsim_fds, GINT_TO_POINTER(fd));
+	g_mutex_unlock(&mtdsim_lock);
+	return close(fd);
+}
+
+static gchar* mtdsim_foroffset(guint64 offset) {
+	gchar* mtd = NULL;
+	g_mutex_lock(&mtdsim_lock);
+	if (mtdsim_devices == NULL)
+		goto out;
+
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, mtdsim_devices);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct mtdsim_device* device = value;
+		if (device->hasoffset && offset >= device->offset
+				&& offset - device->offset < device->info.size) {
+			mtd = g_strdup(device->path);
+			break;
+		}
+	}
+
+	out: //
+	g_mutex_unlock(&mtdsim_lock);
+	return mtd;
+}
+
+const struct mtd_backend mtdsim_backend = { .name = "sim", .handles =
+		mtdsim_handles, .open = mtdsim_open, .ioctl = mtdsim_ioctl, .pread =
+		mtdsim_pread, .pwrite = mtdsim_pwrite, .close = mtdsim_close,
+		.foroffset = mtdsim_foroffset };
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "mtdbackend.h"
+
+#define MTDSIM_CONFIGSUFFIX ".sim"
+#define MTDSIM_GROUP "mtdsim"
+// what the process exits with when a simulated power cut hits
+#define MTDSIM_POWERCUTEXIT 99
@@ -1,37 +1,114 @@
 #define GETTEXT_PACKAGE "gtk20"
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/reboot.h>
 #include <thingymcconfig/client_glib.h>
 #include <thingymcconfig/logging.h>
-#include <teenynet/http.h>
+#include "http.h"
 #include "ota.h"
 #include "args.h"
 #include "jsonparserutils.h"
+#include "jsonbuilderutils.h"
 #include "crypto.h"
 #include "manifest.h"
+#include "manifestbin.h"
+#include "shard.h"
+#include "changes.h"
 #include "utils.h"
 #include "mtd.h"
+#include "pipeline.h"
+#include "journal.h"
+#include "delta.h"
+#include "chunker.h"
+#include "compress.h"
+#include "verify.h"
+#include "state.h"
+#include "schedule.h"
+#include "rollout.h"
+#include "peer.h"
+#include "metrics.h"
 #include "stamp.h"
+#include "bench.h"
+#include "blockdev.h"
 
 static gchar* host;
 static gchar* path;
+static gchar* statedir;
+static gchar* metricsdir = NULL;
+static gchar* codec = "auto";
+static gchar* journalpath;
+static gchar* statepath;
 static struct crypto_keys* keys;
 static struct manifest_manifest* manifest = NULL;
+/*
+ * the envelope the current manifest came in, the manifest exactly as it was
+ * signed and its signatures, for saving in the state
+ */
+static gchar* manifestenvelope = NULL;
+// or the binary one, the manifest's strings and signatures point into it
+static GBytes* manifestbin = NULL;
 static guint currentversion = 0;
+static gchar* deviceid = NULL;
+// uuid of the image that is running
+static gchar* currentuuid = NULL;
+// tags from the stamp and the command line
+static GHashTable* devicetags = NULL;
+// images from the manifest this device could install, newest first
+static GPtrArray* imageindex = NULL;
+// this device's manifest shard if the repo is sharded, relative to path
+static gchar* shardpath = NULL;
+/*
+ * the repo wasn't sharded, or not in a way this device can use, when the
+ * manifest was at this serial so the index isn't looked at again until
+ * the serial changes
+ */
+static gboolean notsharded = FALSE;
+static guint notshardedserial = 0;
+// signed changes entries applied since the manifest was fetched
+static GPtrArray* changesentries = NULL;
 static gint64 manifestfetchedat;
+// validators for the sig.json that goes with the current manifest
+static gchar* manifestetag = NULL;
+static gchar* manifestlastmodified = NULL;
 static struct manifest_image* targetimage = NULL;
+/*
+ * uuid of an image that didn't verify when it was built from a delta,
+ * chunks or a compressed copy, the full image is used for it instead.
+ */
+static gchar* fallbackuuid = NULL;
+// erasing the passive partition that was started when the target was picked
+static struct mtd_eraser* preeraser = NULL;
+/*
+ * how much of the image being downloaded is on flash, only touched in the
+ * main context by ota_reportprogress
+ */
+static gsize progress = 0;
 static gboolean waitingtoreboot = FALSE;
 static gboolean dryrun = FALSE;
 static gboolean force = FALSE;
+static gboolean oneshot = FALSE;
+static gchar* benchrepo = NULL;
+static gboolean discard = FALSE;
+static gboolean compare = FALSE;
+static gboolean peers = FALSE;
+static gchar* peergroup = PEER_GROUP_DEFAULT;
+static gint peerport = PEER_HTTPPORT_DEFAULT;
+static struct peer* peer = NULL;
+// the partition that is shared with peers
+static struct mtd_reader* sharedreader = NULL;
 static gchar** mtds = NULL;
 static guint timeoutsource = 0;
+static struct schedule schedule;
 static ThingyMcConfigClient* client;
 static gboolean connectivitystate = FALSE;
+static gboolean supplicantconnected = FALSE;
+// only set while a check is running on the worker thread
+static GCancellable* checkcancellable = NULL;
 
-static gboolean responsecallback(const struct teenyhttp_response* response,
+static gboolean responsecallback(const struct http_response* response,
 		gpointer user_data) {
 	const gchar* contenttype = user_data;
-	return response->code == 200
+	return response->code == HTTP_STATUS_OK
 			&& (strcmp(contenttype, response->contenttype) == 0);
 }
 
@@ -68,27 +145,126 @@ static GHashTable* munchbootargs() {
 	return table;
 }
 
-static void onendtoendconnectionsuccess() {
-	if (!connectivitystate) {
+static gboolean ota_sendconnectivitystate(gpointer user_data) {
+	if (client != NULL && !connectivitystate) {
 		connectivitystate = TRUE;
 		thingymcconfig_client_sendconnectivitystate(client, connectivitystate);
 	}
+	return G_SOURCE_REMOVE;
 }
 
-static void updatemanifest() {
-	if (targetimage != NULL) {
-		g_message("target image selected, not updating manifest");
-		return;
+// the client belongs to the main context, this is called from the worker
+static void onendtoendconnectionsuccess() {
+	g_main_context_invoke(NULL, ota_sendconnectivitystate, NULL);
+}
+
+struct ota_manifestfetch {
+	guint code;
+	gboolean notmodified;
+	gchar* etag;
+	gchar* lastmodified;
+	const gchar* contenttype;
+	struct manifest_envelope* envelope;
+	GBytes* binary;
+};
+
+static gboolean ota_manifestresponsecallback(
+		const struct http_response* response, gpointer user_data) {
+	struct ota_manifestfetch* fetch = user_data;
+
+	fetch->code = response->code;
+	schedule_setretryafter(&schedule,
+			g_hash_table_lookup(response->headers, "retry-after"));
+	if (response->code == HTTP_STATUS_NOTMODIFIED) {
+		fetch->notmodified = TRUE;
+		return TRUE;
+	}
+
+	if (!responsecallback(response,
+			fetch->contenttype != NULL ?
+					fetch->contenttype : MANIFEST_CONTENTTYPE))
+		return FALSE;
+
+	fetch->etag = g_strdup(g_hash_table_lookup(response->headers, "etag"));
+	fetch->lastmodified = g_strdup(
+			g_hash_table_lookup(response->headers, "last-modified"));
+	return TRUE;
+}
+
+static gboolean ota_fetchmanifestbin(struct ota_manifestfetch* fetch,
+		const gchar** headers, const gchar* file) {
+	gboolean ret = FALSE;
+
+	gchar* binpath = buildpath(path, file, NULL);
+	GByteArray* binbuffer = g_byte_array_new();
+	fetch->contenttype = MANIFESTBIN_CONTENTTYPE;
+	if (!http_get(host, binpath, headers, ota_manifestresponsecallback, fetch,
+			http_datacallback_bytebuffer, binbuffer))
+		goto err_fetch;
+
+	if (!fetch->notmodified) {
+		fetch->binary = g_byte_array_free_to_bytes(binbuffer);
+		binbuffer = NULL;
 	}
 
+	ret = TRUE;
+
+	err_fetch: //
+	g_free(binpath);
+	if (binbuffer != NULL)
+		g_byte_array_free(binbuffer, TRUE);
+	return ret;
+}
+
+static gboolean ota_fetchenvelope(struct ota_manifestfetch* fetch,
+		const gchar** headers) {
+	gboolean ret = FALSE;
+
+	gchar* envelopepath = buildpath(path, OTA_ENVELOPE, NULL);
+	GByteArray* envelopebuffer = g_byte_array_new();
+	if (!http_get(host, envelopepath, headers, ota_manifestresponsecallback,
+			fetch, http_datacallback_bytebuffer, envelopebuffer))
+		goto err_fetch;
+
+	if (!fetch->notmodified) {
+		fetch->envelope = manifest_envelope_deserialise(
+				(gchar*) envelopebuffer->data, envelopebuffer->len);
+		if (fetch->envelope == NULL) {
+			g_message("failed to parse envelope");
+			goto err_parse;
+		}
+	}
+
+	ret = TRUE;
+
+	err_parse: //
+	err_fetch: //
+	g_free(envelopepath);
+	g_byte_array_free(envelopebuffer, TRUE);
+	return ret;
+}
+
+/*
+ * The old layout, sig.json and manifest.json. The signatures change
+ * whenever the manifest does so only sig.json is fetched conditionally.
+ */
+static gboolean ota_fetchmanifestandsig(struct ota_manifestfetch* fetch,
+		const gchar** headers) {
+	gboolean ret = FALSE;
+
 	gchar* sigpath = buildpath(path, OTA_SIG, NULL);
 	GByteArray* sigbuffer = g_byte_array_new();
-	if (!teenyhttp_get(host, sigpath, responsecallback,
-	MANIFEST_CONTENTTYPE, teenyhttp_datacallback_bytebuffer, sigbuffer)) {
+	if (!http_get(host, sigpath, headers, ota_manifestresponsecallback, fetch,
+			http_datacallback_bytebuffer, sigbuffer)) {
 		g_message("failed to fetch sig");
 		goto err_fetchsig;
 	}
 
+	if (fetch->notmodified) {
+		ret = TRUE;
+		goto notmodified;
+	}
+
 	GPtrArray* sigs = manifest_signatures_deserialise((gchar*) sigbuffer->data,
 			sigbuffer->len);
 	if (sigs == NULL) {
@@ -98,72 +274,485 @@ static void updatemanifest() {
 
 	gchar* manifestpath = buildpath(path, OTA_MANIFEST, NULL);
 	GByteArray* manifestbuffer = g_byte_array_new();
-	if (!teenyhttp_get(host, manifestpath, responsecallback,
-	MANIFEST_CONTENTTYPE, teenyhttp_datacallback_bytebuffer, manifestbuffer)) {
+	if (!http_get(host, manifestpath, NULL, responsecallback,
+	MANIFEST_CONTENTTYPE, http_datacallback_bytebuffer, manifestbuffer)) {
 		g_message("failed to fetch manifest");
+		g_byte_array_free(manifestbuffer, TRUE);
+		g_ptr_array_free(sigs, TRUE);
 		goto err_fetchmanifest;
 	}
 
-	struct crypto_checksigcntx chksigcntx = { .what = "manifest", .data =
-			manifestbuffer->data, .len = manifestbuffer->len, .keys = keys,
-			.cont = TRUE };
-	g_ptr_array_foreach(sigs, crypto_checksig, &chksigcntx);
-	if (!chksigcntx.cont) {
-		g_message("manifest sig check failed");
-		goto err_manifestsig;
+	fetch->envelope = g_malloc0(sizeof(*fetch->envelope));
+	fetch->envelope->manifestlen = manifestbuffer->len;
+	fetch->envelope->manifest = (gchar*) g_byte_array_free(manifestbuffer,
+	FALSE);
+	fetch->envelope->signatures = sigs;
+
+	ret = TRUE;
+
+	err_fetchmanifest: //
+	g_free(manifestpath);
+	err_parsesig: //
+	notmodified: //
+	err_fetchsig: //
+	g_free(sigpath);
+	g_byte_array_free(sigbuffer, TRUE);
+	return ret;
+}
+
+static gboolean ota_shardindexresponsecallback(
+		const struct http_response* response, gpointer user_data) {
+	guint* code = user_data;
+	*code = response->code;
+	return responsecallback(response, SHARD_CONTENTTYPE);
+}
+
+static void ota_setnotsharded() {
+	notsharded = TRUE;
+	notshardedserial = manifest != NULL ? manifest->serial : 0;
+}
+
+/*
+ * The index is signed like the manifest is so a bad server can't send a
+ * device to a shard for other hardware. Even if it did the images in it
+ * wouldn't have this device's tags.
+ */
+static void ota_findshard() {
+	gchar* indexpath = buildpath(path, OTA_SHARDINDEX, NULL);
+	GByteArray* indexbuffer = g_byte_array_new();
+	guint code = 0;
+	if (!http_get(host, indexpath, NULL, ota_shardindexresponsecallback,
+			&code, http_datacallback_bytebuffer, indexbuffer)) {
+		if (code == HTTP_STATUS_NOTFOUND) {
+			g_message("repo isn't sharded");
+			ota_setnotsharded();
+		} else
+			g_message("failed to fetch shard index");
+		goto err_fetch;
 	}
 
-	struct manifest_manifest* newmanifest = manifest_deserialise(
-			(gchar*) manifestbuffer->data, manifestbuffer->len);
-	if (newmanifest == NULL) {
-		g_message("failed to parse manifest");
-		goto err_manifestparse;
+	struct manifest_envelope* envelope = manifest_envelope_deserialise(
+			(gchar*) indexbuffer->data, indexbuffer->len);
+	if (envelope == NULL) {
+		g_message("failed to parse shard index");
+		goto err_parse;
 	}
 
-	if (manifest != NULL) {
-		if (newmanifest->serial <= manifest->serial) {
-			g_message(
-					"new manifest is older or the same version as the current one, ignoring");
-			manifest_free(newmanifest);
-			goto out;
-		} else
-			manifest_free(manifest);
+	struct crypto_checksigcntx chksigcntx = { .what = "shard index", .data =
+			(guint8*) envelope->manifest, .len = envelope->manifestlen, .keys =
+			keys, .cont = TRUE };
+	if (!crypto_checksigs(envelope->signatures, &chksigcntx)) {
+		g_message("shard index sig check failed");
+		goto err_sig;
+	}
+
+	struct shard_index* index = shard_index_deserialise(envelope->manifest,
+			envelope->manifestlen);
+	if (index == NULL)
+		goto err_index;
+
+	gchar** tags = (gchar**) g_hash_table_get_keys_as_array(devicetags, NULL);
+	g_free(shardpath);
+	shardpath = shard_index_filename(index, tags);
+	if (shardpath != NULL) {
+		g_message("using manifest shard %s", shardpath);
+		notsharded = FALSE;
+	} else {
+		g_message(
+				"more than one tag for a key the repo is sharded by, using the whole manifest");
+		ota_setnotsharded();
 	}
+	g_free(tags);
+	shard_index_free(index);
+
+	err_index: //
+	err_sig: //
+	manifest_envelope_free(envelope);
+	err_parse: //
+	err_fetch: //
+	g_free(indexpath);
+	g_byte_array_free(indexbuffer, TRUE);
+}
+
+/*
+ * Try the layouts newest first, a 404 means the repo doesn't have that
+ * one. A shard that has gone means the repo was resharded so the index is
+ * looked at again next time.
+ */
+static gboolean ota_fetchmanifest(struct ota_manifestfetch* fetch,
+		const gchar** headers) {
+	if (shardpath != NULL) {
+		if (ota_fetchmanifestbin(fetch, headers, shardpath))
+			return TRUE;
+		if (fetch->code != HTTP_STATUS_NOTFOUND) {
+			g_message("failed to fetch manifest shard");
+			return FALSE;
+		}
+		g_message("manifest shard has gone");
+		g_free(shardpath);
+		shardpath = NULL;
+		memset(fetch, 0, sizeof(*fetch));
+	}
+
+	if (ota_fetchmanifestbin(fetch, headers, OTA_MANIFESTBIN))
+		return TRUE;
+	if (fetch->code != HTTP_STATUS_NOTFOUND) {
+		g_message("failed to fetch binary manifest");
+		return FALSE;
+	}
+	memset(fetch, 0, sizeof(*fetch));
+
+	if (ota_fetchenvelope(fetch, headers))
+		return TRUE;
+	if (fetch->code != HTTP_STATUS_NOTFOUND) {
+		g_message("failed to fetch envelope");
+		return FALSE;
+	}
+	memset(fetch, 0, sizeof(*fetch));
+
+	return ota_fetchmanifestandsig(fetch, headers);
+}
+
+// only the images with tags this device has are indexed
+static void ota_indeximages() {
+	if (imageindex != NULL)
+		g_ptr_array_free(imageindex, TRUE);
+	imageindex = manifest_index(manifest, devicetags);
+	g_message("manifest %u has %u images for this device", manifest->serial,
+			imageindex->len);
+}
+
+static void ota_setmanifest(struct manifest_manifest* newmanifest) {
+	if (imageindex != NULL) {
+		g_ptr_array_free(imageindex, TRUE);
+		imageindex = NULL;
+	}
+	if (manifest != NULL)
+		manifest_free(manifest);
 	manifest = newmanifest;
+	ota_indeximages();
+}
+
+/*
+ * Check a signed changes entry and apply it to the manifest. Entries that
+ * apply are kept so they can be saved with the manifest they were applied
+ * to and checked again when it's restored.
+ */
+static gboolean ota_applyentry(guint serial, const gchar* data, gsize len) {
+	gboolean ret = FALSE;
+
+	struct manifest_envelope* envelope = manifest_envelope_deserialise(data,
+			len);
+	if (envelope == NULL) {
+		g_message("failed to parse changes entry %u", serial);
+		goto err_parse;
+	}
+
+	struct crypto_checksigcntx chksigcntx = { .what = "changes entry", .data =
+			(guint8*) envelope->manifest, .len = envelope->manifestlen, .keys =
+			keys, .cont = TRUE };
+	if (!crypto_checksigs(envelope->signatures, &chksigcntx)) {
+		g_message("changes entry sig check failed");
+		goto err_sig;
+	}
+
+	struct changes_entry* entry = changes_entry_deserialise(
+			envelope->manifest, envelope->manifestlen);
+	if (entry == NULL)
+		goto err_entry;
+
+	// the manifest we have was verified or built from verified entries
+	gchar* manifesthash = changes_manifesthash(manifest);
+	gboolean follows = strcmp(entry->prev, manifesthash) == 0;
+	g_free(manifesthash);
+	if (!follows) {
+		g_message("changes entry %u wasn't made for manifest %u", serial,
+				manifest->serial);
+		goto err_chain;
+	}
+	if (entry->serial != serial || !changes_apply(manifest, entry))
+		goto err_apply;
+
+	g_ptr_array_add(changesentries, g_strndup(data, len));
+	ret = TRUE;
+
+	err_apply: //
+	err_chain: //
+	changes_entry_free(entry);
+	err_entry: //
+	err_sig: //
+	manifest_envelope_free(envelope);
+	err_parse: //
+	return ret;
+}
+
+static gboolean ota_applychange(guint serial) {
+	gboolean ret = FALSE;
+
+	gchar* filename = changes_filename(serial);
+	gchar* entrypath = buildpath(path, filename, NULL);
+	GByteArray* entrybuffer = g_byte_array_new();
+	if (!http_get(host, entrypath, NULL, responsecallback,
+	MANIFEST_CONTENTTYPE, http_datacallback_bytebuffer, entrybuffer)) {
+		g_message("failed to fetch changes entry %u", serial);
+		goto err_fetch;
+	}
+
+	ret = ota_applyentry(serial, (gchar*) entrybuffer->data,
+			entrybuffer->len);
+
+	err_fetch: //
+	g_free(entrypath);
+	g_free(filename);
+	g_byte_array_free(entrybuffer, TRUE);
+	return ret;
+}
+
+/*
+ * Catch up with the repo using its changes journal, steady state that's
+ * the tiny head and an entry or two instead of the whole manifest.
+ * Returns FALSE if the whole manifest has to be fetched instead because
+ * the repo doesn't have a journal, we're too far behind or an entry
+ * doesn't check out.
+ */
+static gboolean ota_catchup() {
+	gboolean ret = FALSE;
+
+	gchar* headpath = buildpath(path, OTA_CHANGES, NULL);
+	GByteArray* headbuffer = g_byte_array_new();
+	if (!http_get(host, headpath, NULL, responsecallback,
+	MANIFEST_CONTENTTYPE, http_datacallback_bytebuffer, headbuffer)) {
+		g_message("repo has no changes journal or it couldn't be fetched");
+		goto err_fetch;
+	}
+
+	struct changes_head head;
+	if (!changes_head_deserialise((gchar*) headbuffer->data, headbuffer->len,
+			&head))
+		goto err_head;
+
+	if (head.serial <= manifest->serial) {
+		g_message("manifest hasn't changed");
+		ret = TRUE;
+		goto uptodate;
+	}
+
+	if (manifest->serial + 1 < head.first) {
+		g_message("manifest %u is too old for the changes journal",
+				manifest->serial);
+		goto err_behind;
+	}
+
+	guint applied = 0;
+	for (guint serial = manifest->serial + 1; serial <= head.serial;
+			serial++) {
+		if (!ota_applychange(serial))
+			break;
+		applied++;
+	}
+	if (applied > 0) {
+		g_message("applied %u changes, manifest is now %u", applied,
+				manifest->serial);
+		ota_indeximages();
+		schedule_setinterval(&schedule, manifest->pollinterval);
+	}
+	if (manifest->serial != head.serial)
+		goto err_apply;
+	ret = TRUE;
+
+	uptodate: //
 	manifestfetchedat = g_get_real_time();
 	onendtoendconnectionsuccess();
+	err_apply: //
+	err_behind: //
+	err_head: //
+	err_fetch: //
+	g_free(headpath);
+	g_byte_array_free(headbuffer, TRUE);
+	return ret;
+}
 
-	out: //
-	err_manifestparse: //
-	err_manifestsig: //
-	err_fetchmanifest: //
-	g_free(manifestpath);
-	g_byte_array_free(manifestbuffer, TRUE);
-	err_parsesig: //
-	err_fetchsig: //
-	g_free(sigpath);
-	g_byte_array_free(sigbuffer, TRUE);
+static struct manifest_manifest* ota_verifyenvelope(
+		struct manifest_envelope* envelope) {
+	struct crypto_checksigcntx chksigcntx = { .what = "manifest", .data =
+			(guint8*) envelope->manifest, .len = envelope->manifestlen, .keys =
+			keys, .cont = TRUE };
+	if (!crypto_checksigs(envelope->signatures, &chksigcntx)) {
+		g_message("manifest sig check failed");
+		return NULL;
+	}
+
+	gint64 parsestart = g_get_monotonic_time();
+	struct manifest_manifest* newmanifest = manifest_deserialise(
+			envelope->manifest, envelope->manifestlen);
+	metrics_observesince(METRICS_MANIFESTPARSE, parsestart);
+	if (newmanifest == NULL)
+		g_message("failed to parse manifest");
+	return newmanifest;
 }
 
-static void ota_image_findcandidate(gpointer data, gpointer user_data) {
-	struct manifest_image* image = data;
-	GPtrArray* candidates = user_data;
-	g_message("checking image %s", image->uuid);
-	if (!image->enabled) {
-		g_message("image isn't enabled");
-		return;
-	} else if (!force && image->version <= currentversion) {
-		g_message("image version %d isn't higher than %d", image->version,
-				currentversion);
-		return;
+/*
+ * Images older than what's running can never be installed so they aren't
+ * even looked at unless we're forced to.
+ */
+static struct manifest_manifest* ota_verifybinary(GBytes* binary) {
+	gsize len;
+	const guint8* data = g_bytes_get_data(binary, &len);
+	const guint8* body;
+	gsize bodylen;
+	GPtrArray* sigs;
+	if (manifestbin_check(data, len, &body, &bodylen, &sigs) == NULL) {
+		g_message("binary manifest is invalid");
+		return NULL;
 	}
-	g_ptr_array_add(candidates, image);
+
+	struct manifest_manifest* newmanifest = NULL;
+	struct crypto_checksigcntx chksigcntx = { .what = "manifest", .data =
+			(guint8*) body, .len = bodylen, .keys = keys, .cont = TRUE };
+	if (!crypto_checksigs(sigs, &chksigcntx)) {
+		g_message("manifest sig check failed");
+		goto err_sig;
+	}
+
+	gint64 parsestart = g_get_monotonic_time();
+	newmanifest = manifestbin_deserialise(binary, force ? 0 : currentversion);
+	metrics_observesince(METRICS_MANIFESTPARSE, parsestart);
+	if (newmanifest == NULL)
+		g_message("failed to parse manifest");
+
+	err_sig: //
+	g_ptr_array_free(sigs, TRUE);
+	return newmanifest;
 }
 
-static gint ota_image_score(gconstpointer a, gconstpointer b) {
-	const struct manifest_image* left = *((struct manifest_image**) a);
-	const struct manifest_image* right = *((struct manifest_image**) b);
-	return left->version - right->version;
+/*
+ * The manifest is fetched conditionally so an unchanged repo costs a
+ * single 304 and there's nothing to verify or parse. Repos without the
+ * binary manifest or that predate the envelope are detected by the 404
+ * and fall back to the older layouts.
+ */
+static gboolean updatemanifest() {
+	gboolean ret = FALSE;
+
+	if (targetimage != NULL) {
+		g_message("target image selected, not updating manifest");
+		return TRUE;
+	}
+
+	gboolean indexchecked = FALSE;
+	if (shardpath == NULL
+			&& (!notsharded || manifest == NULL
+					|| manifest->serial != notshardedserial)) {
+		ota_findshard();
+		indexchecked = TRUE;
+	}
+
+	/*
+	 * The changes journal is for the whole manifest, applying it to a
+	 * shard would bring back everything the shard left out. Every entry
+	 * applied is saved with the manifest so once there are as many as
+	 * the repo keeps a full fetch starts things over.
+	 */
+	gint64 fetchstart = g_get_monotonic_time();
+	if (manifest != NULL && shardpath == NULL
+			&& changesentries->len < CHANGES_KEEP && ota_catchup()) {
+		metrics_observesince(METRICS_MANIFESTFETCH, fetchstart);
+		// the index was looked at before catching up so it's current
+		if (indexchecked && notsharded)
+			notshardedserial = manifest->serial;
+		return TRUE;
+	}
+
+	const gchar* conditionalheaders[3] = { NULL };
+	gchar* ifnonematch = NULL;
+	gchar* ifmodifiedsince = NULL;
+	if (manifest != NULL) {
+		int numheaders = 0;
+		if (manifestetag != NULL) {
+			ifnonematch = g_strdup_printf("If-None-Match: %s", manifestetag);
+			conditionalheaders[numheaders++] = ifnonematch;
+		}
+		if (manifestlastmodified != NULL) {
+			ifmodifiedsince = g_strdup_printf("If-Modified-Since: %s",
+					manifestlastmodified);
+			conditionalheaders[numheaders++] = ifmodifiedsince;
+		}
+	}
+
+	struct ota_manifestfetch fetch = { 0 };
+	if (!ota_fetchmanifest(&fetch, conditionalheaders))
+		goto err_fetch;
+	metrics_observesince(METRICS_MANIFESTFETCH, fetchstart);
+
+	if (fetch.notmodified) {
+		g_message("manifest hasn't changed");
+		manifestfetchedat = g_get_real_time();
+		onendtoendconnectionsuccess();
+		ret = TRUE;
+		goto notmodified;
+	}
+
+	struct manifest_envelope* envelope = fetch.envelope;
+	struct manifest_manifest* newmanifest =
+			fetch.binary != NULL ?
+					ota_verifybinary(fetch.binary) :
+					ota_verifyenvelope(envelope);
+	if (newmanifest == NULL)
+		goto err_manifest;
+
+	/*
+	 * Only remember the validators once the manifest has been verified,
+	 * otherwise a bad or half updated repo would never be fetched again.
+	 */
+	if (manifest != NULL && newmanifest->serial <= manifest->serial) {
+		g_message(
+				"new manifest is older or the same version as the current one, ignoring");
+		manifest_free(newmanifest);
+		goto updatevalidators;
+	}
+	ota_setmanifest(newmanifest);
+	g_ptr_array_set_size(changesentries, 0);
+	// same as for catching up, the index is as new as this manifest
+	if (indexchecked && notsharded)
+		notshardedserial = manifest->serial;
+	g_free(manifestenvelope);
+	manifestenvelope = NULL;
+	if (manifestbin != NULL)
+		g_bytes_unref(manifestbin);
+	manifestbin = NULL;
+	if (fetch.binary != NULL)
+		manifestbin = g_bytes_ref(fetch.binary);
+	else {
+		gsize envelopelen;
+		manifestenvelope = jsonbuilder_freetostring(
+				manifest_envelope_serialise(envelope->manifest,
+						envelope->signatures), &envelopelen, TRUE);
+	}
+	manifestfetchedat = g_get_real_time();
+	schedule_setinterval(&schedule, manifest->pollinterval);
+	onendtoendconnectionsuccess();
+
+	updatevalidators: //
+	g_free(manifestetag);
+	manifestetag = fetch.etag;
+	fetch.etag = NULL;
+	g_free(manifestlastmodified);
+	manifestlastmodified = fetch.lastmodified;
+	fetch.lastmodified = NULL;
+	ret = TRUE;
+
+	err_manifest: //
+	if (envelope != NULL)
+		manifest_envelope_free(envelope);
+	if (fetch.binary != NULL)
+		g_bytes_unref(fetch.binary);
+	notmodified: //
+	err_fetch: //
+	g_free(fetch.etag);
+	g_free(fetch.lastmodified);
+	g_free(ifnonematch);
+	g_free(ifmodifiedsince);
+	return ret;
 }
 
 static void ota_checkimages() {
@@ -172,43 +761,87 @@ static void ota_checkimages() {
 
 	g_message("looking for update..");
 
-	if (manifest->images->len == 0) {
-		g_message("manifest contains no images");
+	if (imageindex->len == 0) {
+		g_message("manifest contains no images for this device");
 		return;
 	}
 
-	GPtrArray* candidates = g_ptr_array_new();
-	g_ptr_array_foreach(manifest->images, ota_image_findcandidate, candidates);
-	if (candidates->len > 0) {
-		g_message("have %d candidates", candidates->len);
-		g_ptr_array_sort(candidates, ota_image_score);
-		targetimage = g_ptr_array_index(candidates, candidates->len - 1);
+	for (guint i = 0; i < imageindex->len; i++) {
+		struct manifest_image* image = g_ptr_array_index(imageindex, i);
+		g_message("checking image %s", image->uuid);
+		// everything after this is older
+		if (!force && image->version <= currentversion) {
+			g_message("image version %d isn't higher than %d", image->version,
+					currentversion);
+			break;
+		} else if (!force
+				&& !rollout_covers(image->rollout, deviceid, image->uuid)) {
+			g_message("image hasn't been rolled out to this device yet");
+			continue;
+		}
+		targetimage = image;
 		g_message("scheduled update to image %s(%u)", targetimage->uuid,
 				targetimage->version);
+		break;
 	}
-	g_ptr_array_free(candidates, TRUE);
 }
 
-static const gchar* ota_findpassive() {
+/*
+ * Work out which partition we booted from using the offset uboot passes in
+ * the bootargs. The result needs to be freed.
+ */
+static gchar* ota_findactive() {
 	GHashTable* bootargs = munchbootargs();
-	gchar* mtd = mtds[0];
+	gchar* activepart = NULL;
 	if (!g_hash_table_contains(bootargs, "part")) {
-		g_message(
-				"failed to find image offset in bootargs, first mtd will be used");
+		g_message("failed to find image offset in bootargs");
 		goto err_nopartkey;
 	}
 
 	gchar* partkey = g_hash_table_lookup(bootargs, "part");
-	guint64 offset = g_ascii_strtoull(partkey, NULL, 16);
-	gchar* activepart = mtd_foroffset(offset);
+	activepart = mtd_forpart(partkey);
 	if (activepart == NULL) {
-		g_message(
-				"failed to find partition for offset %u, first mtd will be used",
-				(unsigned ) offset);
+		g_message("failed to find partition for %s", partkey);
 		goto err_badoffset;
 	}
 	g_message("active partition is %s", activepart);
 
+	err_badoffset: //
+	err_nopartkey: //
+	g_hash_table_unref(bootargs);
+	return activepart;
+}
+
+/*
+ * Benchmarking overwrites the partition it's given so only let it loose on
+ * simulated flash and never on the partition that is running.
+ */
+static gboolean ota_benchable(const gchar* mtd) {
+	if (!mtd_issimulated(mtd)) {
+		g_message("%s isn't simulated flash, refusing to benchmark on it",
+				mtd);
+		return FALSE;
+	}
+
+	gchar* activepart = ota_findactive();
+	gboolean active = activepart != NULL && strcmp(activepart, mtd) == 0;
+	g_free(activepart);
+	if (active) {
+		g_message("%s is the active partition, refusing to benchmark on it",
+				mtd);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static const gchar* ota_findpassive() {
+	gchar* mtd = mtds[0];
+	gchar* activepart = ota_findactive();
+	if (activepart == NULL) {
+		g_message("couldn't find active partition, first mtd will be used");
+		goto err_noactive;
+	}
+
 	gchar* passive = NULL;
 	for (gchar** part = mtds; *part != NULL; part++) {
 		if (strcmp(*part, activepart) != 0) {
@@ -221,81 +854,1250 @@ static const gchar* ota_findpassive() {
 	g_message("selected %s as passive partition", passive);
 	mtd = passive;
 
-	err_nopassive: //
-	err_badoffset: //
-	err_nopartkey: //
-	g_hash_table_unref(bootargs);
+	g_free(activepart);
+	err_noactive: //
 	return mtd;
 }
 
+enum ota_result {
+	OTA_RESULT_OK, OTA_RESULT_FAILED,
+	// the check was cancelled, the next one carries on from here
+	OTA_RESULT_CANCELLED
+};
+
+/*
+ * Work out why something failed, a disconnect cancels the check's requests
+ * and that shouldn't count against the image or the way it was fetched.
+ */
+static enum ota_result ota_result(gboolean ok) {
+	if (ok)
+		return OTA_RESULT_OK;
+	GCancellable* cancellable = g_cancellable_get_current();
+	if (cancellable != NULL && g_cancellable_is_cancelled(cancellable))
+		return OTA_RESULT_CANCELLED;
+	return OTA_RESULT_FAILED;
+}
+
+// only save the journal every so often to avoid wearing out the storage
+#define OTA_JOURNAL_INTERVAL (256 * 1024)
+
+struct ota_download {
+	struct pipeline* pipeline;
+	struct journal journal;
+	gsize lastsaved;
+	// how much of the image has gone into the pipeline
+	gsize offset;
+	// bytes to drop if the server ignored the range request
+	gsize skip;
+};
+
+/*
+ * The target image belongs to the worker thread and can be freed before
+ * this runs so what's needed from it is copied.
+ */
+struct ota_progress {
+	gchar* uuid;
+	gsize size;
+	gsize offset;
+	// where the download started, nothing is logged for it
+	gboolean start;
+};
+
+static gboolean ota_reportprogress(gpointer user_data) {
+	struct ota_progress* report = user_data;
+	unsigned lastpercent = (progress * 100) / report->size;
+	unsigned percent = (report->offset * 100) / report->size;
+	progress = report->offset;
+	if (!report->start
+			&& (percent / 10 != lastpercent / 10
+					|| report->offset == report->size))
+		g_message("%u%% of image %s written", percent, report->uuid);
+	return G_SOURCE_REMOVE;
+}
+
+static void ota_progress_free(gpointer data) {
+	struct ota_progress* report = data;
+	g_free(report->uuid);
+	g_free(report);
+}
+
+static void ota_queueprogress(const struct journal* journal, gsize offset,
+		gboolean start) {
+	struct ota_progress* report = g_malloc0(sizeof(*report));
+	report->uuid = g_strdup(journal->uuid);
+	report->size = journal->size;
+	report->offset = offset;
+	report->start = start;
+	g_main_context_invoke_full(NULL, G_PRIORITY_DEFAULT, ota_reportprogress,
+			report, ota_progress_free);
+}
+
+static void ota_commitcallback(gsize offset,
+		const struct crypto_digests* digests, gpointer user_data) {
+	struct ota_download* download = user_data;
+	// this is called on the flash thread
+	ota_queueprogress(&download->journal, offset, FALSE);
+	download->journal.committed = offset;
+	download->journal.digests = *digests;
+	if (offset - download->lastsaved >= OTA_JOURNAL_INTERVAL
+			|| offset == download->journal.size) {
+		journal_save(journalpath, &download->journal);
+		download->lastsaved = offset;
+	}
+}
+
+static gboolean ota_imageresponsecallback(const struct http_response* response,
+		gpointer user_data) {
+	struct ota_download* download = user_data;
+	switch (response->code) {
+	case HTTP_STATUS_PARTIALCONTENT:
+		return TRUE;
+	case HTTP_STATUS_OK:
+		if (download->offset != 0)
+			g_message("server doesn't support ranges, skipping %"
+			G_GSIZE_FORMAT " bytes", download->offset);
+		download->skip = download->offset;
+		return TRUE;
+	default:
+		g_message("image request failed; %u", response->code);
+		return FALSE;
+	}
+}
+
+/*
+ * Everything that reconstructs the image ends up here, the start of the
+ * image that is already on flash is dropped.
+ */
+static gboolean ota_output(struct ota_download* download, const guint8* data,
+		gsize len) {
+	gsize skip = MIN(download->skip, len);
+	download->skip -= skip;
+	if (len == skip)
+		return TRUE;
+	download->offset += len - skip;
+	return pipeline_push(download->pipeline, data + skip, len - skip);
+}
+
+static gboolean ota_imagedatacallback(guint8* data, gsize len,
+		gpointer user_data) {
+	return ota_output(user_data, data, len);
+}
+
+static gboolean ota_fetchimage(struct ota_download* download,
+		const gchar* from, const gchar* dir) {
+	g_message("streaming image from %s to passive partition...", from);
+	gchar* imagepath = buildpath(dir, targetimage->uuid, NULL);
+	gchar* range = g_strdup_printf("Range: bytes=%" G_GSIZE_FORMAT "-",
+			download->offset);
+	const gchar* headers[] = { range, NULL };
+	gboolean ret = http_get(from, imagepath,
+			download->offset != 0 ? headers : NULL, ota_imageresponsecallback,
+			download, ota_imagedatacallback, download)
+			&& download->offset == download->journal.size;
+	g_free(range);
+	g_free(imagepath);
+	return ret;
+}
+
+/*
+ * Deltas are small next to the images they rebuild so they're held in
+ * memory until they've been verified, nothing from a delta that doesn't
+ * verify ever reaches flash. Anything bigger than this isn't worth it.
+ */
+#define OTA_DELTA_MAXSIZE (8 * 1024 * 1024)
+
+struct ota_deltadownload {
+	GByteArray* delta;
+	gsize size;
+	struct crypto_digests digests;
+};
+
+static gboolean ota_deltaresponsecallback(const struct http_response* response,
+		gpointer user_data) {
+	if (response->code != HTTP_STATUS_OK) {
+		g_message("delta request failed; %u", response->code);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean ota_deltadatacallback(guint8* data, gsize len,
+		gpointer user_data) {
+	struct ota_deltadownload* deltadownload = user_data;
+	if (deltadownload->delta->len + len > deltadownload->size)
+		return FALSE;
+	crypto_digests_update(&deltadownload->digests, data, len);
+	g_byte_array_append(deltadownload->delta, data, len);
+	return TRUE;
+}
+
+static gboolean ota_deltaoutputcallback(const guint8* data, gsize len,
+		gpointer user_data) {
+	return ota_output(user_data, data, len);
+}
+
+// the active partition is read through the bad block map like uboot does
+static gboolean ota_readactive(gsize offset, guint8* data, gsize len,
+		gpointer user_data) {
+	return mtd_reader_read(user_data, offset, data, len);
+}
+
+static gboolean ota_isfallback(struct manifest_image* image) {
+	return fallbackuuid != NULL && strcmp(image->uuid, fallbackuuid) == 0;
+}
+
+static void ota_setfallback(struct manifest_image* image) {
+	g_message("image %s will be fetched whole from now on", image->uuid);
+	g_free(fallbackuuid);
+	fallbackuuid = g_strdup(image->uuid);
+}
+
+static struct manifest_delta* ota_finddelta(struct manifest_image* image) {
+	if (dryrun || ota_isfallback(image))
+		return NULL;
+	for (int i = 0; i < image->deltas->len; i++) {
+		struct manifest_delta* delta = g_ptr_array_index(image->deltas, i);
+		if (delta->from == currentversion && delta->size <= OTA_DELTA_MAXSIZE)
+			return delta;
+	}
+	return NULL;
+}
+
+/*
+ * Rebuild the target image from the active partition and a delta. The
+ * delta is always fetched from the start and verified before it's applied,
+ * the part of the output that is already on flash is skipped.
+ */
+static gboolean ota_fetchdelta(struct ota_download* download,
+		struct manifest_delta* delta) {
+	gboolean ret = FALSE;
+
+	gchar* activemtd = ota_findactive();
+	if (activemtd == NULL) {
+		g_message("can't apply delta without the active partition");
+		goto err_findactive;
+	}
+
+	struct mtd_reader* reader = mtd_reader_open(activemtd);
+	if (reader == NULL)
+		goto err_reader;
+
+	struct ota_deltadownload deltadownload = { .size = delta->size };
+	crypto_digests_init_for(&deltadownload.digests, delta->signatures);
+	deltadownload.delta = g_byte_array_sized_new(delta->size);
+
+	g_message("fetching delta from version %u...", delta->from);
+	gchar* deltafilename = manifest_delta_filename(targetimage, delta);
+	gchar* deltapath = buildpath(path, deltafilename, NULL);
+	if (!http_get(host, deltapath, NULL, ota_deltaresponsecallback, NULL,
+			ota_deltadatacallback, &deltadownload)
+			|| deltadownload.delta->len != delta->size) {
+		g_message("failed to fetch delta");
+		goto err_fetch;
+	}
+
+	struct crypto_checksigcntx cntx = { .what = "delta", .digests =
+			&deltadownload.digests, .keys = keys, .cont = TRUE };
+	if (!crypto_checksigs(delta->signatures, &cntx)) {
+		g_message("delta signature verification failed");
+		ota_setfallback(targetimage);
+		goto err_sig;
+	}
+
+	g_message("applying delta to passive partition...");
+	download->skip = download->offset;
+	struct delta_patcher* patcher = delta_patcher_new(ota_readactive, reader,
+			mtd_reader_size(reader), ota_deltaoutputcallback, download);
+	if (!delta_patcher_push(patcher, deltadownload.delta->data,
+			deltadownload.delta->len) || !delta_patcher_finish(patcher)) {
+		g_message("delta doesn't apply to the active partition");
+		goto err_apply;
+	}
+
+	ret = TRUE;
+
+	err_apply: //
+	delta_patcher_free(patcher);
+	err_sig: //
+	err_fetch: //
+	g_free(deltapath);
+	g_free(deltafilename);
+	g_byte_array_free(deltadownload.delta, TRUE);
+	mtd_reader_close(reader);
+	err_reader: //
+	g_free(activemtd);
+	err_findactive: //
+	return ret;
+}
+
+#define OTA_READBUFFERSZ (64 * 1024)
+
+struct ota_chunkdownload {
+	struct ota_download* download;
+	gsize received;
+};
+
+static gboolean ota_usechunks(struct manifest_image* image) {
+	return !dryrun && !ota_isfallback(image) && image->chunkindex != NULL;
+}
+
+static gboolean ota_okresponsecallback(const struct http_response* response,
+		gpointer user_data) {
+	return response->code == HTTP_STATUS_OK;
+}
+
+static gboolean ota_rangeresponsecallback(const struct http_response* response,
+		gpointer user_data) {
+	// a full response would mean downloading the whole image per run
+	return response->code == HTTP_STATUS_PARTIALCONTENT;
+}
+
+static gboolean ota_chunkdatacallback(guint8* data, gsize len,
+		gpointer user_data) {
+	struct ota_chunkdownload* chunkdownload = user_data;
+	chunkdownload->received += len;
+	return ota_output(chunkdownload->download, data, len);
+}
+
+static GArray* ota_fetchchunkindex() {
+	GArray* chunks = NULL;
+	gchar* indexfilename = manifest_chunkindex_filename(targetimage);
+	gchar* indexpath = buildpath(path, indexfilename, NULL);
+	GByteArray* indexbuffer = g_byte_array_new();
+	if (!http_get(host, indexpath, NULL, ota_okresponsecallback, NULL,
+			http_datacallback_bytebuffer, indexbuffer)
+			|| indexbuffer->len != targetimage->chunkindex->size) {
+		g_message("failed to fetch chunk index");
+		goto err_fetch;
+	}
+
+	struct crypto_checksigcntx cntx = { .what = "chunk index", .data =
+			indexbuffer->data, .len = indexbuffer->len, .keys = keys, .cont =
+	TRUE };
+	if (!crypto_checksigs(targetimage->chunkindex->signatures, &cntx)) {
+		g_message("chunk index signature verification failed");
+		goto err_sig;
+	}
+
+	chunks = chunker_index_deserialise((gchar*) indexbuffer->data,
+			indexbuffer->len);
+
+	err_sig: //
+	err_fetch: //
+	g_byte_array_free(indexbuffer, TRUE);
+	g_free(indexpath);
+	g_free(indexfilename);
+	return chunks;
+}
+
+static void ota_indexactive_addchunk(const struct chunker_chunk* chunk,
+		gpointer user_data) {
+	GHashTable* index = user_data;
+	if (!g_hash_table_contains(index, chunk->sha256)) {
+		struct chunker_chunk* key = g_malloc(sizeof(*key));
+		*key = *chunk;
+		g_hash_table_insert(index, key, NULL);
+	}
+}
+
+static gboolean findbyversion(gconstpointer a, gconstpointer b) {
+	return ((struct manifest_image*) a)->version == GPOINTER_TO_UINT(b);
+}
+
+/*
+ * Chunk the active partition the same way the repo chunked the images.
+ * Only the running image is interesting so if the manifest still lists it
+ * only that much of the partition is read.
+ */
+static GHashTable* ota_indexactive(struct mtd_reader* reader) {
+	gsize len = mtd_reader_size(reader);
+	guint index;
+	if (g_ptr_array_find_with_equal_func(manifest->images,
+			GUINT_TO_POINTER(currentversion), findbyversion, &index)) {
+		struct manifest_image* current = g_ptr_array_index(manifest->images,
+				index);
+		len = MIN(len, current->size);
+	}
+
+	// keys are chunks, the digest is at the start so lookups can use it
+	GHashTable* activeindex = g_hash_table_new_full(chunker_digest_hash,
+			chunker_digest_equal, g_free, NULL);
+	struct chunker* chunker = chunker_new(ota_indexactive_addchunk,
+			activeindex);
+	guint8* buffer = g_malloc(OTA_READBUFFERSZ);
+	for (gsize offset = 0; offset < len;) {
+		gsize want = MIN(OTA_READBUFFERSZ, len - offset);
+		if (!mtd_reader_read(reader, offset, buffer, want))
+			break;
+		chunker_push(chunker, buffer, want);
+		offset += want;
+	}
+	chunker_finish(chunker);
+	chunker_free(chunker);
+	g_free(buffer);
+	return activeindex;
+}
+
+/*
+ * Rebuild the target image from chunks that are already in the active
+ * partition and fetch the rest with range requests on the image.
+ */
+static gboolean ota_fetchchunks(struct ota_download* download) {
+	gboolean ret = FALSE;
+
+	gchar* activemtd = ota_findactive();
+	if (activemtd == NULL) {
+		g_message("can't use chunks without the active partition");
+		goto err_findactive;
+	}
+
+	struct mtd_reader* reader = mtd_reader_open(activemtd);
+	if (reader == NULL)
+		goto err_reader;
+
+	GArray* chunks = ota_fetchchunkindex();
+	if (chunks == NULL)
+		goto err_index;
+
+	struct chunker_chunk* last =
+			chunks->len > 0 ?
+					&g_array_index(chunks, struct chunker_chunk,
+							chunks->len - 1) :
+					NULL;
+	if (last == NULL || last->offset + last->len != targetimage->size) {
+		g_message("chunk index doesn't cover the image");
+		goto err_coverage;
+	}
+
+	GHashTable* activeindex = ota_indexactive(reader);
+	guint8* buffer = g_malloc(OTA_READBUFFERSZ);
+	gchar* imagepath = buildpath(path, targetimage->uuid, NULL);
+
+	g_message("building image from chunks...");
+	download->skip = download->offset;
+	guint copied = 0, fetched = 0;
+	for (guint i = 0; i < chunks->len; i++) {
+		struct chunker_chunk* chunk = &g_array_index(chunks,
+				struct chunker_chunk, i);
+
+		// already on flash
+		if (chunk->offset + chunk->len <= download->offset) {
+			download->skip -= chunk->len;
+			continue;
+		}
+
+		gpointer localkey;
+		if (g_hash_table_lookup_extended(activeindex, chunk->sha256, &localkey,
+		NULL)) {
+			struct chunker_chunk* local = localkey;
+			if (!mtd_reader_read(reader, local->offset, buffer, local->len)
+					|| !ota_output(download, buffer, local->len))
+				goto err_copy;
+			copied++;
+			continue;
+		}
+
+		// fetch this and any following missing chunks in one request
+		guint run = i;
+		while (run + 1 < chunks->len
+				&& !g_hash_table_contains(activeindex,
+						g_array_index(chunks, struct chunker_chunk, run + 1).sha256))
+			run++;
+		struct chunker_chunk* runend = &g_array_index(chunks,
+				struct chunker_chunk, run);
+		gsize runlen = (runend->offset + runend->len) - chunk->offset;
+
+		gchar* range = g_strdup_printf(
+				"Range: bytes=%" G_GSIZE_FORMAT "-%" G_GSIZE_FORMAT,
+				chunk->offset, (chunk->offset + runlen) - 1);
+		const gchar* headers[] = { range, NULL };
+		struct ota_chunkdownload chunkdownload = { .download = download };
+		gboolean ok = http_get(host, imagepath, headers,
+				ota_rangeresponsecallback, NULL, ota_chunkdatacallback,
+				&chunkdownload) && chunkdownload.received == runlen;
+		g_free(range);
+		if (!ok) {
+			g_message("failed to fetch chunks %u to %u", i, run);
+			goto err_fetch;
+		}
+		fetched += (run - i) + 1;
+		i = run;
+	}
+
+	g_message("%u chunks copied from the active partition, %u fetched",
+			copied, fetched);
+	ret = TRUE;
+
+	err_fetch: //
+	err_copy: //
+	g_free(imagepath);
+	g_free(buffer);
+	g_hash_table_unref(activeindex);
+	err_coverage: //
+	g_array_free(chunks, TRUE);
+	err_index: //
+	mtd_reader_close(reader);
+	err_reader: //
+	g_free(activemtd);
+	err_findactive: //
+	return ret;
+}
+
+struct ota_peerdownload {
+	struct ota_download* download;
+	GArray* chunks;
+	// the chunk being received and what has arrived of it so far
+	guint chunk;
+	GByteArray* buffer;
+	gboolean bad;
+};
+
+static gboolean ota_peerdatacallback(guint8* data, gsize len,
+		gpointer user_data) {
+	struct ota_peerdownload* peerdownload = user_data;
+	while (len > 0) {
+		if (peerdownload->chunk == peerdownload->chunks->len)
+			return FALSE;
+		struct chunker_chunk* chunk = &g_array_index(peerdownload->chunks,
+				struct chunker_chunk, peerdownload->chunk);
+		gsize want = MIN(len, chunk->len - peerdownload->buffer->len);
+		g_byte_array_append(peerdownload->buffer, data, want);
+		data += want;
+		len -= want;
+		if (peerdownload->buffer->len < chunk->len)
+			break;
+
+		guint8 digest[SHA256_DIGEST_SIZE];
+		struct sha256_ctx sha256;
+		sha256_init(&sha256);
+		sha256_update(&sha256, peerdownload->buffer->len,
+				peerdownload->buffer->data);
+		sha256_digest(&sha256, sizeof(digest), digest);
+		if (memcmp(digest, chunk->sha256, sizeof(digest)) != 0) {
+			g_message("chunk at %" G_GSIZE_FORMAT " from peer is bad",
+					chunk->offset);
+			peerdownload->bad = TRUE;
+			return FALSE;
+		}
+		if (!ota_output(peerdownload->download, peerdownload->buffer->data,
+				peerdownload->buffer->len))
+			return FALSE;
+		g_byte_array_set_size(peerdownload->buffer, 0);
+		peerdownload->chunk++;
+	}
+	return TRUE;
+}
+
+/*
+ * Fetch the image from a peer checking each chunk against the signed
+ * chunk index before it goes anywhere near flash, a peer that sends
+ * something bad is dropped straight away and the repo picks up from the
+ * last good chunk. Images without a chunk index are streamed as they are
+ * and only the signature check on the whole image catches a bad peer.
+ */
+static gboolean ota_fetchpeer(struct ota_download* download,
+		const gchar* address) {
+	if (targetimage->chunkindex == NULL)
+		return ota_fetchimage(download, address, "");
+
+	gboolean ret = FALSE;
+
+	GArray* chunks = ota_fetchchunkindex();
+	if (chunks == NULL)
+		goto err_index;
+
+	// start from the chunk that the part already on flash ends in
+	guint first = 0;
+	while (first < chunks->len
+			&& g_array_index(chunks, struct chunker_chunk, first).offset
+					+ g_array_index(chunks, struct chunker_chunk, first).len
+					<= download->offset)
+		first++;
+	if (first == chunks->len) {
+		g_message("chunk index doesn't cover the image");
+		goto err_coverage;
+	}
+	gsize start = g_array_index(chunks, struct chunker_chunk, first).offset;
+
+	g_message("streaming image from %s to passive partition...", address);
+	struct ota_peerdownload peerdownload = { .download = download, .chunks =
+			chunks, .chunk = first, .buffer = g_byte_array_new() };
+	download->skip = download->offset - start;
+	gchar* imagepath = buildpath("", targetimage->uuid, NULL);
+	gchar* range = g_strdup_printf("Range: bytes=%" G_GSIZE_FORMAT "-", start);
+	const gchar* headers[] = { range, NULL };
+	ret = http_get(address, imagepath, headers, ota_rangeresponsecallback,
+	NULL, ota_peerdatacallback, &peerdownload)
+			&& download->offset == download->journal.size;
+	if (peerdownload.bad)
+		peer_ban(peer, address);
+	g_free(range);
+	g_free(imagepath);
+	g_byte_array_free(peerdownload.buffer, TRUE);
+
+	err_coverage: //
+	g_array_free(chunks, TRUE);
+	err_index: //
+	return ret;
+}
+
+struct ota_compresseddownload {
+	struct compress_decompressor* decompressor;
+	struct crypto_digests digests;
+	gsize received;
+};
+
+static gboolean ota_compresseddatacallback(guint8* data, gsize len,
+		gpointer user_data) {
+	struct ota_compresseddownload* compresseddownload = user_data;
+	crypto_digests_update(&compresseddownload->digests, data, len);
+	compresseddownload->received += len;
+	return compress_decompressor_push(compresseddownload->decompressor, data,
+			len);
+}
+
+static gboolean ota_decompressedcallback(const guint8* data, gsize len,
+		gpointer user_data) {
+	return ota_output(user_data, data, len);
+}
+
+/*
+ * lz4 decompresses several times faster than zstd so it's preferred on
+ * single core parts where decompression competes with everything else,
+ * zstd is smaller so it wins when there are cores to spare.
+ */
+static struct manifest_compressed* ota_findcompressed(
+		struct manifest_image* image) {
+	enum manifest_compression preference[2];
+	int numpreferences = 0;
+
+	if (ota_isfallback(image) || strcmp(codec, "none") == 0)
+		return NULL;
+	else if (strcmp(codec, OTA_COMPRESSION_ZSTD_NAME) == 0)
+		preference[numpreferences++] = OTA_COMPRESSION_ZSTD;
+	else if (strcmp(codec, OTA_COMPRESSION_LZ4_NAME) == 0)
+		preference[numpreferences++] = OTA_COMPRESSION_LZ4;
+	else if (g_get_num_processors() == 1) {
+		preference[numpreferences++] = OTA_COMPRESSION_LZ4;
+		preference[numpreferences++] = OTA_COMPRESSION_ZSTD;
+	} else {
+		preference[numpreferences++] = OTA_COMPRESSION_ZSTD;
+		preference[numpreferences++] = OTA_COMPRESSION_LZ4;
+	}
+
+	for (int p = 0; p < numpreferences; p++) {
+		if (!compress_supported(preference[p]))
+			continue;
+		for (int i = 0; i < image->compressed->len; i++) {
+			struct manifest_compressed* compressed = g_ptr_array_index(
+					image->compressed, i);
+			if (compressed->algorithm == preference[p])
+				return compressed;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Fetch a compressed copy of the image and decompress it on the way to
+ * flash. Like deltas the whole thing is fetched again on resume.
+ */
+static gboolean ota_fetchcompressed(struct ota_download* download,
+		struct manifest_compressed* compressed) {
+	gboolean ret = FALSE;
+
+	struct ota_compresseddownload compresseddownload = { 0 };
+	crypto_digests_init_for(&compresseddownload.digests,
+			compressed->signatures);
+	compresseddownload.decompressor = compress_decompressor_new(
+			compressed->algorithm, ota_decompressedcallback, download);
+	if (compresseddownload.decompressor == NULL)
+		goto err_decompressor;
+
+	download->skip = download->offset;
+
+	g_message("streaming %s compressed image to passive partition...",
+			manifest_compressionstrings[compressed->algorithm]);
+	gchar* compressedfilename = manifest_compressed_filename(targetimage,
+			compressed);
+	gchar* compressedpath = buildpath(path, compressedfilename, NULL);
+	if (!http_get(host, compressedpath, NULL, ota_okresponsecallback, NULL,
+			ota_compresseddatacallback, &compresseddownload)) {
+		g_message("failed to fetch compressed image");
+		goto err_fetch;
+	}
+
+	if (compresseddownload.received != compressed->size
+			|| !compress_decompressor_finish(
+					compresseddownload.decompressor)) {
+		g_message("compressed image is incomplete");
+		goto err_incomplete;
+	}
+
+	struct crypto_checksigcntx cntx = { .what = "compressed image", .digests =
+			&compresseddownload.digests, .keys = keys, .cont = TRUE };
+	if (!crypto_checksigs(compressed->signatures, &cntx)) {
+		g_message("compressed image signature verification failed");
+		ota_setfallback(targetimage);
+		goto err_sig;
+	}
+
+	ret = TRUE;
+
+	err_sig: //
+	err_incomplete: //
+	err_fetch: //
+	g_free(compressedpath);
+	g_free(compressedfilename);
+	compress_decompressor_free(compresseddownload.decompressor);
+	err_decompressor: //
+	return ret;
+}
+
+/*
+ * Pick up where a previous attempt at the same image on the same partition
+ * left off.
+ */
+static void ota_resume(struct ota_download* download, const gchar* mtd) {
+	if (!mtd_canresume(mtd)) {
+		g_message("%s can only be written in one go, starting over", mtd);
+		return;
+	}
+
+	struct journal* journal = journal_load(journalpath);
+	if (journal == NULL)
+		return;
+
+	if (strcmp(journal->uuid, download->journal.uuid) == 0
+			&& strcmp(journal->mtd, mtd) == 0
+			&& journal->size == download->journal.size
+			&& journal->digests.which == download->journal.digests.which
+			&& (journal->committed % pipeline_chunksize(mtd) == 0
+					|| journal->committed == journal->size)) {
+		g_message("resuming image %s from %" G_GSIZE_FORMAT " bytes",
+				journal->uuid, journal->committed);
+		download->journal.committed = journal->committed;
+		download->journal.digests = journal->digests;
+		download->lastsaved = journal->committed;
+		metrics_add(METRICS_RETRIES, 1);
+	} else
+		g_message("journal is for a different image, starting over");
+
+	journal_free(journal);
+}
+
+/*
+ * Erasing is the slowest part of writing to NOR so when there's a target
+ * but the download has to wait for the next check start erasing the part
+ * of the passive partition the image will be written to. In compare mode
+ * only blocks that differ from the image are erased and that can't be
+ * known until it arrives, the writer erases ahead of itself instead.
+ */
+static void ota_preerase() {
+	if (dryrun || compare || oneshot || targetimage == NULL
+			|| preeraser != NULL)
+		return;
+
+	const gchar* mtd = ota_findpassive();
+	struct ota_download download = { 0 };
+	download.journal.uuid = (gchar*) targetimage->uuid;
+	download.journal.mtd = (gchar*) mtd;
+	download.journal.size = targetimage->size;
+	crypto_digests_init_for(&download.journal.digests,
+			targetimage->signatures);
+	ota_resume(&download, mtd);
+
+	g_message("erasing passive partition from %" G_GSIZE_FORMAT " bytes",
+			download.journal.committed);
+	preeraser = mtd_eraser_new(mtd, download.journal.committed,
+			targetimage->size);
+}
+
+/*
+ * Record which physical erase block each block of the image ended up in.
+ * uboot's nand read skips bad blocks in the same way so this is only
+ * needed by scripts that read the partition some other way. How long each
+ * block took to read back is kept with it, blocks that are getting slow
+ * are usually on their way out.
+ */
+static void ota_saveblockmap(const gchar* mtd, const GArray* blockmap,
+		const GArray* timings) {
+	JsonBuilder* builder = json_builder_new();
+	json_builder_begin_object(builder);
+	JSONBUILDER_ADD_STRING(builder, OTA_BLOCKMAP_JSONFIELD_UUID,
+			targetimage->uuid);
+	JSONBUILDER_ADD_STRING(builder, OTA_BLOCKMAP_JSONFIELD_MTD, mtd);
+	JSONBUILDER_ADD_INT(builder, OTA_BLOCKMAP_JSONFIELD_ERASESIZE,
+			mtd_erasesize(mtd));
+	JSONBUILDER_START_ARRAY(builder, OTA_BLOCKMAP_JSONFIELD_BLOCKS);
+	for (int i = 0; i < blockmap->len; i++)
+		json_builder_add_int_value(builder,
+				g_array_index(blockmap, guint32, i));
+	json_builder_end_array(builder);
+	JSONBUILDER_START_ARRAY(builder, OTA_BLOCKMAP_JSONFIELD_VERIFYTIMES);
+	for (int i = 0; i < timings->len; i++)
+		json_builder_add_int_value(builder,
+				g_array_index(timings, guint64, i));
+	json_builder_end_array(builder);
+	json_builder_end_object(builder);
+
+	gchar* blockmappath = buildpath(statedir, OTA_BLOCKMAPFILE, NULL);
+	jsonbuilder_writetofile(builder, TRUE, blockmappath);
+	g_free(blockmappath);
+}
+
+struct ota_blockfetch {
+	guint8* data;
+	gsize len;
+	gsize received;
+};
+
+static gboolean ota_blockfetchdatacallback(guint8* data, gsize len,
+		gpointer user_data) {
+	struct ota_blockfetch* blockfetch = user_data;
+	if (blockfetch->received + len > blockfetch->len)
+		return FALSE;
+	memcpy(blockfetch->data + blockfetch->received, data, len);
+	blockfetch->received += len;
+	return TRUE;
+}
+
+static gboolean ota_refetchblock(gsize offset, guint8* data, gsize len,
+		gpointer user_data) {
+	metrics_add(METRICS_RETRIES, 1);
+	struct ota_blockfetch blockfetch = { .data = data, .len = len };
+	gchar* imagepath = buildpath(path, targetimage->uuid, NULL);
+	gchar* range = g_strdup_printf(
+			"Range: bytes=%" G_GSIZE_FORMAT "-%" G_GSIZE_FORMAT, offset,
+			offset + len - 1);
+	const gchar* headers[] = { range, NULL };
+	gboolean ret = http_get(host, imagepath, headers,
+			ota_rangeresponsecallback, NULL, ota_blockfetchdatacallback,
+			&blockfetch) && blockfetch.received == len;
+	g_free(range);
+	g_free(imagepath);
+	return ret;
+}
+
+/*
+ * Read the image back from the passive partition, fix up any blocks that
+ * didn't program properly and check the signatures against what's really
+ * on flash before it's allowed to boot.
+ */
+static enum ota_result ota_verify(struct ota_download* download,
+		const gchar* mtd, struct verify_result* result) {
+	g_message("verifying passive partition...");
+	if (!verify_image(mtd, download->pipeline, targetimage->size,
+			targetimage->signatures, ota_refetchblock, NULL, result)) {
+		g_message("failed to read back image");
+		return ota_result(FALSE);
+	}
+
+	guint64 total = 0, slowest = 0;
+	guint slowestblock = 0;
+	for (guint i = 0; i < result->timings->len; i++) {
+		guint64 took = g_array_index(result->timings, guint64, i);
+		total += took;
+		if (took > slowest) {
+			slowest = took;
+			slowestblock = i;
+		}
+	}
+	g_message("read back %u blocks in %" G_GUINT64_FORMAT "us,"
+	" slowest was block %u at %" G_GUINT64_FORMAT "us, %u repaired",
+			result->timings->len, total, slowestblock, slowest,
+			result->repaired);
+
+	struct crypto_checksigcntx cntx = { .what = "image on flash", .digests =
+			&result->digests, .keys = keys, .cont = TRUE };
+	if (!crypto_checksigs(targetimage->signatures, &cntx)) {
+		g_message("image on flash failed signature verification");
+		return OTA_RESULT_FAILED;
+	}
+
+	return OTA_RESULT_OK;
+}
+
 static void ota_tryupdate() {
 	if (targetimage == NULL)
 		return;
 
-	gchar* imagepath = buildpath(path, targetimage->uuid, NULL);
-	GByteArray* imagebuffer = g_byte_array_new();
-	teenyhttp_get_simple(host, imagepath, teenyhttp_datacallback_bytebuffer,
-			imagebuffer);
+	const gchar* mtd = dryrun ? NULL : ota_findpassive();
 
-	if (imagebuffer->len != targetimage->size) {
-		g_message(
-				"downloaded image size doesn't match manifest %u vs %" G_GSIZE_FORMAT,
-				imagebuffer->len, targetimage->size);
-		goto err_imagelen;
+	struct ota_download download = { 0 };
+	download.journal.uuid = (gchar*) targetimage->uuid;
+	download.journal.mtd = (gchar*) mtd;
+	download.journal.size = targetimage->size;
+	crypto_digests_init_for(&download.journal.digests,
+			targetimage->signatures);
+	if (mtd != NULL)
+		ota_resume(&download, mtd);
+
+	ota_queueprogress(&download.journal, download.journal.committed, TRUE);
+	download.offset = download.journal.committed;
+	gsize progressstart = download.offset;
+	download.pipeline = pipeline_new(mtd, targetimage->size,
+			download.journal.committed, &download.journal.digests, preeraser,
+			mtd != NULL ? ota_commitcallback : NULL, &download);
+	preeraser = NULL;
+	if (download.pipeline == NULL) {
+		g_message("failed to set up image pipeline");
+		return;
 	}
 
-	struct crypto_checksigcntx cntx = { .what = "image", .data =
-			imagebuffer->data, .len = imagebuffer->len, .keys = keys, .cont =
-	TRUE };
-	g_ptr_array_foreach(targetimage->signatures, crypto_checksig, &cntx);
-	if (!cntx.cont) {
+	/*
+	 * Peers are on the same network so fetch the whole image from one if
+	 * possible. Whatever a peer didn't manage to send comes from the repo.
+	 */
+	gint64 downloadstart = g_get_monotonic_time();
+	gchar* peeraddress = NULL;
+	if (peer != NULL && download.offset < download.journal.size)
+		peeraddress = peer_find(peer, targetimage->uuid);
+	enum ota_result result = OTA_RESULT_FAILED;
+	/*
+	 * With a chunk index what the peer sent was checked chunk by chunk as
+	 * it arrived, otherwise the peer is only to blame for the whole image
+	 * failing its signature check if every byte of it came from the peer.
+	 */
+	gboolean blamepeer = FALSE;
+	if (peeraddress != NULL) {
+		gsize peerstart = download.offset;
+		result = ota_result(ota_fetchpeer(&download, peeraddress));
+		blamepeer = result == OTA_RESULT_OK && peerstart == 0
+				&& targetimage->chunkindex == NULL;
+		if (result == OTA_RESULT_FAILED) {
+			metrics_add(METRICS_RETRIES, 1);
+			g_message("fetching from peer %s failed at %" G_GSIZE_FORMAT
+			" bytes, using %s", peeraddress, download.offset, host);
+		}
+	}
+
+	/*
+	 * Each way of getting the image picks up from wherever the one before
+	 * it got to so if something goes wrong part way through the next one
+	 * carries on from there.
+	 */
+	gboolean derived = FALSE;
+	if (download.offset < download.journal.size) {
+		struct manifest_delta* delta = ota_finddelta(targetimage);
+		struct manifest_compressed* compressed = ota_findcompressed(
+				targetimage);
+		if (result == OTA_RESULT_FAILED && delta != NULL) {
+			derived = TRUE;
+			result = ota_result(ota_fetchdelta(&download, delta));
+			if (result == OTA_RESULT_FAILED)
+				g_message("delta update failed");
+		}
+		if (result == OTA_RESULT_FAILED && ota_usechunks(targetimage)) {
+			derived = TRUE;
+			result = ota_result(ota_fetchchunks(&download));
+			if (result == OTA_RESULT_FAILED)
+				g_message("chunked update failed");
+		}
+		if (result == OTA_RESULT_FAILED && compressed != NULL) {
+			derived = TRUE;
+			result = ota_result(ota_fetchcompressed(&download, compressed));
+			if (result == OTA_RESULT_FAILED)
+				g_message("compressed update failed");
+		}
+		if (result == OTA_RESULT_FAILED)
+			ota_fetchimage(&download, host, path);
+	}
+
+	switch (pipeline_finish(download.pipeline)) {
+	case PIPELINE_OK: {
+		guint64 took = g_get_monotonic_time() - downloadstart;
+		metrics_observe(METRICS_DOWNLOAD, took);
+		if (took > 0)
+			metrics_set(METRICS_DOWNLOADRATE,
+					((download.offset - progressstart) * G_USEC_PER_SEC)
+							/ took);
+		break;
+	}
+	case PIPELINE_INCOMPLETE:
+		g_message("image download incomplete, will resume");
+		goto err_incomplete;
+	default:
+		g_message("failed to download and install image");
+		goto err_pipeline;
+	}
+
+	struct crypto_checksigcntx cntx = { .what = "image", .digests =
+			pipeline_digests(download.pipeline), .keys = keys, .cont = TRUE };
+	if (!crypto_checksigs(targetimage->signatures, &cntx)) {
 		g_message("image signature verification failed");
+		if (blamepeer)
+			peer_ban(peer, peeraddress);
+		if (derived)
+			ota_setfallback(targetimage);
 		goto err_imagesig;
 	}
 
 	if (!dryrun) {
-		const gchar* mtd = ota_findpassive();
-		g_message("erasing passive partition...");
-		if (!mtd_erase(mtd))
-			goto err_mtderase;
-
-		g_message("installing image...");
-		if (!mtd_writeimage(mtd, imagebuffer->data, imagebuffer->len))
-			goto err_mtdwrite;
-
+		struct verify_result verifyresult = { 0 };
+		switch (ota_verify(&download, mtd, &verifyresult)) {
+		case OTA_RESULT_OK:
+			break;
+		case OTA_RESULT_CANCELLED:
+			// everything is on flash, the next check verifies it again
+			g_message("verification was cancelled, will resume");
+			verify_result_clear(&verifyresult);
+			goto err_incomplete;
+		default:
+			verify_result_clear(&verifyresult);
+			goto err_verify;
+		}
+		ota_saveblockmap(mtd, pipeline_blockmap(download.pipeline),
+				verifyresult.timings);
+		verify_result_clear(&verifyresult);
+		journal_clear(journalpath);
+		metrics_add(METRICS_UPDATES, 1);
+		metrics_write(metricsdir);
 		g_message("scheduling reboot...");
 		waitingtoreboot = TRUE;
 		reboot(RB_AUTOBOOT);
 	}
 
-	err_mtdwrite: //
-	err_mtderase: //
-	err_imagelen: //
+	goto out;
+
+	err_verify: //
 	err_imagesig: //
-	g_byte_array_free(imagebuffer, TRUE);
+	err_pipeline: //
+	// don't leave anything bootable behind that hasn't been verified
+	if (mtd != NULL) {
+		journal_clear(journalpath);
+		mtd_invalidate(mtd);
+	}
+	out: //
+	err_incomplete: //
+	g_free(peeraddress);
+	pipeline_free(download.pipeline);
+	// still the target so make a start on the rest before the next check
+	if (!waitingtoreboot)
+		ota_preerase();
 }
 
-static gboolean timeout(gpointer user_data) {
-	updatemanifest();
+/*
+ * The manifest is saved with its signatures and verified again like the
+ * changes entries applied since are, otherwise anything that could write
+ * the state could pick the target. For the binary manifest that's a
+ * single signature check. The manifest the entries produced is never
+ * saved.
+ */
+static void ota_restorestate() {
+	struct state* state = state_load(statepath);
+	if (state == NULL)
+		return;
+
+	struct manifest_manifest* savedmanifest;
+	if (state->manifestbin != NULL) {
+		gsize binlen;
+		guchar* bin = g_base64_decode(state->manifestbin, &binlen);
+		GBytes* binary = g_bytes_new_take(bin, binlen);
+		savedmanifest = ota_verifybinary(binary);
+		if (savedmanifest != NULL)
+			manifestbin = binary;
+		else
+			g_bytes_unref(binary);
+	} else {
+		struct manifest_envelope* envelope = manifest_envelope_deserialise(
+				state->envelope, strlen(state->envelope));
+		savedmanifest = envelope != NULL ? ota_verifyenvelope(envelope) : NULL;
+		if (savedmanifest != NULL) {
+			manifestenvelope = state->envelope;
+			state->envelope = NULL;
+		}
+		if (envelope != NULL)
+			manifest_envelope_free(envelope);
+	}
+	if (savedmanifest == NULL) {
+		g_message("saved manifest is corrupt or isn't signed, ignoring state");
+		goto err_manifest;
+	}
+
+	ota_setmanifest(savedmanifest);
+	if (state->changes != NULL) {
+		for (guint i = 0; i < state->changes->len; i++) {
+			const gchar* entry = g_ptr_array_index(state->changes, i);
+			if (!ota_applyentry(manifest->serial + 1, entry, strlen(entry))) {
+				g_message("saved changes entry doesn't apply, dropping it"
+						" and any after it");
+				break;
+			}
+		}
+		ota_indeximages();
+	}
+	manifestfetchedat = state->fetchedat;
+	manifestetag = state->etag;
+	state->etag = NULL;
+	manifestlastmodified = state->lastmodified;
+	state->lastmodified = NULL;
+	schedule_setinterval(&schedule, manifest->pollinterval);
+	g_message("restored manifest %u", manifest->serial);
+
+	if (state->target != NULL) {
+		for (int i = 0; i < manifest->images->len; i++) {
+			struct manifest_image* image = g_ptr_array_index(manifest->images,
+					i);
+			// the target might have been installed since it was saved
+			if (strcmp(image->uuid, state->target) == 0
+					&& image->version > currentversion) {
+				targetimage = image;
+				g_message("restored target image %s(%u)", targetimage->uuid,
+						targetimage->version);
+				// nothing will be downloaded until there's a connection
+				ota_preerase();
+				break;
+			}
+		}
+	}
+
+	err_manifest: //
+	state_free(state);
+}
+
+static void ota_savestate() {
+	if (manifestenvelope == NULL && manifestbin == NULL)
+		return;
+
+	gchar* encodedbin = NULL;
+	if (manifestbin != NULL) {
+		gsize binlen;
+		const guint8* bin = g_bytes_get_data(manifestbin, &binlen);
+		encodedbin = g_base64_encode(bin, binlen);
+	}
+
+	struct state state = { .envelope = manifestenvelope, .manifestbin =
+			encodedbin,
+			.fetchedat = manifestfetchedat, .etag = manifestetag,
+			.lastmodified = manifestlastmodified, .target =
+					targetimage != NULL ? (gchar*) targetimage->uuid : NULL,
+			.changes = changesentries };
+	if (!state_save(statepath, &state))
+		g_message("failed to save state");
+	g_free(encodedbin);
+}
+
+/*
+ * Share the running image with peers. The manifest says how big it is so
+ * it's only shared while the manifest lists it. The partition is read
+ * past bad blocks like the delta and chunk code does.
+ */
+static void ota_share() {
+	if (peer == NULL || sharedreader == NULL || manifest == NULL)
+		return;
+
+	struct manifest_image* current = NULL;
+	for (int i = 0; i < manifest->images->len; i++) {
+		struct manifest_image* image = g_ptr_array_index(manifest->images, i);
+		if (strcmp(image->uuid, currentuuid) == 0) {
+			current = image;
+			break;
+		}
+	}
+
+	if (current != NULL && current->size <= mtd_reader_size(sharedreader))
+		peer_share(peer, current->uuid, current->size, ota_readactive,
+				sharedreader);
+	else
+		peer_share(peer, NULL, 0, NULL, NULL);
+}
+
+static void ota_schedulecheck(guint delay);
+
+// a whole check, fetching and installing an update can take minutes
+static gboolean ota_check() {
+	gboolean checked = updatemanifest();
+	ota_share();
 	ota_checkimages();
+	ota_savestate();
 	ota_tryupdate();
-	return waitingtoreboot ? G_SOURCE_REMOVE : G_SOURCE_CONTINUE;
+
+	metrics_add(METRICS_CHECKS, 1);
+	if (!checked)
+		metrics_add(METRICS_CHECKSFAILED, 1);
+	metrics_write(metricsdir);
+	return checked;
+}
+
+static void ota_check_thread(GTask* task, gpointer source_object,
+		gpointer task_data, GCancellable* cancellable) {
+	g_cancellable_push_current(cancellable);
+	gboolean checked = ota_check();
+	g_cancellable_pop_current(cancellable);
+	g_task_return_boolean(task, checked);
+}
+
+static void ota_check_done(GObject* source_object, GAsyncResult* res,
+		gpointer user_data) {
+	gboolean checked = g_task_propagate_boolean(G_TASK(res), NULL);
+	if (g_cancellable_is_cancelled(checkcancellable))
+		g_message("check was cancelled");
+	g_clear_object(&checkcancellable);
+
+	/*
+	 * If the network came back while a cancelled check was finishing up
+	 * the check it scheduled was skipped so schedule another one.
+	 */
+	if (supplicantconnected && !waitingtoreboot && timeoutsource == 0)
+		ota_schedulecheck(schedule_next(&schedule, checked));
+}
+
+/*
+ * Everything the agent does with the network and flash happens on a worker
+ * thread so the main loop is free to deal with thingymcconfig while an
+ * update is downloading. Disconnecting cancels the worker's requests.
+ */
+static gboolean timeout(gpointer user_data) {
+	timeoutsource = 0;
+	if (checkcancellable != NULL) {
+		g_message("previous check is still running");
+		return G_SOURCE_REMOVE;
+	}
+
+	checkcancellable = g_cancellable_new();
+	GTask* task = g_task_new(NULL, checkcancellable, ota_check_done, NULL);
+	g_task_run_in_thread(task, ota_check_thread);
+	g_object_unref(task);
+	return G_SOURCE_REMOVE;
+}
+
+static void ota_schedulecheck(guint delay) {
+	if (timeoutsource != 0)
+		g_source_remove(timeoutsource);
+	g_message("next check in %u seconds", delay);
+	timeoutsource = g_timeout_add_seconds(delay, timeout, NULL);
 }
 
 static void ota_daemon_connected(void) {
 	thingymcconfig_client_sendappstate(client);
 }
 
+/*
+ * Every device in the fleet sees the network come back at the same time
+ * after an outage so don't check straight away unless there's a reason to.
+ */
 static void ota_supplicant_connected(void) {
-	timeout(NULL);
-	timeoutsource = g_timeout_add_seconds(60 * 10, timeout, NULL);
+	supplicantconnected = TRUE;
+	// the worker owns the state, it'll schedule the next check when it's done
+	if (checkcancellable != NULL)
+		return;
+
+	gint64 sincefetch = (g_get_real_time() - manifestfetchedat)
+			/ G_USEC_PER_SEC;
+	gboolean pending = manifest == NULL || targetimage != NULL
+			|| sincefetch >= schedule.interval;
+	ota_schedulecheck(schedule_first(&schedule, pending));
 }
 
 static void ota_supplicant_disconnected(void) {
+	supplicantconnected = FALSE;
 	if (timeoutsource != 0) {
 		g_source_remove(timeoutsource);
 		timeoutsource = 0;
 	}
+	if (checkcancellable != NULL)
+		g_cancellable_cancel(checkcancellable);
 }
 
 static void ota_daemon_disconnected(void) {
@@ -308,10 +2110,14 @@ int main(int argc, char** argv) {
 	path = "/ota/spibeagle";
 	gchar* arg_configdir = OTA_CONFIGDIR_DEFAULT;
 	gchar* logfile = NULL;
+	gchar** arg_tags = NULL;
+	statedir = OTA_STATEDIR_DEFAULT;
 
 	GError* error = NULL;
 	GOptionEntry entries[] = { ARGS_HOST, ARGS_PATH, ARGS_CONFIGDIR, ARGS_MTD,
-	ARGS_DRYRUN, ARGS_FORCE, ARGS_LOG, { NULL } };
+	ARGS_DRYRUN, ARGS_FORCE, ARGS_LOG, ARGS_STATEDIR, ARGS_CODEC,
+	ARGS_COMPARE, ARGS_ONESHOT, ARGS_PEERS, ARGS_PEERGROUP, ARGS_PEERPORT,
+	ARGS_METRICSDIR, ARGS_BENCH, ARGS_DISCARD, ARGS_TAGS, { NULL } };
 	GOptionContext* optioncontext = g_option_context_new(NULL);
 	g_option_context_add_main_entries(optioncontext, entries,
 	GETTEXT_PACKAGE);
@@ -323,16 +2129,39 @@ int main(int argc, char** argv) {
 
 	logging_init(logfile);
 
+	if (peers && (peerport <= 0 || peerport > G_MAXUINT16)) {
+		g_message("peer port must be between 1 and %u", G_MAXUINT16);
+		goto err_args;
+	}
+
+	if (g_mkdir_with_parents(statedir, 0700) != 0) {
+		g_message("failed to create state directory");
+		goto err_args;
+	}
+	if (metricsdir == NULL)
+		metricsdir = statedir;
+	else if (g_mkdir_with_parents(metricsdir, 0755) != 0) {
+		g_message("failed to create metrics directory");
+		goto err_args;
+	}
+	journalpath = buildpath(statedir, JOURNALFILE, NULL);
+	statepath = buildpath(statedir, STATEFILE, NULL);
+
 	if (!dryrun) {
 		int nummtds = mtds != NULL ? g_strv_length(mtds) : 0;
-		if (nummtds < 2) {
+		// benchmarking only ever writes to the first one
+		if (benchrepo != NULL && nummtds < 1) {
+			g_message("you must specify an mtd partition to benchmark with");
+			goto err_args;
+		} else if (benchrepo == NULL && nummtds < 2) {
 			g_message("you must specify at least two mtd partitions");
 			goto err_args;
 		} else if (nummtds > 2) {
 			//TODO some message about not using more than two mtds here
 		}
 
-		if (!mtd_init(mtds))
+		blockdev_setdiscard(discard);
+		if (!mtd_init(mtds, compare))
 			goto err_mtdinit;
 	}
 
@@ -345,14 +2174,56 @@ int main(int argc, char** argv) {
 		goto err_loadkeys;
 	}
 
+	if (benchrepo != NULL) {
+		if (!dryrun && !ota_benchable(mtds[0])) {
+			ret = 1;
+			goto out;
+		}
+		if (!bench_run(benchrepo, dryrun ? NULL : mtds[0], keys))
+			ret = 1;
+		metrics_write(metricsdir);
+		goto out;
+	}
+
 	gchar* stamppath = buildpath(arg_configdir, STAMPFILE, NULL);
 	struct stamp_stamp* stamp = stamp_loadstamp(stamppath);
 	if (stamp == NULL)
 		goto err_loadstamp;
 	currentversion = stamp->version;
+	currentuuid = g_strdup(stamp->uuid);
+	deviceid = getdeviceid(stamp->uuid);
+	schedule_init(&schedule, deviceid);
+	devicetags = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	changesentries = g_ptr_array_new_with_free_func(g_free);
+	for (gchar** tag = stamp->tags; *tag != NULL; tag++)
+		g_hash_table_add(devicetags, g_strdup(*tag));
+	for (gchar** tag = arg_tags; tag != NULL && *tag != NULL; tag++)
+		g_hash_table_add(devicetags, g_strdup(*tag));
 	stamp_freestamp(stamp);
 
-	teenyhttp_init();
+	ota_restorestate();
+
+	/*
+	 * In oneshot mode something else (a systemd timer, cron..) decides when
+	 * to check so do a single check and get out of the way.
+	 */
+	if (oneshot) {
+		ota_check();
+		// let anything the worker and flash threads queued up run
+		while (g_main_context_iteration(NULL, FALSE))
+			;
+		goto out;
+	}
+
+	if (peers) {
+		peer = peer_new(peergroup, peerport);
+		gchar* activemtd = dryrun ? NULL : ota_findactive();
+		if (activemtd != NULL) {
+			sharedreader = mtd_reader_open(activemtd);
+			g_free(activemtd);
+		}
+		ota_share();
+	}
 
 	client = thingymcconfig_client_new("ota");
 	g_signal_connect(client, THINGYMCCONFIG_DETAILEDSIGNAL_DAEMON_CONNECTED,
@@ -371,7 +2242,12 @@ int main(int argc, char** argv) {
 	g_main_loop_run(mainloop);
 
 	thingymcconfig_client_free(client);
+	if (peer != NULL)
+		peer_free(peer);
+	if (sharedreader != NULL)
+		mtd_reader_close(sharedreader);
 
+	out: //
 	err_loadstamp: //
 	err_loadkeys: //
 	err_mtdinit: //
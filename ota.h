@@ -4,3 +4,11 @@
 
 #define OTA_CONFIGDIR_DEFAULT     "/etc/thingyjp/ota"
 #define OTA_CONFIGDIR_SUBDIR_KEYS "keys"
+#define OTA_STATEDIR_DEFAULT      "/var/lib/thingyjp/ota"
+
+#define OTA_BLOCKMAPFILE                 "blockmap.json"
+#define OTA_BLOCKMAP_JSONFIELD_UUID      "uuid"
+#define OTA_BLOCKMAP_JSONFIELD_MTD       "mtd"
+#define OTA_BLOCKMAP_JSONFIELD_ERASESIZE "erasesize"
+#define OTA_BLOCKMAP_JSONFIELD_BLOCKS    "blocks"
+#define OTA_BLOCKMAP_JSONFIELD_VERIFYTIMES "verifytimes"
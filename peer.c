@@ -0,0 +1,442 @@
+#include <string.h>
+#include "peer.h"
+
+#define PEER_BUFFERSZ (64 * 1024)
+
+struct peer_remote {
+	gchar* ip;
+	gchar* uuid;
+	gint64 lastseen;
+};
+
+struct peer {
+	guint32 id;
+	gchar* group;
+	guint16 httpport;
+
+	GMutex lock;
+	// what this device is sharing, protected by lock
+	gchar* uuid;
+	gsize size;
+	peer_readfunc read;
+	gpointer readuserdata;
+	// "address:port" -> peer_remote, protected by lock
+	GHashTable* remotes;
+	/*
+	 * addresses of peers that served bad data, protected by lock. The port
+	 * is left off so a peer can't get around it by announcing another one.
+	 */
+	GHashTable* banned;
+
+	GThread* thread;
+	GMainContext* context;
+	GMainLoop* loop;
+};
+
+static void peer_remote_free(gpointer data) {
+	struct peer_remote* remote = data;
+	g_free(remote->ip);
+	g_free(remote->uuid);
+	g_free(remote);
+}
+
+/*
+ * Announcements are a single line, "thingyota1 <id> <http port> <uuid>".
+ * The id is random and only there so a device can ignore its own
+ * announcements when multicast loopback delivers them back to it.
+ */
+static gboolean peer_receive(GSocket* socket, GIOCondition condition,
+		gpointer user_data) {
+	struct peer* peer = user_data;
+
+	gchar buffer[256];
+	GSocketAddress* from = NULL;
+	gssize len = g_socket_receive_from(socket, &from, buffer,
+			sizeof(buffer) - 1, NULL, NULL);
+	if (len <= 0)
+		goto err_receive;
+	buffer[len] = '\0';
+
+	gchar** parts = g_strsplit(g_strstrip(buffer), " ", 0);
+	if (g_strv_length(parts) != 4 || strcmp(parts[0], PEER_MAGIC) != 0)
+		goto err_parse;
+
+	guint64 id = g_ascii_strtoull(parts[1], NULL, 10);
+	guint64 port = g_ascii_strtoull(parts[2], NULL, 10);
+	const gchar* uuid = parts[3];
+	if (id == peer->id || port == 0 || port > G_MAXUINT16
+			|| !g_uuid_string_is_valid(uuid))
+		goto err_parse;
+
+	gchar* ip = g_inet_address_to_string(
+			g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(from)));
+	gchar* address = g_strdup_printf("%s:%u", ip, (unsigned) port);
+
+	struct peer_remote* remote = g_malloc0(sizeof(*remote));
+	remote->ip = ip;
+	remote->uuid = g_strdup(uuid);
+	remote->lastseen = g_get_monotonic_time();
+
+	g_mutex_lock(&peer->lock);
+	if (!g_hash_table_contains(peer->remotes, address))
+		g_message("peer %s has image %s", address, uuid);
+	g_hash_table_replace(peer->remotes, address, remote);
+	g_mutex_unlock(&peer->lock);
+
+	err_parse: //
+	g_strfreev(parts);
+	err_receive: //
+	g_clear_object(&from);
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean peer_announce(gpointer user_data) {
+	GSocket* socket = user_data;
+	struct peer* peer = g_object_get_data(G_OBJECT(socket), "peer");
+	GSocketAddress* group = g_object_get_data(G_OBJECT(socket), "group");
+
+	g_mutex_lock(&peer->lock);
+	gchar* announcement =
+			peer->uuid != NULL ?
+					g_strdup_printf("%s %u %u %s\n", PEER_MAGIC,
+							(unsigned) peer->id, (unsigned) peer->httpport,
+							peer->uuid) :
+					NULL;
+	g_mutex_unlock(&peer->lock);
+
+	if (announcement != NULL) {
+		GError* err = NULL;
+		if (g_socket_send_to(socket, group, announcement,
+				strlen(announcement), NULL, &err) < 0) {
+			g_message("failed to announce; %s", err->message);
+			g_clear_error(&err);
+		}
+		g_free(announcement);
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean peer_parserange(const gchar* range, gsize size, gsize* start,
+		gsize* end) {
+	if (!g_str_has_prefix(range, "bytes="))
+		return FALSE;
+	range += strlen("bytes=");
+
+	gchar* endptr;
+	*start = g_ascii_strtoull(range, &endptr, 10);
+	if (endptr == range || *endptr != '-')
+		return FALSE;
+	range = endptr + 1;
+	if (*range == '\0')
+		*end = size - 1;
+	else {
+		*end = g_ascii_strtoull(range, &endptr, 10);
+		if (*endptr != '\0')
+			return FALSE;
+		*end = MIN(*end, size - 1);
+	}
+	return *start <= *end;
+}
+
+static gboolean peer_respond(GOutputStream* out, guint code,
+		const gchar* reason, const gchar* extraheaders, gsize len) {
+	gchar* header = g_strdup_printf("HTTP/1.1 %u %s\r\n"
+			"Content-Type: application/octet-stream\r\n"
+			"Content-Length: %" G_GSIZE_FORMAT "\r\n"
+			"%s"
+			"Connection: close\r\n\r\n", code, reason, len,
+			extraheaders != NULL ? extraheaders : "");
+	gboolean ret = g_output_stream_write_all(out, header, strlen(header), NULL,
+	NULL, NULL);
+	g_free(header);
+	return ret;
+}
+
+/*
+ * Just enough of HTTP/1.1 to answer the GETs the agent makes, the only
+ * thing that can be fetched is /<uuid of the shared image>.
+ */
+static gboolean peer_serve(GThreadedSocketService* service,
+		GSocketConnection* connection, GObject* source_object,
+		gpointer user_data) {
+	struct peer* peer = user_data;
+
+	// a peer that stops talking shouldn't hold on to a connection forever
+	g_socket_set_timeout(g_socket_connection_get_socket(connection),
+	PEER_TIMEOUT);
+
+	GDataInputStream* in = g_data_input_stream_new(
+			g_io_stream_get_input_stream(G_IO_STREAM(connection)));
+	g_data_input_stream_set_newline_type(in,
+			G_DATA_STREAM_NEWLINE_TYPE_CR_LF);
+	GOutputStream* out = g_io_stream_get_output_stream(
+			G_IO_STREAM(connection));
+
+	gchar* requestline = g_data_input_stream_read_line(in, NULL, NULL, NULL);
+	if (requestline == NULL)
+		goto err_request;
+
+	gchar* range = NULL;
+	for (;;) {
+		gchar* line = g_data_input_stream_read_line(in, NULL, NULL, NULL);
+		if (line == NULL)
+			goto err_headers;
+		if (*line == '\0') {
+			g_free(line);
+			break;
+		}
+		if (range == NULL && g_ascii_strncasecmp(line, "range:", 6) == 0)
+			range = g_strdup(g_strstrip(line + 6));
+		g_free(line);
+	}
+
+	gchar** parts = g_strsplit(requestline, " ", 3);
+	if (g_strv_length(parts) != 3 || strcmp(parts[0], "GET") != 0
+			|| parts[1][0] != '/') {
+		peer_respond(out, 400, "Bad Request", NULL, 0);
+		goto err_badrequest;
+	}
+
+	g_mutex_lock(&peer->lock);
+	gboolean shared = peer->uuid != NULL
+			&& strcmp(parts[1] + 1, peer->uuid) == 0;
+	gsize size = peer->size;
+	peer_readfunc read = peer->read;
+	gpointer readuserdata = peer->readuserdata;
+	g_mutex_unlock(&peer->lock);
+
+	if (!shared) {
+		peer_respond(out, 404, "Not Found", NULL, 0);
+		goto err_notfound;
+	}
+
+	gsize start = 0, end = size - 1;
+	gchar* contentrange = NULL;
+	if (range != NULL) {
+		if (!peer_parserange(range, size, &start, &end)) {
+			gchar* unsatisfiable = g_strdup_printf(
+					"Content-Range: bytes */%" G_GSIZE_FORMAT "\r\n", size);
+			peer_respond(out, 416, "Range Not Satisfiable", unsatisfiable, 0);
+			g_free(unsatisfiable);
+			goto err_range;
+		}
+		contentrange = g_strdup_printf(
+				"Content-Range: bytes %" G_GSIZE_FORMAT "-%" G_GSIZE_FORMAT
+				"/%" G_GSIZE_FORMAT "\r\n", start, end, size);
+	}
+
+	if (!peer_respond(out, range != NULL ? 206 : 200,
+			range != NULL ? "Partial Content" : "OK", contentrange,
+			(end - start) + 1))
+		goto err_respond;
+
+	guint8* buffer = g_malloc(PEER_BUFFERSZ);
+	for (gsize offset = start; offset <= end;) {
+		gsize len = MIN(PEER_BUFFERSZ, (end - offset) + 1);
+		if (!read(offset, buffer, len, readuserdata))
+			break;
+		if (!g_output_stream_write_all(out, buffer, len, NULL, NULL, NULL))
+			break;
+		offset += len;
+	}
+	g_free(buffer);
+
+	err_respond: //
+	g_free(contentrange);
+	err_range: //
+	err_notfound: //
+	err_badrequest: //
+	g_strfreev(parts);
+	err_headers: //
+	g_free(range);
+	g_free(requestline);
+	err_request: //
+	g_object_unref(in);
+	return TRUE;
+}
+
+static GSocket* peer_announcesocket(struct peer* peer) {
+	GError* err = NULL;
+	GSocket* socket = g_socket_new(G_SOCKET_FAMILY_IPV4,
+			G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, &err);
+	if (socket == NULL)
+		goto err_socket;
+
+	// every agent on this host listens on the same port
+	GInetAddress* any = g_inet_address_new_any(G_SOCKET_FAMILY_IPV4);
+	GSocketAddress* bindaddress = g_inet_socket_address_new(any,
+	PEER_ANNOUNCEPORT);
+	gboolean bound = g_socket_bind(socket, bindaddress, TRUE, &err);
+	g_object_unref(bindaddress);
+	g_object_unref(any);
+	if (!bound)
+		goto err_bind;
+
+	GInetAddress* groupaddress = g_inet_address_new_from_string(peer->group);
+	if (groupaddress == NULL || !g_inet_address_get_is_multicast(groupaddress)) {
+		g_message("%s isn't a multicast address", peer->group);
+		g_clear_object(&groupaddress);
+		goto err_group;
+	}
+	gboolean joined = g_socket_join_multicast_group(socket, groupaddress,
+	FALSE, NULL, &err);
+	if (!joined) {
+		g_object_unref(groupaddress);
+		goto err_join;
+	}
+	g_socket_set_multicast_loopback(socket, TRUE);
+	g_object_set_data_full(G_OBJECT(socket), "group",
+			g_inet_socket_address_new(groupaddress, PEER_ANNOUNCEPORT),
+			g_object_unref);
+	g_object_unref(groupaddress);
+	g_object_set_data(G_OBJECT(socket), "peer", peer);
+	return socket;
+
+	err_join: //
+	err_group: //
+	err_bind: //
+	g_object_unref(socket);
+	err_socket: //
+	if (err != NULL) {
+		g_message("failed to set up peer announcements; %s", err->message);
+		g_clear_error(&err);
+	}
+	return NULL;
+}
+
+static gpointer peer_thread(gpointer data) {
+	struct peer* peer = data;
+	g_main_context_push_thread_default(peer->context);
+
+	GSocketService* service = g_threaded_socket_service_new(
+	PEER_MAXCONNECTIONS);
+	GError* err = NULL;
+	if (!g_socket_listener_add_inet_port(G_SOCKET_LISTENER(service),
+			peer->httpport, NULL, &err)) {
+		g_message("failed to listen for peers on port %u; %s",
+				(unsigned) peer->httpport, err->message);
+		g_clear_error(&err);
+		goto err_listen;
+	}
+	g_signal_connect(service, "run", G_CALLBACK(peer_serve), peer);
+	g_socket_service_start(service);
+
+	GSocket* socket = peer_announcesocket(peer);
+	if (socket == NULL)
+		goto err_announcesocket;
+
+	GSource* receivesource = g_socket_create_source(socket, G_IO_IN, NULL);
+	g_source_set_callback(receivesource, (GSourceFunc) peer_receive, peer,
+	NULL);
+	g_source_attach(receivesource, peer->context);
+
+	GSource* announcesource = g_timeout_source_new_seconds(
+	PEER_ANNOUNCE_INTERVAL);
+	g_source_set_callback(announcesource, peer_announce, socket, NULL);
+	g_source_attach(announcesource, peer->context);
+
+	g_main_loop_run(peer->loop);
+
+	g_source_destroy(announcesource);
+	g_source_unref(announcesource);
+	g_source_destroy(receivesource);
+	g_source_unref(receivesource);
+	g_object_unref(socket);
+	err_announcesocket: //
+	g_socket_service_stop(service);
+	g_socket_listener_close(G_SOCKET_LISTENER(service));
+	err_listen: //
+	g_object_unref(service);
+	g_main_context_pop_thread_default(peer->context);
+	return NULL;
+}
+
+struct peer* peer_new(const gchar* group, guint16 httpport) {
+	struct peer* peer = g_malloc0(sizeof(*peer));
+	peer->id = g_random_int();
+	peer->group = g_strdup(group);
+	peer->httpport = httpport;
+	g_mutex_init(&peer->lock);
+	peer->remotes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			peer_remote_free);
+	peer->banned = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+	NULL);
+	peer->context = g_main_context_new();
+	peer->loop = g_main_loop_new(peer->context, FALSE);
+	peer->thread = g_thread_new("peer", peer_thread, peer);
+	return peer;
+}
+
+/*
+ * Change what this device is sharing, a NULL uuid stops sharing. The
+ * read function has to stay usable until the next call.
+ */
+void peer_share(struct peer* peer, const gchar* uuid, gsize size,
+		peer_readfunc read, gpointer user_data) {
+	g_mutex_lock(&peer->lock);
+	if (g_strcmp0(uuid, peer->uuid) != 0 && uuid != NULL)
+		g_message("sharing image %s with peers", uuid);
+	g_free(peer->uuid);
+	peer->uuid = size > 0 ? g_strdup(uuid) : NULL;
+	peer->size = size;
+	peer->read = read;
+	peer->readuserdata = user_data;
+	g_mutex_unlock(&peer->lock);
+}
+
+/*
+ * The "address:port" of a peer that recently announced the image or NULL,
+ * if there are several one is picked at random to spread the load.
+ */
+gchar* peer_find(struct peer* peer, const gchar* uuid) {
+	gchar* address = NULL;
+	gint64 now = g_get_monotonic_time();
+	GPtrArray* candidates = g_ptr_array_new();
+
+	g_mutex_lock(&peer->lock);
+	GHashTableIter iter;
+	gpointer key, value;
+	g_hash_table_iter_init(&iter, peer->remotes);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		struct peer_remote* remote = value;
+		if (now - remote->lastseen > PEER_EXPIRY * G_USEC_PER_SEC) {
+			g_hash_table_iter_remove(&iter);
+			continue;
+		}
+		if (strcmp(remote->uuid, uuid) == 0
+				&& !g_hash_table_contains(peer->banned, remote->ip))
+			g_ptr_array_add(candidates, key);
+	}
+	if (candidates->len > 0)
+		address = g_strdup(
+				g_ptr_array_index(candidates,
+						g_random_int_range(0, candidates->len)));
+	g_mutex_unlock(&peer->lock);
+
+	g_ptr_array_free(candidates, TRUE);
+	return address;
+}
+
+// stop using a peer that served something that didn't verify
+void peer_ban(struct peer* peer, const gchar* address) {
+	const gchar* port = strrchr(address, ':');
+	gchar* ip = port != NULL ?
+			g_strndup(address, port - address) : g_strdup(address);
+	g_message("not using peer %s again", ip);
+	g_mutex_lock(&peer->lock);
+	g_hash_table_add(peer->banned, ip);
+	g_mutex_unlock(&peer->lock);
+}
+
+void peer_free(struct peer* peer) {
+	g_main_loop_quit(peer->loop);
+	g_thread_join(peer->thread);
+	g_main_loop_unref(peer->loop);
+	g_main_context_unref(peer->context);
+	g_hash_table_unref(peer->remotes);
+	g_hash_table_unref(peer->banned);
+	g_mutex_clear(&peer->lock);
+	g_free(peer->uuid);
+	g_free(peer->group);
+	g_free(peer);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <gio/gio.h>
+
+#define PEER_GROUP_DEFAULT       "239.255.86.42"
+#define PEER_ANNOUNCEPORT        8642
+#define PEER_HTTPPORT_DEFAULT    8643
+#define PEER_ANNOUNCE_INTERVAL   30
+// peers that haven't announced for this long have gone away
+#define PEER_EXPIRY              (PEER_ANNOUNCE_INTERVAL * 3)
+#define PEER_MAGIC               "thingyota1"
+#define PEER_MAXCONNECTIONS      4
+// seconds a peer connection can sit idle before it's dropped
+#define PEER_TIMEOUT             10
+
+/*
+ * Sharing images with other devices on the same network. Each device
+ * announces the image it can serve to a multicast group and keeps track
+ * of what the others have announced. Images are served over plain http
+ * with range support so the normal download code can fetch from a peer
+ * exactly like it does from the repo. Nothing a peer sends is trusted,
+ * images from peers go through the same signature checks as images from
+ * the repo.
+ *
+ * All of the networking happens on a thread with its own main context so
+ * that serving and listening carry on while the agent is busy updating.
+ */
+
+// called on a server thread, must be safe to call from several at once
+typedef gboolean (*peer_readfunc)(gsize offset, guint8* data, gsize len,
+		gpointer user_data);
+
+struct peer;
+
+struct peer* peer_new(const gchar* group, guint16 httpport);
+void peer_share(struct peer* peer, const gchar* uuid, gsize size,
+		peer_readfunc read, gpointer user_data);
+gchar* peer_find(struct peer* peer, const gchar* uuid);
+void peer_ban(struct peer* peer, const gchar* address);
+void peer_free(struct peer* peer);
@@ -0,0 +1,268 @@
+/*
+ * Streams an image from the network to flash without ever holding the whole
+ * thing in memory. Data pushed in from the download is packed into erase
+ * block sized chunks that are handed to a flash thread which hashes them.
+ * Only a fixed number of chunks exist so the download stalls when the flash
+ * can't keep up instead of buffering.
+ */
+
+#include <string.h>
+#include "pipeline.h"
+#include "mtd.h"
+#include "metrics.h"
+
+#define PIPELINE_CHUNKS    4
+#define PIPELINE_CHUNKSZ   (64 * 1024)
+
+struct pipeline_chunk {
+	guint8* data;
+	gsize len;
+	// image offset and hash state at the end of this chunk
+	gsize end;
+	struct crypto_digests digests;
+};
+
+struct pipeline {
+	struct mtd_writer* writer;
+	struct crypto_digests digests;
+	gsize len;
+	gsize pushed;
+	gsize chunksz;
+	struct pipeline_chunk chunks[PIPELINE_CHUNKS];
+	struct pipeline_chunk* current;
+	GAsyncQueue* free;
+	GAsyncQueue* full;
+	GThread* flashthread;
+	gint failed;
+	// sha256 of each erase block written by this pipeline, for verifying
+	gsize blocksz;
+	guint firstblock;
+	GByteArray* blockdigests;
+	pipeline_commitcallback commitcallback;
+	gpointer commitcallback_data;
+};
+
+static void pipeline_queuechunk(struct pipeline* pipeline) {
+	struct pipeline_chunk* chunk = pipeline->current;
+	chunk->end = pipeline->pushed;
+	g_async_queue_push(pipeline->full, chunk);
+	pipeline->current = NULL;
+	gint queued = g_async_queue_length(pipeline->full);
+	if (queued > 0)
+		metrics_peak(METRICS_PIPELINEBUFFERED, queued * pipeline->chunksz);
+}
+
+static void pipeline_digestblocks(struct pipeline* pipeline,
+		const guint8* data, gsize len) {
+	for (gsize off = 0; off < len; off += pipeline->blocksz) {
+		struct sha256_ctx sha256;
+		guint8 digest[SHA256_DIGEST_SIZE];
+		sha256_init(&sha256);
+		sha256_update(&sha256, MIN(pipeline->blocksz, len - off), data + off);
+		sha256_digest(&sha256, sizeof(digest), digest);
+		g_byte_array_append(pipeline->blockdigests, digest, sizeof(digest));
+	}
+}
+
+static gpointer pipeline_flashthread(gpointer data) {
+	struct pipeline* pipeline = data;
+
+	for (;;) {
+		struct pipeline_chunk* chunk = g_async_queue_pop(pipeline->full);
+		// an empty chunk marks the end of the stream
+		if (chunk->len == 0) {
+			g_async_queue_push(pipeline->free, chunk);
+			break;
+		}
+
+		// keep draining after a failure so the producer never blocks
+		if (!g_atomic_int_get(&pipeline->failed)) {
+			// hashing here keeps it off of the thread doing the download
+			crypto_digests_update(&pipeline->digests, chunk->data, chunk->len);
+			chunk->digests = pipeline->digests;
+			if (pipeline->writer != NULL)
+				pipeline_digestblocks(pipeline, chunk->data, chunk->len);
+			if (pipeline->writer != NULL
+					&& !mtd_writer_write(pipeline->writer, chunk->data,
+							chunk->len))
+				g_atomic_int_set(&pipeline->failed, TRUE);
+			/*
+			 * Writing can only be resumed from a chunk boundary so the
+			 * short chunk left by an incomplete download isn't committed.
+			 */
+			else if (pipeline->commitcallback != NULL
+					&& (chunk->end % pipeline->chunksz == 0
+							|| chunk->end == pipeline->len))
+				pipeline->commitcallback(chunk->end, &chunk->digests,
+						pipeline->commitcallback_data);
+		}
+
+		chunk->len = 0;
+		g_async_queue_push(pipeline->free, chunk);
+	}
+
+	return NULL;
+}
+
+/*
+ * Chunks need to be a whole number of erase blocks so that every chunk
+ * starts on a fresh block.
+ */
+gsize pipeline_chunksize(const gchar* mtd) {
+	if (mtd == NULL)
+		return PIPELINE_CHUNKSZ;
+	guint32 erasesize = mtd_erasesize(mtd);
+	return MAX(erasesize, (PIPELINE_CHUNKSZ / erasesize) * erasesize);
+}
+
+/*
+ * Create a pipeline for an image of len bytes that will be written to mtd.
+ * If mtd is NULL the image is only hashed. To resume a previous attempt
+ * pass the offset it got to, which must be on a chunk boundary, and the
+ * hash state at that point. An eraser that was already started for the
+ * passive partition can be handed over, the pipeline always takes
+ * ownership of it.
+ */
+struct pipeline* pipeline_new(const gchar* mtd, gsize len, gsize offset,
+		const struct crypto_digests* digests, struct mtd_eraser* eraser,
+		pipeline_commitcallback commitcallback, gpointer user_data) {
+	struct pipeline* pipeline = g_malloc0(sizeof(*pipeline));
+	pipeline->len = len;
+	pipeline->pushed = offset;
+	pipeline->commitcallback = commitcallback;
+	pipeline->commitcallback_data = user_data;
+	if (digests != NULL)
+		pipeline->digests = *digests;
+	else
+		crypto_digests_init(&pipeline->digests);
+
+	pipeline->chunksz = PIPELINE_CHUNKSZ;
+	if (mtd != NULL) {
+		pipeline->writer = mtd_writer_open(mtd, offset, len, eraser);
+		if (pipeline->writer == NULL)
+			goto err_openwriter;
+		pipeline->chunksz = pipeline_chunksize(mtd);
+		pipeline->blocksz = mtd_erasesize(mtd);
+		pipeline->firstblock = offset / pipeline->blocksz;
+		pipeline->blockdigests = g_byte_array_new();
+	} else if (eraser != NULL)
+		mtd_eraser_free(eraser);
+
+	pipeline->free = g_async_queue_new();
+	pipeline->full = g_async_queue_new();
+	for (int i = 0; i < G_N_ELEMENTS(pipeline->chunks); i++) {
+		pipeline->chunks[i].data = g_malloc(pipeline->chunksz);
+		g_async_queue_push(pipeline->free, &pipeline->chunks[i]);
+	}
+
+	pipeline->flashthread = g_thread_new("flash", pipeline_flashthread,
+			pipeline);
+
+	return pipeline;
+
+	err_openwriter: //
+	g_free(pipeline);
+	return NULL;
+}
+
+gboolean pipeline_push(struct pipeline* pipeline, const guint8* data,
+		gsize len) {
+	if (g_atomic_int_get(&pipeline->failed))
+		return FALSE;
+
+	if (pipeline->pushed + len > pipeline->len) {
+		g_message("received more data than expected");
+		return FALSE;
+	}
+
+	while (len > 0) {
+		if (pipeline->current == NULL)
+			pipeline->current = g_async_queue_pop(pipeline->free);
+
+		struct pipeline_chunk* chunk = pipeline->current;
+		gsize copy = MIN(len, pipeline->chunksz - chunk->len);
+		memcpy(chunk->data + chunk->len, data, copy);
+		chunk->len += copy;
+		// counted as it goes so each chunk knows where it really ends
+		pipeline->pushed += copy;
+		data += copy;
+		len -= copy;
+
+		if (chunk->len == pipeline->chunksz)
+			pipeline_queuechunk(pipeline);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Flush the last partial chunk, wait for the flash thread to finish and
+ * report whether the whole image made it to flash. PIPELINE_INCOMPLETE means
+ * everything that was received was written and the image can be resumed.
+ */
+enum pipeline_result pipeline_finish(struct pipeline* pipeline) {
+	if (pipeline->flashthread == NULL)
+		return PIPELINE_FAILED;
+
+	if (pipeline->current != NULL && pipeline->current->len > 0)
+		pipeline_queuechunk(pipeline);
+
+	if (pipeline->current == NULL)
+		pipeline->current = g_async_queue_pop(pipeline->free);
+	g_async_queue_push(pipeline->full, pipeline->current);
+	pipeline->current = NULL;
+
+	g_thread_join(pipeline->flashthread);
+	pipeline->flashthread = NULL;
+
+	if (g_atomic_int_get(&pipeline->failed)) {
+		g_message("failed to write image");
+		return PIPELINE_FAILED;
+	}
+
+	if (pipeline->pushed != pipeline->len) {
+		g_message(
+				"downloaded image size doesn't match manifest %" G_GSIZE_FORMAT " vs %" G_GSIZE_FORMAT,
+				pipeline->pushed, pipeline->len);
+		return PIPELINE_INCOMPLETE;
+	}
+
+	return PIPELINE_OK;
+}
+
+// only valid once the pipeline has finished
+const struct crypto_digests* pipeline_digests(struct pipeline* pipeline) {
+	return &pipeline->digests;
+}
+
+/*
+ * The sha256 of what was written to the erase block that holds block of
+ * the image or NULL if it was written by an earlier attempt.
+ */
+const guint8* pipeline_blockdigest(struct pipeline* pipeline, guint block) {
+	if (pipeline->blockdigests == NULL || block < pipeline->firstblock)
+		return NULL;
+	gsize off = (block - pipeline->firstblock) * SHA256_DIGEST_SIZE;
+	if (off >= pipeline->blockdigests->len)
+		return NULL;
+	return pipeline->blockdigests->data + off;
+}
+
+const GArray* pipeline_blockmap(struct pipeline* pipeline) {
+	return pipeline->writer != NULL ?
+			mtd_writer_blockmap(pipeline->writer) : NULL;
+}
+
+void pipeline_free(struct pipeline* pipeline) {
+	if (pipeline->flashthread != NULL)
+		pipeline_finish(pipeline);
+	for (int i = 0; i < G_N_ELEMENTS(pipeline->chunks); i++)
+		g_free(pipeline->chunks[i].data);
+	g_async_queue_unref(pipeline->free);
+	g_async_queue_unref(pipeline->full);
+	if (pipeline->writer != NULL)
+		mtd_writer_close(pipeline->writer);
+	if (pipeline->blockdigests != NULL)
+		g_byte_array_free(pipeline->blockdigests, TRUE);
+	g_free(pipeline);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <glib.h>
+#include "crypto.h"
+#include "mtd.h"
+
+struct pipeline;
+
+enum pipeline_result {
+	PIPELINE_OK, PIPELINE_INCOMPLETE, PIPELINE_FAILED
+};
+
+/*
+ * Called from the flash thread each time a chunk has been written. offset
+ * is the number of bytes of the image now on flash and digests is the hash
+ * state for exactly those bytes.
+ */
+typedef void (*pipeline_commitcallback)(gsize offset,
+		const struct crypto_digests* digests, gpointer user_data);
+
+gsize pipeline_chunksize(const gchar* mtd);
+struct pipeline* pipeline_new(const gchar* mtd, gsize len, gsize offset,
+		const struct crypto_digests* digests, struct mtd_eraser* eraser,
+		pipeline_commitcallback commitcallback, gpointer user_data);
+gboolean pipeline_push(struct pipeline* pipeline, const guint8* data,
+		gsize len);
+enum pipeline_result pipeline_finish(struct pipeline* pipeline);
+const struct crypto_digests* pipeline_digests(struct pipeline* pipeline);
+const guint8* pipeline_blockdigest(struct pipeline* pipeline, guint block);
+const GArray* pipeline_blockmap(struct pipeline* pipeline);
+void pipeline_free(struct pipeline* pipeline);
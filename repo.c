@@ -1,12 +1,20 @@
 #define GETTEXT_PACKAGE "gtk20"
+#include <unistd.h>
 #include <json-glib/json-glib.h>
 #include "jsonbuilderutils.h"
 #include "jsonparserutils.h"
 #include "crypto.h"
 #include "manifest.h"
+#include "manifestbin.h"
 #include "args.h"
 #include "utils.h"
 #include "stamp.h"
+#include "delta.h"
+#include "chunker.h"
+#include "compress.h"
+#include "rollout.h"
+#include "shard.h"
+#include "changes.h"
 
 static const enum manifest_signaturetype sigtypes[] = { OTA_SIGTYPE_RSASHA256,
 		OTA_SIGTYPE_RSASHA512 };
@@ -14,6 +22,14 @@ static gchar* arg_repodir = NULL;
 static gchar* keysdir = NULL;
 static gchar* manifestpath;
 static gchar* sigpath;
+static gchar* envelopepath;
+static gchar* manifestbinpath;
+static gchar* shardindexpath;
+static gchar* changesheadpath;
+// -1 leaves whatever the manifest already has
+static gint param_pollinterval = -1;
+// NULL leaves the repo sharded (or not) as it is, "none" stops sharding
+static gchar** param_shardby = NULL;
 
 static gchar* buildsigkey(struct manifest_signature* sig) {
 	GString* s = g_string_new(NULL);
@@ -54,6 +70,21 @@ static void repo_image_list_printimage(gpointer data, gpointer user_data) {
 	int* index = user_data;
 	g_message("%d: uuid: %s, version: %d, enabled: %s", *index, image->uuid,
 			image->version, image->enabled ? "yes" : "no");
+	if (image->tags->len > 0) {
+		GString* tags = g_string_new(NULL);
+		for (guint i = 0; i < image->tags->len; i++)
+			g_string_append_printf(tags, "%s%s", i > 0 ? ", " : "",
+					(gchar*) g_ptr_array_index(image->tags, i));
+		g_message("%d: tags: %s", *index, tags->str);
+		g_string_free(tags, TRUE);
+	}
+	if (image->rollout != NULL)
+		g_message(
+				"%d: rollout: %u%% from %"G_GINT64_FORMAT" +%u%%/hour, now %u%%",
+				*index, image->rollout->percent, image->rollout->start,
+				image->rollout->rate,
+				rollout_coverage(image->rollout,
+						g_get_real_time() / G_USEC_PER_SEC));
 	*index += 1;
 }
 
@@ -65,27 +96,350 @@ static void repo_image_list() {
 	manifest_free(manifest);
 }
 
+static gboolean repo_writemanifestbin(struct manifest_manifest* manifest,
+		struct crypto_keys* keys, const gchar* path) {
+	GByteArray* body = manifestbin_serialisebody(manifest);
+	GPtrArray* binsigs = manifest_signatures_new();
+	for (int i = 0; i < G_N_ELEMENTS(sigtypes); i++)
+		g_ptr_array_add(binsigs,
+				crypto_sign(sigtypes[i], keys, body->data, body->len));
+	GByteArray* manifestbin = manifestbin_serialise(body, binsigs);
+	gboolean ret = g_file_set_contents(path, (gchar*) manifestbin->data,
+			manifestbin->len, NULL);
+	g_byte_array_free(manifestbin, TRUE);
+	g_ptr_array_free(binsigs, TRUE);
+	g_byte_array_free(body, TRUE);
+	return ret;
+}
+
+// an image is in a shard if it has no tags for the shard's keys it doesn't
+static gboolean repo_shard_contains(struct manifest_image* image,
+		gchar** shardby, GPtrArray* shardtags) {
+	for (guint i = 0; i < image->tags->len; i++) {
+		const gchar* tag = g_ptr_array_index(image->tags, i);
+		for (gchar** key = shardby; *key != NULL; key++) {
+			if (shard_tagiskey(tag, *key)
+					&& !g_ptr_array_find_with_equal_func(shardtags, tag,
+							g_str_equal, NULL))
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static gchar** repo_shardby_load() {
+	gchar* contents;
+	gsize len;
+	if (!g_file_get_contents(shardindexpath, &contents, &len, NULL))
+		return NULL;
+	gchar** shardby = NULL;
+	struct manifest_envelope* envelope = manifest_envelope_deserialise(
+			contents, len);
+	if (envelope != NULL) {
+		struct shard_index* index = shard_index_deserialise(
+				envelope->manifest, envelope->manifestlen);
+		if (index != NULL) {
+			shardby = index->shardby;
+			index->shardby = NULL;
+			shard_index_free(index);
+		}
+		manifest_envelope_free(envelope);
+	}
+	g_free(contents);
+	return shardby;
+}
+
+static void repo_removestaleshards(const gchar* sharddir, GHashTable* written) {
+	GDir* dir = g_dir_open(sharddir, 0, NULL);
+	if (dir == NULL)
+		return;
+
+	const gchar* name;
+	while ((name = g_dir_read_name(dir)) != NULL) {
+		if (g_hash_table_contains(written, name))
+			continue;
+		gchar* stalepath = buildpath(sharddir, name, NULL);
+		unlink(stalepath);
+		g_free(stalepath);
+	}
+	g_dir_close(dir);
+}
+
+/*
+ * An image with two tags for a key is only for devices with both and
+ * those devices don't have a shard, it wouldn't be in any shard at all.
+ */
+static gboolean repo_shardby_valid(struct manifest_manifest* manifest,
+		gchar** shardby) {
+	for (guint i = 0; i < manifest->images->len; i++) {
+		struct manifest_image* image = g_ptr_array_index(manifest->images, i);
+		for (gchar** key = shardby; *key != NULL; key++) {
+			guint values = 0;
+			for (guint t = 0; t < image->tags->len; t++) {
+				if (shard_tagiskey(g_ptr_array_index(image->tags, t), *key))
+					values++;
+			}
+			if (values > 1) {
+				g_message("image %s has more than one %s tag, not sharding",
+						image->uuid, *key);
+				return FALSE;
+			}
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Write a shard for every combination of the values the images have for
+ * each key, not having a tag for a key counts as a value. Shards that
+ * aren't needed anymore are removed, devices looking for them get a 404
+ * and go back to the index.
+ */
+static void repo_writeshards(struct manifest_manifest* manifest,
+		struct crypto_keys* keys) {
+	gchar** shardby = repo_shardby_load();
+	if (param_shardby != NULL) {
+		g_strfreev(shardby);
+		shardby = g_strv_length(param_shardby) == 1
+				&& strcmp(param_shardby[0], "none") == 0 ?
+				NULL : g_strdupv(param_shardby);
+	}
+	if (shardby != NULL && !repo_shardby_valid(manifest, shardby)) {
+		g_strfreev(shardby);
+		shardby = NULL;
+	}
+
+	gchar* sharddir = buildpath(arg_repodir, OTA_SHARDDIR, NULL);
+	GHashTable* written = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, NULL);
+	if (shardby == NULL) {
+		unlink(shardindexpath);
+		goto notsharded;
+	}
+	g_mkdir_with_parents(sharddir, 0755);
+
+	guint numkeys = g_strv_length(shardby);
+	GPtrArray** values = g_malloc0_n(numkeys, sizeof(*values));
+	for (guint k = 0; k < numkeys; k++) {
+		values[k] = g_ptr_array_new();
+		for (guint i = 0; i < manifest->images->len; i++) {
+			struct manifest_image* image = g_ptr_array_index(manifest->images,
+					i);
+			for (guint t = 0; t < image->tags->len; t++) {
+				gchar* tag = g_ptr_array_index(image->tags, t);
+				if (shard_tagiskey(tag, shardby[k])
+						&& !g_ptr_array_find_with_equal_func(values[k], tag,
+								g_str_equal, NULL))
+					g_ptr_array_add(values[k], tag);
+			}
+		}
+	}
+
+	// the images aren't copied, they're only borrowed for serialising
+	struct manifest_manifest shard = *manifest;
+	shard.images = g_ptr_array_new();
+	GPtrArray* shardtags = g_ptr_array_new();
+	guint* combination = g_malloc0_n(numkeys, sizeof(*combination));
+	gboolean done = FALSE;
+	while (!done) {
+		g_ptr_array_set_size(shardtags, 0);
+		// one past the values is not having a tag for the key
+		for (guint k = 0; k < numkeys; k++) {
+			if (combination[k] < values[k]->len)
+				g_ptr_array_add(shardtags,
+						g_ptr_array_index(values[k], combination[k]));
+		}
+
+		g_ptr_array_set_size(shard.images, 0);
+		for (guint i = 0; i < manifest->images->len; i++) {
+			struct manifest_image* image = g_ptr_array_index(manifest->images,
+					i);
+			if (repo_shard_contains(image, shardby, shardtags))
+				g_ptr_array_add(shard.images, image);
+		}
+
+		g_ptr_array_add(shardtags, NULL);
+		gchar* filename = shard_filename(shardby, (gchar**) shardtags->pdata);
+		gchar* shardpath = buildpath(arg_repodir, filename, NULL);
+		if (!repo_writemanifestbin(&shard, keys, shardpath))
+			g_message("failed to write shard %s", filename);
+		g_hash_table_add(written, g_path_get_basename(filename));
+		g_free(shardpath);
+		g_free(filename);
+
+		// next combination, like counting
+		done = TRUE;
+		for (guint k = 0; k < numkeys; k++) {
+			if (++combination[k] <= values[k]->len) {
+				done = FALSE;
+				break;
+			}
+			combination[k] = 0;
+		}
+	}
+	g_message("wrote %u shards", g_hash_table_size(written));
+
+	// the shards go first so the index never points at missing ones
+	GPtrArray* alltags = g_ptr_array_new();
+	for (guint k = 0; k < numkeys; k++)
+		for (guint v = 0; v < values[k]->len; v++)
+			g_ptr_array_add(alltags, g_ptr_array_index(values[k], v));
+	g_ptr_array_add(alltags, NULL);
+	struct shard_index index = { .shardby = shardby, .tags =
+			(gchar**) alltags->pdata };
+	gsize indexlen;
+	gchar* indexjson = shard_index_serialise(&index, &indexlen);
+	GPtrArray* sigs = manifest_signatures_new();
+	for (int i = 0; i < G_N_ELEMENTS(sigtypes); i++)
+		g_ptr_array_add(sigs,
+				crypto_sign(sigtypes[i], keys, (guint8*) indexjson,
+						indexlen));
+	JsonBuilder* indexbuilder = manifest_envelope_serialise(indexjson, sigs);
+	jsonbuilder_writetofile(indexbuilder, TRUE, shardindexpath);
+
+	g_ptr_array_free(sigs, TRUE);
+	g_free(indexjson);
+	g_ptr_array_free(alltags, TRUE);
+	g_free(combination);
+	g_ptr_array_free(shardtags, TRUE);
+	g_ptr_array_free(shard.images, TRUE);
+	for (guint k = 0; k < numkeys; k++)
+		g_ptr_array_free(values[k], TRUE);
+	g_free(values);
+
+	notsharded: //
+	repo_removestaleshards(sharddir, written);
+	g_hash_table_unref(written);
+	g_free(sharddir);
+	g_strfreev(shardby);
+}
+
+static gboolean repo_changes_haveentry(guint serial) {
+	gchar* filename = changes_filename(serial);
+	gchar* path = buildpath(arg_repodir, filename, NULL);
+	gboolean exists = g_file_test(path, G_FILE_TEST_IS_REGULAR);
+	g_free(path);
+	g_free(filename);
+	return exists;
+}
+
+/*
+ * Add the entry that turns previous into manifest, chained to previous,
+ * and move the head. Only the newest CHANGES_KEEP entries are kept. If
+ * the entry before is missing the journal starts again here.
+ */
+static void repo_writechanges(const struct manifest_manifest* previous,
+		const struct manifest_manifest* manifest, struct crypto_keys* keys) {
+	// nothing to say what changed from
+	if (previous->serial == 0)
+		return;
+
+	gchar* changesdir = buildpath(arg_repodir, OTA_CHANGESDIR, NULL);
+	g_mkdir_with_parents(changesdir, 0755);
+
+	struct changes_head oldhead = { 0 };
+	gchar* headjson;
+	gsize headlen;
+	if (g_file_get_contents(changesheadpath, &headjson, &headlen, NULL)) {
+		changes_head_deserialise(headjson, headlen, &oldhead);
+		g_free(headjson);
+	}
+
+	struct changes_entry* entry = changes_entry_diff(previous, manifest);
+	entry->prev = changes_manifesthash(previous);
+	struct changes_head head = { .serial = manifest->serial, .first =
+			manifest->serial };
+	if (repo_changes_haveentry(previous->serial)
+			&& oldhead.serial == previous->serial)
+		head.first = MAX(oldhead.first,
+				manifest->serial > CHANGES_KEEP ?
+						manifest->serial - CHANGES_KEEP + 1 : 1);
+
+	gsize entrylen;
+	gchar* entryjson = changes_entry_serialise(entry, &entrylen);
+	GPtrArray* sigs = manifest_signatures_new();
+	for (int i = 0; i < G_N_ELEMENTS(sigtypes); i++)
+		g_ptr_array_add(sigs,
+				crypto_sign(sigtypes[i], keys, (guint8*) entryjson,
+						entrylen));
+	JsonBuilder* envelopebuilder = manifest_envelope_serialise(entryjson,
+			sigs);
+	gchar* entryfilename = changes_filename(entry->serial);
+	gchar* entrypath = buildpath(arg_repodir, entryfilename, NULL);
+	jsonbuilder_writetofile(envelopebuilder, TRUE, entrypath);
+	g_message("%u images changed and %u removed since serial %u",
+			entry->put->len, entry->delete->len, previous->serial);
+
+	// the entry goes first so the head never points past what's there
+	gchar* newheadjson = changes_head_serialise(&head, &headlen);
+	g_file_set_contents(changesheadpath, newheadjson, headlen, NULL);
+
+	for (guint serial = oldhead.first; serial > 0 && serial < head.first;
+			serial++) {
+		gchar* stalefilename = changes_filename(serial);
+		gchar* stalepath = buildpath(arg_repodir, stalefilename, NULL);
+		unlink(stalepath);
+		g_free(stalepath);
+		g_free(stalefilename);
+	}
+
+	g_free(newheadjson);
+	g_free(entrypath);
+	g_free(entryfilename);
+	g_ptr_array_free(sigs, TRUE);
+	g_free(entryjson);
+	changes_entry_free(entry);
+	g_free(changesdir);
+}
+
 static void repo_updatemanifest(struct manifest_manifest* manifest,
 		struct crypto_keys* keys) {
+	// what's on disk is what devices have now
+	struct manifest_manifest* previous = manifest_load(manifestpath);
 	manifest->serial++;
 	manifest->timestamp = g_get_real_time() / 1000000;
+	if (param_pollinterval >= 0)
+		manifest->pollinterval = param_pollinterval;
 
 	JsonBuilder* builder = manifest_serialise(manifest);
 	gsize manifestjsonlen;
 	gchar* manifestjson = jsonbuilder_freetostring(builder, &manifestjsonlen,
 	TRUE);
 
+	GPtrArray* sigs = manifest_signatures_new();
+	for (int i = 0; i < G_N_ELEMENTS(sigtypes); i++)
+		g_ptr_array_add(sigs,
+				crypto_sign(sigtypes[i], keys, (guint8*) manifestjson,
+						manifestjsonlen));
+
 	JsonBuilder* sigbuilder = json_builder_new();
 	json_builder_begin_array(sigbuilder);
-	for (int i = 0; i < G_N_ELEMENTS(sigtypes); i++) {
-		struct manifest_signature* sig = crypto_sign(sigtypes[i], keys,
-				(guint8*) manifestjson, manifestjsonlen);
-		manifest_signature_serialise(sigbuilder, sig);
-	}
+	for (int i = 0; i < sigs->len; i++)
+		manifest_signature_serialise(sigbuilder, g_ptr_array_index(sigs, i));
 	json_builder_end_array(sigbuilder);
 
+	JsonBuilder* envelopebuilder = manifest_envelope_serialise(manifestjson,
+			sigs);
+	gsize envelopejsonlen;
+	gchar* envelopejson = jsonbuilder_freetostring(envelopebuilder,
+			&envelopejsonlen, TRUE);
+
+	// the separate files are for agents that don't know about the envelope
 	g_file_set_contents(manifestpath, manifestjson, manifestjsonlen, NULL);
 	jsonbuilder_writetofile(sigbuilder, TRUE, sigpath);
+	// g_file_set_contents() replaces the file atomically so the envelope
+	// is never torn
+	g_file_set_contents(envelopepath, envelopejson, envelopejsonlen, NULL);
+
+	// the same again in binary for devices, signed separately
+	repo_writemanifestbin(manifest, keys, manifestbinpath);
+	repo_writeshards(manifest, keys);
+	repo_writechanges(previous, manifest, keys);
+	manifest_free(previous);
+
+	g_free(envelopejson);
+	g_free(manifestjson);
+	g_ptr_array_free(sigs, TRUE);
 }
 
 static gboolean findbyversion(gconstpointer a, gconstpointer b) {
@@ -97,7 +451,198 @@ static gint sortbyversion(gconstpointer a, gconstpointer b) {
 			- (*(struct manifest_image**) b)->version;
 }
 
-static void repo_image_add(const gchar* imagepath, const gchar* stamp) {
+static void repo_delta_add(struct manifest_image* image, guint8* imagedata,
+		gsize imagesz, const struct manifest_image* from,
+		struct crypto_keys* keys) {
+	gchar* frompath = buildpath(arg_repodir, from->uuid, NULL);
+	gchar* fromdata;
+	gsize fromsz;
+	if (!g_file_get_contents(frompath, &fromdata, &fromsz, NULL)) {
+		g_message("failed to read image %s, no delta from version %u",
+				from->uuid, from->version);
+		goto err_readfrom;
+	}
+
+	GByteArray* deltadata = delta_encode((guint8*) fromdata, fromsz,
+			imagedata, imagesz);
+	if (deltadata->len >= imagesz) {
+		g_message("delta from version %u isn't smaller than the image",
+				from->version);
+		goto err_toobig;
+	}
+
+	struct manifest_delta* delta = manifest_delta_new();
+	delta->from = from->version;
+	delta->size = deltadata->len;
+	for (int i = 0; i < G_N_ELEMENTS(sigtypes); i++)
+		g_ptr_array_add(delta->signatures,
+				crypto_sign(sigtypes[i], keys, deltadata->data,
+						deltadata->len));
+
+	gchar* deltafilename = manifest_delta_filename(image, delta);
+	gchar* deltapath = buildpath(arg_repodir, deltafilename, NULL);
+	if (g_file_set_contents(deltapath, (gchar*) deltadata->data,
+			deltadata->len, NULL)) {
+		g_message("added delta from version %u, %u bytes", from->version,
+				deltadata->len);
+		g_ptr_array_add(image->deltas, delta);
+	} else {
+		g_message("failed to write delta from version %u", from->version);
+		manifest_delta_free(delta);
+	}
+	g_free(deltapath);
+	g_free(deltafilename);
+
+	err_toobig: //
+	g_byte_array_free(deltadata, TRUE);
+	g_free(fromdata);
+	err_readfrom: //
+	g_free(frompath);
+}
+
+static void repo_chunkindex_add(struct manifest_image* image,
+		guint8* imagedata, gsize imagesz, struct crypto_keys* keys) {
+	GArray* chunks = chunker_index(imagedata, imagesz);
+	gsize indexlen;
+	gchar* index = chunker_index_serialise(chunks, &indexlen);
+
+	struct manifest_chunkindex* chunkindex = manifest_chunkindex_new();
+	chunkindex->size = indexlen;
+	for (int i = 0; i < G_N_ELEMENTS(sigtypes); i++)
+		g_ptr_array_add(chunkindex->signatures,
+				crypto_sign(sigtypes[i], keys, (guint8*) index, indexlen));
+
+	gchar* indexfilename = manifest_chunkindex_filename(image);
+	gchar* indexpath = buildpath(arg_repodir, indexfilename, NULL);
+	if (g_file_set_contents(indexpath, index, indexlen, NULL)) {
+		g_message("added chunk index, %u chunks", chunks->len);
+		image->chunkindex = chunkindex;
+	} else {
+		g_message("failed to write chunk index");
+		manifest_chunkindex_free(chunkindex);
+	}
+
+	g_free(indexpath);
+	g_free(indexfilename);
+	g_free(index);
+	g_array_free(chunks, TRUE);
+}
+
+static void repo_compressed_add(struct manifest_image* image,
+		guint8* imagedata, gsize imagesz, struct crypto_keys* keys) {
+	for (enum manifest_compression algorithm = OTA_COMPRESSION_ZSTD;
+			algorithm < G_N_ELEMENTS(manifest_compressionstrings);
+			algorithm++) {
+		const gchar* name = manifest_compressionstrings[algorithm];
+		if (!compress_supported(algorithm)) {
+			g_message("%s support not built in, skipping", name);
+			continue;
+		}
+
+		GByteArray* compresseddata = compress_compress(algorithm, imagedata,
+				imagesz);
+		if (compresseddata == NULL)
+			continue;
+
+		if (compresseddata->len >= imagesz) {
+			g_message("%s copy isn't smaller than the image", name);
+			g_byte_array_free(compresseddata, TRUE);
+			continue;
+		}
+
+		struct manifest_compressed* compressed = manifest_compressed_new();
+		compressed->algorithm = algorithm;
+		compressed->size = compresseddata->len;
+		for (int i = 0; i < G_N_ELEMENTS(sigtypes); i++)
+			g_ptr_array_add(compressed->signatures,
+					crypto_sign(sigtypes[i], keys, compresseddata->data,
+							compresseddata->len));
+
+		gchar* compressedfilename = manifest_compressed_filename(image,
+				compressed);
+		gchar* compressedpath = buildpath(arg_repodir, compressedfilename,
+		NULL);
+		if (g_file_set_contents(compressedpath, (gchar*) compresseddata->data,
+				compresseddata->len, NULL)) {
+			g_message("added %s copy, %u bytes", name, compresseddata->len);
+			g_ptr_array_add(image->compressed, compressed);
+		} else {
+			g_message("failed to write %s copy", name);
+			manifest_compressed_free(compressed);
+		}
+		g_free(compressedpath);
+		g_free(compressedfilename);
+		g_byte_array_free(compresseddata, TRUE);
+	}
+}
+
+/*
+ * Generate deltas from the newest numdeltas images older than image.
+ * The manifest images are kept sorted by version.
+ */
+static void repo_deltas_add(struct manifest_manifest* manifest,
+		struct manifest_image* image, guint8* imagedata, gsize imagesz,
+		guint numdeltas, struct crypto_keys* keys) {
+	for (guint i = manifest->images->len; i > 0 && numdeltas > 0; i--) {
+		const struct manifest_image* from = g_ptr_array_index(manifest->images,
+				i - 1);
+		if (from->version >= image->version)
+			continue;
+		repo_delta_add(image, imagedata, imagesz, from, keys);
+		numdeltas--;
+	}
+}
+
+/*
+ * Changing a rollout that's already underway carries on from how far it
+ * has got unless a new percentage is given, devices that already have the
+ * image aren't affected by it going backwards.
+ */
+static void repo_rollout_set(struct manifest_image* image, gint percent,
+		gint rate, gint64 start) {
+	gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+
+	if (percent >= 100) {
+		g_free(image->rollout);
+		image->rollout = NULL;
+		g_message("image %s is available to all devices", image->uuid);
+		return;
+	}
+
+	if (image->rollout == NULL)
+		image->rollout = manifest_rollout_new();
+	else if (percent < 0)
+		percent = rollout_coverage(image->rollout, now);
+
+	image->rollout->percent = MAX(percent, 0);
+	if (rate >= 0)
+		image->rollout->rate = MIN(rate, 100);
+	image->rollout->start = start > 0 ? start : now;
+	g_message("image %s rollout: %u%% from %"G_GINT64_FORMAT" +%u%%/hour",
+			image->uuid, image->rollout->percent, image->rollout->start,
+			image->rollout->rate);
+}
+
+// add tags, or remove them if they start with -
+static void repo_image_settags(struct manifest_image* image, gchar** tags) {
+	for (gchar** tag = tags; tag != NULL && *tag != NULL; tag++) {
+		if (**tag == '-') {
+			for (guint i = 0; i < image->tags->len; i++) {
+				gchar* existing = g_ptr_array_index(image->tags, i);
+				if (strcmp(existing, *tag + 1) == 0) {
+					g_ptr_array_remove_index(image->tags, i);
+					g_free(existing);
+					break;
+				}
+			}
+		} else if (!manifest_image_hastag(image, *tag))
+			g_ptr_array_add(image->tags, g_strdup(*tag));
+	}
+}
+
+static void repo_image_add(const gchar* imagepath, const gchar* stamp,
+		gchar** tags, guint numdeltas, gint rolloutpercent, gint rolloutrate,
+		gint64 rolloutstart) {
 	struct manifest_manifest* manifest = manifest_load(manifestpath);
 
 	struct stamp_stamp* s = stamp_loadstamp(stamp);
@@ -139,6 +684,14 @@ static void repo_image_add(const gchar* imagepath, const gchar* stamp) {
 	image->version = s->version;
 	image->size = imagesz;
 	image->enabled = TRUE;
+	repo_image_settags(image, s->tags);
+	repo_image_settags(image, tags);
+	if (rolloutpercent >= 0 || rolloutrate >= 0)
+		repo_rollout_set(image, rolloutpercent, rolloutrate, rolloutstart);
+	repo_deltas_add(manifest, image, (guint8*) imagedata, imagesz, numdeltas,
+			keys);
+	repo_chunkindex_add(image, (guint8*) imagedata, imagesz, keys);
+	repo_compressed_add(image, (guint8*) imagedata, imagesz, keys);
 	g_ptr_array_add(manifest->images, image);
 	g_ptr_array_sort(manifest->images, sortbyversion);
 
@@ -165,8 +718,53 @@ static void repo_image_add(const gchar* imagepath, const gchar* stamp) {
 	return;
 }
 
-static void repo_image_update(guint index) {
+static void repo_image_update(guint index, gchar** tags,
+		const gchar* enabled) {
+	struct manifest_manifest* manifest = manifest_load(manifestpath);
+	struct crypto_keys* keys = repo_keys_load();
 
+	if (index >= manifest->images->len) {
+		g_message("bad image index");
+		goto err_badindex;
+	}
+
+	struct manifest_image* image = g_ptr_array_index(manifest->images, index);
+	if (enabled != NULL) {
+		if (strcmp(enabled, "true") == 0)
+			image->enabled = TRUE;
+		else if (strcmp(enabled, "false") == 0)
+			image->enabled = FALSE;
+		else {
+			g_message("enabled must be true or false");
+			goto err_badenabled;
+		}
+	}
+	repo_image_settags(image, tags);
+
+	repo_updatemanifest(manifest, keys);
+	err_badenabled: //
+	err_badindex: //
+	manifest_free(manifest);
+	crypto_keys_free(keys);
+}
+
+static void repo_image_rollout(guint index, gint percent, gint rate,
+		gint64 start) {
+	struct manifest_manifest* manifest = manifest_load(manifestpath);
+	struct crypto_keys* keys = repo_keys_load();
+
+	if (index >= manifest->images->len) {
+		g_message("bad image index");
+		goto err_badindex;
+	}
+
+	repo_rollout_set(g_ptr_array_index(manifest->images, index), percent,
+			rate, start);
+
+	repo_updatemanifest(manifest, keys);
+	err_badindex: //
+	manifest_free(manifest);
+	crypto_keys_free(keys);
 }
 
 static void repo_image_delete(guint index) {
@@ -258,6 +856,36 @@ static gboolean findbyuuid(gconstpointer a, gconstpointer b) {
 	return strcmp(image->uuid, uuid) == 0;
 }
 
+// match the files that belong to an image other than the image itself
+static gboolean findbyextrafilename(gconstpointer a, gconstpointer b) {
+	const struct manifest_image* image = a;
+	const gchar* filename = b;
+	if (image->chunkindex != NULL) {
+		gchar* indexfilename = manifest_chunkindex_filename(image);
+		gboolean match = strcmp(indexfilename, filename) == 0;
+		g_free(indexfilename);
+		if (match)
+			return TRUE;
+	}
+	for (int i = 0; i < image->compressed->len; i++) {
+		gchar* compressedfilename = manifest_compressed_filename(image,
+				g_ptr_array_index(image->compressed, i));
+		gboolean match = strcmp(compressedfilename, filename) == 0;
+		g_free(compressedfilename);
+		if (match)
+			return TRUE;
+	}
+	for (int i = 0; i < image->deltas->len; i++) {
+		gchar* deltafilename = manifest_delta_filename(image,
+				g_ptr_array_index(image->deltas, i));
+		gboolean match = strcmp(deltafilename, filename) == 0;
+		g_free(deltafilename);
+		if (match)
+			return TRUE;
+	}
+	return FALSE;
+}
+
 static void repo_repair() {
 	struct manifest_manifest* manifest = manifest_load(manifestpath);
 	struct crypto_keys* keys = repo_keys_load();
@@ -269,10 +897,13 @@ static void repo_repair() {
 	for (const gchar* filename = g_dir_read_name(dir); filename != NULL;
 			filename = g_dir_read_name(dir)) {
 		if (strcmp(filename, OTA_MANIFEST) == 0
-				|| strcmp(filename, OTA_SIG) == 0)
+				|| strcmp(filename, OTA_SIG) == 0
+				|| strcmp(filename, OTA_ENVELOPE) == 0)
 			continue;
 		if (!g_ptr_array_find_with_equal_func(manifest->images, filename,
-				findbyuuid, NULL)) {
+				findbyuuid, NULL)
+				&& !g_ptr_array_find_with_equal_func(manifest->images,
+						filename, findbyextrafilename, NULL)) {
 			g_message("deleting dangling image %s", filename);
 			gchar* imagepath = buildpath(arg_repodir, filename, NULL);
 			unlink(imagepath);
@@ -310,22 +941,30 @@ int main(int argc, char** argv) {
 	gboolean action_delete = FALSE;
 	gboolean action_verify = FALSE;
 	gboolean action_repair = FALSE;
+	gboolean action_rollout = FALSE;
 	gchar* param_imagepath = NULL;
 	gint param_imageindex = -1;
 	gchar* param_stamp = NULL;
 	gchar** param_imagetags = NULL;
-	gchar* param_imageenabled = "true";
+	gchar* param_imageenabled = NULL;
+	gint param_deltas = 3;
+	gint param_rolloutpercent = -1;
+	gint param_rolloutrate = -1;
+	gint64 param_rolloutstart = 0;
 
 	GError* error = NULL;
 	GOptionEntry entries[] = { ARGS_REPODIR, ARGS_KEYDIR,
 //
 			ARGS_ACTION_ADD, ARGS_ACTION_LIST,
 			ARGS_ACTION_UPDATE, ARGS_ACTION_DELETE, ARGS_ACTION_VERIFY,
-			ARGS_ACTION_REPAIR,
+			ARGS_ACTION_REPAIR, ARGS_ACTION_ROLLOUT,
 			//
 			ARGS_PARAMETER_IMAGEPATH, ARGS_PARAMETER_IMAGEINDEX,
 			ARGS_PARAMETER_IMAGESTAMP, ARGS_PARAMETER_IMAGETAGS,
-			ARGS_PARAMETER_IMAGEENABLED,
+			ARGS_PARAMETER_IMAGEENABLED, ARGS_PARAMETER_DELTAS,
+			ARGS_PARAMETER_POLLINTERVAL, ARGS_PARAMETER_ROLLOUTPERCENT,
+			ARGS_PARAMETER_ROLLOUTRATE, ARGS_PARAMETER_ROLLOUTSTART,
+			ARGS_PARAMETER_SHARDBY,
 			//
 			{ NULL } };
 	GOptionContext* optioncontext = g_option_context_new(NULL);
@@ -350,7 +989,7 @@ int main(int argc, char** argv) {
 	}
 
 	if (action_list + action_add + action_update + action_delete + action_verify
-			+ action_repair != 1) {
+			+ action_repair + action_rollout != 1) {
 		g_message("you must specify one action");
 		goto err_args;
 	}
@@ -362,6 +1001,10 @@ int main(int argc, char** argv) {
 
 	manifestpath = buildpath(arg_repodir, OTA_MANIFEST, NULL);
 	sigpath = buildpath(arg_repodir, OTA_SIG, NULL);
+	envelopepath = buildpath(arg_repodir, OTA_ENVELOPE, NULL);
+	manifestbinpath = buildpath(arg_repodir, OTA_MANIFESTBIN, NULL);
+	shardindexpath = buildpath(arg_repodir, OTA_SHARDINDEX, NULL);
+	changesheadpath = buildpath(arg_repodir, OTA_CHANGES, NULL);
 
 	if (action_list)
 		repo_image_list();
@@ -374,9 +1017,16 @@ int main(int argc, char** argv) {
 			g_message("you must pass the path of the image stamp file");
 			goto err_args;
 		}
-		repo_image_add(param_imagepath, param_stamp);
+		repo_image_add(param_imagepath, param_stamp, param_imagetags,
+				MAX(param_deltas, 0), param_rolloutpercent, param_rolloutrate,
+				param_rolloutstart);
 	} else if (action_update) {
-		repo_image_update(param_imageindex);
+		if (param_imageindex < 0) {
+			g_message("you must pass a valid image index");
+			goto err_args;
+		}
+		repo_image_update(param_imageindex, param_imagetags,
+				param_imageenabled);
 	} else if (action_delete) {
 		if (param_imageindex < 0) {
 			g_message("you must pass a valid image index");
@@ -387,6 +1037,17 @@ int main(int argc, char** argv) {
 		repo_verify();
 	else if (action_repair) {
 		repo_repair();
+	} else if (action_rollout) {
+		if (param_imageindex < 0) {
+			g_message("you must pass a valid image index");
+			goto err_args;
+		}
+		if (param_rolloutpercent < 0 && param_rolloutrate < 0) {
+			g_message("you must pass a percentage and/or a rate");
+			goto err_args;
+		}
+		repo_image_rollout(param_imageindex, param_rolloutpercent,
+				param_rolloutrate, param_rolloutstart);
 	}
 
 	err_createdir: //
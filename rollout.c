@@ -0,0 +1,42 @@
+#include "rollout.h"
+
+/*
+ * The image uuid is mixed in so the same devices aren't always the first
+ * to get a new image.
+ */
+guint rollout_bucket(const gchar* deviceid, const gchar* imageuuid) {
+	guint8 digest[32];
+	gsize digestlen = sizeof(digest);
+	GChecksum* checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	g_checksum_update(checksum, (const guchar*) deviceid, -1);
+	g_checksum_update(checksum, (const guchar*) imageuuid, -1);
+	g_checksum_get_digest(checksum, digest, &digestlen);
+	g_checksum_free(checksum);
+
+	// the bytes would be promoted to int, the top one can overflow that
+	guint32 value = ((guint32) digest[0] << 24) | ((guint32) digest[1] << 16)
+			| ((guint32) digest[2] << 8) | (guint32) digest[3];
+	return value % ROLLOUT_BUCKETS;
+}
+
+// the percentage of devices the rollout covers at the time now
+guint rollout_coverage(const struct manifest_rollout* rollout, gint64 now) {
+	if (now < rollout->start)
+		return 0;
+	guint64 hours = (now - rollout->start) / (60 * 60);
+	guint64 coverage = rollout->percent + (hours * rollout->rate);
+	return MIN(coverage, 100);
+}
+
+gboolean rollout_covers(const struct manifest_rollout* rollout,
+		const gchar* deviceid, const gchar* imageuuid) {
+	if (rollout == NULL)
+		return TRUE;
+	guint bucket = rollout_bucket(deviceid, imageuuid);
+	guint coverage = rollout_coverage(rollout,
+			g_get_real_time() / G_USEC_PER_SEC);
+	// this is called for every image on every check, it's too noisy otherwise
+	g_debug("rollout of %s covers %u%% of devices, this device is in bucket %u",
+			imageuuid, coverage, bucket);
+	return bucket < coverage;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <glib.h>
+#include "manifest.h"
+
+#define ROLLOUT_BUCKETS 100
+
+guint rollout_bucket(const gchar* deviceid, const gchar* imageuuid);
+guint rollout_coverage(const struct manifest_rollout* rollout, gint64 now);
+gboolean rollout_covers(const struct manifest_rollout* rollout,
+		const gchar* deviceid, const gchar* imageuuid);
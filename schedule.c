@@ -0,0 +1,84 @@
+#include "schedule.h"
+
+static guint schedule_jitter(guint delay) {
+	gint32 range = (delay * SCHEDULE_JITTER_PERCENT) / 100;
+	if (range == 0)
+		return delay;
+	return delay + g_random_int_range(-range, range + 1);
+}
+
+void schedule_init(struct schedule* schedule, const gchar* deviceid) {
+	schedule->interval = SCHEDULE_INTERVAL_DEFAULT;
+	schedule->phase = deviceid != NULL ? g_str_hash(deviceid) : g_random_int();
+	schedule->failures = 0;
+	schedule->retryafter = 0;
+}
+
+void schedule_setinterval(struct schedule* schedule, guint interval) {
+	if (interval == 0)
+		interval = SCHEDULE_INTERVAL_DEFAULT;
+	interval = CLAMP(interval, SCHEDULE_INTERVAL_MIN, SCHEDULE_INTERVAL_MAX);
+	if (interval != schedule->interval)
+		g_message("poll interval is now %u seconds", interval);
+	schedule->interval = interval;
+}
+
+/*
+ * Only the delay-seconds form of Retry-After is understood, a date is
+ * treated the same as not having the header and the normal backoff
+ * applies.
+ */
+void schedule_setretryafter(struct schedule* schedule, const gchar* value) {
+	if (value == NULL)
+		return;
+	gchar* end;
+	guint64 seconds = g_ascii_strtoull(value, &end, 10);
+	if (end == value || *end != '\0') {
+		g_message("ignoring retry-after \"%s\"", value);
+		return;
+	}
+	schedule->retryafter = MIN(seconds, SCHEDULE_INTERVAL_MAX);
+}
+
+// seconds until this device's slot in the interval comes around again
+static guint schedule_untilslot(struct schedule* schedule) {
+	guint64 now = g_get_real_time() / G_USEC_PER_SEC;
+	guint64 slot = schedule->phase % schedule->interval;
+	guint64 into = (now + schedule->interval - slot) % schedule->interval;
+	guint delay = schedule->interval - into;
+	/*
+	 * jitter can land a check just before the slot, don't check again
+	 * straight after it
+	 */
+	if (delay < (schedule->interval * SCHEDULE_JITTER_PERCENT * 2) / 100)
+		delay += schedule->interval;
+	return delay;
+}
+
+guint schedule_first(struct schedule* schedule, gboolean pending) {
+	if (pending)
+		return schedule->phase % SCHEDULE_FIRSTCHECK_SPREAD;
+	return schedule_jitter(schedule_untilslot(schedule));
+}
+
+guint schedule_next(struct schedule* schedule, gboolean success) {
+	guint delay;
+	if (success) {
+		schedule->failures = 0;
+		delay = schedule_jitter(schedule_untilslot(schedule));
+	} else {
+		guint shift = MIN(schedule->failures, 16);
+		/*
+		 * the cap doesn't depend on the interval, a repo that's struggling
+		 * gets an hour of quiet even from devices that poll every minute
+		 */
+		delay = schedule_jitter(
+				MIN(SCHEDULE_BACKOFF_MIN << shift, SCHEDULE_BACKOFF_MAX));
+		schedule->failures++;
+	}
+
+	if (schedule->retryafter > delay)
+		delay = schedule->retryafter;
+	schedule->retryafter = 0;
+	return MAX(delay, 1);
+}
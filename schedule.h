@@ -0,0 +1,33 @@
+#pragma once
+
+#include <glib.h>
+
+#define SCHEDULE_INTERVAL_DEFAULT   (60 * 10)
+#define SCHEDULE_INTERVAL_MIN       60
+#define SCHEDULE_INTERVAL_MAX       (60 * 60 * 24)
+#define SCHEDULE_BACKOFF_MIN        30
+#define SCHEDULE_BACKOFF_MAX        (60 * 60)
+// how far either side of its slot a device is allowed to wander
+#define SCHEDULE_JITTER_PERCENT     10
+// something to do, don't wait a whole interval before starting on it
+#define SCHEDULE_FIRSTCHECK_SPREAD  60
+
+/*
+ * When to check for a new manifest next. Every device gets a stable slot
+ * inside the interval from its identity so a fleet that comes back up
+ * after an outage spreads itself out over the interval instead of
+ * hitting the repo all at once, failures back off exponentially and a
+ * server that's asked us to go away with Retry-After is listened to.
+ */
+struct schedule {
+	guint interval;
+	guint phase;
+	guint failures;
+	guint retryafter;
+};
+
+void schedule_init(struct schedule* schedule, const gchar* deviceid);
+void schedule_setinterval(struct schedule* schedule, guint interval);
+void schedule_setretryafter(struct schedule* schedule, const gchar* value);
+guint schedule_first(struct schedule* schedule, gboolean pending);
+guint schedule_next(struct schedule* schedule, gboolean success);
@@ -0,0 +1,128 @@
+#include <string.h>
+#include <json-glib/json-glib.h>
+#include "shard.h"
+#include "jsonparserutils.h"
+#include "jsonbuilderutils.h"
+
+// tags are key=value
+gboolean shard_tagiskey(const gchar* tag, const gchar* key) {
+	gsize keylen = strlen(key);
+	return strncmp(tag, key, keylen) == 0 && tag[keylen] == '=';
+}
+
+/*
+ * The shard for a set of tags, relative to the repo. Tags the repo isn't
+ * sharded by don't change the result. A shard only has the images for
+ * one value of each key so there isn't one for more than one tag for a
+ * key, NULL is returned and the whole manifest has to be used instead.
+ */
+gchar* shard_filename(gchar** shardby, gchar** tags) {
+	GChecksum* checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	for (gchar** key = shardby; *key != NULL; key++) {
+		const gchar* value = NULL;
+		for (gchar** tag = tags; tag != NULL && *tag != NULL; tag++) {
+			if (!shard_tagiskey(*tag, *key))
+				continue;
+			if (value != NULL) {
+				g_checksum_free(checksum);
+				return NULL;
+			}
+			value = *tag;
+		}
+		if (value != NULL)
+			g_checksum_update(checksum, (const guchar*) value, -1);
+		g_checksum_update(checksum, (const guchar*) "\n", 1);
+	}
+	gchar* filename = g_strdup_printf("%s/%s%s", OTA_SHARDDIR,
+			g_checksum_get_string(checksum), SHARD_SUFFIX);
+	g_checksum_free(checksum);
+	return filename;
+}
+
+/*
+ * A device with a tag no image has, hw=revc when there are only images
+ * for reva and revb, gets the shard for not having that key at all.
+ */
+gchar* shard_index_filename(const struct shard_index* index, gchar** tags) {
+	GPtrArray* known = g_ptr_array_new();
+	for (gchar** tag = tags; tag != NULL && *tag != NULL; tag++) {
+		if (g_strv_contains((const gchar* const *) index->tags, *tag))
+			g_ptr_array_add(known, *tag);
+	}
+	g_ptr_array_add(known, NULL);
+	gchar* filename = shard_filename(index->shardby, (gchar**) known->pdata);
+	g_ptr_array_free(known, TRUE);
+	return filename;
+}
+
+static void shard_addstrings(JsonBuilder* builder, const gchar* name,
+		gchar** strings) {
+	JSONBUILDER_START_ARRAY(builder, name);
+	for (gchar** string = strings; *string != NULL; string++)
+		json_builder_add_string_value(builder, *string);
+	json_builder_end_array(builder);
+}
+
+gchar* shard_index_serialise(const struct shard_index* index, gsize* len) {
+	JsonBuilder* builder = json_builder_new();
+	json_builder_begin_object(builder);
+	shard_addstrings(builder, SHARD_JSONFIELD_SHARDBY, index->shardby);
+	shard_addstrings(builder, SHARD_JSONFIELD_TAGS, index->tags);
+	json_builder_end_object(builder);
+	return jsonbuilder_freetostring(builder, len, TRUE);
+}
+
+static gchar** shard_getstrings(JsonObject* rootobj, const gchar* name) {
+	JsonArray* array = JSON_OBJECT_GET_MEMBER_ARRAY(rootobj, name);
+	if (array == NULL)
+		return NULL;
+
+	GPtrArray* strings = g_ptr_array_new();
+	for (guint i = 0; i < json_array_get_length(array); i++) {
+		const gchar* string = json_array_get_string_element(array, i);
+		if (string == NULL) {
+			g_ptr_array_add(strings, NULL);
+			g_strfreev((gchar**) g_ptr_array_free(strings, FALSE));
+			return NULL;
+		}
+		g_ptr_array_add(strings, g_strdup(string));
+	}
+	g_ptr_array_add(strings, NULL);
+	return (gchar**) g_ptr_array_free(strings, FALSE);
+}
+
+struct shard_index* shard_index_deserialise(const gchar* data, gsize len) {
+	struct shard_index* index = NULL;
+	JsonParser* parser = json_parser_new();
+	if (!json_parser_load_from_data(parser, data, len, NULL)) {
+		g_message("failed to parse shard index");
+		goto err_parse;
+	}
+
+	JsonObject* rootobj = JSON_NODE_GET_OBJECT(json_parser_get_root(parser));
+	if (rootobj == NULL) {
+		g_message("shard index root should be an object");
+		goto err_badroot;
+	}
+
+	index = g_malloc0(sizeof(*index));
+	index->shardby = shard_getstrings(rootobj, SHARD_JSONFIELD_SHARDBY);
+	index->tags = shard_getstrings(rootobj, SHARD_JSONFIELD_TAGS);
+	if (index->shardby == NULL || index->tags == NULL
+			|| *index->shardby == NULL) {
+		g_message("shard index is incomplete or invalid");
+		shard_index_free(index);
+		index = NULL;
+	}
+
+	err_badroot: //
+	err_parse: //
+	g_object_unref(parser);
+	return index;
+}
+
+void shard_index_free(struct shard_index* index) {
+	g_strfreev(index->shardby);
+	g_strfreev(index->tags);
+	g_free(index);
+}
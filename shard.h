@@ -0,0 +1,31 @@
+#pragma once
+
+#include <glib.h>
+
+#define OTA_SHARDINDEX          "shards.json"
+// the index is a json envelope but it isn't a manifest
+#define SHARD_CONTENTTYPE       "application/json"
+#define OTA_SHARDDIR            "shards"
+#define SHARD_SUFFIX            ".bin"
+#define SHARD_JSONFIELD_SHARDBY "shardby"
+#define SHARD_JSONFIELD_TAGS    "tags"
+
+/*
+ * A sharded repo publishes a binary manifest per combination of the
+ * values of a few tag keys (hw, channel..) as well as the whole manifest.
+ * Each shard has the images a device with those tags could install and is
+ * signed on its own. The index is an envelope with the keys the repo is
+ * sharded by and the tags there are shards for so a device can work out
+ * which shard is its own.
+ */
+struct shard_index {
+	gchar** shardby;
+	gchar** tags;
+};
+
+gboolean shard_tagiskey(const gchar* tag, const gchar* key);
+gchar* shard_filename(gchar** shardby, gchar** tags);
+gchar* shard_index_serialise(const struct shard_index* index, gsize* len);
+struct shard_index* shard_index_deserialise(const gchar* data, gsize len);
+gchar* shard_index_filename(const struct shard_index* index, gchar** tags);
+void shard_index_free(struct shard_index* index);
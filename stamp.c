@@ -20,10 +20,11 @@ int main(int argc, char** argv) {
 	gchar* arg_repodir = NULL;
 	gint param_imageversion = -1;
 	gchar* arg_repouuid = NULL;
+	gchar** arg_tags = NULL;
 
 	GError* error = NULL;
 	GOptionEntry entries[] = { ARGS_ROOTDIR, ARGS_CONFIGDIR, ARGS_REPODIR,
-	ARGS_PARAMETER_IMAGEVERSION, ARGS_REPOUUID, { NULL } };
+	ARGS_PARAMETER_IMAGEVERSION, ARGS_REPOUUID, ARGS_TAGS, { NULL } };
 	GOptionContext* optioncontext = g_option_context_new(NULL);
 	g_option_context_add_main_entries(optioncontext, entries, GETTEXT_PACKAGE);
 	g_option_context_set_description(optioncontext, "stamp image");
@@ -88,6 +89,12 @@ int main(int argc, char** argv) {
 			g_uuid_string_random());
 	JSONBUILDER_ADD_STRING(builder, STAMP_JSONFIELD_REPOUUID, arg_repouuid);
 	JSONBUILDER_ADD_INT(builder, STAMP_JSONFIELD_VERSION, param_imageversion);
+	if (arg_tags != NULL) {
+		JSONBUILDER_START_ARRAY(builder, STAMP_JSONFIELD_TAGS);
+		for (gchar** tag = arg_tags; *tag != NULL; tag++)
+			json_builder_add_string_value(builder, *tag);
+		json_builder_end_array(builder);
+	}
 	json_builder_end_object(builder);
 	jsonbuilder_writetofile(builder, TRUE, path);
 
@@ -6,11 +6,14 @@
 #define STAMP_JSONFIELD_UUID	 "uuid"
 #define STAMP_JSONFIELD_REPOUUID "repouuid"
 #define STAMP_JSONFIELD_VERSION  "version"
+#define STAMP_JSONFIELD_TAGS	 "tags"
 
 struct stamp_stamp {
 	gchar* uuid;
 	gchar* repouuid;
 	guint version;
+	// NULL terminated, empty if the image has no tags
+	gchar** tags;
 };
 
 static struct stamp_stamp* stamp_loadstamp(const gchar*) __attribute__((unused));
@@ -50,10 +53,22 @@ static struct stamp_stamp* stamp_loadstamp(const gchar* stamp) {
 		goto err_parse;
 	}
 
+	GPtrArray* tags = g_ptr_array_new();
+	JsonArray* tagsarray = JSON_OBJECT_GET_MEMBER_ARRAY(stamproot,
+			STAMP_JSONFIELD_TAGS);
+	for (guint i = 0; tagsarray != NULL && i < json_array_get_length(tagsarray);
+			i++) {
+		const gchar* tag = json_array_get_string_element(tagsarray, i);
+		if (tag != NULL)
+			g_ptr_array_add(tags, g_strdup(tag));
+	}
+	g_ptr_array_add(tags, NULL);
+
 	s = g_malloc0(sizeof(*s));
 	s->uuid = g_strdup(uuid);
 	s->repouuid = g_strdup(repouuid);
 	s->version = version;
+	s->tags = (gchar**) g_ptr_array_free(tags, FALSE);
 	err_load: //
 	err_parse: //
 	g_object_unref(stampparser);
@@ -64,5 +79,6 @@ static void stamp_freestamp(struct stamp_stamp*) __attribute__((unused));
 static void stamp_freestamp(struct stamp_stamp* stamp) {
 	g_free(stamp->uuid);
 	g_free(stamp->repouuid);
+	g_strfreev(stamp->tags);
 	g_free(stamp);
 }
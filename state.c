@@ -0,0 +1,104 @@
+#include <json-glib/json-glib.h>
+#include "state.h"
+#include "jsonparserutils.h"
+#include "jsonbuilderutils.h"
+
+static gchar* state_getstring(JsonObject* root, const gchar* field) {
+	if (!json_object_has_member(root, field))
+		return NULL;
+	return g_strdup(JSON_OBJECT_GET_MEMBER_STRING(root, field));
+}
+
+static void state_change_deserialise(JsonArray *array, guint index,
+		JsonNode *element_node, gpointer user_data) {
+	GPtrArray* changes = user_data;
+	if (!JSON_NODE_HOLDS_VALUE(element_node)
+			|| json_node_get_value_type(element_node) != G_TYPE_STRING) {
+		g_message("saved changes entry isn't a string");
+		return;
+	}
+	g_ptr_array_add(changes, g_strdup(json_node_get_string(element_node)));
+}
+
+struct state* state_load(const gchar* path) {
+	struct state* state = NULL;
+	JsonParser* parser = json_parser_new();
+	if (!json_parser_load_from_file(parser, path, NULL))
+		goto err_load;
+
+	JsonObject* root = JSON_NODE_GET_OBJECT(json_parser_get_root(parser));
+	if (root == NULL)
+		goto err_parse;
+
+	gchar* envelope = state_getstring(root, STATE_JSONFIELD_ENVELOPE);
+	gchar* manifestbin = state_getstring(root, STATE_JSONFIELD_MANIFESTBIN);
+	if (envelope == NULL && manifestbin == NULL) {
+		g_message("state is incomplete or invalid");
+		goto err_parse;
+	}
+
+	state = g_malloc0(sizeof(*state));
+	state->envelope = envelope;
+	state->manifestbin = manifestbin;
+	state->fetchedat = JSON_OBJECT_GET_MEMBER_INT(root,
+			STATE_JSONFIELD_FETCHEDAT);
+	state->etag = state_getstring(root, STATE_JSONFIELD_ETAG);
+	state->lastmodified = state_getstring(root, STATE_JSONFIELD_LASTMODIFIED);
+	state->target = state_getstring(root, STATE_JSONFIELD_TARGET);
+	JsonArray* changes = JSON_OBJECT_GET_MEMBER_ARRAY(root,
+			STATE_JSONFIELD_CHANGES);
+	if (changes != NULL) {
+		state->changes = g_ptr_array_new_with_free_func(g_free);
+		json_array_foreach_element(changes, state_change_deserialise,
+				state->changes);
+	}
+
+	err_parse: //
+	err_load: //
+	g_object_unref(parser);
+	return state;
+}
+
+gboolean state_save(const gchar* path, const struct state* state) {
+	JsonBuilder* builder = json_builder_new();
+	json_builder_begin_object(builder);
+	if (state->envelope != NULL)
+		JSONBUILDER_ADD_STRING(builder, STATE_JSONFIELD_ENVELOPE,
+				state->envelope);
+	if (state->manifestbin != NULL)
+		JSONBUILDER_ADD_STRING(builder, STATE_JSONFIELD_MANIFESTBIN,
+				state->manifestbin);
+	JSONBUILDER_ADD_INT(builder, STATE_JSONFIELD_FETCHEDAT, state->fetchedat);
+	if (state->etag != NULL)
+		JSONBUILDER_ADD_STRING(builder, STATE_JSONFIELD_ETAG, state->etag);
+	if (state->lastmodified != NULL)
+		JSONBUILDER_ADD_STRING(builder, STATE_JSONFIELD_LASTMODIFIED,
+				state->lastmodified);
+	if (state->target != NULL)
+		JSONBUILDER_ADD_STRING(builder, STATE_JSONFIELD_TARGET, state->target);
+	if (state->changes != NULL && state->changes->len > 0) {
+		JSONBUILDER_START_ARRAY(builder, STATE_JSONFIELD_CHANGES);
+		for (guint i = 0; i < state->changes->len; i++)
+			json_builder_add_string_value(builder,
+					g_ptr_array_index(state->changes, i));
+		json_builder_end_array(builder);
+	}
+	json_builder_end_object(builder);
+
+	gsize jsonlen;
+	gchar* json = jsonbuilder_freetostring(builder, &jsonlen, TRUE);
+	gboolean ret = g_file_set_contents(path, json, jsonlen, NULL);
+	g_free(json);
+	return ret;
+}
+
+void state_free(struct state* state) {
+	g_free(state->envelope);
+	g_free(state->manifestbin);
+	g_free(state->etag);
+	g_free(state->lastmodified);
+	g_free(state->target);
+	if (state->changes != NULL)
+		g_ptr_array_free(state->changes, TRUE);
+	g_free(state);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <glib.h>
+
+#define STATEFILE                       "state.json"
+#define STATE_JSONFIELD_ENVELOPE        "envelope"
+#define STATE_JSONFIELD_MANIFESTBIN     "manifestbin"
+#define STATE_JSONFIELD_FETCHEDAT       "fetchedat"
+#define STATE_JSONFIELD_ETAG            "etag"
+#define STATE_JSONFIELD_LASTMODIFIED    "lastmodified"
+#define STATE_JSONFIELD_TARGET          "target"
+#define STATE_JSONFIELD_CHANGES         "changes"
+
+/*
+ * What the agent knows between runs: the last manifest that passed
+ * signature verification with its signatures, the signed changes
+ * entries that have been applied to it since, the validators to fetch it
+ * conditionally with and the image that was picked from it. How far the
+ * image got is in the journal.
+ */
+struct state {
+	// one or the other, a binary manifest is base64 encoded
+	gchar* envelope;
+	gchar* manifestbin;
+	gint64 fetchedat;
+	gchar* etag;
+	gchar* lastmodified;
+	gchar* target;
+	// changes entry envelopes in the order they were applied, may be NULL
+	GPtrArray* changes;
+};
+
+struct state* state_load(const gchar* path);
+gboolean state_save(const gchar* path, const struct state* state);
+void state_free(struct state* state);
@@ -0,0 +1,250 @@
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <linux/ioctl.h>
+#include <mtd/mtd-user.h>
+#include <mtd/ubi-user.h>
+
+#include "mtdbackend.h"
+
+#define UBI_SYSFS "/sys/class/ubi"
+
+/*
+ * Slots in UBI volumes. UBI takes care of erasing, bad blocks and wear
+ * levelling so there's nothing to erase, and an image goes in as a single
+ * atomic volume update: the update is started for the size of the image
+ * and the data has to be written in order. If the update doesn't finish
+ * UBI marks the volume as corrupted so a half written slot can't boot.
+ */
+
+struct ubi_file {
+	gboolean updating;
+	// where the next write of the update has to be
+	gint64 position;
+	gint64 remaining;
+};
+
+static GMutex ubi_lock;
+static GHashTable* ubi_volumes;
+static GHashTable* ubi_files;
+
+// the sysfs name of a volume, ubi0_1 for /dev/ubi0_1
+static gchar* ubi_volumename(const gchar* mtd) {
+	gchar* name = g_path_get_basename(mtd);
+	int device, volume;
+	char end;
+	if (sscanf(name, "ubi%d_%d%c", &device, &volume, &end) != 2) {
+		g_free(name);
+		return NULL;
+	}
+	return name;
+}
+
+static guint64 ubi_readsysfs(const gchar* volume, const gchar* attr) {
+	guint64 value = 0;
+	gchar* path = g_build_path("/", UBI_SYSFS, volume, attr, NULL);
+	gchar* contents;
+	if (g_file_get_contents(path, &contents, NULL, NULL)) {
+		value = g_ascii_strtoull(contents, NULL, 10);
+		g_free(contents);
+	}
+	g_free(path);
+	return value;
+}
+
+static gboolean ubi_handles(const gchar* mtd) {
+	gchar* name = ubi_volumename(mtd);
+	if (name == NULL)
+		return FALSE;
+	gchar* path = g_build_path("/", UBI_SYSFS, name, NULL);
+	gboolean ret = g_file_test(path, G_FILE_TEST_IS_DIR);
+	g_free(path);
+	g_free(name);
+	return ret;
+}
+
+static int ubi_open(const gchar* mtd, int flags) {
+	int fd = open(mtd, flags);
+	if (fd == -1)
+		return fd;
+
+	g_mutex_lock(&ubi_lock);
+	if (ubi_volumes == NULL) {
+		ubi_volumes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+		NULL);
+		ubi_files = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+		NULL, g_free);
+	}
+	g_hash_table_add(ubi_volumes, g_strdup(mtd));
+	g_hash_table_insert(ubi_files, GINT_TO_POINTER(fd),
+			g_malloc0(sizeof(struct ubi_file)));
+	g_mutex_unlock(&ubi_lock);
+	return fd;
+}
+
+static struct ubi_file* ubi_forfd(int fd) {
+	g_mutex_lock(&ubi_lock);
+	struct ubi_file* file = g_hash_table_lookup(ubi_files,
+			GINT_TO_POINTER(fd));
+	g_mutex_unlock(&ubi_lock);
+	return file;
+}
+
+// the volume's sysfs name from the character device's major:minor
+static gchar* ubi_volumeforfd(int fd) {
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISCHR(st.st_mode))
+		return NULL;
+	gchar* link = g_strdup_printf("/sys/dev/char/%u:%u", major(st.st_rdev),
+			minor(st.st_rdev));
+	gchar* target = g_file_read_link(link, NULL);
+	g_free(link);
+	if (target == NULL)
+		return NULL;
+	gchar* name = g_path_get_basename(target);
+	g_free(target);
+	return name;
+}
+
+static int ubi_getinfo(int fd, struct mtd_info_user* info) {
+	gchar* volume = ubi_volumeforfd(fd);
+	if (volume == NULL) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	guint64 lebsize = ubi_readsysfs(volume, "usable_eb_size");
+	guint64 lebs = ubi_readsysfs(volume, "reserved_ebs");
+	// min_io_size belongs to the device, ubi0 for ubi0_1
+	gchar* sep = strchr(volume, '_');
+	guint64 miniosize = 0;
+	if (sep != NULL) {
+		*sep = '\0';
+		miniosize = ubi_readsysfs(volume, "min_io_size");
+	}
+	g_free(volume);
+	if (lebsize == 0 || miniosize == 0 || lebsize % miniosize != 0) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	memset(info, 0, sizeof(*info));
+	info->type = MTD_UBIVOLUME;
+	info->flags = MTD_WRITEABLE | MTD_NO_ERASE;
+	info->erasesize = lebsize;
+	/*
+	 * updates will take any length but the flash under them is still
+	 * programmed a min I/O unit at a time, padding the image out to that
+	 * costs nothing and keeps the page counts true
+	 */
+	info->writesize = miniosize;
+	guint64 size = MIN(lebs * lebsize, G_MAXUINT32);
+	info->size = size - (size % lebsize);
+	return 0;
+}
+
+static int ubi_ioctl(int fd, unsigned long request, void* arg) {
+	switch (request) {
+	case MEMGETINFO:
+		return ubi_getinfo(fd, arg);
+	case MEMERASE:
+		// the volume update erases as it goes
+		return 0;
+	case MEMGETBADBLOCK:
+		return 0;
+	default:
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+}
+
+static gboolean ubi_begin(int fd, gsize len) {
+	struct ubi_file* file = ubi_forfd(fd);
+	gint64 bytes = len;
+	if (ioctl(fd, UBI_IOCVOLUP, &bytes) == -1) {
+		g_message("failed to start volume update; %d", errno);
+		return FALSE;
+	}
+	file->updating = TRUE;
+	file->position = 0;
+	file->remaining = len;
+	return TRUE;
+}
+
+static ssize_t ubi_pwrite(int fd, const void* data, size_t len, off_t offset) {
+	struct ubi_file* file = ubi_forfd(fd);
+	if (!file->updating || offset != file->position
+			|| len > file->remaining) {
+		g_message("volume updates have to be written in order");
+		errno = EINVAL;
+		return -1;
+	}
+
+	gsize done = 0;
+	while (done < len) {
+		ssize_t wrote = write(fd, (const guint8*) data + done, len - done);
+		if (wrote < 0) {
+			if (errno == EINTR)
+				continue;
+			return done > 0 ? done : -1;
+		}
+		done += wrote;
+	}
+
+	file->position += done;
+	file->remaining -= done;
+	if (file->remaining == 0)
+		file->updating = FALSE;
+	return done;
+}
+
+static int ubi_close(int fd) {
+	g_mutex_lock(&ubi_lock);
+	struct ubi_file* file = g_hash_table_lookup(ubi_files, GINT_TO_POINTER(fd));
+	if (file->updating)
+		g_message("volume update left unfinished, the volume is now corrupt");
+	g_hash_table_remove(ubi_files, GINT_TO_POINTER(fd));
+	g_mutex_unlock(&ubi_lock);
+	return close(fd);
+}
+
+/*
+ * Volumes don't have an offset so for UBI ota.part in the bootargs is the
+ * id of the volume that was booted.
+ */
+static gchar* ubi_forid(guint id) {
+	gchar* mtd = NULL;
+	g_mutex_lock(&ubi_lock);
+	if (ubi_volumes == NULL)
+		goto out;
+
+	GHashTableIter iter;
+	gpointer key;
+	g_hash_table_iter_init(&iter, ubi_volumes);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		gchar* name = ubi_volumename(key);
+		int device, volume;
+		gboolean match = name != NULL
+				&& sscanf(name, "ubi%d_%d", &device, &volume) == 2
+				&& volume == id;
+		g_free(name);
+		if (match) {
+			mtd = g_strdup(key);
+			break;
+		}
+	}
+
+	out: //
+	g_mutex_unlock(&ubi_lock);
+	return mtd;
+}
+
+const struct mtd_backend ubi_backend = { .name = "ubi", .handles =
+		ubi_handles, .open = ubi_open, .ioctl = ubi_ioctl, .pread = pread,
+		.pwrite = ubi_pwrite, .close = ubi_close, .begin = ubi_begin,
+		.forid = ubi_forid };
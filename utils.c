@@ -15,3 +15,39 @@ gchar* buildpath(const gchar* dir, ...) {
 
 	return g_string_free(pathgstr, FALSE);
 }
+
+gchar* hexencode(const guint8* data, gsize len) {
+	GString* hexgstr = g_string_sized_new(len * 2);
+	for (gsize i = 0; i < len; i++)
+		g_string_append_printf(hexgstr, "%02x", data[i]);
+	return g_string_free(hexgstr, FALSE);
+}
+
+gboolean hexdecode(const gchar* hex, guint8* out, gsize len) {
+	if (strlen(hex) != len * 2)
+		return FALSE;
+	for (gsize i = 0; i < len; i++) {
+		gint hi = g_ascii_xdigit_value(hex[i * 2]);
+		gint lo = g_ascii_xdigit_value(hex[(i * 2) + 1]);
+		if (hi < 0 || lo < 0)
+			return FALSE;
+		out[i] = (hi << 4) | lo;
+	}
+	return TRUE;
+}
+
+/*
+ * Something that identifies this device. The machine id is unique per
+ * device, the fallback (usually the stamp uuid) might not be so anything
+ * that uses this to tell devices apart only works as well as that does.
+ */
+gchar* getdeviceid(const gchar* fallback) {
+	gchar* machineid;
+	if (g_file_get_contents(MACHINEIDPATH, &machineid, NULL, NULL)) {
+		g_strstrip(machineid);
+		if (strlen(machineid) > 0)
+			return machineid;
+		g_free(machineid);
+	}
+	return g_strdup(fallback);
+}
@@ -2,4 +2,9 @@
 
 #include <glib.h>
 
+#define MACHINEIDPATH "/etc/machine-id"
+
 gchar* buildpath(const gchar* dir, ...);
+gchar* hexencode(const guint8* data, gsize len);
+gboolean hexdecode(const gchar* hex, guint8* out, gsize len);
+gchar* getdeviceid(const gchar* fallback);
@@ -0,0 +1,114 @@
+/*
+ * Reads an image back from flash one erase block at a time after it has
+ * been written. Blocks written in this run are checked against the digest
+ * taken when they were written and any that don't match are fetched again
+ * and rewritten in place. The whole image is hashed on the way so the
+ * signatures can be checked against what is really on flash.
+ */
+
+#include <string.h>
+#include "verify.h"
+#include "mtd.h"
+#include "metrics.h"
+
+static void verify_digest(const guint8* data, gsize len, guint8* digest) {
+	struct sha256_ctx sha256;
+	sha256_init(&sha256);
+	sha256_update(&sha256, len, data);
+	sha256_digest(&sha256, SHA256_DIGEST_SIZE, digest);
+}
+
+static gboolean verify_repairblock(const gchar* mtd, guint32 physical,
+		guint8* data, gsize offset, gsize len, const guint8* expected,
+		verify_fetchcallback fetchcallback, gpointer user_data) {
+	guint8 digest[SHA256_DIGEST_SIZE];
+
+	if (!fetchcallback(offset, data, len, user_data)) {
+		g_message("failed to fetch block at %" G_GSIZE_FORMAT " again",
+				offset);
+		return FALSE;
+	}
+	verify_digest(data, len, digest);
+	if (memcmp(digest, expected, sizeof(digest)) != 0) {
+		g_message("refetched block at %" G_GSIZE_FORMAT " is bad too", offset);
+		return FALSE;
+	}
+
+	if (!mtd_rewriteblock(mtd, physical, data, len))
+		return FALSE;
+
+	if (!mtd_read(mtd, physical, data, len))
+		return FALSE;
+	verify_digest(data, len, digest);
+	if (memcmp(digest, expected, sizeof(digest)) != 0) {
+		g_message("block at 0x%x still doesn't match after rewriting",
+				(unsigned) physical);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean verify_image(const gchar* mtd, struct pipeline* pipeline, gsize len,
+		GPtrArray* signatures, verify_fetchcallback fetchcallback,
+		gpointer user_data, struct verify_result* result) {
+	gboolean ret = FALSE;
+
+	const GArray* blockmap = pipeline_blockmap(pipeline);
+	guint32 erasesize = mtd_erasesize(mtd);
+	guint8* block = g_malloc(erasesize);
+
+	crypto_digests_init_for(&result->digests, signatures);
+	result->timings = g_array_new(FALSE, FALSE, sizeof(guint64));
+	result->repaired = 0;
+
+	if (blockmap->len != (len + erasesize - 1) / erasesize) {
+		g_message("block map doesn't cover the image");
+		goto err_blockmap;
+	}
+
+	for (guint i = 0; i < blockmap->len; i++) {
+		guint32 physical = g_array_index(blockmap, guint32, i);
+		gsize offset = (gsize) i * erasesize;
+		gsize blocklen = MIN(erasesize, len - offset);
+
+		gint64 start = g_get_monotonic_time();
+		if (!mtd_read(mtd, physical, block, blocklen))
+			goto err_read;
+		const guint8* expected = pipeline_blockdigest(pipeline, i);
+		gboolean good = TRUE;
+		if (expected != NULL) {
+			guint8 digest[SHA256_DIGEST_SIZE];
+			verify_digest(block, blocklen, digest);
+			good = memcmp(digest, expected, sizeof(digest)) == 0;
+		}
+		guint64 took = g_get_monotonic_time() - start;
+		g_array_append_val(result->timings, took);
+		metrics_observe(METRICS_READBACK, took);
+
+		if (!good) {
+			g_message("block at 0x%x didn't read back correctly",
+					(unsigned) physical);
+			if (!verify_repairblock(mtd, physical, block, offset, blocklen,
+					expected, fetchcallback, user_data))
+				goto err_repair;
+			result->repaired++;
+		}
+
+		crypto_digests_update(&result->digests, block, blocklen);
+	}
+
+	ret = TRUE;
+
+	err_repair: //
+	err_read: //
+	err_blockmap: //
+	g_free(block);
+	return ret;
+}
+
+void verify_result_clear(struct verify_result* result) {
+	if (result->timings != NULL)
+		g_array_free(result->timings, TRUE);
+	result->timings = NULL;
+}
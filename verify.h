@@ -0,0 +1,22 @@
+#pragma once
+
+#include <glib.h>
+#include "crypto.h"
+#include "pipeline.h"
+
+// fetch len bytes of the image from offset again into data
+typedef gboolean (*verify_fetchcallback)(gsize offset, guint8* data,
+		gsize len, gpointer user_data);
+
+struct verify_result {
+	// hash state for the image as read back from flash
+	struct crypto_digests digests;
+	// microseconds taken to read and hash each block
+	GArray* timings;
+	unsigned repaired;
+};
+
+gboolean verify_image(const gchar* mtd, struct pipeline* pipeline, gsize len,
+		GPtrArray* signatures, verify_fetchcallback fetchcallback,
+		gpointer user_data, struct verify_result* result);
+void verify_result_clear(struct verify_result* result);